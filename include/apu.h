@@ -5,7 +5,8 @@
 // Emulates a DMA transfer of sprite data to the PPU
 void do_oam_dma(uint8_t addr);
 
-// Invalidates the cached signal level as outlined in set_audio_signal_level()
+// Invalidates the cached signal level as outlined in mix_pending_inputs() in
+// audio.cpp
 void begin_audio_frame();
 
 // 'n' is 0 for the first pulse channel and 1 for the second.
@@ -27,17 +28,19 @@ void write_dmc_reg_0(uint8_t val); // $4010
 void write_dmc_reg_1(uint8_t val); // $4011
 void write_dmc_reg_2(uint8_t val); // $4012
 void write_dmc_reg_3(uint8_t val); // $4013
-// IRQ line from DMC
-extern bool dmc_irq;
 
 void write_frame_counter(uint8_t val); // $4017
-// IRQ line from frame counter
-extern bool frame_irq;
 
 // $4015
 uint8_t read_apu_status();
 void write_apu_status(uint8_t val);
 
+// Mixer output for a given sum of pulse channel outputs (0-30) and sum of
+// premultiplied triangle, noise, and DMC outputs (0-202), scaled to the int16
+// range. Set up by init_apu(). The audio code does the lookups (see
+// set_audio_mixer_inputs()).
+extern int16_t mixer_table[31][203];
+
 void init_apu();
 void init_apu_for_rom();
 
@@ -3,11 +3,70 @@
 void init_audio_for_rom();
 void deinit_audio_for_rom();
 
-// Sets the instantaneous signal level
-void set_audio_signal_level(int16_t level);
-// Resamples and buffers the audio generated during one (video) frame
+// Records the mixer inputs (see mixer_table in apu.h) at the current time.
+// Called by the APU whenever a channel's output level changes. The inputs are
+// mixed in batches, at the latest by end_audio_frame().
+void set_audio_mixer_inputs(unsigned pulse_sum, unsigned tnd_sum);
+// Finishes the audio generated during one (video) frame and hands it off for
+// resampling and buffering. In the SDL build, that happens on a separate audio
+// thread.
 void end_audio_frame();
+#ifdef HEADLESS
+// Returns the samples produced by the most recent end_audio_frame() call
+// (mono, at get_audio_sample_rate() Hz). The count is stored in
+// 'n_samples_out'.
+int16_t const *get_frame_samples(size_t &n_samples_out);
+
+// Audio output modes, for runs where sound is only needed roughly or not at
+// all. The APU is emulated exactly in all modes ($4015 reads, IRQs, DMC DMA,
+// etc.), and states are interchangeable between them.
+enum Audio_mode {
+    // No mixing or resampling. get_frame_samples() returns no samples.
+    AUDIO_OFF,
+    // The signal is point-sampled at a quarter of sample_rate, bypassing
+    // blip_buf. No band-limiting or filtering is done, so expect aliasing and
+    // a DC offset.
+    AUDIO_LOW,
+    // Band-limited resampling to sample_rate Hz (the default)
+    AUDIO_FULL
+};
+
+// Sets the audio mode for the console. Meant to be called between frames.
+void set_audio_mode(Audio_mode mode);
+// Returns the sample rate of the current mode's output
+unsigned get_audio_sample_rate();
+#endif
+#ifndef HEADLESS
+// Sets up the audio ring buffer. Must be called before init_sdl().
+//
+// 'latency_ms' is the target for the total amount of buffered audio (the ring
+// buffer plus the SDL buffer), which sizes both buffers. Lower values mean
+// less delay but less protection against underruns. 0 gives the defaults
+// (around 140 ms).
+//
+// If 'sync' is true, emulation is paced by audio playback: the emulation
+// thread waits when the ring buffer is at the target instead of sleeping
+// until the end of each frame, and the playback rate isn't adjusted.
+// Otherwise, emulation is paced by timers (see sleep_till_end_of_frame()), and
+// the playback rate is adjusted slightly to keep the ring buffer at the target.
+void init_audio(unsigned latency_ms, bool sync);
+void deinit_audio();
+
+// True if emulation is paced by audio playback (see init_audio())
+extern bool sync_to_audio;
+
+// Size of the SDL audio buffer in samples, for the latency set by
+// init_audio()
+unsigned get_audio_device_buffer_len();
+
+// Number of times the SDL audio callback ran out of samples (underruns), and
+// number of times samples were dropped because the ring buffer was full or
+// playback stalled (overruns)
+unsigned long get_audio_underruns();
+unsigned long get_audio_overruns();
+
 // Moves up to 'len' samples from the audio buffer to 'dst'. In case of
 // underflow, moves all remaining samples and zeroes the remainder of 'dst' (as
 // required by SDL2).
 void read_samples(int16_t *dst, size_t len);
+#endif
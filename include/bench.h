@@ -0,0 +1,47 @@
+// Benchmark mode for the headless build (--bench). Runs a ROM uncapped and
+// prints a JSON report with the emulation speed and the split of time between
+// different parts of the emulator.
+//
+// The split is measured by sampling: the emulator records which region it is
+// executing in 'bench_region', and a SIGPROF handler counts how often each
+// region is seen. This keeps the overhead to a few stores per CPU cycle.
+
+enum Bench_region {
+    BENCH_CPU = 0, // CPU emulation (instruction dispatch and memory accesses)
+    BENCH_PPU,     // tick_ppu<>()
+    BENCH_APU,     // tick_apu()
+    BENCH_REWIND,  // transfer_system_state() (save states and rewind)
+    BENCH_OTHER,   // Other end-of-frame work (audio resampling, etc.)
+
+    N_BENCH_REGIONS
+};
+
+#ifdef INCLUDE_BENCH
+
+extern PER_CONSOLE Bench_region volatile bench_region;
+
+// Number of CPU instructions executed
+extern PER_CONSOLE uint64_t bench_n_instructions;
+
+#  define BENCH_REGION(region) bench_region = region;
+// For code that can be entered from different regions
+#  define BENCH_ENTER(region)                            \
+     Bench_region const bench_prev_region = bench_region; \
+     bench_region = region;
+#  define BENCH_LEAVE bench_region = bench_prev_region;
+
+#else
+
+#  define BENCH_REGION(region)
+#  define BENCH_ENTER(region)
+#  define BENCH_LEAVE
+
+#endif
+
+// Starts measuring. Call right before run(), after the ROM has been loaded.
+void start_bench();
+// Called at the end of each frame
+void bench_frame();
+// Stops measuring, times state saving and loading (which clears the rewind
+// buffer), and prints the JSON report to stdout
+void end_bench(char const *rom_filename);
@@ -27,6 +27,22 @@
 
 extern char const *program_name; // argv[0]
 
+// Storage class for emulator state that belongs to a single console (CPU
+// registers, RAM, PPU and APU state, mapper registers, etc.). Each thread gets
+// its own copy, so that independent consoles can be run on separate threads
+// within the same process. Goes right after 'static' or 'extern', as in
+//
+//   static PER_CONSOLE uint8_t ram[0x800];
+//
+// Read-only tables and frontend state (SDL, the audio ring buffer) are shared
+// and should not use it.
+//
+// (Thread-local storage is used instead of threading a context pointer
+// through tick(), read_mem(), etc., which would add an indirection to every
+// state access in the hot paths. TLS accesses are a fixed offset from the
+// thread pointer in executables.)
+#define PER_CONSOLE __thread
+
 //
 // General utility functions and macros
 //
@@ -150,6 +166,79 @@ void transfer_p(T *ptr, size_t len, uint8_t *&bufp) {
 #define TRANSFER(x) transfer<calculating_size, is_save>(x, buf);
 #define TRANSFER_P(x, len) transfer_p<calculating_size, is_save>(x, len, buf);
 
+// The scalars and small arrays in the state of each subsystem (and mapper) are
+// kept together in a struct declared STATE_BLOCK, which is saved and loaded
+// with a single TRANSFER(). The alignment puts each block on cache lines of its
+// own, so that it can be copied without touching unrelated variables.
+#define STATE_BLOCK __attribute__((aligned(64)))
+
+// Dirty-page tracking for the larger memory areas in the state (RAM, nametable
+// RAM, CHR RAM, and WRAM). Each 256-byte page of an area has a stamp that is
+// set to save_clock whenever the page is written, and saving to a buffer that
+// already holds an earlier state only copies the pages that were written after
+// that state was saved. Most frames only write to a few pages.
+
+unsigned const dirty_page_shift = 8;
+
+// Number of stamps needed for a 'len'-byte area
+inline size_t n_dirty_pages(size_t len) {
+    return (len + (1 << dirty_page_shift) - 1) >> dirty_page_shift;
+}
+
+// Incremented after each save that can be used as a base for a later save.
+// Starts out at 1.
+extern PER_CONSOLE uint32_t save_clock;
+
+// The save_clock value at the time the buffer being saved to was last saved
+// to, or 0 if it doesn't hold an earlier state. Pages with a stamp above it
+// are copied.
+extern PER_CONSOLE uint32_t save_base;
+
+// Marks the page containing byte 'offset' of an area as written
+inline void mark_dirty(uint32_t *stamps, size_t offset) {
+    stamps[offset >> dirty_page_shift] = save_clock;
+}
+
+// Marks all pages of a 'len'-byte area as written
+inline void mark_all_dirty(uint32_t *stamps, size_t len) {
+    for (size_t i = 0; i < n_dirty_pages(len); ++i)
+        stamps[i] = save_clock;
+}
+
+// Like transfer_p(), for an area with dirty-page tracking. Consecutive dirty
+// pages are copied with a single memcpy().
+template<bool calculating_size, bool is_save, typename T>
+void transfer_tracked(T *ptr, size_t len, uint32_t *stamps, uint8_t *&bufp) {
+    if (!calculating_size) {
+        uint8_t *const area = (uint8_t*)ptr;
+        if (!is_save) {
+            memcpy(area, bufp, len);
+            mark_all_dirty(stamps, len);
+        }
+        else if (save_base == 0)
+            memcpy(bufp, area, len);
+        else {
+            size_t const page_size = 1 << dirty_page_shift;
+            for (size_t page = 0; page < n_dirty_pages(len);) {
+                if (stamps[page] <= save_base) {
+                    ++page;
+                    continue;
+                }
+                size_t const start = page;
+                do ++page;
+                while (page < n_dirty_pages(len) && stamps[page] > save_base);
+                size_t const end = min(page*page_size, len);
+                memcpy(bufp + start*page_size, area + start*page_size,
+                       end - start*page_size);
+            }
+        }
+    }
+    bufp += len;
+}
+
+#define TRANSFER_TRACKED(x, len, stamps) \
+    transfer_tracked<calculating_size, is_save>(x, len, stamps, buf);
+
 //
 // Error reporting
 //
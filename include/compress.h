@@ -0,0 +1,25 @@
+// Compression of save states. A state is XORed against a reference state
+// (usually the state from the previous frame), which zeroes out everything
+// that didn't change, and the result is run-length encoded as alternating
+// zero runs and literal bytes. Most of a state is unchanged between frames, so
+// deltas are typically a few percent of the full size. Encoding and decoding
+// both run at close to memcpy() speed.
+
+// Maximum size of encode_delta()'s output for a 'len'-byte state
+size_t max_delta_size(size_t len);
+
+// Encodes 'state' XOR 'ref' into 'dst', which must have room for
+// max_delta_size(len) bytes, and returns the encoded size. If 'ref' is null,
+// 'state' is encoded as is (zero runs in it are still compressed).
+size_t encode_delta(uint8_t const *state, uint8_t const *ref, size_t len,
+                    uint8_t *dst);
+
+// XORs the delta in 'src' into the 'len'-byte 'state'. Since XOR is its own
+// inverse, this turns 'ref' into 'state' and 'state' into 'ref' for a delta
+// from encode_delta(). Returns the number of bytes read from 'src'.
+size_t apply_delta(uint8_t const *src, uint8_t *state, size_t len);
+
+// Returns true if the 'src_len' bytes at 'src' hold exactly one delta for a
+// 'len'-byte state. apply_delta() trusts its input, so this should be used on
+// deltas from untrusted sources (e.g. files).
+bool is_valid_delta(uint8_t const *src, size_t src_len, size_t len);
@@ -2,20 +2,116 @@
 //
 // http://wiki.nesdev.com/w/index.php/CPU
 
-// Current CPU read/write state. Needed to get the timing for APU DMC sample
-// loading right (tested by the sprdma_and_dmc_dma tests).
-extern bool cpu_is_reading;
+// CPU state other than RAM and WRAM, which are saved separately with
+// dirty-page tracking (see transfer_cpu_state())
+struct STATE_BLOCK Cpu_state {
+    // Possible optimization: Making some of the variables a natural size for
+    // the implementation architecture might be faster. CPU emulation is
+    // already relatively speedy though, and we wouldn't get automatic
+    // wrapping.
 
-// Last value put on the CPU data bus. Used to implement open bus reads.
-extern uint8_t cpu_data_bus;
+    // Registers
+    uint16_t pc;
+    uint8_t a, s, x, y;
+
+    // Status flags
+
+    // The value the zero and negative flags are based on. Storing these
+    // together turns the setting of the flags into a simple assignment in most
+    // cases.
+    //
+    //  - !(zn & 0xFF) means the zero flag is set.
+    //  - zn & 0x180 means the negative flag is set.
+    //
+    // Having zn & 0x100 also indicate that the negative flag is set allows the
+    // two flags to be set separately, which is required by the BIT instruction
+    // and when pulling flags from the stack.
+    unsigned zn;
+
+    bool carry;
+    bool irq_disable;
+    bool decimal;
+    bool overflow;
+
+    // The byte after the opcode byte. Always fetched, so factoring out the
+    // fetch saves logic.
+    uint8_t op_1;
+
+    // Current CPU read/write state. Needed to get the timing for APU DMC
+    // sample loading right (tested by the sprdma_and_dmc_dma tests).
+    bool is_reading;
+
+    // Last value put on the CPU data bus. Used to implement open bus reads.
+    uint8_t data_bus;
+
+    // IRQ lines from mapper hardware on the cart, the DMC, and the APU frame
+    // counter
+    bool cart_irq, dmc_irq, frame_irq;
+
+    // The OR of all IRQ sources. Updated in update_irq_status().
+    bool irq_line;
+
+    // Set true when a falling edge occurs on the NMI input
+    bool nmi_asserted;
+
+    // Set true if interrupt polling detects a pending IRQ or NMI. The next
+    // "instruction" executed is the interrupt sequence.
+    bool pending_irq, pending_nmi;
+
+    // Down counter for adding an extra PPU tick for PAL
+    unsigned pal_extra_tick;
+};
+
+extern PER_CONSOLE Cpu_state cpu;
 
 // Offset in CPU cycles within the current frame. Used for audio generation.
-extern unsigned frame_offset;
+extern PER_CONSOLE unsigned frame_offset;
 
 // Runs the PPU and APU for one CPU cycle. Has external linkage so we can use
 // it while the CPU is halted during DMA.
 void tick();
 
+// Scheduled events. Things that happen at a known CPU cycle are given a
+// deadline on cpu_cycle instead of each having a counter that is decremented
+// on every tick. The owner of an event checks event_due() at the point within
+// tick() where the event should be handled, and schedules the next deadline
+// when it runs.
+
+enum Timed_event {
+    FRAME_COUNTER_EVENT, // Next frame counter step (see apu.cpp)
+    // Next change in the output level of a channel
+    PULSE_1_EVENT,
+    PULSE_2_EVENT,
+    TRIANGLE_EVENT,
+    NOISE_EVENT,
+    DMC_EVENT,           // Next DMC output clock
+#ifdef RUN_TESTS
+    TEST_RESET_EVENT,    // Delayed soft reset requested by a test ROM
+#endif
+    N_TIMED_EVENTS
+};
+
+// Deadline for events that aren't scheduled
+uint64_t const no_deadline = UINT64_MAX;
+
+// Number of CPU cycles run since startup. Incremented at the start of tick().
+// Not part of the state; deadlines are saved as cycle counts relative to it.
+extern PER_CONSOLE uint64_t cpu_cycle;
+
+extern PER_CONSOLE uint64_t event_deadlines[N_TIMED_EVENTS];
+// Earliest deadline in event_deadlines. Lets the common case of no event being
+// due be handled with a single comparison.
+extern PER_CONSOLE uint64_t next_deadline;
+
+// Sets the deadline for 'e' to 'cycle', replacing the old one. Pass
+// no_deadline to cancel the event.
+void schedule_event(Timed_event e, uint64_t cycle);
+
+// True if 'e' is due during the current CPU cycle
+inline bool event_due(Timed_event e) {
+    return cpu_cycle >= next_deadline && event_deadlines[e] == cpu_cycle;
+}
+
 // Also used outside the CPU core to load DMC samples - hence the external
 // linkage
 uint8_t read_mem(uint16_t addr);
@@ -26,10 +122,24 @@ void set_cart_irq(bool s);
 void set_dmc_irq(bool s);
 void set_frame_irq(bool s);
 
-// Starts emulation by issuing a RESET interrupt and entering the emulation
-// loop
+// Starts emulation by powering on the console (see power_on()) and entering
+// the emulation loop. Returns when end_emulation() is signaled.
 void run();
 
+// For frontends that drive emulation one frame at a time (see nesalizer.h).
+// power_on() puts the console into its cold boot state and issues a RESET
+// interrupt. run_frame() then runs emulation until the end-of-frame operations
+// for the current frame have run (or until end_emulation() is signaled).
+void power_on();
+void run_frame();
+
+// Used to re-simulate frames for rewinding. Runs emulation until the end of
+// the current frame, without audio output and without any of the end-of-frame
+// operations (drawing, input, etc.).
+void replay_frame();
+// True while replay_frame() is running
+extern PER_CONSOLE bool replaying_frame;
+
 // These functions inform the CPU emulation code of various events, which are
 // handled at the next instruction boundary. Handling events at instruction
 // boundaries simplifies state transfers as the current location within the CPU
@@ -1,11 +1,17 @@
 void init_input();
 
 void calc_controller_state();
+
+// Returns the button states for controller 'n' (0 or 1) as a byte with the
+// bits (from high to low) Right, Left, Down, Up, Start, Select, B, A
 uint8_t get_button_states(unsigned n);
+// Sets the button states for controller 'n' from a byte in the same format.
+// Used to feed input from sources other than the keyboard.
+void set_button_states(unsigned n, uint8_t states);
 
 // For rewind to work properly across resets, the reset button needs to be
 // treated as just another key whose state is saved along with the rest
-extern bool reset_pushed;
+extern PER_CONSOLE bool reset_pushed;
 
 template<bool calculating_size, bool is_save>
 void transfer_input_state(uint8_t *&buf);
@@ -16,6 +16,11 @@ extern struct Mapper_fns {
     // address bus).
     void    (*ppu_tick_callback)();
 
+    // For catch-up PPU emulation (see ppu.h). Returns a lower bound on the
+    // number of PPU ticks until ppu_tick_callback() might change the cart IRQ
+    // line, given the current mapper state. UINT_MAX means never.
+    unsigned (*ppu_ticks_till_irq)();
+
     // Saving and loading of mapper-specific state
     size_t  (*state_size)(uint8_t*&);
     size_t  (*save_state)(uint8_t*&);
@@ -46,7 +51,7 @@ void set_prg_32k_bank(unsigned bank);
 void set_prg_16k_bank(unsigned n, int bank, bool is_ram = false);
 void set_prg_8k_bank (unsigned n, int bank, bool is_ram = false);
 
-extern uint8_t *chr_pages[8];
+extern PER_CONSOLE uint8_t *chr_pages[8];
 
 void set_chr_8k_bank(unsigned bank);
 void set_chr_4k_bank(unsigned n, unsigned bank);
@@ -55,12 +60,12 @@ void set_chr_1k_bank(unsigned n, unsigned bank);
 
 // 8 KB page mapped at $6000-$7FFF. Used for extra work RAM (WRAM) and/or
 // saving (SRAM). MMC5 can remap this.
-extern uint8_t *wram_6000_page;
+extern PER_CONSOLE uint8_t *wram_6000_page;
 
 void set_wram_6000_bank(unsigned bank);
 
 // Updating this will require updating mirroring_to_str as well
-extern enum Mirroring {
+extern PER_CONSOLE enum Mirroring {
     HORIZONTAL      = 0,
     VERTICAL        = 1,
     ONE_SCREEN_LOW  = 2,
@@ -103,6 +108,9 @@ void set_mirroring(Mirroring m);
 //
 //  Each mapper has an apply_state(), which sets up memory mappings, etc.,
 //  associated with the state.
+//
+//  Mappers with more than one state variable keep them in a STATE_BLOCK struct
+//  (see common.h), which is then transferred with a single TRANSFER().
 
 // Helper
 #define MAPPER_FN_INSTANTIATIONS(n)                                     \
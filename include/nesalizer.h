@@ -0,0 +1,90 @@
+/* C API for embedding the emulator. Built as libnesalizer.a and
+ * libnesalizer.so with 'make LIBRARY=1'.
+ *
+ * Each thread has its own console. All functions except nes_init() operate on
+ * the console of the calling thread, so independent consoles can be run on
+ * separate threads (one console per thread).
+ *
+ * Errors (e.g. malformed or unsupported ROMs) are fatal, as in the rest of the
+ * emulator: a message is printed to stderr and the process exits.
+ *
+ * Unlike the internal headers, this header is self-contained and includable
+ * from C. */
+
+#ifndef NESALIZER_H
+#define NESALIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NES_API __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One-time initialization of shared tables. Must be called before any other
+ * function. */
+NES_API void nes_init(void);
+
+/* Loads a ROM image in iNES format from memory and powers on the console. The
+ * image is copied. 'name' is used in messages and for guessing the TV system
+ * (PAL if it contains "(E)" or "PAL", like for ROM filenames). */
+NES_API void nes_load_rom(void const *data, size_t size, char const *name);
+/* Frees the resources associated with the loaded ROM */
+NES_API void nes_unload_rom(void);
+
+/* Runs the console for one frame with the given controller states. The bits
+ * are (from high to low) Right, Left, Down, Up, Start, Select, B, A. */
+NES_API void nes_step_frame(uint8_t pad_1, uint8_t pad_2);
+
+/* Returns the frame rendered by the most recent nes_step_frame() call (256x240
+ * pixels, ARGB). Valid until the next nes_step_frame() call. */
+NES_API uint32_t const *nes_get_frame(void);
+/* Like nes_get_frame(), but returns the frame in the PPU's native format,
+ * without converting it to RGB. Each pixel has the NES color (a palette RAM
+ * value, 0-63) in bits 5-0 and the color emphasis bits from $2001 in bits
+ * 8-6. */
+NES_API uint16_t const *nes_get_frame_pixels(void);
+/* Returns the audio generated during the most recent nes_step_frame() call
+ * (mono, signed 16-bit, at nes_audio_sample_rate() Hz) and stores the number
+ * of samples in 'n_samples'. Valid until the next nes_step_frame() call. */
+NES_API int16_t const *nes_get_audio(size_t *n_samples);
+
+/* Audio modes for nes_set_audio_mode(). The APU is emulated exactly in all
+ * modes, including everything games can observe ($4015, frame and DMC IRQs,
+ * DMC DMA timing), and states can be saved in one mode and loaded in another.
+ *
+ *   NES_AUDIO_OFF:  No audio is generated, and nes_get_audio() returns no
+ *                   samples. Saves the time spent mixing and resampling.
+ *   NES_AUDIO_LOW:  Cheap point sampling at 11025 Hz, without band-limiting
+ *                   or filtering.
+ *   NES_AUDIO_FULL: Band-limited resampling to 44100 Hz. The default. */
+enum {
+    NES_AUDIO_OFF,
+    NES_AUDIO_LOW,
+    NES_AUDIO_FULL
+};
+
+/* Sets the audio mode for the console. Can be changed between frames. */
+NES_API void nes_set_audio_mode(int mode);
+/* Sample rate in Hz of the audio returned by nes_get_audio() in the current
+ * mode */
+NES_API unsigned nes_audio_sample_rate(void);
+
+/* Size in bytes of a saved state. Depends on the ROM. */
+NES_API size_t nes_state_size(void);
+/* Saves the state to/loads the state from a caller-provided buffer of
+ * nes_state_size() bytes */
+NES_API void nes_save_state(void *buf);
+NES_API void nes_load_state(void const *buf);
+
+/* Presses the reset button. Takes effect at the start of the next
+ * nes_step_frame() call. */
+NES_API void nes_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,6 @@
+// Conversion of pixels from the PPU's output format to RGB. A pixel is a
+// uint16_t holding the NES color (the value from palette RAM, with grayscale
+// applied) in bits 5-0 and the color emphasis bits from $2001 in bits 8-6.
+
+// Converts 'n' pixels to ARGB (0x00RRGGBB)
+void pixels_to_argb(uint16_t const *pixels, uint32_t *argb, size_t n);
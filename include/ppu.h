@@ -8,24 +8,122 @@
 
 // Nametable memory of variable size, initialized when loading the ROM. 2 KB is
 // built in, and the cart can provide an extra 2 KB (though this is rare).
-extern uint8_t *ciram;
+extern PER_CONSOLE uint8_t *ciram;
+// Dirty-page stamps for 'ciram' (see transfer_tracked() in common.h)
+extern PER_CONSOLE uint32_t *ciram_stamps;
 
 // The number of the last line in the frame, at the end of the VBlank interval.
 // Differs between PAL and NTSC.
-extern unsigned prerender_line;
+extern PER_CONSOLE unsigned prerender_line;
 
 // Optimization - always equals show_bg || show_sprites
-extern bool rendering_enabled;
+extern PER_CONSOLE bool rendering_enabled;
 
-// PPU cycles run so far. Used as a general-purpose timestamp.
-extern uint64_t ppu_cycle;
+enum Sprite_size {
+    EIGHT_BY_EIGHT,
+    EIGHT_BY_SIXTEEN
+};
 
-// Current position within the frame
-extern unsigned dot, scanline;
+// PPU state other than CHR RAM and nametable memory, which are saved
+// separately with dirty-page tracking (see transfer_ppu_state())
+struct STATE_BLOCK Ppu_state {
+    uint8_t palettes[0x20];
+    uint8_t oam[0x100];
+    uint8_t sec_oam[0x20];
 
-// VRAM address currently being output. Some mappers (e.g., MMC3) snoop on
-// this.
-extern unsigned ppu_addr_bus;
+    // VRAM address/scroll regs. 15 bits long.
+    unsigned t, v;
+    uint8_t fine_x;
+    // v is not immediately updated from t on the second write to $2006. This
+    // variable implements the delay.
+    unsigned pending_v_update;
+
+    unsigned v_inc;           // $2000:2
+    uint16_t sprite_pat_addr; // $2000:3
+    uint16_t bg_pat_addr;     // $2000:4
+    Sprite_size sprite_size;  // $2000:5
+    bool nmi_on_vblank;       // $2000:7
+
+    // $2001:0 - 0x30 if grayscale mode enabled, otherwise 0x3F
+    uint8_t grayscale_color_mask;
+    bool show_bg_left_8;      // $2001:1
+    bool show_sprites_left_8; // $2001:2
+    bool show_bg;             // $2001:3
+    bool show_sprites;        // $2001:4
+    uint8_t tint_bits;        // $2001:7-5
+
+    bool sprite_overflow;     // $2002:5
+    bool sprite_zero_hit;     // $2002:6
+    bool in_vblank;           // $2002:7
+
+    uint8_t oam_addr; // $2003
+    // Pointer into the secondary OAM, 5 bits wide
+    //  - Updated during sprite evaluation and loading
+    //  - Cleared at dots 64.5, 256.5 and 340.5, if rendering
+    unsigned sec_oam_addr;
+    uint8_t oam_data; // $2004 (seen when reading from $2004)
+
+    // Sprite evaluation state
+
+    // Goes high for three ticks when an in-range sprite is found during
+    // sprite evaluation
+    unsigned copy_sprite_signal;
+    bool oam_addr_overflow, sec_oam_addr_overflow;
+    bool overflow_detection;
+
+    // PPUSCROLL/PPUADDR write flip-flop. First write when false, second write
+    // when true.
+    bool write_flip_flop;
+
+    uint8_t data_reg; // $2007 read buffer
+
+    bool odd_frame;
+
+    // PPU cycles run so far. Used as a general-purpose timestamp.
+    uint64_t cycle;
+
+    // Internal PPU counters and registers
+
+    // Current position within the frame
+    unsigned dot, scanline;
+
+    uint8_t nt_byte, at_byte;
+    uint8_t bg_byte_l, bg_byte_h;
+    uint16_t bg_shift_l, bg_shift_h;
+    unsigned at_shift_l, at_shift_h;
+    unsigned at_latch_l, at_latch_h;
+
+    // Sprite output units
+    uint8_t sprite_attribs[8];
+    uint8_t sprite_x[8];
+    uint8_t sprite_pat_l[8];
+    uint8_t sprite_pat_h[8];
+
+    bool s0_on_next_scanline;
+    bool s0_on_cur_scanline;
+
+    // Temporary storage (also exists in PPU) for data during sprite loading
+    uint8_t sprite_y, sprite_index;
+    bool sprite_in_range;
+
+    // Writes to certain registers are suppressed during the initial frame:
+    // http://wiki.nesdev.com/w/index.php/PPU_power_up_state
+    //
+    // Emulating this makes NY2011 and possibly other demos hang. They probably
+    // don't run on the real thing either.
+    bool initial_frame;
+
+    // VRAM address currently being output. Some mappers (e.g., MMC3) snoop on
+    // this.
+    unsigned addr_bus;
+
+    // Open bus for reads from PPU $2000-$2007 (tested by ppu_open_bus.nes).
+    // "wcycle" is short for "write cycle".
+    uint8_t open_bus;
+    uint64_t bit_7_6_wcycle, bit_5_wcycle, bit_4_0_wcycle;
+};
+
+extern PER_CONSOLE Ppu_state ppu;
 
 void init_ppu_for_rom();
 
@@ -33,6 +131,53 @@ void init_ppu_for_rom();
 void tick_ntsc_ppu();
 void tick_pal_ppu();
 
+#ifdef CATCH_UP_PPU
+
+// Catch-up PPU emulation (CATCH_UP_PPU=1 in the Makefile). Instead of running
+// the PPU three (3.2 for PAL) ticks per CPU cycle from tick(), the ticks are
+// counted in 'ppu_ticks_owed' and run in one go when something depends on the
+// PPU being up to date: PPU register accesses (including OAM DMA), mapper
+// reads and writes, and state saves.
+//
+// Events the CPU has to see at the right time are predicted: the end of the
+// frame, the start of VBlank (NMI), and IRQs from mappers that watch the PPU
+// (see Mapper_fns::ppu_ticks_till_irq). The PPU is caught up at interrupt
+// polling points and instruction boundaries once the earliest one might have
+// happened. That makes the CPU see exactly the same PPU state as when ticking
+// every cycle, which remains the reference implementation.
+
+// PPU ticks that have not been run yet
+extern PER_CONSOLE unsigned ppu_ticks_owed;
+// Lower bound on the number of ticks (from the current PPU position) until an
+// event the CPU needs to see might happen. Always at least 1.
+extern PER_CONSOLE unsigned ppu_ticks_till_event;
+
+// Runs the owed ticks and updates the prediction
+void catch_up_ppu();
+
+// Recomputes ppu_ticks_till_event. Needs to be called after writes to mapper
+// registers, which might change when the mapper asserts IRQ.
+void predict_ppu_events();
+
+inline void sync_ppu() {
+    if (ppu_ticks_owed > 0)
+        catch_up_ppu();
+}
+
+inline void sync_ppu_if_event_due() {
+    if (ppu_ticks_owed >= ppu_ticks_till_event)
+        catch_up_ppu();
+}
+
+#else
+
+// The PPU is always up to date
+inline void sync_ppu() {}
+inline void sync_ppu_if_event_due() {}
+inline void predict_ppu_events() {}
+
+#endif
+
 // n = 0...7 corresponds to $2000-$2007
 uint8_t read_ppu_reg(unsigned n);
 void write_ppu_reg(uint8_t val, unsigned n);
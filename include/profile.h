@@ -0,0 +1,83 @@
+// Optional cycle counters for hot paths, enabled with PROFILE=1 (see the
+// Makefile). The time stamp counter is read before and after each measured
+// call, and the difference is accumulated per frame. The per-frame totals are
+// summed up at the end of each frame, also keeping track of the most
+// expensive frame. Instructions are timed individually and tallied per
+// opcode.
+//
+// The results are printed to stderr when the ROM is unloaded, and whenever the
+// process receives SIGUSR1 (at the end of the next frame).
+//
+// The counters are inclusive: tick_ppu<>() includes the mapper PPU tick
+// callback, do_oam_dma() includes the ticks for the DMA cycles, and the opcode
+// totals include the PPU and APU ticks run during the instruction. Reading the
+// time stamp counter has an overhead of a few dozen cycles, which shows up in
+// the totals as well.
+
+enum Prof_counter {
+    PROF_TICK_PPU = 0,          // tick_ppu<>()
+    PROF_TICK_APU,              // tick_apu()
+    PROF_MAPPER_PPU_TICK,       // mapper_fns.ppu_tick_callback()
+    PROF_MAPPER_WRITE,          // mapper_fns.write()
+    PROF_READ_PPU_REG,          // read_ppu_reg()
+    PROF_WRITE_PPU_REG,         // write_ppu_reg()
+    PROF_OAM_DMA,               // do_oam_dma()
+
+    N_PROF_COUNTERS
+};
+
+#ifdef PROFILE
+
+#  if defined(__i386__) || defined(__x86_64__)
+#    include <x86intrin.h>
+inline uint64_t prof_now() { return __rdtsc(); }
+#  else
+// Nanoseconds instead of cycles on other architectures
+inline uint64_t prof_now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1000000000ull*t.tv_sec + t.tv_nsec;
+}
+#  endif
+
+struct Prof_accumulator {
+    uint64_t calls;
+    uint64_t cycles;
+};
+
+// Counters for the current frame
+extern PER_CONSOLE Prof_accumulator prof_frame[N_PROF_COUNTERS];
+
+// Runs the statement(s) in the variadic arguments and adds the elapsed cycles
+// to 'counter'. Just runs the statement(s) if profiling is disabled.
+#  define PROFILE_CALL(counter, ...)                            \
+     do {                                                       \
+         uint64_t const prof_start = prof_now();                \
+         __VA_ARGS__;                                           \
+         ++prof_frame[counter].calls;                           \
+         prof_frame[counter].cycles += prof_now() - prof_start; \
+     } while (0)
+
+// Adds one execution of 'opcode' that started at time 'start'
+void prof_opcode(uint8_t opcode, uint64_t start);
+
+#else
+
+#  define PROFILE_CALL(counter, ...) do { __VA_ARGS__; } while (0)
+
+#endif
+
+// Installs the SIGUSR1 handler. Not done for the library, where signal
+// handling is up to the host program.
+void init_profile();
+
+// Clears all counters. Called when a ROM is loaded.
+void reset_profile();
+
+// Called at the end of each frame. Adds the counters for the frame to the
+// totals, and prints the results if SIGUSR1 has been received since the last
+// frame.
+void profile_end_frame();
+
+// Prints the results for the completed frames to stderr
+void print_profile();
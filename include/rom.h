@@ -1,33 +1,44 @@
 // Loading and unloading of ROM files
 
 // Points to the start of the PRG data within the ROM image
-extern uint8_t *prg_base;
-extern unsigned prg_16k_banks;
+extern PER_CONSOLE uint8_t *prg_base;
+extern PER_CONSOLE unsigned prg_16k_banks;
 
 // Points to the start of the CHR data within the ROM image, or to a
 // dynamically allocated buffer if the cart uses RAM for CHR
-extern uint8_t *chr_base;
-extern unsigned chr_8k_banks;
-extern bool chr_is_ram;
+extern PER_CONSOLE uint8_t *chr_base;
+extern PER_CONSOLE unsigned chr_8k_banks;
+extern PER_CONSOLE bool chr_is_ram;
+// Dirty-page stamps for CHR RAM (see transfer_tracked() in common.h). Only
+// allocated if chr_is_ram is true.
+extern PER_CONSOLE uint32_t *chr_ram_stamps;
 
 // Points to a dynamically allocated buffer for SRAM/WRAM. We usually have to
 // assume the cart has SRAM/WRAM due to iNES ickiness.
-extern uint8_t *wram_base;
-extern unsigned wram_8k_banks;
+extern PER_CONSOLE uint8_t *wram_base;
+extern PER_CONSOLE unsigned wram_8k_banks;
+// Dirty-page stamps for SRAM/WRAM
+extern PER_CONSOLE uint32_t *wram_stamps;
 
 // True if this is a PAL ROM
-extern bool is_pal;
+extern PER_CONSOLE bool is_pal;
+
+// MD5 hash of the PRG ROM. Used to identify the game.
+extern PER_CONSOLE uint8_t prg_md5[16];
 
 // If true, the mapper has bus conflicts and does not shut off ROM output for
 // writes to the $8000+ range. This results in an AND between the written value
 // and the value in ROM. Cybernoid depends on this being emulated.
-extern bool has_bus_conflicts;
+extern PER_CONSOLE bool has_bus_conflicts;
 
-extern Mapper_fns mapper_fns;
+extern PER_CONSOLE Mapper_fns mapper_fns;
 
 // Loads a ROM file. If 'print_info' is true, information about the cart is
 // printed to stdout.
 void load_rom(char const *filename, bool print_info);
+// Ditto for a ROM image in memory. The image is copied. 'name' is used in
+// messages and in place of the filename when guessing the TV system.
+void load_rom_from_memory(uint8_t const *data, size_t size, char const *name, bool print_info);
 
 // Frees resources associated with the ROM
 void unload_rom();
@@ -1,11 +1,29 @@
 // Save state and rewinding implementation
 
-void init_save_states_for_rom();
+// Prints the state and rewind buffer sizes if 'print_info' is true
+void init_save_states_for_rom(bool print_info);
 void deinit_save_states_for_rom();
 
-// Plain old save state. Not related to rewinding.
-void save_state();
-void load_state();
+// Size in bytes of a saved state. Varies depending on the mapper.
+size_t get_state_size();
+
+// The part of the state that belongs to a single subsystem
+struct State_section {
+    char const *name;
+    size_t offset, size;
+};
+
+// Number of sections in the state: APU, CPU, PPU, controller, input, and
+// mapper, in that order
+unsigned const n_state_sections = 6;
+
+// Returns the layout of the state, with n_state_sections sections. Valid
+// after init_save_states_for_rom().
+State_section const *get_state_sections();
+// Saves the state to/loads the state from a caller-provided buffer of
+// get_state_size() bytes. Loading clears the rewind buffer.
+void save_state_to_buf(uint8_t *buf);
+void load_state_from_buf(uint8_t const *buf);
 
 // Called once per frame to implementing rewinding. If 'do_rewind' is true, we
 // should rewind.
@@ -18,5 +36,5 @@ unsigned get_frame_len();
 
 // True if the current frame should appear to run in reverse (e.g., w.r.t.
 // audio)
-extern bool is_backwards_frame;
+extern PER_CONSOLE bool is_backwards_frame;
 
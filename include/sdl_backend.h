@@ -1,37 +1,64 @@
-// Video, audio, and input backend. Uses SDL2.
+// Video, audio, and input backend. Uses SDL2, except in headless builds (see
+// the HEADLESS option in the Makefile), where a null backend
+// (null_backend.cpp) without any SDL dependency is used instead.
 
-#include <SDL.h>
+#ifndef HEADLESS
+#  include <SDL.h>
 
 void init_sdl();
 void deinit_sdl();
 
 // SDL rendering thread. Runs separately from the emulation thread.
 void sdl_thread();
+#else
+// Sets up the null backend for the console on the calling thread. If
+// 'input_filename' is non-null, controller input is read from that file. It
+// holds two bytes per frame - one for each controller - with the buttons in
+// the same bit order as for get_button_states(). Buttons are released at the
+// end of the file. If 'max_frames' is non-zero, emulation ends after that many
+// frames. If 'record_rewind' is true, states are recorded for rewinding each
+// frame as in the SDL build (used to make benchmarks representative).
+void init_null_backend(char const *input_filename, unsigned long max_frames,
+                       bool record_rewind);
+void deinit_null_backend();
 
-// Called from the emulation thread to cause the SDL thread to exit
+// Returns the number of frames completed so far
+unsigned long get_n_frames();
+
+// Returns the most recently rendered frame (256x240 pixels, ARGB). Converted
+// from the PPU's output on each call.
+uint32_t const *get_frame_buffer();
+// Returns the most recently rendered frame (256x240 pixels) in the PPU's
+// output format (see palette.h)
+uint16_t const *get_frame_pixels();
+#endif
+
+// Called from the emulation thread to cause the SDL thread to exit. Does
+// nothing in headless builds.
 void exit_sdl_thread();
 
 // Video
 
-void put_pixel(unsigned x, unsigned y, uint32_t color);
+// 'pixel' is in the format described in palette.h. Frames are converted to
+// RGB when they're displayed, off the emulation thread.
+void put_pixel(unsigned x, unsigned y, uint16_t pixel);
 void draw_frame();
 
 // Audio
 
 int const sample_rate = 44100;
 
-// Protect the audio buffer from concurrent access by the emulation thread and
-// SDL
-void lock_audio();
-void unlock_audio();
-
+#ifndef HEADLESS
 // Stop and start audio playback in SDL
 void start_audio_playback();
 void stop_audio_playback();
+#endif
 
 // Input and events
 
 void handle_ui_keys();
 
+#ifndef HEADLESS
 extern SDL_mutex *event_lock;
 extern Uint8 const *keys;
+#endif
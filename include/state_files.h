@@ -0,0 +1,28 @@
+// Persistent save states, stored in numbered slot files next to the ROM
+
+// Number of save slots. Slot 0 holds autosaves.
+unsigned const n_state_slots = 5;
+
+// Prepares for saving and loading states for the ROM. The file for slot n is
+// named <rom_filename>.state<n>. Nothing is written until a state is saved.
+void init_state_files_for_rom(char const *rom_filename);
+// Finishes any pending writes
+void deinit_state_files_for_rom();
+
+// Selects the slot used by save_state() and load_state(). Slot 1 is selected
+// initially.
+void select_state_slot(unsigned n);
+
+// Saves the state to the selected slot. The state is compressed and written on
+// a background thread, so this only copies it and never waits for disk I/O. If
+// the slot already has a write queued, the queued state is replaced, so saving
+// every frame is cheap.
+void save_state();
+// Loads the state from the selected slot, waiting for any pending writes
+// first. Prints a warning and leaves the state alone if the slot is empty, or
+// if the file is invalid or for a different ROM.
+void load_state();
+
+// Called once per frame. Saves the state to slot 0 every autosave_seconds
+// seconds (see state_files.cpp), unless a write is already in progress.
+void handle_autosave();
@@ -1,6 +1,6 @@
-extern double cpu_clock_rate;
-extern double ppu_clock_rate;
-extern double ppu_fps;
+extern PER_CONSOLE double cpu_clock_rate;
+extern PER_CONSOLE double ppu_clock_rate;
+extern PER_CONSOLE double ppu_fps;
 
 void init_timing();
 void init_timing_for_rom();
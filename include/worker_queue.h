@@ -0,0 +1,56 @@
+// Bounded queue of work slots processed in order by a worker thread. Used to
+// move resampling (audio.cpp) and rewind segment compression (save_states.cpp)
+// off the emulation thread.
+//
+// The slots themselves are owned by the user of the queue, which refers to
+// them by index. The producer gets a free slot from begin_queue_slot(), fills
+// it in without holding the lock, and hands it to the worker with
+// end_queue_slot(). The worker calls 'process' for each queued slot, also
+// without holding the lock, and frees it afterwards.
+//
+// PER_CONSOLE state can't be reached from the worker thread, so anything
+// 'process' needs must be reachable from 'ctx'.
+
+#include <pthread.h>
+
+struct Worker_queue {
+    // Called on the worker thread for each queued slot
+    void (*process)(void *ctx, unsigned slot);
+    void *ctx;
+    // Used in error messages
+    char const *name;
+
+    unsigned n_slots;
+    // Index of the oldest queued slot and the number of queued slots
+    unsigned first_queued, n_queued;
+    bool exit_worker;
+
+    pthread_mutex_t lock;
+    // Signaled when a slot is queued or when the worker should exit
+    pthread_cond_t queued_cond;
+    // Signaled when the worker is done with a slot
+    pthread_cond_t done_cond;
+
+    pthread_t thread;
+    bool thread_started;
+};
+
+void init_worker_queue(Worker_queue &q, unsigned n_slots,
+                       void (*process)(void *ctx, unsigned slot), void *ctx,
+                       char const *name);
+// Stops the worker (see stop_worker()) and frees the queue's resources
+void deinit_worker_queue(Worker_queue &q);
+
+// Returns the index of a free slot for the producer to fill in, starting the
+// worker if needed. Waits for the worker to catch up while 'max_queued' or
+// more slots are queued. 'max_queued' must be between 1 and the number of
+// slots.
+unsigned begin_queue_slot(Worker_queue &q, unsigned max_queued);
+// Queues the slot returned by the last begin_queue_slot() call
+void end_queue_slot(Worker_queue &q);
+
+// Waits until the worker has processed all queued slots
+void flush_worker_queue(Worker_queue &q);
+// Stops the worker after it has processed all queued slots. The worker is
+// restarted by the next begin_queue_slot() call.
+void stop_worker(Worker_queue &q);
@@ -7,25 +7,155 @@
 #include "ppu.h"
 #include "rom.h"
 
-// Clock used by the APU and DMA circuitry, parts of which tick at half the CPU
-// frequency. Whether the initial tick is high or low seems to be random. The
-// name apu_clk1 is from Visual 2A03.
-static bool apu_clk1_is_high;
+enum OAM_DMA_state {
+    OAM_DMA_IN_PROGRESS = 0,
+    OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK,
+    OAM_DMA_IN_PROGRESS_LAST_TICK,
+    OAM_DMA_NOT_IN_PROGRESS
+};
+
+enum Frame_counter_mode { FOUR_STEP = 0, FIVE_STEP = 1 };
+
+// Pulse channel
+struct Pulse {
+    // Range 0-15
+    // (Potentially) affected by
+    //   - volume updates,
+    //   - length counter updates,
+    //   - period updates,
+    //   - and waveform position updates
+    unsigned output_level;
+
+    bool     enabled;
+
+    bool     const_vol;
+    unsigned duty;
+    unsigned waveform_pos;
+    unsigned len_cnt;
+    unsigned period;
+    unsigned period_cnt;
+    bool     sweep_enabled;
+    bool     sweep_negate;
+    unsigned sweep_period;
+    unsigned sweep_period_cnt;
+    unsigned sweep_shift;
+    bool     sweep_reload_flag;
+    unsigned vol;
+
+    unsigned env_div_cnt;
+    unsigned env_vol;
+    bool     halt_len_loop_env;
+    bool     env_start_flag;
+
+    // Recalculated whenever anything happens that might affect the sweep
+    // target period. Not sure if this optimization is still worthwhile.
+    int sweep_target_period;
+};
+
+// State that gets saved and loaded with a single copy. The channel timers and
+// the frame counter run off cycle deadlines kept outside the block, and the
+// *period_cnt and delayed_frame_timer_reset fields are only brought up to date
+// from them when saving (see transfer_apu_state()).
+static PER_CONSOLE struct STATE_BLOCK Apu_state {
+    // Clock used by the APU and DMA circuitry, parts of which tick at half the
+    // CPU frequency. Whether the initial tick is high or low seems to be
+    // random. The name apu_clk1 is from Visual 2A03.
+    bool clk1_is_high;
+
+    // Current OAM DMA state. Needed to get the timing for APU DMC sample
+    // loading right (tested by the sprdma_and_dmc_dma tests).
+    OAM_DMA_state oam_dma_state;
+
+    Pulse pulse[2];
+
+    // Triangle channel
+
+    // Range 0-15, premultiplied by 3 for mixing. Affected only by waveform
+    // position updates.
+    unsigned tri_output_level;
+
+    bool     tri_enabled;
+
+    unsigned tri_period;
+    unsigned tri_period_cnt;
+
+    unsigned tri_waveform_pos;
+
+    unsigned tri_len_cnt;
+    bool     tri_halt_flag;
+
+    unsigned tri_lin_cnt_load;
+    unsigned tri_lin_cnt;
+    bool     tri_lin_cnt_reload_flag;
+
+    // Noise channel
+
+    // Range 0-15, premultiplied by 2 for mixing. Affected by
+    //   - volume updates,
+    //   - Length counter updates,
+    //   - and shift reg value
+    unsigned noise_output_level;
+
+    bool     noise_enabled;
+
+    bool     noise_halt_len_loop_env;
+    bool     noise_const_vol;
+    unsigned noise_vol;
+    unsigned noise_feedback_bit;
+    unsigned noise_period;
+    unsigned noise_period_cnt;
+    unsigned noise_len_cnt;
+    unsigned noise_shift_reg;
+    bool     noise_env_start_flag;
+    unsigned noise_env_vol;
+    unsigned noise_env_div_cnt;
+
+    // DMC channel
+
+    // Range 0-127
+    // Counter value directly determines output level
+    unsigned dmc_counter;
+
+    // $4010
+    bool     dmc_irq_enabled;
+    bool     dmc_loop_sample;
+    unsigned dmc_period;
+    // DMC_EVENT holds the deadline
+    unsigned dmc_period_cnt;
+
+    // $4012, missing the implied "| 0x8000" that puts it into ROM
+    unsigned dmc_sample_start_addr;
+    // $4013
+    unsigned dmc_sample_len;
+
+    uint8_t  dmc_sample_buffer;
+    bool     dmc_sample_buffer_has_data;
+    uint8_t  dmc_shift_reg;
+    bool     dpcm_active;
+
+    // True while a sample byte is being loaded, to prevent recursion in
+    // load_dmc_sample_byte(). This also mirrors how the hardware behaves.
+    bool     dmc_loading_sample_byte;
+
+    unsigned dmc_sample_cur_addr; // 15 bits wide
+    unsigned dmc_bytes_remaining;
+    unsigned dmc_bits_remaining;
+
+    // Frame counter
+
+    Frame_counter_mode frame_counter_mode;
+    bool inhibit_frame_irq;
+
+    unsigned frame_counter_clock;
+    // Cycles until the delayed reset
+    unsigned delayed_frame_timer_reset;
+} apu;
 
 //
 // OAM (sprite data) DMA
 //
 // Put here since it uses the APU clock and has interactions with DMC DMA
 
-// Current OAM DMA state. Needed to get the timing for APU DMC sample loading
-// right (tested by the sprdma_and_dmc_dma tests).
-static enum OAM_DMA_state {
-    OAM_DMA_IN_PROGRESS = 0,
-    OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK,
-    OAM_DMA_IN_PROGRESS_LAST_TICK,
-    OAM_DMA_NOT_IN_PROGRESS
-} oam_dma_state;
-
 void do_oam_dma(uint8_t addr) {
     // We get either WDTTT... or WDDTTT... where W is the write cycle, D a
     // dummy cycle, and T a transfer cycle (there's 512 of them). The extra
@@ -34,39 +164,39 @@ void do_oam_dma(uint8_t addr) {
     // The current OAM DMA state influences the timing for APU DMC sample
     // loads, so we need to keep track of it
 
-    oam_dma_state = OAM_DMA_IN_PROGRESS;
+    apu.oam_dma_state = OAM_DMA_IN_PROGRESS;
 
     // Dummy cycles
-    if (!apu_clk1_is_high) tick();
+    if (!apu.clk1_is_high) tick();
     tick();
 
     unsigned const start_addr = 0x100*addr;
     for (unsigned i = 0; i < 254; ++i) {
         // Do it like this to get open bus right. Could be that it's not
         // visible in any way though.
-        cpu_data_bus = read_mem(start_addr + i);
+        cpu.data_bus = read_mem(start_addr + i);
         tick();
-        write_oam_data_reg(cpu_data_bus);
+        write_oam_data_reg(cpu.data_bus);
     }
 
-    cpu_data_bus = read_mem(start_addr + 254);
-    oam_dma_state = OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK;
+    cpu.data_bus = read_mem(start_addr + 254);
+    apu.oam_dma_state = OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK;
     tick();
-    write_oam_data_reg(cpu_data_bus);
-    oam_dma_state = OAM_DMA_IN_PROGRESS;
+    write_oam_data_reg(cpu.data_bus);
+    apu.oam_dma_state = OAM_DMA_IN_PROGRESS;
 
-    cpu_data_bus = read_mem(start_addr + 255);
-    oam_dma_state = OAM_DMA_IN_PROGRESS_LAST_TICK;
+    cpu.data_bus = read_mem(start_addr + 255);
+    apu.oam_dma_state = OAM_DMA_IN_PROGRESS_LAST_TICK;
     tick();
-    write_oam_data_reg(cpu_data_bus);
+    write_oam_data_reg(cpu.data_bus);
 
-    oam_dma_state = OAM_DMA_NOT_IN_PROGRESS;
+    apu.oam_dma_state = OAM_DMA_NOT_IN_PROGRESS;
 }
 
 
 // Set when the output level of any channel changes. Lets us skip the mixing
 // step most of the time.
-static bool channel_updated;
+static PER_CONSOLE bool channel_updated;
 
 void begin_audio_frame() { channel_updated = true; }
 
@@ -76,52 +206,69 @@ uint8_t const len_table[] = {
   12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30 };
 
 //
-// Pulse channels
+// Channel timers
 //
 
-static struct Pulse {
-    // Range 0-15
-    // (Potentially) affected by
-    //   - volume updates,
-    //   - length counter updates,
-    //   - period updates,
-    //   - and waveform position updates
-    unsigned output_level;
-
-    bool     enabled;
+// The pulse, triangle, and noise timers aren't decremented on every cycle.
+// Each channel instead keeps the cycle of its next timer clock, and is caught
+// up (see run_timer()) whenever its current state is needed or something that
+// affects its timer is about to change. Events are only scheduled for the
+// timer clocks that change the output level of a channel, so silent or steady
+// channels cost nothing per cycle.
+
+// True while the frame counter runs from tick_apu(). The frame counter acts
+// before the channel timers are clocked within a cycle.
+static PER_CONSOLE bool in_frame_counter_step;
+
+// Returns the number of timer clocks that have happened since the last call,
+// given the cycle of the next clock and the number of cycles between clocks,
+// and moves 'next_clock' past them. 'clock_len' must not have changed since
+// the last call.
+static uint64_t run_timer(uint64_t &next_clock, unsigned clock_len) {
+    // Timer clocks for the current cycle haven't happened yet during frame
+    // counter steps
+    uint64_t const now = cpu_cycle - in_frame_counter_step;
+
+    if (next_clock > now)
+        return 0;
+
+    uint64_t const n_clocks = (now - next_clock)/clock_len + 1;
+    next_clock += n_clocks*clock_len;
+    return n_clocks;
+}
 
-    bool     const_vol;
-    unsigned duty;
-    unsigned waveform_pos;
-    unsigned len_cnt;
-    unsigned period;
-    unsigned period_cnt;
-    bool     sweep_enabled;
-    bool     sweep_negate;
-    unsigned sweep_period;
-    unsigned sweep_period_cnt;
-    unsigned sweep_shift;
-    bool     sweep_reload_flag;
-    unsigned vol;
+// The pulse timers are clocked on cycles where apu_clk1 goes low. Returns the
+// first such cycle after the current one.
+static uint64_t next_apu_clk1_low() {
+    return cpu_cycle + (apu.clk1_is_high ? 1 : 2);
+}
 
-    unsigned env_div_cnt;
-    unsigned env_vol;
-    bool     halt_len_loop_env;
-    bool     env_start_flag;
+//
+// Pulse channels
+//
 
-    // Recalculated whenever anything happens that might affect the sweep
-    // target period. Not sure if this optimization is still worthwhile.
-    int sweep_target_period;
-} pulse[2];
+// Cycle of the next timer clock for each channel. Pulse::period_cnt is only
+// kept up to date for state transfers.
+static PER_CONSOLE uint64_t pulse_next_clock[2];
 
 static void update_sweep_target_period(unsigned n) {
-    int addition = pulse[n].period >> pulse[n].sweep_shift;
+    int addition = apu.pulse[n].period >> apu.pulse[n].sweep_shift;
     // The adder on the first pulse channel is missing the carry in to the
     // first bit for some unknown reason
-    if (pulse[n].sweep_negate) addition = (n == 0) ? ~addition : -addition;
-    pulse[n].sweep_target_period = (int)pulse[n].period + addition;
+    if (apu.pulse[n].sweep_negate) addition = (n == 0) ? ~addition : -addition;
+    apu.pulse[n].sweep_target_period = (int)apu.pulse[n].period + addition;
+}
+
+// Each timer clock advances the waveform position. Must be called before
+// changing the period or the waveform position.
+static void catch_up_pulse(unsigned n) {
+    apu.pulse[n].waveform_pos =
+      (apu.pulse[n].waveform_pos +
+       run_timer(pulse_next_clock[n], 2*(apu.pulse[n].period + 1))) % 8;
 }
 
+// Also schedules PULSE_1/2_EVENT for the next timer clock that changes the
+// output level. Used as the event handler.
 static void update_pulse_output_level(unsigned n) {
     static uint8_t const pulse_duties[4][8] =
       { { 0, 1, 0, 0, 0, 0, 0, 0 },
@@ -129,109 +276,105 @@ static void update_pulse_output_level(unsigned n) {
         { 0, 1, 1, 1, 1, 0, 0, 0 },
         { 1, 0, 0, 1, 1, 1, 1, 1 } };
 
-    unsigned const prev_output_level = pulse[n].output_level;
+    catch_up_pulse(n);
 
-    if (pulse[n].len_cnt == 0                               ||
-        pulse[n].period < 8                                 ||
-        !pulse_duties[pulse[n].duty][pulse[n].waveform_pos] ||
-        pulse[n].sweep_target_period > 0x7FF) {
+    unsigned const prev_output_level = apu.pulse[n].output_level;
+    uint8_t const *const duty = pulse_duties[apu.pulse[n].duty];
+    unsigned const pos = apu.pulse[n].waveform_pos;
+    unsigned const vol = apu.pulse[n].const_vol ? apu.pulse[n].vol : apu.pulse[n].env_vol;
 
-        pulse[n].output_level = 0;
-    }
-    else
-        pulse[n].output_level =
-          pulse[n].const_vol ? pulse[n].vol : pulse[n].env_vol;
+    bool const silenced =
+      apu.pulse[n].len_cnt == 0 ||
+      apu.pulse[n].period < 8   ||
+      apu.pulse[n].sweep_target_period > 0x7FF;
+
+    apu.pulse[n].output_level = (silenced || !duty[pos]) ? 0 : vol;
 
-    if (pulse[n].output_level != prev_output_level)
+    if (apu.pulse[n].output_level != prev_output_level)
         channel_updated = true;
+
+    uint64_t edge = no_deadline;
+    if (!silenced && vol > 0) {
+        unsigned steps = 1;
+        while (duty[(pos + steps) % 8] == duty[pos])
+            ++steps;
+        edge = pulse_next_clock[n] + (steps - 1)*2*(apu.pulse[n].period + 1);
+    }
+    schedule_event((Timed_event)(PULSE_1_EVENT + n), edge);
 }
 
 void write_pulse_reg_0(unsigned n, uint8_t val) {
-    pulse[n].duty              = val >> 6;
-    pulse[n].halt_len_loop_env = val & 0x20;
-    pulse[n].const_vol         = val & 0x10;
-    pulse[n].vol               = val & 0xF;
+    apu.pulse[n].duty              = val >> 6;
+    apu.pulse[n].halt_len_loop_env = val & 0x20;
+    apu.pulse[n].const_vol         = val & 0x10;
+    apu.pulse[n].vol               = val & 0xF;
 
     update_pulse_output_level(n);
 }
 
 void write_pulse_reg_1(unsigned n, uint8_t val) {
-    pulse[n].sweep_enabled = val & 0x80;
-    pulse[n].sweep_period  = (val >> 4) & 7;
-    pulse[n].sweep_negate  = val & 8;
-    pulse[n].sweep_shift   = val & 7;
+    apu.pulse[n].sweep_enabled = val & 0x80;
+    apu.pulse[n].sweep_period  = (val >> 4) & 7;
+    apu.pulse[n].sweep_negate  = val & 8;
+    apu.pulse[n].sweep_shift   = val & 7;
 
-    pulse[n].sweep_reload_flag = true;
+    apu.pulse[n].sweep_reload_flag = true;
 
     update_sweep_target_period(n);
     update_pulse_output_level(n);
 }
 
 void write_pulse_reg_2(unsigned n, uint8_t val) {
-    pulse[n].period = (pulse[n].period & ~0x0FF) | val;
+    catch_up_pulse(n);
+    apu.pulse[n].period = (apu.pulse[n].period & ~0x0FF) | val;
 
     update_sweep_target_period(n);
     update_pulse_output_level(n);
 }
 
 void write_pulse_reg_3(unsigned n, uint8_t val) {
-    if (pulse[n].enabled)
-        pulse[n].len_cnt = len_table[val >> 3];
-    pulse[n].period = (pulse[n].period & ~0x700) | ((val & 7) << 8);
+    catch_up_pulse(n);
+    if (apu.pulse[n].enabled)
+        apu.pulse[n].len_cnt = len_table[val >> 3];
+    apu.pulse[n].period = (apu.pulse[n].period & ~0x700) | ((val & 7) << 8);
 
     // Side effects
-    pulse[n].waveform_pos   = 0;
-    pulse[n].env_start_flag = true;
+    apu.pulse[n].waveform_pos   = 0;
+    apu.pulse[n].env_start_flag = true;
 
     update_sweep_target_period(n);
     update_pulse_output_level(n);
 }
 
-static void clock_pulse_generator(unsigned n) {
-    assert(n < 2);
-    assert(pulse[n].duty < 4);
-    assert(pulse[n].waveform_pos < 8);
-    pulse[n].waveform_pos = (pulse[n].waveform_pos + 1) % 8;
-
-    update_pulse_output_level(n);
-}
-
 //
 // Triangle channel
 //
 
-// Range 0-15, premultiplied by 3 for mixing. Affected only by waveform
-// position updates.
-static unsigned tri_output_level;
-
-static bool     tri_enabled;
-
-static unsigned tri_period;
-static unsigned tri_period_cnt;
-
-static unsigned tri_waveform_pos;
-
-static unsigned tri_len_cnt;
-static bool     tri_halt_flag;
-
-static unsigned tri_lin_cnt_load;
-static unsigned tri_lin_cnt;
-static bool     tri_lin_cnt_reload_flag;
+// Cycle of the next timer clock. apu.tri_period_cnt is only kept up to date
+// for state transfers.
+static PER_CONSOLE uint64_t tri_next_clock;
 
 void write_triangle_reg_0(uint8_t val) {
-    tri_halt_flag    = val & 0x80;
-    tri_lin_cnt_load = val & 0x7F;
+    apu.tri_halt_flag    = val & 0x80;
+    apu.tri_lin_cnt_load = val & 0x7F;
 }
 
+static void catch_up_triangle();
+static void update_tri_output_level();
+
 void write_triangle_reg_1(uint8_t val) {
-    tri_period = (tri_period & ~0x0FF) | val;
+    catch_up_triangle();
+    apu.tri_period = (apu.tri_period & ~0x0FF) | val;
+    update_tri_output_level();
 }
 
 void write_triangle_reg_2(uint8_t val) {
-    tri_lin_cnt_reload_flag = true;
-    if (tri_enabled)
-        tri_len_cnt = len_table[val >> 3];
-    tri_period = (tri_period & ~0x700) | ((val & 7) << 8);
+    catch_up_triangle();
+    apu.tri_lin_cnt_reload_flag = true;
+    if (apu.tri_enabled)
+        apu.tri_len_cnt = len_table[val >> 3];
+    apu.tri_period = (apu.tri_period & ~0x700) | ((val & 7) << 8);
+    update_tri_output_level();
 }
 
 // Premultiply by three to save multiplication during mixing
@@ -239,64 +382,105 @@ uint8_t const tri_waveform_steps[32] =
   { 3*15, 3*14, 3*13, 3*12, 3*11, 3*10, 3*9, 3*8, 3*7, 3*6,  3*5,  3*4,  3*3,  3*2,  3*1,  3*0,
      3*0,  3*1,  3*2,  3*3,  3*4,  3*5, 3*6, 3*7, 3*8, 3*9, 3*10, 3*11, 3*12, 3*13, 3*14, 3*15 };
 
-static void clock_triangle_generator() {
-    if (tri_len_cnt > 0 && tri_lin_cnt > 0 &&
-        // Prevent ultrasonic frequencies, which cause pops (very audible for Crashman stage in MM2)
-        tri_period > 1 &&
-        // Ditto for prolly-too-low-to-be-deliberate frequencies
-        tri_period <= 0x7FD)
-    {
-        unsigned const prev_output_level = tri_output_level;
+// True if timer clocks step the waveform
+static bool tri_is_stepping() {
+    return apu.tri_len_cnt > 0 && apu.tri_lin_cnt > 0 &&
+      // Prevent ultrasonic frequencies, which cause pops (very audible for Crashman stage in MM2)
+      apu.tri_period > 1 &&
+      // Ditto for prolly-too-low-to-be-deliberate frequencies
+      apu.tri_period <= 0x7FD;
+}
+
+// Must be called before changing anything tri_is_stepping() or the period
+// depends on
+static void catch_up_triangle() {
+    uint64_t const n_clocks = run_timer(tri_next_clock, apu.tri_period + 1);
+    if (tri_is_stepping())
+        apu.tri_waveform_pos = (apu.tri_waveform_pos + n_clocks) % 32;
+}
 
-        tri_waveform_pos = (tri_waveform_pos + 1) % 32;
-        tri_output_level = tri_waveform_steps[tri_waveform_pos];
+// Also schedules TRIANGLE_EVENT for the next timer clock that changes the
+// output level. Used as the event handler.
+static void update_tri_output_level() {
+    catch_up_triangle();
 
-        if (tri_output_level != prev_output_level)
-            channel_updated = true;
+    unsigned const prev_output_level = apu.tri_output_level;
+
+    apu.tri_output_level = tri_waveform_steps[apu.tri_waveform_pos];
+
+    if (apu.tri_output_level != prev_output_level)
+        channel_updated = true;
+
+    uint64_t edge = no_deadline;
+    if (tri_is_stepping()) {
+        // The waveform repeats its lowest and highest levels
+        unsigned const steps =
+          (tri_waveform_steps[(apu.tri_waveform_pos + 1) % 32] == apu.tri_output_level) ?
+            2 : 1;
+        edge = tri_next_clock + (steps - 1)*(apu.tri_period + 1);
     }
+    schedule_event(TRIANGLE_EVENT, edge);
 }
 
 //
 // Noise channel
 //
 
-// Range 0-15, premultiplied by 2 for mixing. Affected by
-//   - volume updates,
-//   - Length counter updates,
-//   - and shift reg value
-static unsigned noise_output_level;
-
-static bool     noise_enabled;
-
-static bool     noise_halt_len_loop_env;
-static bool     noise_const_vol;
-static unsigned noise_vol;
-static unsigned noise_feedback_bit;
-static unsigned noise_period;
-static unsigned noise_period_cnt;
-static unsigned noise_len_cnt;
-static unsigned noise_shift_reg;
-static bool     noise_env_start_flag;
-static unsigned noise_env_vol;
-static unsigned noise_env_div_cnt;
+// Cycle of the next timer clock. apu.noise_period_cnt is only kept up to date
+// for state transfers.
+static PER_CONSOLE uint64_t noise_next_clock;
+
+// Returns the value of the shift register after a timer clock
+static unsigned next_noise_shift_reg(unsigned shift_reg) {
+    // Only the lowest bit from 'feedback' is used
+    unsigned const feedback = (shift_reg >> apu.noise_feedback_bit) ^ shift_reg;
+    return (feedback << 14) | (shift_reg >> 1);
+}
+
+// Each timer clock shifts the shift register. Must be called before changing
+// the period or the feedback bit.
+static void catch_up_noise() {
+    for (uint64_t n = run_timer(noise_next_clock, apu.noise_period + 1); n > 0; --n)
+        apu.noise_shift_reg = next_noise_shift_reg(apu.noise_shift_reg);
+}
 
+// Also schedules NOISE_EVENT for the next timer clock that changes the output
+// level. Used as the event handler.
 static void update_noise_output_level() {
-    unsigned const prev_output_level = noise_output_level;
+    catch_up_noise();
 
-    noise_output_level =
-      (noise_len_cnt == 0 || !(noise_shift_reg & 1)) ?
+    unsigned const prev_output_level = apu.noise_output_level;
+    unsigned const vol = apu.noise_const_vol ? apu.noise_vol : apu.noise_env_vol;
+
+    apu.noise_output_level =
+      (apu.noise_len_cnt == 0 || !(apu.noise_shift_reg & 1)) ?
       0 :
-      2*(noise_const_vol ? noise_vol : noise_env_vol); // Premultiply by 2
+      2*vol; // Premultiply by 2
 
-    if (noise_output_level != prev_output_level)
+    if (apu.noise_output_level != prev_output_level)
         channel_updated = true;
+
+    uint64_t edge = no_deadline;
+    if (apu.noise_len_cnt > 0 && vol > 0) {
+        // Look ahead for the next clock that changes the low bit of the shift
+        // register. Runs are short, but give up after a few clocks to bound
+        // the work. The event handler then just looks again.
+        unsigned shift_reg = apu.noise_shift_reg;
+        unsigned steps = 0;
+        do {
+            shift_reg = next_noise_shift_reg(shift_reg);
+            ++steps;
+        } while (!((shift_reg ^ apu.noise_shift_reg) & 1) && steps < 16);
+        edge = noise_next_clock + (steps - 1)*(apu.noise_period + 1);
+    }
+    schedule_event(NOISE_EVENT, edge);
 }
 
 // $400C
 void write_noise_reg_0(uint8_t val) {
-    noise_halt_len_loop_env = val & 0x20;
-    noise_const_vol         = val & 0x10;
-    noise_vol               = val & 0x0F;
+    apu.noise_halt_len_loop_env = val & 0x20;
+    apu.noise_const_vol         = val & 0x10;
+    apu.noise_vol               = val & 0x0F;
 
     update_noise_output_level();
 }
@@ -305,96 +489,63 @@ uint16_t const ntsc_noise_periods[] =
   { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
 uint16_t const pal_noise_periods[]  =
   { 4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708,  944, 1890, 3778 };
-static uint16_t const *noise_periods;
+static PER_CONSOLE uint16_t const *noise_periods;
 
 // $400E
 void write_noise_reg_1(uint8_t val) {
-    noise_feedback_bit = (val & 0x80) ? 6 : 1;
-    noise_period       = noise_periods[val & 0x0F];
+    catch_up_noise();
+    apu.noise_feedback_bit = (val & 0x80) ? 6 : 1;
+    apu.noise_period       = noise_periods[val & 0x0F];
+    update_noise_output_level();
 }
 
 // $400F
 void write_noise_reg_2(uint8_t val) {
-    if (noise_enabled) {
-        noise_len_cnt = len_table[val >> 3];
+    if (apu.noise_enabled) {
+        apu.noise_len_cnt = len_table[val >> 3];
         update_noise_output_level();
     }
-    noise_env_start_flag = true;
-}
-
-static void clock_noise_generator() {
-    // Only the lowest bit from 'feedback' is used
-    unsigned const feedback = (noise_shift_reg >> noise_feedback_bit) ^ noise_shift_reg;
-    noise_shift_reg = (feedback << 14) | (noise_shift_reg >> 1);
-    update_noise_output_level();
+    apu.noise_env_start_flag = true;
 }
 
 //
 // DMC channel
 //
 
-// Range 0-127
-// Counter value directly determines output level
-static unsigned dmc_counter;
-
-// Set by the last sample byte being loaded, unless inhibited or looping is set
-// Cleared by
+// The IRQ line (cpu.dmc_irq) is set by the last sample byte being loaded,
+// unless inhibited or looping is set. Cleared by
 //  * the reset signal,
 //  * writing $4015,
 //  * and clearing the IRQ enable flag in $4010
-bool            dmc_irq;
-// $4010
-static bool     dmc_irq_enabled;
-static bool     dmc_loop_sample;
-static unsigned dmc_period;
-static unsigned dmc_period_cnt;
-
-// $4012, missing the implied "| 0x8000" that puts it into ROM
-static unsigned dmc_sample_start_addr;
-// $4013
-static unsigned dmc_sample_len;
-
-static uint8_t  dmc_sample_buffer;
-static bool     dmc_sample_buffer_has_data;
-static uint8_t  dmc_shift_reg;
-static bool     dpcm_active;
-
-// True while a sample byte is being loaded, to prevent recursion in
-// load_dmc_sample_byte(). This also mirrors how the hardware behaves.
-static bool     dmc_loading_sample_byte;
-
-static unsigned dmc_sample_cur_addr; // 15 bits wide
-static unsigned dmc_bytes_remaining;
-static unsigned dmc_bits_remaining;
 
 uint16_t const ntsc_dmc_periods[] =
  { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106,  84,  72,  54 };
 uint16_t const pal_dmc_periods[] =
  { 398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118,  98,  78,  66,  50 };
-static uint16_t const *dmc_periods;
+static PER_CONSOLE uint16_t const *dmc_periods;
 
 void write_dmc_reg_0(uint8_t val) {
-    if (!(dmc_irq_enabled = val & 0x80))
+    if (!(apu.dmc_irq_enabled = val & 0x80))
         set_dmc_irq(false);
-    dmc_loop_sample = val & 0x40;
-    dmc_period      = dmc_periods[val & 0x0F];
+    apu.dmc_loop_sample = val & 0x40;
+    apu.dmc_period      = dmc_periods[val & 0x0F];
 }
 
 void write_dmc_reg_1(uint8_t val) {
-    unsigned const old_dmc_counter = dmc_counter;
+    unsigned const old_dmc_counter = apu.dmc_counter;
 
-    dmc_counter = val & 0x7F;
+    apu.dmc_counter = val & 0x7F;
 
-    if (dmc_counter != old_dmc_counter)
+    if (apu.dmc_counter != old_dmc_counter)
         channel_updated = true;
 }
 
 void write_dmc_reg_2(uint8_t val) {
-    dmc_sample_start_addr = 0x4000 | (val << 6);
+    apu.dmc_sample_start_addr = 0x4000 | (val << 6);
 }
 
 void write_dmc_reg_3(uint8_t val) {
-    dmc_sample_len = (val << 4) + 1;
+    apu.dmc_sample_len = (val << 4) + 1;
 }
 
 static void load_dmc_sample_byte() {
@@ -404,66 +555,66 @@ static void load_dmc_sample_byte() {
         1,   // OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK
         3 }; // OAM_DMA_IN_PROGRESS_LAST_TICK
 
-    assert(dmc_bytes_remaining > 0);
+    assert(apu.dmc_bytes_remaining > 0);
 
     // This can happen if a write to $4015 that enables the channel is
     // immediately followed by a DMC clock. The hardware appears to act the
     // same.
-    if (dmc_loading_sample_byte)
+    if (apu.dmc_loading_sample_byte)
         return;
 
-    dmc_sample_buffer = read_prg(dmc_sample_cur_addr);
+    apu.dmc_sample_buffer = read_prg(apu.dmc_sample_cur_addr);
     // Should do this to be OCD and get open bus rights, but it currently
     // breaks OAM DMA
-    // cpu_data_bus = dmc_sample_buffer;
+    // cpu.data_bus = dmc_sample_buffer;
 
-    dmc_loading_sample_byte = true;
+    apu.dmc_loading_sample_byte = true;
     unsigned const delay =
-      (oam_dma_state != OAM_DMA_NOT_IN_PROGRESS) ?
-        oam_dma_delay[oam_dma_state] :
-        cpu_is_reading ? 4 : 3;
+      (apu.oam_dma_state != OAM_DMA_NOT_IN_PROGRESS) ?
+        oam_dma_delay[apu.oam_dma_state] :
+        cpu.is_reading ? 4 : 3;
     // We use tick() since the PPU as as well as the rest of the APU should
     // keep ticking during the fetch
     for (unsigned i = 0; i < delay; ++i) tick();
-    dmc_loading_sample_byte = false;
-    dmc_sample_buffer_has_data = true;
-
-    dmc_sample_cur_addr = (dmc_sample_cur_addr + 1) & 0x7FFF;
-    if (--dmc_bytes_remaining == 0) {
-        if (dmc_loop_sample) {
-            dmc_sample_cur_addr = dmc_sample_start_addr;
-            dmc_bytes_remaining = dmc_sample_len;
+    apu.dmc_loading_sample_byte = false;
+    apu.dmc_sample_buffer_has_data = true;
+
+    apu.dmc_sample_cur_addr = (apu.dmc_sample_cur_addr + 1) & 0x7FFF;
+    if (--apu.dmc_bytes_remaining == 0) {
+        if (apu.dmc_loop_sample) {
+            apu.dmc_sample_cur_addr = apu.dmc_sample_start_addr;
+            apu.dmc_bytes_remaining = apu.dmc_sample_len;
         }
         else
-            if (dmc_irq_enabled)
+            if (apu.dmc_irq_enabled)
                 set_dmc_irq(true);
     }
 }
 
 static void clock_dmc() {
-    if (dpcm_active) {
-        if (dmc_shift_reg & 1) {
-            if (dmc_counter < 126) {
-                dmc_counter += 2;
+    if (apu.dpcm_active) {
+        if (apu.dmc_shift_reg & 1) {
+            if (apu.dmc_counter < 126) {
+                apu.dmc_counter += 2;
                 channel_updated = true;
             }
         }
         else
-            if (dmc_counter > 1) {
-                dmc_counter -= 2;
+            if (apu.dmc_counter > 1) {
+                apu.dmc_counter -= 2;
                 channel_updated = true;
             }
-        dmc_shift_reg >>= 1;
+        apu.dmc_shift_reg >>= 1;
     }
 
-    if (--dmc_bits_remaining == 0) {
-        dmc_bits_remaining = 8;
+    if (--apu.dmc_bits_remaining == 0) {
+        apu.dmc_bits_remaining = 8;
 
-        if ((dpcm_active = dmc_sample_buffer_has_data)) {
-            dmc_shift_reg              = dmc_sample_buffer;
-            dmc_sample_buffer_has_data = false;
+        if ((apu.dpcm_active = apu.dmc_sample_buffer_has_data)) {
+            apu.dmc_shift_reg              = apu.dmc_sample_buffer;
+            apu.dmc_sample_buffer_has_data = false;
         }
-        if (dmc_bytes_remaining > 0)
+        if (apu.dmc_bytes_remaining > 0)
             load_dmc_sample_byte();
     }
 }
@@ -472,18 +623,20 @@ static void clock_dmc() {
 // Frame counter
 //
 
-// Set by the frame counter in 4-step mode, unless inhibited
-// Cleared by (derived from Visual 2A03)
+// The IRQ line (cpu.frame_irq) is set by the frame counter in 4-step mode,
+// unless inhibited. Cleared by (derived from Visual 2A03)
 //  * the reset signal,
 //  * setting the inhibit IRQ flag,
 //  * and reading $4015
-bool        frame_irq;
-
-static enum Frame_counter_mode { FOUR_STEP = 0, FIVE_STEP = 1 } frame_counter_mode;
-static bool inhibit_frame_irq;
-static unsigned frame_counter_clock;
 
-static unsigned delayed_frame_timer_reset;
+// The frame counter isn't clocked on every cycle. apu.frame_counter_clock
+// holds its value as of CPU cycle frame_counter_cycle, and it counts up by one
+// per cycle from there. FRAME_COUNTER_EVENT is scheduled for the next cycle
+// where something happens: a quarter or half frame signal, a frame IRQ, the
+// counter wrapping around, or a delayed reset from writing $4017.
+static PER_CONSOLE uint64_t frame_counter_cycle;
+// Cycle at which the delayed reset happens, or no_deadline
+static PER_CONSOLE uint64_t frame_counter_reset_cycle;
 
 // Quarter frame
 static void clock_env_and_tri_lin() {
@@ -491,21 +644,21 @@ static void clock_env_and_tri_lin() {
     // Pulse channels
 
     for (unsigned n = 0; n < 2; ++n) {
-        if (pulse[n].env_start_flag) {
-            pulse[n].env_start_flag = false;
+        if (apu.pulse[n].env_start_flag) {
+            apu.pulse[n].env_start_flag = false;
 
-            pulse[n].env_vol     = 15;
-            pulse[n].env_div_cnt = pulse[n].vol;
+            apu.pulse[n].env_vol     = 15;
+            apu.pulse[n].env_div_cnt = apu.pulse[n].vol;
         }
         else {
-            if (pulse[n].env_div_cnt-- == 0) {
-                pulse[n].env_div_cnt = pulse[n].vol;
+            if (apu.pulse[n].env_div_cnt-- == 0) {
+                apu.pulse[n].env_div_cnt = apu.pulse[n].vol;
 
-                if (pulse[n].env_vol > 0)
-                    --pulse[n].env_vol;
+                if (apu.pulse[n].env_vol > 0)
+                    --apu.pulse[n].env_vol;
                 else
-                    if (pulse[n].halt_len_loop_env)
-                        pulse[n].env_vol = 15;
+                    if (apu.pulse[n].halt_len_loop_env)
+                        apu.pulse[n].env_vol = 15;
             }
         }
         update_pulse_output_level(n);
@@ -513,85 +666,148 @@ static void clock_env_and_tri_lin() {
 
     // Noise channel
 
-    if (noise_env_start_flag) {
-        noise_env_start_flag = false;
+    if (apu.noise_env_start_flag) {
+        apu.noise_env_start_flag = false;
 
-        noise_env_vol     = 15;
-        noise_env_div_cnt = noise_vol;
+        apu.noise_env_vol     = 15;
+        apu.noise_env_div_cnt = apu.noise_vol;
     }
     else {
-        if (noise_env_div_cnt-- == 0) {
-            noise_env_div_cnt = noise_vol;
+        if (apu.noise_env_div_cnt-- == 0) {
+            apu.noise_env_div_cnt = apu.noise_vol;
 
-            if (noise_env_vol > 0)
-                --noise_env_vol;
+            if (apu.noise_env_vol > 0)
+                --apu.noise_env_vol;
             else
-                if (noise_halt_len_loop_env)
-                    noise_env_vol = 15;
+                if (apu.noise_halt_len_loop_env)
+                    apu.noise_env_vol = 15;
         }
     }
     update_noise_output_level();
 
     // Triangle channel
 
-    if (tri_lin_cnt_reload_flag) {
-        tri_lin_cnt_reload_flag = tri_halt_flag;
-        tri_lin_cnt = tri_lin_cnt_load;
+    catch_up_triangle();
+    if (apu.tri_lin_cnt_reload_flag) {
+        apu.tri_lin_cnt_reload_flag = apu.tri_halt_flag;
+        apu.tri_lin_cnt = apu.tri_lin_cnt_load;
     }
     else
-        if (tri_lin_cnt > 0)
-            --tri_lin_cnt;
+        if (apu.tri_lin_cnt > 0)
+            --apu.tri_lin_cnt;
+    update_tri_output_level();
 }
 
 // Half frame
 static void clock_len_and_sweep() {
     for (unsigned n = 0; n < 2; ++n) {
-        if (!pulse[n].halt_len_loop_env && pulse[n].len_cnt > 0) {
-            --pulse[n].len_cnt;
+        if (!apu.pulse[n].halt_len_loop_env && apu.pulse[n].len_cnt > 0) {
+            --apu.pulse[n].len_cnt;
             update_pulse_output_level(n);
         }
 
-        if (pulse[n].sweep_period_cnt == 0) {
-            if (pulse[n].sweep_enabled            &&
-                pulse[n].period      >= 8         &&
-                pulse[n].sweep_shift != 0         &&
-                pulse[n].sweep_target_period >= 0 &&
-                pulse[n].sweep_target_period <= 0x7FF) {
+        if (apu.pulse[n].sweep_period_cnt == 0) {
+            if (apu.pulse[n].sweep_enabled            &&
+                apu.pulse[n].period      >= 8         &&
+                apu.pulse[n].sweep_shift != 0         &&
+                apu.pulse[n].sweep_target_period >= 0 &&
+                apu.pulse[n].sweep_target_period <= 0x7FF) {
 
-                pulse[n].period = pulse[n].sweep_target_period;
+                catch_up_pulse(n);
+                apu.pulse[n].period = apu.pulse[n].sweep_target_period;
                 update_sweep_target_period(n);
                 update_pulse_output_level(n);
             }
         }
 
-        if (pulse[n].sweep_reload_flag || pulse[n].sweep_period_cnt == 0) {
-            pulse[n].sweep_reload_flag = false;
-            pulse[n].sweep_period_cnt = pulse[n].sweep_period;
+        if (apu.pulse[n].sweep_reload_flag || apu.pulse[n].sweep_period_cnt == 0) {
+            apu.pulse[n].sweep_reload_flag = false;
+            apu.pulse[n].sweep_period_cnt = apu.pulse[n].sweep_period;
         }
         else
-            --pulse[n].sweep_period_cnt;
+            --apu.pulse[n].sweep_period_cnt;
     }
 
-    if (!tri_halt_flag && tri_len_cnt > 0)
-        --tri_len_cnt;
+    if (!apu.tri_halt_flag && apu.tri_len_cnt > 0) {
+        catch_up_triangle();
+        --apu.tri_len_cnt;
+        update_tri_output_level();
+    }
 
-    if (!noise_halt_len_loop_env && noise_len_cnt > 0) {
-        --noise_len_cnt;
+    if (!apu.noise_halt_len_loop_env && apu.noise_len_cnt > 0) {
+        --apu.noise_len_cnt;
         update_noise_output_level();
     }
 }
 
+// The actual frame counter counts at half the CPU frequency, but the half and
+// quarter frame signals are delayed by one CPU cycle, making it easier to
+// treat it as counting in CPU cycles.
+//
+// The times in CPU ticks for the quarter frame and half frame signals, in
+// ascending order. They differ between NTSC and PAL.
+//
+// TODO: Docs specify 20780 for the final clock in PAL mode, but 20782 makes
+// tests pass (including for the next clock after that). Investigate further.
+static unsigned const ntsc_frame_counter_times[] =
+  { 2*3728, 2*7456, 2*11185, 2*14914, 2*18640 };
+static unsigned const pal_frame_counter_times[] =
+  { 2*4156, 2*8313, 2*12469, 2*16626, 2*20782 };
+static PER_CONSOLE unsigned const *frame_counter_times;
+
+// Brings frame_counter_clock up to date with the current cycle
+static void sync_frame_counter() {
+    apu.frame_counter_clock += cpu_cycle - frame_counter_cycle;
+    frame_counter_cycle  = cpu_cycle;
+}
+
+// Schedules FRAME_COUNTER_EVENT for the next clock value (after the current
+// one) where the frame counter does something in the current mode, or for the
+// delayed reset if that comes first. frame_counter_clock must be in sync.
+static void schedule_frame_counter() {
+    unsigned const *t = frame_counter_times;
+    unsigned const four_step_clocks[] =
+      { t[0] + 1, t[1] + 1, t[2] + 1, t[3], t[3] + 1, t[3] + 2 };
+    unsigned const five_step_clocks[] =
+      { t[0] + 1, t[1] + 1, t[2] + 1, t[4] + 1, t[4] + 2 };
+
+    unsigned const *clocks;
+    unsigned n_clocks;
+    if (apu.frame_counter_mode == FOUR_STEP) {
+        clocks   = four_step_clocks;
+        n_clocks = ARRAY_LEN(four_step_clocks);
+    }
+    else {
+        clocks   = five_step_clocks;
+        n_clocks = ARRAY_LEN(five_step_clocks);
+    }
+
+    uint64_t deadline = frame_counter_reset_cycle;
+    // The clock can be past all the steps after a switch from five-step to
+    // four-step mode. It then keeps counting until the delayed reset.
+    for (unsigned i = 0; i < n_clocks; ++i)
+        if (clocks[i] > apu.frame_counter_clock) {
+            deadline = min(deadline, cpu_cycle + clocks[i] - apu.frame_counter_clock);
+            break;
+        }
+
+    schedule_event(FRAME_COUNTER_EVENT, deadline);
+}
+
 void write_frame_counter(uint8_t val) {
-    frame_counter_mode = (Frame_counter_mode)(val >> 7);
-    if ((inhibit_frame_irq = val & 0x40))
+    sync_frame_counter();
+
+    apu.frame_counter_mode = (Frame_counter_mode)(val >> 7);
+    if ((apu.inhibit_frame_irq = val & 0x40))
         set_frame_irq(false);
 
     // There is a delay before the frame counter is reset, the length of which
     // varies depending on if the write happens while apu_clk1 is high or low:
     // http://wiki.nesdev.com/w/index.php/APU_Frame_Counter
-    delayed_frame_timer_reset = apu_clk1_is_high ? 4 : 3;
+    frame_counter_reset_cycle = cpu_cycle + (apu.clk1_is_high ? 4 : 3);
+    schedule_frame_counter();
 
-    if (frame_counter_mode == FIVE_STEP) {
+    if (apu.frame_counter_mode == FIVE_STEP) {
         clock_env_and_tri_lin();
         clock_len_and_sweep();
     }
@@ -600,78 +816,69 @@ void write_frame_counter(uint8_t val) {
 // The frame IRQ is set during three consecutive CPU ticks at the end of the
 // frame period when in four-step mode, so we factor out this helper
 static void check_frame_irq() {
-    if (!inhibit_frame_irq)
+    if (!apu.inhibit_frame_irq)
         set_frame_irq(true);
 }
 
-// The actual frame counter counts at half the CPU frequency, but the half and
-// quarter frame signals are delayed by one CPU cycle, making it easier to
-// treat it as counting in CPU cycles.
-//
-// T1-T5 are the times in CPU ticks for the quarter frame and half frame
-// signals, in ascending order. They differ between NTSC and PAL.
-template<unsigned T1, unsigned T2, unsigned T3, unsigned T4, unsigned T5>
-static void clock_frame_counter_generic() {
-    // Possible optimization: Could be sped up with a down-counter instead of a
-    // switch
-
-    switch (frame_counter_mode) {
-    case FOUR_STEP:
-        if (delayed_frame_timer_reset > 0 && --delayed_frame_timer_reset == 0)
-            frame_counter_clock = 0;
-        else
-            if (++frame_counter_clock == T4 + 2) {
-                frame_counter_clock = 0;
+// Runs when FRAME_COUNTER_EVENT is due
+static void run_frame_counter() {
+    unsigned const *t = frame_counter_times;
+
+    in_frame_counter_step = true;
+
+    if (cpu_cycle == frame_counter_reset_cycle) {
+        frame_counter_reset_cycle = no_deadline;
+        apu.frame_counter_clock   = 0;
+        frame_counter_cycle       = cpu_cycle;
+    }
+    else {
+        sync_frame_counter();
+        if (apu.frame_counter_mode == FOUR_STEP) {
+            if (apu.frame_counter_clock == t[3] + 2) {
+                apu.frame_counter_clock = 0;
                 check_frame_irq();
             }
+        }
+        else
+            if (apu.frame_counter_clock == t[4] + 2)
+                apu.frame_counter_clock = 0;
+    }
 
-        switch (frame_counter_clock) {
-        case T1 + 1: case T3 + 1:
-            clock_env_and_tri_lin();
-            break;
+    unsigned const clock = apu.frame_counter_clock;
 
-        case T2 + 1:
+    switch (apu.frame_counter_mode) {
+    case FOUR_STEP:
+        if (clock == t[0] + 1 || clock == t[2] + 1)
+            clock_env_and_tri_lin();
+        else if (clock == t[1] + 1) {
             clock_len_and_sweep();
             clock_env_and_tri_lin();
-            break;
-
-        case T4:
+        }
+        else if (clock == t[3])
             check_frame_irq();
-            break;
-
-        case T4 + 1:
+        else if (clock == t[3] + 1) {
             check_frame_irq();
             clock_len_and_sweep();
             clock_env_and_tri_lin();
-            break;
         }
         break;
 
     case FIVE_STEP:
-        if (delayed_frame_timer_reset > 0 && --delayed_frame_timer_reset == 0)
-            frame_counter_clock = 0;
-        else
-            if (++frame_counter_clock == T5 + 2)
-                frame_counter_clock = 0;
-
-        switch (frame_counter_clock) {
-        case T2 + 1: case T5 + 1:
+        if (clock == t[1] + 1 || clock == t[4] + 1) {
             clock_len_and_sweep();
             clock_env_and_tri_lin();
-            break;
-
-        case T1 + 1: case T3 + 1:
-            clock_env_and_tri_lin();
-            break;
         }
+        else if (clock == t[0] + 1 || clock == t[2] + 1)
+            clock_env_and_tri_lin();
         break;
 
     default: UNREACHABLE
     }
-}
 
-// Points to the correct instantiated version for NTSC/PAL
-static void (*clock_frame_counter)();
+    in_frame_counter_step = false;
+
+    schedule_frame_counter();
+}
 
 //
 // Status
@@ -679,14 +886,14 @@ static void (*clock_frame_counter)();
 
 uint8_t read_apu_status() {
     uint8_t const res =
-      (dmc_irq                   << 7) |
-      (frame_irq                 << 6) |
-      (cpu_data_bus            & 0x20) | // Open bus
-      ((dmc_bytes_remaining > 0) << 4) |
-      ((noise_len_cnt       > 0) << 3) |
-      ((tri_len_cnt         > 0) << 2) |
-      ((pulse[1].len_cnt    > 0) << 1) |
-       (pulse[0].len_cnt    > 0);
+      (cpu.dmc_irq                       << 7) |
+      (cpu.frame_irq                     << 6) |
+      (cpu.data_bus                    & 0x20) | // Open bus
+      ((apu.dmc_bytes_remaining > 0) << 4) |
+      ((apu.noise_len_cnt       > 0) << 3) |
+      ((apu.tri_len_cnt         > 0) << 2) |
+      ((apu.pulse[1].len_cnt    > 0) << 1) |
+       (apu.pulse[0].len_cnt    > 0);
 
     set_frame_irq(false);
 
@@ -695,17 +902,20 @@ uint8_t read_apu_status() {
 
 void write_apu_status(uint8_t val) {
     for (unsigned n = 0; n < 2; ++n) {
-        if (!(pulse[n].enabled = val & (1 << n))) {
-            pulse[n].len_cnt = 0;
+        if (!(apu.pulse[n].enabled = val & (1 << n))) {
+            apu.pulse[n].len_cnt = 0;
             update_pulse_output_level(n);
         }
     }
 
-    if (!(tri_enabled = val & 4))
-        tri_len_cnt = 0;
+    if (!(apu.tri_enabled = val & 4)) {
+        catch_up_triangle();
+        apu.tri_len_cnt = 0;
+        update_tri_output_level();
+    }
 
-    if (!(noise_enabled = val & 8)) {
-        noise_len_cnt = 0;
+    if (!(apu.noise_enabled = val & 8)) {
+        apu.noise_len_cnt = 0;
         update_noise_output_level();
     }
 
@@ -717,12 +927,12 @@ void write_apu_status(uint8_t val) {
     // DMC enable bit. We model DMC enabled/disabled through the number of
     // sample bytes that remain (greater than zero => enabled).
     if (!(val & 0x10))
-        dmc_bytes_remaining = 0;
+        apu.dmc_bytes_remaining = 0;
     else {
-        if (dmc_bytes_remaining == 0) {
-            dmc_sample_cur_addr = dmc_sample_start_addr;
-            dmc_bytes_remaining = dmc_sample_len;
-            if (!dmc_sample_buffer_has_data)
+        if (apu.dmc_bytes_remaining == 0) {
+            apu.dmc_sample_cur_addr = apu.dmc_sample_start_addr;
+            apu.dmc_bytes_remaining = apu.dmc_sample_len;
+            if (!apu.dmc_sample_buffer_has_data)
                 load_dmc_sample_byte();
         }
     }
@@ -732,103 +942,88 @@ void write_apu_status(uint8_t val) {
 // Mixer
 //
 
-// Use float instead of double to save some cache. Shouldn't make any
-// difference otherwise.
-static float pulse_mixer_table[31];
-static float tri_noi_dmc_mixer_table[203];
+int16_t mixer_table[31][203];
 
 void init_apu() {
     // http://wiki.nesdev.com/w/index.php/APU_Mixer
 
-    pulse_mixer_table[0] = 0;
+    float pulse_levels[31];
+    pulse_levels[0] = 0;
     for (unsigned n = 1; n < 31; ++n)
-        pulse_mixer_table[n] = 95.52/(8128.0/n + 100.0);
+        pulse_levels[n] = 95.52/(8128.0/n + 100.0);
 
-    tri_noi_dmc_mixer_table[0] = 0;
+    float tri_noi_dmc_levels[203];
+    tri_noi_dmc_levels[0] = 0;
     for (unsigned n = 1; n < 203; ++n)
-        tri_noi_dmc_mixer_table[n] = 163.67/(24329.0/n + 100.0);
+        tri_noi_dmc_levels[n] = 163.67/(24329.0/n + 100.0);
+
+    // Combine the levels and scale them to the int16 range up front, so that
+    // mixing is a single lookup
+    for (unsigned p = 0; p < 31; ++p)
+        for (unsigned tnd = 0; tnd < 203; ++tnd) {
+            int const level =
+              INT16_MIN +
+                (pulse_levels[p] + tri_noi_dmc_levels[tnd])*(INT16_MAX - INT16_MIN);
+            assert(level <= INT16_MAX);
+            mixer_table[p][tnd] = level;
+        }
 }
 
 void init_apu_for_rom() {
     // Frame counter timing:
     //   http://wiki.nesdev.com/w/index.php/APU_Frame_Counter
     //   http://forums.nesdev.com/viewtopic.php?t=9011
-    //
-    // TODO: Docs specify 20780 for the final clock in PAL mode, but 20782
-    // makes tests pass (including for the next clock after that). Investigate
-    // further.
 
     if (is_pal) {
-        clock_frame_counter =
-          clock_frame_counter_generic<2*4156, 2*8313, 2*12469, 2*16626, 2*20782>;
-
+        frame_counter_times = pal_frame_counter_times;
         dmc_periods         = pal_dmc_periods;
         noise_periods       = pal_noise_periods;
     }
     else {
-        clock_frame_counter =
-          clock_frame_counter_generic<2*3728, 2*7456, 2*11185, 2*14914, 2*18640>;
-
+        frame_counter_times = ntsc_frame_counter_times;
         dmc_periods         = ntsc_dmc_periods;
         noise_periods       = ntsc_noise_periods;
     }
 }
 
-void tick_apu() {
-    apu_clk1_is_high = !apu_clk1_is_high;
-
-    clock_frame_counter();
-
-    if (!apu_clk1_is_high)
-        //
-        // Pulse
-        //
-        for (unsigned n = 0; n < 2; ++n)
-            if (--pulse[n].period_cnt == 0) {
-                pulse[n].period_cnt = pulse[n].period + 1;
-                clock_pulse_generator(n);
-            }
+// Runs the APU events that are due on the current cycle, in the order things
+// happen within a cycle
+static void run_apu_events() {
+    if (event_due(FRAME_COUNTER_EVENT))
+        run_frame_counter();
 
-    //
-    // Triangle
-    //
+    for (unsigned n = 0; n < 2; ++n)
+        if (event_due((Timed_event)(PULSE_1_EVENT + n)))
+            update_pulse_output_level(n);
 
-    if (--tri_period_cnt == 0) {
-        tri_period_cnt = tri_period + 1;
-        clock_triangle_generator();
-    }
+    if (event_due(TRIANGLE_EVENT))
+        update_tri_output_level();
 
-    //
-    // Noise
-    //
+    if (event_due(NOISE_EVENT))
+        update_noise_output_level();
 
-    if (--noise_period_cnt == 0) {
-        noise_period_cnt = noise_period + 1;
-        clock_noise_generator();
+    // The next DMC clock is scheduled before running this one, as loading a
+    // sample byte runs tick() recursively
+    if (event_due(DMC_EVENT)) {
+        schedule_event(DMC_EVENT, cpu_cycle + apu.dmc_period);
+        clock_dmc();
     }
+}
 
-    //
-    // DMC
-    //
+void tick_apu() {
+    apu.clk1_is_high = !apu.clk1_is_high;
 
-    if (--dmc_period_cnt == 0) {
-        dmc_period_cnt = dmc_period;
-        clock_dmc();
-    }
+    if (cpu_cycle >= next_deadline)
+        run_apu_events();
 
     //
     // Mixing
     //
 
     if (channel_updated) {
-        // Possible optimization: Could use integer math and prebias here
-        int const signal_level =
-          INT16_MIN +
-            (pulse_mixer_table[pulse[0].output_level + pulse[1].output_level] +
-             tri_noi_dmc_mixer_table[tri_output_level + noise_output_level +
-                                     dmc_counter])*(INT16_MAX - INT16_MIN);
-        assert(signal_level <= INT16_MAX);
-        set_audio_signal_level(signal_level);
+        set_audio_mixer_inputs(
+          apu.pulse[0].output_level + apu.pulse[1].output_level,
+          apu.tri_output_level + apu.noise_output_level + apu.dmc_counter);
 
         channel_updated = false;
     }
@@ -842,60 +1037,68 @@ void reset_apu() {
     // Things explicitly initialized by the reset signal, derived from tracing
     // the _res node in Visual 2A03
 
-    apu_clk1_is_high = false;
-    oam_dma_state    = OAM_DMA_NOT_IN_PROGRESS;
+    apu.clk1_is_high  = false;
+    apu.oam_dma_state = OAM_DMA_NOT_IN_PROGRESS;
 
     // Pulse channels
 
     for (unsigned n = 0; n < 2; ++n) {
-        pulse[n].enabled          = false;
-        pulse[n].waveform_pos     = 0;
-        pulse[n].len_cnt          = 0;
-        pulse[n].period_cnt       = 1;
-        pulse[n].sweep_period_cnt = 0;
-        pulse[n].env_div_cnt      = 0;
-        pulse[n].env_vol          = 0;
+        apu.pulse[n].enabled          = false;
+        apu.pulse[n].waveform_pos     = 0;
+        apu.pulse[n].len_cnt          = 0;
+        pulse_next_clock[n]           = next_apu_clk1_low();
+        apu.pulse[n].sweep_period_cnt = 0;
+        apu.pulse[n].env_div_cnt      = 0;
+        apu.pulse[n].env_vol          = 0;
     }
 
     // Triangle channel
 
-    tri_enabled      = false;
-    tri_period_cnt   = 1;
-    tri_waveform_pos = 0;
-    tri_len_cnt      = 0;
-    tri_lin_cnt      = 0;
+    apu.tri_enabled      = false;
+    tri_next_clock       = cpu_cycle + 1;
+    apu.tri_waveform_pos = 0;
+    // Avoids a pop due to a sudden volume change when the triangle starts
+    // playing
+    apu.tri_output_level = tri_waveform_steps[apu.tri_waveform_pos];
+    apu.tri_len_cnt      = 0;
+    apu.tri_lin_cnt      = 0;
 
     // Noise channel
 
-    noise_enabled     = false;
-    noise_period      = noise_period_cnt = noise_periods[0];
-    noise_len_cnt     = 0;
-    noise_shift_reg   = 1; // Essential for LFSR to work
-    noise_env_vol     = 0;
-    noise_env_div_cnt = 0;
+    apu.noise_enabled     = false;
+    apu.noise_period      = noise_periods[0];
+    noise_next_clock      = cpu_cycle + apu.noise_period;
+    apu.noise_len_cnt     = 0;
+    apu.noise_shift_reg   = 1; // Essential for LFSR to work
+    apu.noise_env_vol     = 0;
+    apu.noise_env_div_cnt = 0;
 
     // DMC channel
 
-    dmc_period_cnt             = dmc_period = dmc_periods[0];
-    dmc_sample_cur_addr        = 0x4000;
-    dmc_bytes_remaining        = 0;
-    dmc_sample_buffer_has_data = false;
-    dmc_bits_remaining         = 8;
+    apu.dmc_period                 = dmc_periods[0];
+    schedule_event(DMC_EVENT, cpu_cycle + apu.dmc_period);
+    apu.dmc_sample_cur_addr        = 0x4000;
+    apu.dmc_bytes_remaining        = 0;
+    apu.dmc_sample_buffer_has_data = false;
+    apu.dmc_bits_remaining         = 8;
     // The value here shouldn't matter, but this seems to be what the reset
     // signal does
-    dmc_shift_reg              = 0xFF;
-    dpcm_active                = false;
+    apu.dmc_shift_reg              = 0xFF;
+    apu.dpcm_active                = false;
 
     // Frame counter
 
-    delayed_frame_timer_reset = frame_counter_clock = 0;
+    apu.frame_counter_clock   = 0;
+    frame_counter_cycle       = cpu_cycle;
+    frame_counter_reset_cycle = no_deadline;
+    schedule_frame_counter();
 
     // IRQ sources
 
     set_dmc_irq(false);
     set_frame_irq(false);
 
-    if (frame_counter_mode == FIVE_STEP) {
+    if (apu.frame_counter_mode == FIVE_STEP) {
         clock_env_and_tri_lin();
         clock_len_and_sweep();
     }
@@ -907,11 +1110,8 @@ void reset_apu() {
         update_pulse_output_level(n);
     }
 
+    update_tri_output_level();
     update_noise_output_level();
-
-    // Avoids a pop due to a sudden volume change when the triangle starts
-    // playing
-    tri_output_level = tri_waveform_steps[tri_waveform_pos];
 }
 
 void set_apu_cold_boot_state() {
@@ -922,49 +1122,49 @@ void set_apu_cold_boot_state() {
     // Pulse channels
 
     for (unsigned n = 0; n < 2; ++n) {
-        pulse[n].const_vol         = false;
-        pulse[n].duty              = 0;
-        pulse[n].period            = 0;
-        pulse[n].sweep_enabled     = false;
-        pulse[n].sweep_negate      = false;
-        pulse[n].sweep_period      = 0;
-        pulse[n].sweep_shift       = 0;
-        pulse[n].sweep_reload_flag = false;
-        pulse[n].vol               = 0;
-
-        pulse[n].halt_len_loop_env = false;
-        pulse[n].env_start_flag    = false;
+        apu.pulse[n].const_vol         = false;
+        apu.pulse[n].duty              = 0;
+        apu.pulse[n].period            = 0;
+        apu.pulse[n].sweep_enabled     = false;
+        apu.pulse[n].sweep_negate      = false;
+        apu.pulse[n].sweep_period      = 0;
+        apu.pulse[n].sweep_shift       = 0;
+        apu.pulse[n].sweep_reload_flag = false;
+        apu.pulse[n].vol               = 0;
+
+        apu.pulse[n].halt_len_loop_env = false;
+        apu.pulse[n].env_start_flag    = false;
     }
 
     // Triangle channel
 
-    tri_period              = 0;
-    tri_halt_flag           = false;
-    tri_lin_cnt_load        = 0;
-    tri_lin_cnt_reload_flag = false;
+    apu.tri_period              = 0;
+    apu.tri_halt_flag           = false;
+    apu.tri_lin_cnt_load        = 0;
+    apu.tri_lin_cnt_reload_flag = false;
 
     // Noise channel
 
-    noise_halt_len_loop_env = false;
-    noise_const_vol         = false;
-    noise_vol               = 0;
-    noise_feedback_bit      = 1; // Noise looping off
-    noise_env_start_flag    = false;
+    apu.noise_halt_len_loop_env = false;
+    apu.noise_const_vol         = false;
+    apu.noise_vol               = 0;
+    apu.noise_feedback_bit      = 1; // Noise looping off
+    apu.noise_env_start_flag    = false;
 
     // DMC channel
 
-    dmc_counter             = 0;
-    dmc_irq_enabled         = false;
-    dmc_loop_sample         = false;
-    dmc_sample_start_addr   = 0x4000;
-    dmc_sample_len          = 1;
-    dmc_sample_buffer       = 0;
-    dmc_loading_sample_byte = false;
+    apu.dmc_counter             = 0;
+    apu.dmc_irq_enabled         = false;
+    apu.dmc_loop_sample         = false;
+    apu.dmc_sample_start_addr   = 0x4000;
+    apu.dmc_sample_len          = 1;
+    apu.dmc_sample_buffer       = 0;
+    apu.dmc_loading_sample_byte = false;
 
     // Frame counter
 
-    frame_counter_mode = FOUR_STEP;
-    inhibit_frame_irq  = false;
+    apu.frame_counter_mode = FOUR_STEP;
+    apu.inhibit_frame_irq  = false;
 
     // Reset signal takes care of the rest
     reset_apu();
@@ -976,90 +1176,53 @@ void set_apu_cold_boot_state() {
 
 template<bool calculating_size, bool is_save>
 void transfer_apu_state(uint8_t *&buf) {
-    TRANSFER(apu_clk1_is_high)
-    TRANSFER(oam_dma_state)
-
-    // Pulse channel
-
-    for (unsigned i = 0; i < 2; ++i) {
-        TRANSFER(pulse[i].output_level)
-        TRANSFER(pulse[i].enabled)
-        TRANSFER(pulse[i].const_vol)
-        TRANSFER(pulse[i].duty)
-        TRANSFER(pulse[i].waveform_pos);
-        TRANSFER(pulse[i].len_cnt)
-        TRANSFER(pulse[i].period)
-        TRANSFER(pulse[i].period_cnt)
-        TRANSFER(pulse[i].sweep_target_period)
-        TRANSFER(pulse[i].sweep_enabled)
-        TRANSFER(pulse[i].sweep_negate)
-        TRANSFER(pulse[i].sweep_period)
-        TRANSFER(pulse[i].sweep_period_cnt)
-        TRANSFER(pulse[i].sweep_shift)
-        TRANSFER(pulse[i].sweep_reload_flag)
-        TRANSFER(pulse[i].vol)
-
-        TRANSFER(pulse[i].env_div_cnt)
-        TRANSFER(pulse[i].env_vol)
-        TRANSFER(pulse[i].halt_len_loop_env)
-        TRANSFER(pulse[i].env_start_flag)
-    }
+    // The state stores the counters for scheduled events, as they would be if
+    // they were decremented on every cycle. Derive them from the deadlines.
+    if (!calculating_size && is_save) {
+        // Pulse timers count down on cycles where apu_clk1 goes low
+        for (unsigned n = 0; n < 2; ++n) {
+            catch_up_pulse(n);
+            apu.pulse[n].period_cnt =
+              (pulse_next_clock[n] - next_apu_clk1_low())/2 + 1;
+        }
 
-    // Triangle channel
+        catch_up_triangle();
+        apu.tri_period_cnt = tri_next_clock - cpu_cycle;
 
-    TRANSFER(tri_output_level)
-    TRANSFER(tri_enabled)
-    TRANSFER(tri_period)
-    TRANSFER(tri_period_cnt)
-    TRANSFER(tri_waveform_pos)
-    TRANSFER(tri_len_cnt)
-    TRANSFER(tri_halt_flag)
-    TRANSFER(tri_lin_cnt_load)
-    TRANSFER(tri_lin_cnt)
-    TRANSFER(tri_lin_cnt_reload_flag)
+        catch_up_noise();
+        apu.noise_period_cnt = noise_next_clock - cpu_cycle;
 
-    // Noise channel
+        apu.dmc_period_cnt = event_deadlines[DMC_EVENT] - cpu_cycle;
 
-    TRANSFER(noise_output_level)
-    TRANSFER(noise_enabled)
-    TRANSFER(noise_halt_len_loop_env)
-    TRANSFER(noise_const_vol)
-    TRANSFER(noise_vol)
-    TRANSFER(noise_feedback_bit)
-    TRANSFER(noise_period)
-    TRANSFER(noise_period_cnt)
-    TRANSFER(noise_len_cnt)
-    TRANSFER(noise_shift_reg)
-    TRANSFER(noise_env_start_flag)
-    TRANSFER(noise_env_vol)
-    TRANSFER(noise_env_div_cnt)
+        sync_frame_counter();
+        apu.delayed_frame_timer_reset =
+          (frame_counter_reset_cycle == no_deadline) ?
+            0 : frame_counter_reset_cycle - cpu_cycle;
+    }
 
-    update_noise_output_level();
+    TRANSFER(apu)
 
-    // DMC channel
+    if (!calculating_size && !is_save) {
+        for (unsigned n = 0; n < 2; ++n) {
+            pulse_next_clock[n] =
+              next_apu_clk1_low() + 2*(apu.pulse[n].period_cnt - 1);
+            update_pulse_output_level(n);
+        }
 
-    TRANSFER(dmc_counter)
-    TRANSFER(dmc_irq_enabled)
-    TRANSFER(dmc_loop_sample)
-    TRANSFER(dmc_period)
-    TRANSFER(dmc_period_cnt)
-    TRANSFER(dmc_sample_start_addr)
-    TRANSFER(dmc_sample_len)
-    TRANSFER(dmc_sample_buffer)
-    TRANSFER(dmc_sample_buffer_has_data)
-    TRANSFER(dmc_shift_reg)
-    TRANSFER(dpcm_active)
-    TRANSFER(dmc_loading_sample_byte)
-    TRANSFER(dmc_sample_cur_addr)
-    TRANSFER(dmc_bytes_remaining)
-    TRANSFER(dmc_bits_remaining)
+        tri_next_clock = cpu_cycle + apu.tri_period_cnt;
+        update_tri_output_level();
 
-    // Frame counter
+        noise_next_clock = cpu_cycle + apu.noise_period_cnt;
+        update_noise_output_level();
+
+        schedule_event(DMC_EVENT, cpu_cycle + apu.dmc_period_cnt);
 
-    TRANSFER(frame_counter_mode)
-    TRANSFER(inhibit_frame_irq)
-    TRANSFER(frame_counter_clock)
-    TRANSFER(delayed_frame_timer_reset)
+        frame_counter_cycle = cpu_cycle;
+        frame_counter_reset_cycle =
+          (apu.delayed_frame_timer_reset == 0) ?
+            no_deadline : cpu_cycle + apu.delayed_frame_timer_reset;
+        schedule_frame_counter();
+    }
 }
 
 // Explicit instantiations
@@ -1,165 +1,319 @@
 #include "common.h"
 
+#include "apu.h"
 #include "audio.h"
 #include "cpu.h"
 #include "blip_buf.h"
 #include "save_states.h"
 #include "sdl_backend.h"
 #include "timing.h"
+#include "worker_queue.h"
+
+#include <semaphore.h>
+
+#ifndef HEADLESS
 
 //
 // Audio ring buffer
 //
+// resample_frame() writes samples and the SDL audio callback reads them. Each
+// side only modifies its own position and reads the other side's, so the
+// callback never locks or waits. When syncing to audio, the writer waits on a
+// semaphore that the callback posts after reading.
+//
 
-// Make room for 1/6th seconds of delay
-static int16_t buf[GE_POW_2(sample_rate/6)];
-// Indices from start_index up to but not including end_index (modulo wrapping)
-// contain samples
-static size_t start_index = 0, end_index = 0;
-// True if the last operation was a read. Indicates whether
-// start_index == end_index means the buffer is full or empty.
-static bool prev_op_was_read = true;
+bool sync_to_audio;
+
+// The ring buffer and its length, which is a power of two
+static int16_t *buf;
+static size_t buf_len;
+// Number of buffered samples to aim for. When syncing to audio, the writer
+// waits instead of buffering more than this.
+static size_t target_fill;
+// Number of samples SDL asks for at a time
+static unsigned device_buffer_len;
+
+// Total number of samples read from and written to the buffer. The samples
+// from read_pos up to but not including write_pos (modulo the buffer length)
+// are unread. Counting samples instead of storing indices into 'buf' keeps a
+// full buffer distinct from an empty one, and wrapping around is harmless as
+// the buffer length is a power of two.
+static size_t read_pos, write_pos;
+
+// A position is stored with release semantics after the samples have been
+// copied, and loaded with acquire semantics by the other side before it
+// touches the samples. Each side can access its own position directly.
+static size_t load_pos(size_t const &pos) {
+    return __atomic_load_n(&pos, __ATOMIC_ACQUIRE);
+}
+static void store_pos(size_t &pos, size_t val) {
+    __atomic_store_n(&pos, val, __ATOMIC_RELEASE);
+}
 
-void read_samples(int16_t *dst, size_t len) {
-    assert(start_index < ARRAY_LEN(buf));
+static size_t buf_index(size_t pos) { return pos & (buf_len - 1); }
 
-    // Move samples from the ring buffer to 'dst' by memcpy()ing contiguous
-    // segments
+// Posted by the callback after reading when syncing to audio
+static sem_t space_sem;
+// How long the writer waits for room before giving up and dropping samples,
+// in milliseconds. Only reached if playback stalls (e.g. in the debugger).
+long const sync_timeout_ms = 250;
 
-    // How many contiguous bytes are available...?
+// See get_audio_underruns() and get_audio_overruns(). Each counter is only
+// incremented by one side.
+static unsigned long n_underruns, n_overruns;
 
-    size_t contig_avail;
-    if ((start_index == end_index && !prev_op_was_read) || start_index > end_index)
-        contig_avail = ARRAY_LEN(buf) - start_index;
-    else
-        contig_avail = end_index - start_index;
+// To avoid an immediate underflow, we wait for the audio buffer to fill up
+// before we start playing. This is set true when we're happy with the fill
+// level.
+static bool playback_started;
+
+static void begin_playback() {
+    start_audio_playback();
+    playback_started = true;
+}
 
-    prev_op_was_read = true;
+void init_audio(unsigned latency_ms, bool sync) {
+    sync_to_audio = sync;
 
-    if (contig_avail >= len) {
-        // ...as many as we need. Copy it all in one go.
-        memcpy(dst, buf + start_index, sizeof(*buf)*len);
-        start_index = (start_index + len) % ARRAY_LEN(buf);
+    if (latency_ms == 0) {
+        // Defaults: a 2048-sample SDL buffer and room for 1/6th seconds of
+        // delay in the ring buffer, kept half full
+        device_buffer_len = 2048;
+        buf_len           = GE_POW_2(sample_rate/6);
+        target_fill       = buf_len/2;
     }
     else {
-        // ... less than we need. Copy the contiguous segment first.
-        memcpy(dst, buf + start_index, sizeof(*buf)*contig_avail);
-        len -= contig_avail;
-        assert(len > 0);
-        // Move past the contiguous segment - possibly to index 0
-        start_index = (start_index + contig_avail) % ARRAY_LEN(buf);
-        assert(start_index <= end_index);
-        // How many contiguous bytes are available now...?
-        size_t const avail = end_index - start_index;
-        if (avail >= len) {
-            // ...as many as we need. Copy the rest.
-            memcpy(dst + contig_avail, buf + start_index, sizeof(*buf)*len);
-            start_index += len;
-            assert(start_index <= end_index);
-        }
-        else {
-            // ...less than we need. Copy as much as we can and zero-fill
-            // the rest of the output buffer, as required by SDL2.
-            memcpy(dst + contig_avail, buf + start_index, sizeof(*buf)*avail);
-            memset(dst + contig_avail + avail, 0, sizeof(*buf)*(len - avail));
-            assert(start_index + avail == end_index);
-            start_index = end_index;
-#ifndef RUN_TESTS
-            puts("audio buffer underflow!");
-#endif
-        }
+        size_t const latency_len = (size_t)latency_ms*sample_rate/1000;
+
+        // SDL wants a power of two. Use at most a quarter of the latency for
+        // the SDL buffer and the rest for the ring buffer.
+        device_buffer_len = 64;
+        while (device_buffer_len < 4096 && 2*device_buffer_len <= latency_len/4)
+            device_buffer_len *= 2;
+        target_fill = max(latency_len - min(latency_len, (size_t)device_buffer_len),
+                          (size_t)device_buffer_len);
+
+        // Leave at least as much room above the target as below it
+        for (buf_len = 1; buf_len < 2*target_fill; buf_len *= 2);
     }
+
+    fail_if(!(buf = new (std::nothrow) int16_t[buf_len]),
+            "failed to allocate audio ring buffer");
+    errno_fail_if(sem_init(&space_sem, 0, 0) == -1,
+                  "failed to initialize audio semaphore");
 }
 
-// Writes up to 'len' samples from 'src' to the ring buffer. In case of
-// overflow, writes as many samples as possible and returns 'false'.
-static void write_samples(int16_t const *src, size_t len) {
-    // Copy samples from 'src' to the ring buffer by memcpy()ing contiguous
-    // segments
+void deinit_audio() {
+    free_array_set_null(buf);
+    sem_destroy(&space_sem);
+}
 
-    // How many contiguous bytes are available...?
+unsigned get_audio_device_buffer_len() { return device_buffer_len; }
 
-    size_t contig_avail;
-    if (start_index < end_index || (start_index == end_index && prev_op_was_read))
-        contig_avail = ARRAY_LEN(buf) - end_index;
-    else
-        contig_avail = start_index - end_index;
+unsigned long get_audio_underruns() {
+    return __atomic_load_n(&n_underruns, __ATOMIC_RELAXED);
+}
 
-    prev_op_was_read = false;
+unsigned long get_audio_overruns() {
+    return __atomic_load_n(&n_overruns, __ATOMIC_RELAXED);
+}
 
-    if (contig_avail >= len) {
-        // ...as many as we need. Copy it all in one go.
-        memcpy(buf + end_index, src, sizeof(*buf)*len);
-        end_index = (end_index + len) % ARRAY_LEN(buf);
+void read_samples(int16_t *dst, size_t len) {
+    size_t const n = min(len, load_pos(write_pos) - read_pos);
+
+    // Copy up to the end of 'buf' and then the rest from the beginning
+    size_t const index   = buf_index(read_pos);
+    size_t const n_first = min(n, buf_len - index);
+    memcpy(dst, buf + index, sizeof(*buf)*n_first);
+    memcpy(dst + n_first, buf, sizeof(*buf)*(n - n_first));
+
+    store_pos(read_pos, read_pos + n);
+    if (sync_to_audio)
+        sem_post(&space_sem);
+
+    if (n < len) {
+        // Underflow. Zero-fill the rest of the output buffer, as required by
+        // SDL2.
+        memset(dst + n, 0, sizeof(*buf)*(len - n));
+        __atomic_fetch_add(&n_underruns, 1, __ATOMIC_RELAXED);
     }
-    else {
-        // ...less than we need. Fill the contiguous segment first.
-        memcpy(buf + end_index, src, sizeof(*buf)*contig_avail);
-        len -= contig_avail;
-        assert(len > 0);
-        // Move past the contiguous segment - possibly to index 0
-        end_index = (end_index + contig_avail) % ARRAY_LEN(buf);
-        assert(end_index <= start_index);
-        // How many contiguous bytes are available now...?
-        size_t const avail = start_index - end_index;
-        if (avail >= len) {
-            // ...as many as we need. Copy the rest.
-            memcpy(buf + end_index, src + contig_avail, sizeof(*buf)*len);
-            end_index += len;
-            assert(end_index <= start_index);
-        }
-        else {
-            // ...less than we need. Copy as much as we can and drop the
-            // rest.
-            memcpy(buf + end_index, src + contig_avail, sizeof(*buf)*avail);
-            assert(end_index + avail == start_index);
-            end_index = start_index;
-#ifndef RUN_TESTS
-            puts("audio buffer overflow!");
-#endif
+}
+
+// Waits until the callback has read some samples. Returns false on timeout.
+// The semaphore must have been drained before the ring buffer was checked
+// (see write_samples()).
+static bool wait_for_space() {
+    timespec deadline;
+    errno_fail_if(clock_gettime(CLOCK_REALTIME, &deadline) == -1,
+      "failed to fetch time from clock_gettime()");
+    long const nanos = deadline.tv_nsec + 1000000l*sync_timeout_ms;
+    deadline.tv_sec += nanos/1000000000l;
+    deadline.tv_nsec = nanos%1000000000l;
+
+    while (sem_timedwait(&space_sem, &deadline) == -1) {
+        if (errno == ETIMEDOUT)
+            return false;
+        errno_fail_if(errno != EINTR, "failed to wait for audio buffer space");
+    }
+    return true;
+}
+
+// Writes 'len' samples from 'src' to the ring buffer. When syncing to audio,
+// waits for room as needed. Otherwise, writes as many samples as fit and drops
+// the rest.
+static void write_samples(int16_t const *src, size_t len) {
+    // Never buffer more than the target when syncing to audio, once the
+    // target has been reached and playback is running
+    size_t const limit =
+      sync_to_audio && playback_started ? target_fill : buf_len;
+
+    while (len > 0) {
+        // Drop posts for reads that happened while we weren't waiting, so that
+        // wait_for_space() only returns for reads after the check below.
+        // Otherwise, stale posts would make us spin instead of sleeping.
+        if (sync_to_audio)
+            while (sem_trywait(&space_sem) == 0);
+
+        size_t const fill = write_pos - load_pos(read_pos);
+        size_t const n = min(len, limit - min(limit, fill));
+
+        if (n == 0) {
+            if (!sync_to_audio) {
+                __atomic_fetch_add(&n_overruns, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            // Can happen before playback has started with a low latency
+            // target, as the buffer is only checked once per frame
+            if (!playback_started)
+                begin_playback();
+            if (!wait_for_space()) {
+                // Playback has stalled. Drop the samples rather than blocking
+                // emulation indefinitely.
+                __atomic_fetch_add(&n_overruns, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            continue;
         }
+
+        // Copy up to the end of 'buf' and then the rest to the beginning
+        size_t const index   = buf_index(write_pos);
+        size_t const n_first = min(n, buf_len - index);
+        memcpy(buf + index, src, sizeof(*buf)*n_first);
+        memcpy(buf, src + n_first, sizeof(*buf)*(n - n_first));
+
+        store_pos(write_pos, write_pos + n);
+
+        src += n;
+        len -= n;
     }
 }
 
-// Returns the fill level of the ring buffer as a double in the range 0.0-1.0.
+// Returns the fill level of the ring buffer relative to target_fill (1.0 means
+// on target). Only called from the writing side.
 static double fill_level() {
-    double const data_len = (end_index - start_index) % ARRAY_LEN(buf);
-    return data_len/ARRAY_LEN(buf);
+    double const data_len = write_pos - load_pos(read_pos);
+    return data_len/target_fill;
 }
 
+#endif
+
 //
-// Initialization, resampling, and buffer management
+// Audio frames
 //
 
-static blip_t *blip;
+// The emulation thread mixes the audio for each frame into a list of signal
+// level deltas (see mix_pending_inputs()). Turning the list into samples with
+// blip_buf, steering the playback rate, and reversing audio while rewinding
+// all happen in resample_frame(). In the SDL build, that runs on an audio
+// thread, which keeps it out of the emulation thread's frame time. Headless
+// builds (including the library) need the samples for each frame right after
+// it's run (see get_frame_samples()), and movie recording isn't thread-safe,
+// so those resample on the emulation thread.
+#if !defined(HEADLESS) && !defined(RECORD_MOVIE)
+#  define AUDIO_THREAD
+#endif
 
-// We try to keep the internal audio buffer 50% full for maximum protection
-// against under- and overflow. To maintain that level, we adjust the playback
-// rate slightly depending on the current buffer fill level. This sets the
-// maximum adjustment allowed (1.5%), though typical adjustments will be much
-// smaller.
-double const max_adjust = 0.015;
+struct Audio_frame {
+    // Times (in CPU ticks from the start of the frame) and sizes of the signal
+    // level changes
+    uint32_t *times;
+    int      *deltas;
+    unsigned n_deltas, capacity;
+
+    // Length of the frame in CPU ticks
+    unsigned len;
+    // True if the audio should be reversed (see resample_frame())
+    bool backwards;
+};
+
+static void alloc_audio_frame(Audio_frame &frame, unsigned capacity) {
+    fail_if(!(frame.times  = new (std::nothrow) uint32_t[capacity]) ||
+            !(frame.deltas = new (std::nothrow) int[capacity]),
+            "failed to allocate audio frame buffer");
+    frame.capacity = capacity;
+    frame.n_deltas = 0;
+}
 
-// To avoid an immediate underflow, we wait for the audio buffer to fill up
-// before we start playing. This is set true when we're happy with the fill
-// level.
-static bool playback_started;
+static void free_audio_frame(Audio_frame &frame) {
+    free_array_set_null(frame.times);
+    free_array_set_null(frame.deltas);
+}
+
+static void add_delta(Audio_frame &frame, unsigned time, int delta) {
+    if (frame.n_deltas == frame.capacity) {
+        // Rare. Most frames have at most a few thousand changes.
+        Audio_frame bigger;
+        alloc_audio_frame(bigger, 2*frame.capacity);
+        memcpy(bigger.times , frame.times , sizeof(*frame.times )*frame.n_deltas);
+        memcpy(bigger.deltas, frame.deltas, sizeof(*frame.deltas)*frame.n_deltas);
+        bigger.n_deltas = frame.n_deltas;
+        free_audio_frame(frame);
+        frame = bigger;
+    }
 
-// Leave some extra room in the buffer to allow audio to be slowed down. Assume
-// PAL, which gives a slightly larger buffer than NTSC. (The expression is
-// equivalent to 1.3*sample_rate/frames_per_second, but a compile-time constant
-// in C++03.)
-// TODO: Make dependent on max_adjust.
-static int16_t blip_samples[1300*sample_rate/pal_milliframes_per_second];
+    frame.times [frame.n_deltas] = time;
+    frame.deltas[frame.n_deltas] = delta;
+    ++frame.n_deltas;
+}
+
+//
+// Resampling
+//
+
+#ifndef HEADLESS
+// Unless we're syncing to audio, we try to keep target_fill samples in the
+// ring buffer, which by default is half of it for maximum protection against
+// under- and overflow. To maintain that level, we adjust the playback rate
+// slightly depending on the current buffer fill level. This sets the maximum
+// adjustment allowed (1.5%), though typical adjustments will be much smaller.
+double const max_adjust = 0.015;
+#endif
 
-void set_audio_signal_level(int16_t level) {
-    // TODO: Do something to reduce the initial pop here?
-    static int16_t previous_signal_level = 0;
+struct Resampler {
+    blip_t *blip;
+
+    // Leave some extra room in the buffer to allow audio to be slowed down.
+    // Assume PAL, which gives a slightly larger buffer than NTSC. (The
+    // expression is equivalent to 1.3*sample_rate/frames_per_second, but a
+    // compile-time constant in C++03.)
+    // TODO: Make dependent on max_adjust.
+    int16_t samples[1300*sample_rate/pal_milliframes_per_second];
+    // Number of samples from the most recently resampled frame
+    size_t n_samples;
+
+#ifdef HEADLESS
+    // Time of the next point sample in CPU ticks, relative to the start of
+    // the next frame (see point_sample_frame())
+    double next_point_time;
+#endif
+};
 
-    unsigned time  = frame_offset;
-    int      delta = level - previous_signal_level;
+// Used only by the audio thread while it runs (see Audio_thread)
+static PER_CONSOLE Resampler *resampler;
 
-    if (is_backwards_frame) {
+// Turns the deltas for a frame into samples
+static void resample_frame(Resampler &r, Audio_frame const &frame) {
+    if (frame.backwards) {
         // Flip deltas and add them from the end of the frame to reverse audio.
         // Since the exact length of the frame can't be known in advance, the
         // length of each frame is recorded when it is saved to the rewind
@@ -181,71 +335,304 @@ void set_audio_signal_level(int16_t level) {
         // arbitrarily in time.
         //
         // Thanks to Blargg for help on this.
-        time  = get_frame_len() - time;
-        delta = -delta;
+        for (unsigned i = 0; i < frame.n_deltas; ++i)
+            blip_add_delta(r.blip, frame.len - frame.times[i], -frame.deltas[i]);
     }
-    blip_add_delta(blip, time, delta);
-
-    previous_signal_level = level;
-}
-
-void end_audio_frame() {
-    if (frame_offset == 0)
-        // No audio added; blip_end_frame() dislikes being called with an
-        // offset of 0
-        return;
-
-    assert(!(is_backwards_frame && frame_offset != get_frame_len()));
-
-    // Bring the signal level at the end of the frame to zero as outlined in
-    // set_audio_signal_level()
-    set_audio_signal_level(0);
+    else
+        for (unsigned i = 0; i < frame.n_deltas; ++i)
+            blip_add_delta(r.blip, frame.times[i], frame.deltas[i]);
 
-    blip_end_frame(blip, frame_offset);
+    blip_end_frame(r.blip, frame.len);
 
+#ifndef HEADLESS
     if (playback_started) {
-        // Fudge playback rate by an amount proportional to the difference
-        // between the desired and current buffer fill levels to try to steer
-        // towards it
-
-        double const fudge_factor = 1.0 + 2*max_adjust*(0.5 - fill_level());
-        blip_set_rates(blip, cpu_clock_rate, sample_rate*fudge_factor);
+        // When syncing to audio, emulation runs at the rate the audio is
+        // consumed, so there's nothing to correct for
+        if (!sync_to_audio) {
+            // Fudge playback rate by an amount proportional to the difference
+            // between the desired and current buffer fill levels to try to
+            // steer towards it
+
+            double const fudge_factor =
+              1.0 + max_adjust*(1.0 - min(fill_level(), 2.0));
+            blip_set_rates(r.blip, cpu_clock_rate, sample_rate*fudge_factor);
+        }
     }
     else {
-        if (fill_level() >= 0.5) {
-            start_audio_playback();
-            playback_started = true;
-        }
+        if (fill_level() >= 1.0)
+            begin_playback();
     }
+#endif
 
-    int const n_samples = blip_read_samples(blip, blip_samples, ARRAY_LEN(blip_samples), 0);
+    int const n_samples = blip_read_samples(r.blip, r.samples, ARRAY_LEN(r.samples), 0);
+    r.n_samples = n_samples;
     // We expect to read all samples from blip_buf. If something goes wrong and
     // we don't, clear the buffer to prevent data piling up in blip_buf's
     // buffer (which lacks bounds checking).
-    int const avail = blip_samples_avail(blip);
+    int const avail = blip_samples_avail(r.blip);
     if (avail != 0) {
         printf("Warning: didn't read all samples from blip_buf (%d samples remain) - dropping samples\n",
           avail);
-        blip_clear(blip);
+        blip_clear(r.blip);
     }
 
 #ifdef RECORD_MOVIE
-    add_movie_audio_frame(blip_samples, n_samples);
+    add_movie_audio_frame(r.samples, n_samples);
 #endif
 
+#ifndef HEADLESS
     // Save the samples to the audio ring buffer
+    write_samples(r.samples, n_samples);
+#endif
+}
+
+#ifdef HEADLESS
+
+static PER_CONSOLE Audio_mode audio_mode = AUDIO_FULL;
 
-    lock_audio();
-    write_samples(blip_samples, n_samples);
-    unlock_audio();
+// Sample rate in AUDIO_LOW mode
+int const low_sample_rate = sample_rate/4;
+
+// Cheap alternative to resample_frame() for AUDIO_LOW mode. Outputs the signal
+// level at evenly spaced points in time.
+static void point_sample_frame(Resampler &r, Audio_frame const &frame) {
+    double const ticks_per_sample = cpu_clock_rate/low_sample_rate;
+
+    // Frames start and end at a signal level of zero (see resample_frame())
+    int level = 0;
+    size_t n_samples = 0;
+    double t = r.next_point_time;
+
+    for (unsigned i = 0; i < frame.n_deltas; ++i) {
+        unsigned time;
+        int delta;
+        if (frame.backwards) {
+            // Walk the deltas from the end instead, flipped as in
+            // resample_frame()
+            unsigned const j = frame.n_deltas - 1 - i;
+            time  = frame.len - frame.times[j];
+            delta = -frame.deltas[j];
+        }
+        else {
+            time  = frame.times[i];
+            delta = frame.deltas[i];
+        }
+
+        for (; t < time; t += ticks_per_sample)
+            r.samples[n_samples++] = level;
+        level += delta;
+    }
+    for (; t < frame.len; t += ticks_per_sample)
+        r.samples[n_samples++] = level;
+
+    assert(n_samples <= ARRAY_LEN(r.samples));
+    r.n_samples = n_samples;
+    r.next_point_time = t - frame.len;
+}
+
+void set_audio_mode(Audio_mode mode) { audio_mode = mode; }
+
+unsigned get_audio_sample_rate() {
+    return audio_mode == AUDIO_LOW ? low_sample_rate : sample_rate;
+}
+
+#endif
+
+#ifdef AUDIO_THREAD
+
+//
+// Audio thread
+//
+
+// Finished frames are handed to the audio thread through a small queue of
+// slots (see worker_queue.h). The emulation thread swaps the frame it recorded
+// with a free slot. When syncing to audio, only one frame is queued at a time,
+// so that the emulation thread stays at most a frame ahead of the audio
+// thread, which in turn waits for room in the ring buffer.
+
+unsigned const n_audio_slots = 4;
+
+struct Audio_thread {
+    // The console's resampler
+    Resampler *resampler;
+
+    Audio_frame slots[n_audio_slots];
+    Worker_queue queue;
+};
+
+static PER_CONSOLE Audio_thread *audio_thread;
+
+static void resample_slot(void *audio_thread_arg, unsigned slot) {
+    Audio_thread *const t = (Audio_thread*)audio_thread_arg;
+    resample_frame(*t->resampler, t->slots[slot]);
+}
+
+// Queues 'frame' for resampling. 'frame' gets the buffers of a free slot in
+// return.
+static void queue_audio_frame(Audio_frame &frame) {
+    Audio_thread *const t = audio_thread;
+
+    unsigned const slot =
+      begin_queue_slot(t->queue, sync_to_audio ? 1 : n_audio_slots);
+    swap(t->slots[slot], frame);
+    frame.n_deltas = 0;
+    end_queue_slot(t->queue);
+}
+
+#endif // AUDIO_THREAD
+
+//
+// Mixing
+//
+
+// The frame being recorded
+static PER_CONSOLE Audio_frame cur_frame;
+
+// Mixer inputs recorded by set_audio_mixer_inputs() and not yet mixed. Kept
+// as separate arrays so that mix_pending_inputs() can work on them in simple
+// passes.
+static unsigned const max_pending_inputs = 2048;
+static PER_CONSOLE unsigned n_pending_inputs;
+static PER_CONSOLE uint32_t pending_times[max_pending_inputs];
+static PER_CONSOLE uint8_t  pending_pulse_sums[max_pending_inputs];
+static PER_CONSOLE uint8_t  pending_tnd_sums[max_pending_inputs];
+
+// The signal level at the end of the most recently mixed input
+// TODO: Do something to reduce the initial pop here?
+static PER_CONSOLE int16_t signal_level;
+
+// Looks up the signal levels for the pending inputs and adds the changes to
+// the frame
+static void mix_pending_inputs() {
+    unsigned const n = n_pending_inputs;
+    if (n == 0)
+        return;
+
+    int16_t levels[max_pending_inputs];
+    for (unsigned i = 0; i < n; ++i)
+        levels[i] = mixer_table[pending_pulse_sums[i]][pending_tnd_sums[i]];
+
+    int deltas[max_pending_inputs];
+    deltas[0] = levels[0] - signal_level;
+    for (unsigned i = 1; i < n; ++i)
+        deltas[i] = levels[i] - levels[i - 1];
+    signal_level = levels[n - 1];
+
+    for (unsigned i = 0; i < n; ++i)
+        if (deltas[i] != 0)
+            add_delta(cur_frame, pending_times[i], deltas[i]);
+
+    n_pending_inputs = 0;
 }
 
+void set_audio_mixer_inputs(unsigned pulse_sum, unsigned tnd_sum) {
+    // Replayed frames are silent (see replay_frame())
+    if (replaying_frame)
+        return;
+#ifdef HEADLESS
+    if (audio_mode == AUDIO_OFF)
+        return;
+#endif
+
+    unsigned const i = n_pending_inputs;
+    pending_times[i]      = frame_offset;
+    pending_pulse_sums[i] = pulse_sum;
+    pending_tnd_sums[i]   = tnd_sum;
+
+    if (++n_pending_inputs == max_pending_inputs)
+        mix_pending_inputs();
+}
+
+void end_audio_frame() {
+#ifndef AUDIO_THREAD
+    resampler->n_samples = 0;
+#endif
+#ifdef HEADLESS
+    // Nothing was recorded (see set_audio_mixer_inputs())
+    if (audio_mode == AUDIO_OFF)
+        return;
+#endif
+
+    if (frame_offset == 0)
+        // No audio added; blip_end_frame() dislikes being called with an
+        // offset of 0
+        return;
+
+    assert(!(is_backwards_frame && frame_offset != get_frame_len()));
+
+    mix_pending_inputs();
+    // Bring the signal level at the end of the frame to zero as outlined in
+    // resample_frame()
+    if (signal_level != 0) {
+        add_delta(cur_frame, frame_offset, -signal_level);
+        signal_level = 0;
+    }
+
+    cur_frame.len       = frame_offset;
+    cur_frame.backwards = is_backwards_frame;
+
+#ifdef AUDIO_THREAD
+    queue_audio_frame(cur_frame);
+#else
+#  ifdef HEADLESS
+    if (audio_mode == AUDIO_LOW)
+        point_sample_frame(*resampler, cur_frame);
+    else
+#  endif
+        resample_frame(*resampler, cur_frame);
+    cur_frame.n_deltas = 0;
+#endif
+}
+
+#ifdef HEADLESS
+int16_t const *get_frame_samples(size_t &n_samples_out) {
+    n_samples_out = resampler->n_samples;
+    return resampler->samples;
+}
+#endif
+
+// Initial number of deltas a frame buffer has room for
+unsigned const initial_frame_capacity = 4096;
+
 void init_audio_for_rom() {
+    fail_if(!(resampler = new (std::nothrow) Resampler),
+            "failed to allocate resampler");
     // Maximum number of unread samples the buffer can hold
-    blip = blip_new(sample_rate/10);
-    blip_set_rates(blip, cpu_clock_rate, sample_rate);
+    resampler->blip = blip_new(sample_rate/10);
+    fail_if(!resampler->blip, "failed to allocate blip_buf buffer");
+    blip_set_rates(resampler->blip, cpu_clock_rate, sample_rate);
+    resampler->n_samples = 0;
+#ifdef HEADLESS
+    resampler->next_point_time = 0.0;
+#endif
+
+    alloc_audio_frame(cur_frame, initial_frame_capacity);
+
+#ifdef AUDIO_THREAD
+    fail_if(!(audio_thread = new (std::nothrow) Audio_thread),
+            "failed to allocate audio thread state");
+    Audio_thread *const t = audio_thread;
+    t->resampler = resampler;
+    for (unsigned i = 0; i < n_audio_slots; ++i)
+        alloc_audio_frame(t->slots[i], initial_frame_capacity);
+    init_worker_queue(t->queue, n_audio_slots, resample_slot, t, "audio");
+#endif
 }
 
 void deinit_audio_for_rom() {
-    blip_delete(blip);
+#ifdef AUDIO_THREAD
+    Audio_thread *const t = audio_thread;
+    // Resamples any queued frames before stopping the audio thread
+    deinit_worker_queue(t->queue);
+    for (unsigned i = 0; i < n_audio_slots; ++i)
+        free_audio_frame(t->slots[i]);
+    delete t;
+    audio_thread = 0;
+#endif
+
+    free_audio_frame(cur_frame);
+
+    blip_delete(resampler->blip);
+    delete resampler;
+    resampler = 0;
 }
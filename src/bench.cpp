@@ -0,0 +1,178 @@
+#include "common.h"
+
+#include "bench.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+
+#include <signal.h>
+#include <sys/time.h>
+
+PER_CONSOLE Bench_region volatile bench_region;
+PER_CONSOLE uint64_t bench_n_instructions;
+
+// Interval between samples in microseconds of CPU time. The actual resolution
+// might be limited by the kernel.
+long const sample_interval_us = 500;
+
+// region_samples[r] is the number of times the SIGPROF handler saw region r
+static PER_CONSOLE uint64_t volatile region_samples[N_BENCH_REGIONS];
+
+char const *const region_names[N_BENCH_REGIONS] =
+  { "cpu", "ppu", "apu", "rewind", "other" };
+
+// Counters at the start of the benchmark
+static PER_CONSOLE timespec start_time;
+static PER_CONSOLE unsigned long start_frames;
+static PER_CONSOLE uint64_t start_instructions;
+
+// CPU cycles (= APU ticks) and PPU dots run during the benchmark, summed at the
+// end of each frame. power_on() resets ppu.cycle, so it's tracked per frame
+// rather than sampled at the start.
+static PER_CONSOLE uint64_t n_cpu_cycles;
+static PER_CONSOLE uint64_t n_ppu_dots;
+static PER_CONSOLE uint64_t prev_ppu_cycle;
+
+static void sigprof_handler(int) {
+    ++region_samples[bench_region];
+}
+
+static void set_sample_timer(long interval_us) {
+    itimerval timer;
+    timer.it_interval.tv_sec  = timer.it_value.tv_sec  = 0;
+    timer.it_interval.tv_usec = timer.it_value.tv_usec = interval_us;
+    errno_fail_if(setitimer(ITIMER_PROF, &timer, 0) == -1,
+      "failed to set profiling timer");
+}
+
+void start_bench() {
+    struct sigaction sa;
+    sa.sa_handler = sigprof_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    errno_fail_if(sigaction(SIGPROF, &sa, 0) == -1,
+      "failed to install SIGPROF handler");
+
+    for (unsigned i = 0; i < N_BENCH_REGIONS; ++i)
+        region_samples[i] = 0;
+    n_cpu_cycles       = n_ppu_dots = prev_ppu_cycle = 0;
+    start_frames       = get_n_frames();
+    start_instructions = bench_n_instructions;
+
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &start_time) == -1,
+      "failed to fetch start time from clock_gettime()");
+    set_sample_timer(sample_interval_us);
+}
+
+void bench_frame() {
+    n_cpu_cycles  += frame_offset;
+    n_ppu_dots    += ppu.cycle - prev_ppu_cycle;
+    prev_ppu_cycle = ppu.cycle;
+}
+
+// Number of state saves and loads timed at the end of the benchmark
+unsigned const n_state_transfers = 1000;
+
+static double elapsed_ns(timespec const &start) {
+    timespec now;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &now) == -1,
+      "failed to fetch time from clock_gettime()");
+    return 1e9*(now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec);
+}
+
+// Times saving and loading the state of the console, which rewinding does at
+// least once per frame. Loading the state clears the rewind buffer, which is
+// fine at the end of the benchmark.
+static void time_state_transfers(double &save_ns, double &load_ns) {
+    uint8_t *buf;
+    fail_if(!(buf = new (std::nothrow) uint8_t[get_state_size()]),
+            "failed to allocate state buffer for benchmark");
+
+    timespec start;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &start) == -1,
+      "failed to fetch time from clock_gettime()");
+    for (unsigned i = 0; i < n_state_transfers; ++i)
+        save_state_to_buf(buf);
+    save_ns = elapsed_ns(start)/n_state_transfers;
+
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &start) == -1,
+      "failed to fetch time from clock_gettime()");
+    for (unsigned i = 0; i < n_state_transfers; ++i)
+        load_state_from_buf(buf);
+    load_ns = elapsed_ns(start)/n_state_transfers;
+
+    delete [] buf;
+}
+
+// Prints 's' as a JSON string
+static void print_json_string(char const *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned char)*s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+void end_bench(char const *rom_filename) {
+    timespec end_time;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &end_time) == -1,
+      "failed to fetch end time from clock_gettime()");
+    set_sample_timer(0);
+
+    double state_save_ns, state_load_ns;
+    time_state_transfers(state_save_ns, state_load_ns);
+
+    double const secs = (end_time.tv_sec - start_time.tv_sec) +
+                        1e-9*(end_time.tv_nsec - start_time.tv_nsec);
+    unsigned long const n_frames = get_n_frames() - start_frames;
+    uint64_t const n_instructions = bench_n_instructions - start_instructions;
+
+    // Fraction of the time spent in each region
+    uint64_t n_samples = 0;
+    for (unsigned i = 0; i < N_BENCH_REGIONS; ++i)
+        n_samples += region_samples[i];
+    double share[N_BENCH_REGIONS];
+    for (unsigned i = 0; i < N_BENCH_REGIONS; ++i)
+        share[i] = n_samples ? (double)region_samples[i]/n_samples : 0.0;
+
+    // Time per unit of work for each component, based on the time spent in
+    // the corresponding region
+    double const ns = 1e9*secs;
+    #define NS_PER(region, n) ((n) ? ns*share[region]/(n) : 0.0)
+
+    printf("{\n  \"rom\": ");
+    print_json_string(rom_filename);
+    printf(",\n"
+           "  \"frames\": %lu,\n"
+           "  \"seconds\": %.6f,\n"
+           "  \"fps\": %.2f,\n"
+           "  \"cpu_instructions\": %" PRIu64 ",\n"
+           "  \"ppu_dots\": %" PRIu64 ",\n"
+           "  \"apu_ticks\": %" PRIu64 ",\n"
+           "  \"ns_per_cpu_instruction\": %.3f,\n"
+           "  \"ns_per_ppu_dot\": %.3f,\n"
+           "  \"ns_per_apu_tick\": %.3f,\n"
+           "  \"state_size\": %zu,\n"
+           "  \"ns_per_state_save\": %.1f,\n"
+           "  \"ns_per_state_load\": %.1f,\n"
+           "  \"samples\": %" PRIu64 ",\n"
+           "  \"time_split\": {",
+           n_frames, secs, n_frames/secs,
+           n_instructions, n_ppu_dots, n_cpu_cycles,
+           NS_PER(BENCH_CPU, n_instructions),
+           NS_PER(BENCH_PPU, n_ppu_dots),
+           NS_PER(BENCH_APU, n_cpu_cycles),
+           get_state_size(), state_save_ns, state_load_ns,
+           n_samples);
+    for (unsigned i = 0; i < N_BENCH_REGIONS; ++i)
+        printf("%s\n    \"%s\": %.4f", i ? "," : "", region_names[i], share[i]);
+    printf("\n  }\n}\n");
+
+    #undef NS_PER
+}
@@ -0,0 +1,143 @@
+#include "common.h"
+
+#include "compress.h"
+
+// Encoded format, repeated until 'len' bytes have been described:
+//
+//   <zero run length> <literal length> <literal bytes>
+//
+// The lengths are varints (seven bits per byte, least significant group first,
+// bit 7 set on all but the last byte). Zero runs shorter than this are
+// included in literals, as splitting there would make the output bigger.
+size_t const min_zero_run = 3;
+
+size_t max_delta_size(size_t len) {
+    // Every literal after the first is preceded by at least min_zero_run
+    // zeros, and varints only grow past one byte for runs that cover at least
+    // 128 bytes, so this is generous
+    return len + len/2 + 16;
+}
+
+static uint8_t *put_varint(uint8_t *dst, size_t n) {
+    for (; n >= 0x80; n >>= 7)
+        *dst++ = (n & 0x7F) | 0x80;
+    *dst++ = n;
+    return dst;
+}
+
+// Like get_varint(), but fails by returning null if the varint doesn't end
+// before 'end' or doesn't fit in a size_t
+static uint8_t const *get_varint_checked(uint8_t const *src,
+                                         uint8_t const *end, size_t &n) {
+    n = 0;
+    for (unsigned shift = 0; src < end && shift < CHAR_BIT*sizeof(size_t);
+         shift += 7) {
+        uint8_t const byte = *src++;
+        n |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return src;
+    }
+    return 0;
+}
+
+static uint8_t const *get_varint(uint8_t const *src, size_t &n) {
+    n = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        uint8_t const byte = *src++;
+        n |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return src;
+    }
+}
+
+static uint8_t diff_byte(uint8_t const *state, uint8_t const *ref, size_t i) {
+    return ref ? state[i] ^ ref[i] : state[i];
+}
+
+// Returns the index of the first non-zero byte of the delta at or after 'i',
+// or 'len' if there is none. Compares eight bytes at a time where possible, as
+// long runs of unchanged bytes are the common case.
+static size_t skip_zeros(uint8_t const *state, uint8_t const *ref, size_t i,
+                         size_t len) {
+    for (; i + 8 <= len; i += 8) {
+        uint64_t s, r = 0;
+        memcpy(&s, state + i, 8);
+        if (ref)
+            memcpy(&r, ref + i, 8);
+        if (s != r)
+            break;
+    }
+    while (i < len && !diff_byte(state, ref, i))
+        ++i;
+    return i;
+}
+
+size_t encode_delta(uint8_t const *state, uint8_t const *ref, size_t len,
+                    uint8_t *dst) {
+    uint8_t *const dst_start = dst;
+
+    for (size_t i = 0; i < len;) {
+        size_t const lit_start = skip_zeros(state, ref, i, len);
+
+        // Extend the literal up to the next long enough zero run
+        size_t lit_end = lit_start;
+        while (lit_end < len) {
+            if (diff_byte(state, ref, lit_end)) {
+                ++lit_end;
+                continue;
+            }
+            size_t run_end = lit_end + 1;
+            while (run_end < len && run_end - lit_end < min_zero_run &&
+                   !diff_byte(state, ref, run_end))
+                ++run_end;
+            if (run_end == len || run_end - lit_end >= min_zero_run)
+                break;
+            lit_end = run_end;
+        }
+
+        dst = put_varint(dst, lit_start - i);
+        dst = put_varint(dst, lit_end - lit_start);
+        for (size_t j = lit_start; j < lit_end; ++j)
+            *dst++ = diff_byte(state, ref, j);
+
+        i = lit_end;
+    }
+
+    assert((size_t)(dst - dst_start) <= max_delta_size(len));
+    return dst - dst_start;
+}
+
+size_t apply_delta(uint8_t const *src, uint8_t *state, size_t len) {
+    uint8_t const *const src_start = src;
+
+    for (size_t i = 0; i < len;) {
+        size_t zero_run, lit_len;
+        src = get_varint(src, zero_run);
+        src = get_varint(src, lit_len);
+        i += zero_run;
+        assert(i + lit_len <= len);
+        for (size_t j = 0; j < lit_len; ++j)
+            state[i++] ^= *src++;
+    }
+
+    return src - src_start;
+}
+
+bool is_valid_delta(uint8_t const *src, size_t src_len, size_t len) {
+    uint8_t const *const end = src + src_len;
+
+    for (size_t i = 0; i < len;) {
+        size_t zero_run, lit_len;
+        if (!(src = get_varint_checked(src, end, zero_run)) ||
+            !(src = get_varint_checked(src, end, lit_len)))
+            return false;
+        // An empty pair would never make progress
+        if (zero_run + lit_len == 0 || zero_run > len - i ||
+            lit_len > len - i - zero_run || lit_len > (size_t)(end - src))
+            return false;
+        i   += zero_run + lit_len;
+        src += lit_len;
+    }
+
+    return src == end;
+}
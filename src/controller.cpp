@@ -4,11 +4,14 @@
 #include "cpu.h"
 #include "input.h"
 
-static uint8_t controller_bits[2];
+static PER_CONSOLE struct STATE_BLOCK Controller_state {
+    // Shift registers
+    uint8_t bits[2];
 
-// Set by writing $4016:0. When enabled, the shift registers in the controllers
-// are initialized from the buttons (level triggered).
-static bool strobe_latch;
+    // Set by writing $4016:0. When enabled, the shift registers in the
+    // controllers are initialized from the buttons (level triggered).
+    bool strobe_latch;
+} controller;
 
 uint8_t read_controller(unsigned n) {
     // Results for standard controller:
@@ -18,12 +21,12 @@ uint8_t read_controller(unsigned n) {
 
     // Reading the controllers with the strobe latch on returns the state of A
     // over and over. Happens rarely.
-    if (strobe_latch)
-        return (cpu_data_bus & 0xE0) | (get_button_states(n) & 1);
+    if (controller.strobe_latch)
+        return (cpu.data_bus & 0xE0) | (get_button_states(n) & 1);
 
-    uint8_t const result = (cpu_data_bus & 0xE0) | (controller_bits[n] & 1);
+    uint8_t const result = (cpu.data_bus & 0xE0) | (controller.bits[n] & 1);
     // 1s are shifted in on an official Nintendo controller, so emulate that
-    controller_bits[n] = 0x80 | (controller_bits[n] >> 1);
+    controller.bits[n] = 0x80 | (controller.bits[n] >> 1);
     return result;
 }
 
@@ -31,17 +34,16 @@ void write_controller_strobe(bool strobe) {
     // On a real controller the button states are continuously reloaded while
     // the strobe latch is on. Emulate this by latching the button states when
     // it goes from set to unset.
-    if (strobe_latch && !strobe)
+    if (controller.strobe_latch && !strobe)
         for (unsigned n = 0; n < 2; ++n)
-            controller_bits[n] = get_button_states(n);
+            controller.bits[n] = get_button_states(n);
 
-    strobe_latch = strobe;
+    controller.strobe_latch = strobe;
 }
 
 template<bool calculating_size, bool is_save>
 void transfer_controller_state(uint8_t *&buf) {
-    TRANSFER(controller_bits)
-    TRANSFER(strobe_latch)
+    TRANSFER(controller)
 }
 
 // Explicit instantiations
@@ -8,12 +8,14 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "bench.h"
 #include "controller.h"
 #include "cpu.h"
 #include "input.h"
 #include "mapper.h"
 #include "opcodes.h"
 #include "ppu.h"
+#include "profile.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
@@ -35,83 +37,72 @@
 // Avoids having to check them all for each instruction. This includes
 // interrupts, end-of-frame operations, state transfers, (soft) reset, and
 // shutdown.
-static bool pending_event;
+static PER_CONSOLE bool pending_event;
 
-static bool pending_end_emulation;
-static bool pending_frame_completion;
-static bool pending_reset;
+static PER_CONSOLE bool pending_end_emulation;
+static PER_CONSOLE bool pending_frame_completion;
+static PER_CONSOLE bool pending_reset;
+
+PER_CONSOLE bool replaying_frame;
 
 void end_emulation()   { pending_event = pending_end_emulation = true; }
 void frame_completed() { pending_event = pending_frame_completion = true; }
 void soft_reset()      { pending_event = pending_reset = true; }
 
-// Set true if interrupt polling detects a pending IRQ or NMI. The next
-// "instruction" executed is the interrupt sequence.
-static bool pending_irq;
-static bool pending_nmi;
-
-#ifdef RUN_TESTS
-// The system is soft-reset when this goes from 1 to 0. Used by test ROMs.
-static unsigned ticks_till_reset;
-#endif
-
 //
-// RAM, registers, status flags, and misc. state
+// Scheduled events
 //
 
-static uint8_t ram[0x800];
-
-// Possible optimization: Making some of the variables a natural size for the
-// implementation architecture might be faster. CPU emulation is already
-// relatively speedy though, and we wouldn't get automatic wrapping.
+PER_CONSOLE uint64_t cpu_cycle;
+PER_CONSOLE uint64_t event_deadlines[N_TIMED_EVENTS];
+PER_CONSOLE uint64_t next_deadline;
 
-// Registers
-static uint16_t pc;
-static uint8_t a, s, x, y;
+void schedule_event(Timed_event e, uint64_t cycle) {
+    event_deadlines[e] = cycle;
 
-// Status flags
+    // There are only a few events, so just rescan them
+    next_deadline = no_deadline;
+    for (unsigned i = 0; i < N_TIMED_EVENTS; ++i)
+        next_deadline = min(next_deadline, event_deadlines[i]);
+}
 
-// The value the zero and negative flags are based on. Storing these together
-// turns the setting of the flags into a simple assignment in most cases.
 //
-//  - !(zn & 0xFF) means the zero flag is set.
-//  - zn & 0x180 means the negative flag is set.
+// RAM, registers, status flags, and misc. state
 //
-// Having zn & 0x100 also indicate that the negative flag is set allows the two
-// flags to be set separately, which is required by the BIT instruction and
-// when pulling flags from the stack.
-static unsigned zn;
-
-static bool carry;
-static bool irq_disable;
-static bool decimal;
-static bool overflow;
 
-// The byte after the opcode byte. Always fetched, so factoring out the fetch
-// saves logic.
-static uint8_t op_1;
+static PER_CONSOLE uint8_t ram[0x800];
+// Dirty-page stamps for 'ram' (see transfer_tracked() in common.h). The zero
+// page and the stack are pages 0 and 1.
+static PER_CONSOLE uint32_t ram_stamps[0x800 >> dirty_page_shift];
 
-bool cpu_is_reading;
-uint8_t cpu_data_bus;
+PER_CONSOLE Cpu_state cpu;
 
 //
 // PPU and APU interface
 //
 
-unsigned frame_offset;
-
-// Down counter for adding an extra PPU tick for PAL
-static unsigned pal_extra_tick;
+PER_CONSOLE unsigned frame_offset;
 
 void tick() {
+    ++cpu_cycle;
+
     // For NTSC, there are exactly three PPU ticks per CPU cycle. For PAL the
     // number is 3.2, which is emulated by adding an extra PPU tick every fifth
     // call. (This isn't perfect, but about as good as we can do without getting
     // into super-obscure hardware behavior, including PPU half-ticks and analog
     // effects.)
+#ifdef CATCH_UP_PPU
+    // The ticks are run later in catch_up_ppu()
+    ppu_ticks_owed += 3;
+    if (is_pal && --cpu.pal_extra_tick == 0) {
+        cpu.pal_extra_tick = 5;
+        ++ppu_ticks_owed;
+    }
+#else
+    BENCH_REGION(BENCH_PPU)
     if (is_pal) {
-        if (--pal_extra_tick == 0) {
-            pal_extra_tick = 5;
+        if (--cpu.pal_extra_tick == 0) {
+            cpu.pal_extra_tick = 5;
             tick_pal_ppu();
         }
         tick_pal_ppu();
@@ -123,12 +114,17 @@ void tick() {
         tick_ntsc_ppu();
         tick_ntsc_ppu();
     }
+#endif
 
-    tick_apu();
+    BENCH_REGION(BENCH_APU)
+    PROFILE_CALL(PROF_TICK_APU, tick_apu());
+    BENCH_REGION(BENCH_CPU)
 
 #ifdef RUN_TESTS
-    if (ticks_till_reset > 0 && --ticks_till_reset == 0)
+    if (event_due(TEST_RESET_EVENT)) {
+        schedule_event(TEST_RESET_EVENT, no_deadline);
         pending_reset = true;
+    }
 #endif
 
     ++frame_offset;
@@ -141,12 +137,12 @@ void tick() {
 // Optimization for read/write ticks without visible side effects
 
 static void read_tick() {
-    cpu_is_reading = true;
+    cpu.is_reading = true;
     tick();
 }
 
 static void write_tick() {
-    cpu_is_reading = false;
+    cpu.is_reading = false;
     tick();
 }
 
@@ -158,20 +154,26 @@ uint8_t read_mem(uint16_t addr) {
 
     switch (addr) {
     case 0x0000 ... 0x1FFF: res = ram[addr & 0x7FF];      break;
-    case 0x2000 ... 0x3FFF: res = read_ppu_reg(addr & 7); break;
+    case 0x2000 ... 0x3FFF:
+        PROFILE_CALL(PROF_READ_PPU_REG, res = read_ppu_reg(addr & 7));
+        break;
     case 0x4015           : res = read_apu_status();      break;
     case 0x4016           : res = read_controller(0);     break;
     case 0x4017           : res = read_controller(1);     break;
-    case 0x4018 ... 0x5FFF: res = mapper_fns.read(addr);  break; // General enough?
+    case 0x4018 ... 0x5FFF: // General enough?
+        // The mapper might report PPU-related state (e.g. MMC5 IRQ status)
+        sync_ppu();
+        res = mapper_fns.read(addr);
+        break;
     case 0x6000 ... 0x7FFF:
         // WRAM/SRAM. Returns open bus if none present.
-        res = wram_6000_page ? wram_6000_page[addr & 0x1FFF] : cpu_data_bus;
+        res = wram_6000_page ? wram_6000_page[addr & 0x1FFF] : cpu.data_bus;
         break;
     case 0x8000 ... 0xFFFF: res = read_prg(addr);         break;
-    default:                res = cpu_data_bus;           break; // Open bus
+    default:                res = cpu.data_bus;           break; // Open bus
     }
 
-    cpu_data_bus = res;
+    cpu.data_bus = res;
     return res;
 }
 
@@ -181,11 +183,20 @@ static void write_mem(uint8_t val, uint16_t addr) {
 
     write_tick();
 
-    cpu_data_bus = val;
+    // Mapper writes can change how the PPU renders (banks, mirroring, etc.)
+    if (addr >= 0x4018)
+        sync_ppu();
+
+    cpu.data_bus = val;
 
     switch (addr) {
-    case 0x0000 ... 0x1FFF: ram[addr & 0x7FF] = val;      break;
-    case 0x2000 ... 0x3FFF: write_ppu_reg(val, addr & 7); break;
+    case 0x0000 ... 0x1FFF:
+        ram[addr & 0x7FF] = val;
+        mark_dirty(ram_stamps, addr & 0x7FF);
+        break;
+    case 0x2000 ... 0x3FFF:
+        PROFILE_CALL(PROF_WRITE_PPU_REG, write_ppu_reg(val, addr & 7));
+        break;
 
     case 0x4000: write_pulse_reg_0(0, val); break;
     case 0x4001: write_pulse_reg_1(0, val); break;
@@ -210,7 +221,7 @@ static void write_mem(uint8_t val, uint16_t addr) {
     case 0x4012: write_dmc_reg_2(val); break;
     case 0x4013: write_dmc_reg_3(val); break;
 
-    case 0x4014: do_oam_dma(val); break;
+    case 0x4014: PROFILE_CALL(PROF_OAM_DMA, do_oam_dma(val)); break;
 
     case 0x4015: write_apu_status(val);            break;
     case 0x4016: write_controller_strobe(val & 1); break;
@@ -227,11 +238,15 @@ static void write_mem(uint8_t val, uint16_t addr) {
                 report_status_and_end_test(val, (char*)wram_6000_page + 4);
             else if (val == 0x81)
                 // Wait 150 ms before resetting
-                ticks_till_reset = 0.15*cpu_clock_rate;
+                schedule_event(TEST_RESET_EVENT,
+                               cpu_cycle + (uint64_t)(0.15*cpu_clock_rate));
         }
 #endif
 
-        if (wram_6000_page) wram_6000_page[addr & 0x1FFF] = val;
+        if (wram_6000_page) {
+            wram_6000_page[addr & 0x1FFF] = val;
+            mark_dirty(wram_stamps, wram_6000_page - wram_base + (addr & 0x1FFF));
+        }
         break;
 
     case 0x8000 ... 0xFFFF: write_prg(addr, val); break;
@@ -240,7 +255,10 @@ static void write_mem(uint8_t val, uint16_t addr) {
     // An alternative to letting the mapper see all writes would be to have
     // separate functions for common address ranges that trigger mapper
     // operations
-    mapper_fns.write(val, addr);
+    PROFILE_CALL(PROF_MAPPER_WRITE, mapper_fns.write(val, addr));
+
+    if (addr >= 0x4018)
+        predict_ppu_events();
 }
 
 //
@@ -252,109 +270,109 @@ static uint8_t lsr(uint8_t);
 static void sbc(uint8_t);
 
 static void adc(uint8_t arg) {
-    unsigned const sum = a + arg + carry;
-    carry = sum > 0xFF;
+    unsigned const sum = cpu.a + arg + cpu.carry;
+    cpu.carry = sum > 0xFF;
     // The overflow flag is set when the sign of the addends is the same and
     // differs from the sign of the sum
-    overflow = ~(a ^ arg) & (a ^ sum) & 0x80;
-    zn = a /* (uint8_t) */ = sum;
+    cpu.overflow = ~(cpu.a ^ arg) & (cpu.a ^ sum) & 0x80;
+    cpu.zn = cpu.a /* (uint8_t) */ = sum;
 }
 
 // Unofficial
 static void alr(uint8_t arg) {
-    a = lsr(a & arg);
+    cpu.a = lsr(cpu.a & arg);
 }
 
 // Unofficial
 static void anc(uint8_t arg) {
     and_(arg);
-    carry = zn & 0x180; // Copy negative flag to carry flag
+    cpu.carry = cpu.zn & 0x180; // Copy negative flag to carry flag
 }
 
 // 'and' is an operator in C++, so we need the underscore
 static void and_(uint8_t arg) {
-    zn = (a &= arg);
+    cpu.zn = (cpu.a &= arg);
 }
 
 // Unofficial
 static void arr(uint8_t arg) {
-    zn = a = (carry << 7) | ((a & arg) >> 1);
-    carry = a & 0x40;
-    overflow = (a ^ (a << 1)) & 0x40;
+    cpu.zn = cpu.a = (cpu.carry << 7) | ((cpu.a & arg) >> 1);
+    cpu.carry = cpu.a & 0x40;
+    cpu.overflow = (cpu.a ^ (cpu.a << 1)) & 0x40;
 }
 
 static uint8_t asl(uint8_t arg) {
-    carry = arg & 0x80;
-    return zn = (arg << 1) & 0xFF;
+    cpu.carry = arg & 0x80;
+    return cpu.zn = (arg << 1) & 0xFF;
 }
 
 // Unofficial
 static void atx(uint8_t arg) {
     // Assume '(A | 0xFF) & arg' is calculated, which is the same as just 'arg':
     // http://forums.nesdev.com/viewtopic.php?t=3831
-    zn = x = a = arg;
+    cpu.zn = cpu.x = cpu.a = arg;
 }
 
 // Unofficial
 static void axs(uint8_t arg) {
-    carry = (a & x) >= arg;
-    zn = x /* (uint8_t) */ = (a & x) - arg;
+    cpu.carry = (cpu.a & cpu.x) >= arg;
+    cpu.zn = cpu.x /* (uint8_t) */ = (cpu.a & cpu.x) - arg;
 }
 
 static void bit(uint8_t arg) {
-    overflow = arg & 0x40;
+    cpu.overflow = arg & 0x40;
     // Set the zero and negative flags separately by using bit 8 of zn for the
     // negative flag
-    zn = ((arg << 1) & 0x100) | (a & arg);
+    cpu.zn = ((arg << 1) & 0x100) | (cpu.a & arg);
 }
 
 // CMP, CPX, CPY
 static void comp(uint8_t reg, uint8_t arg) {
-    carry = reg >= arg;
-    zn = uint8_t(reg - arg);
+    cpu.carry = reg >= arg;
+    cpu.zn = uint8_t(reg - arg);
 }
 
 // Unofficial
 static uint8_t dcp(uint8_t arg) {
-    comp(a, --arg);
+    comp(cpu.a, --arg);
     return arg;
 }
 
 static uint8_t dec(uint8_t arg) {
     // Works without & 0xFF here since bit 8 (the additional negative flag bit)
     // will only get set if arg is 0, in which case bit 7 gets set as well
-    return zn = arg - 1;
+    return cpu.zn = arg - 1;
 }
 
 static void eor(uint8_t arg) {
-    zn = (a ^= arg);
+    cpu.zn = (cpu.a ^= arg);
 }
 
 static uint8_t inc(uint8_t arg) {
-    return zn = (arg + 1) & 0xFF;
+    return cpu.zn = (arg + 1) & 0xFF;
 }
 
 // Unofficial
 static void las(uint8_t arg) {
-    zn = a = x = s = arg & s;
+    cpu.zn = cpu.a = cpu.x = cpu.s = arg & cpu.s;
 }
 
 // Unofficial
 static void lax(uint8_t arg) {
-    zn = a = x = arg;
+    cpu.zn = cpu.a = cpu.x = arg;
 }
 
-static void lda(uint8_t arg) { zn = a = arg; }
-static void ldx(uint8_t arg) { zn = x = arg; }
-static void ldy(uint8_t arg) { zn = y = arg; }
+static void lda(uint8_t arg) { cpu.zn = cpu.a = arg; }
+static void ldx(uint8_t arg) { cpu.zn = cpu.x = arg; }
+static void ldy(uint8_t arg) { cpu.zn = cpu.y = arg; }
 
 static uint8_t lsr(uint8_t arg) {
-    carry = arg & 1;
-    return zn = arg >> 1;
+    cpu.carry = arg & 1;
+    return cpu.zn = arg >> 1;
 }
 
 static void ora(uint8_t arg) {
-    zn = (a |= arg);
+    cpu.zn = (cpu.a |= arg);
 }
 
 // Unofficial
@@ -365,28 +383,28 @@ static uint8_t isc(uint8_t arg) {
 
 // Unofficial
 static uint8_t rla(uint8_t arg) {
-    uint8_t const res = (arg << 1) | carry;
-    carry = arg & 0x80;
+    uint8_t const res = (arg << 1) | cpu.carry;
+    cpu.carry = arg & 0x80;
     and_(res);
     return res;
 }
 
 static uint8_t rol(uint8_t arg) {
-    zn = uint8_t((arg << 1) | carry);
-    carry = arg & 0x80;
-    return zn;
+    cpu.zn = uint8_t((arg << 1) | cpu.carry);
+    cpu.carry = arg & 0x80;
+    return cpu.zn;
 }
 
 static uint8_t ror(uint8_t arg) {
-    zn = (carry << 7) | (arg >> 1);
-    carry = arg & 1;
-    return zn;
+    cpu.zn = (cpu.carry << 7) | (arg >> 1);
+    cpu.carry = arg & 1;
+    return cpu.zn;
 }
 
 // Unofficial
 static uint8_t rra(uint8_t arg) {
-    uint8_t const res = (carry << 7) | (arg >> 1);
-    carry = arg & 1;
+    uint8_t const res = (cpu.carry << 7) | (arg >> 1);
+    cpu.carry = arg & 1;
     adc(res);
     return res;
 }
@@ -395,14 +413,14 @@ static void sbc(uint8_t arg) { adc(~arg); /* -arg - 1 */ }
 
 // Unofficial
 static uint8_t slo(uint8_t arg) {
-    carry = arg & 0x80;
+    cpu.carry = arg & 0x80;
     ora(arg <<= 1);
     return arg;
 }
 
 // Unofficial
 static uint8_t sre(uint8_t arg) {
-    carry = arg & 1;
+    cpu.carry = arg & 1;
     eor(arg >>= 1);
     return arg;
 }
@@ -411,7 +429,7 @@ static uint8_t sre(uint8_t arg) {
 static void xaa(uint8_t arg) {
     // http://visual6502.org/wiki/index.php?title=6502_Opcode_8B_%28XAA,_ANE%29
     // Nestopia uses 0xEE as the magic constant.
-    zn = a = (a | 0xEE) & x & arg;
+    cpu.zn = cpu.a = (cpu.a | 0xEE) & cpu.x & arg;
 }
 
 // Conditional branches
@@ -419,19 +437,19 @@ static void xaa(uint8_t arg) {
 static void poll_for_interrupt();
 
 static void branch_if(bool cond) {
-    ++pc;
+    ++cpu.pc;
     if (cond) {
-        read_mem(pc); // Dummy read
+        read_mem(cpu.pc); // Dummy read
         // TODO: Unsafe unsigned->signed conversion - likely to work in
         // practice
-        uint16_t const new_pc = pc + (int8_t)op_1;
-        if ((pc ^ new_pc) & 0x100) { // Page crossing?
+        uint16_t const new_pc = cpu.pc + (int8_t)cpu.op_1;
+        if ((cpu.pc ^ new_pc) & 0x100) { // Page crossing?
             // Branch instructions perform additional interrupt polling during
             // the fixup tick
             poll_for_interrupt();
-            read_mem((pc & 0xFF00) | (new_pc & 0x00FF)); // Dummy read
+            read_mem((cpu.pc & 0xFF00) | (new_pc & 0x00FF)); // Dummy read
         }
-        pc = new_pc;
+        cpu.pc = new_pc;
     }
 }
 
@@ -440,24 +458,25 @@ static void branch_if(bool cond) {
 
 static void push(uint8_t val) {
     write_tick();
-    ram[0x100 + s--] = val;
+    ram[0x100 + cpu.s--] = val;
+    ram_stamps[1] = save_clock;
 }
 
 static uint8_t pull() {
     read_tick();
-    return ram[0x100 + ++s];
+    return ram[0x100 + ++cpu.s];
 }
 
 static void push_flags(bool with_break_bit_set) {
     push(
-      (!!(zn & 0x180)     << 7) | // Negative
-      (overflow           << 6) |
+      (!!(cpu.zn & 0x180)     << 7) | // Negative
+      (cpu.overflow           << 6) |
       (1                  << 5) |
       (with_break_bit_set << 4) |
-      (decimal            << 3) |
-      (irq_disable        << 2) |
-      (!(zn & 0xFF)       << 1) | // Zero
-      carry);
+      (cpu.decimal            << 3) |
+      (cpu.irq_disable        << 2) |
+      (!(cpu.zn & 0xFF)       << 1) | // Zero
+      cpu.carry);
 }
 
 static void pull_flags() {
@@ -470,11 +489,11 @@ static void pull_flags() {
     //               zn, so that the negative and zero flags can be set
     //               separately. The zero flag moves to bit 3, which won't
     //               affect the result.
-    zn          = ((flags & 0x82) ^ 2) << 1;
-    overflow    = flags & 0x40;
-    decimal     = flags & 0x08;
-    irq_disable = flags & 0x04;
-    carry       = flags & 0x01;
+    cpu.zn          = ((flags & 0x82) ^ 2) << 1;
+    cpu.overflow    = flags & 0x40;
+    cpu.decimal     = flags & 0x08;
+    cpu.irq_disable = flags & 0x04;
+    cpu.carry       = flags & 0x01;
 }
 
 
@@ -494,24 +513,26 @@ static void pull_flags() {
 
 #define ZERO_RMW(fn)                                   \
     do {                                               \
-        ++pc;                                          \
+        ++cpu.pc;                                      \
         read_tick(); /* Read effective address */      \
         read_tick(); /* Write back unmodified value */ \
         poll_for_interrupt();                          \
         write_tick();                                  \
-        ram[op_1] = fn(ram[op_1]);                     \
+        ram[cpu.op_1] = fn(ram[cpu.op_1]);             \
+        ram_stamps[0] = save_clock;                    \
     } while(0)
 
 #define ZERO_X_RMW(fn)                                  \
     do {                                                \
-        ++pc;                                           \
-        uint8_t const addr = op_1 + x;                  \
+        ++cpu.pc;                                       \
+        uint8_t const addr = cpu.op_1 + cpu.x;          \
         read_tick(); /* Read address and add x to it */ \
         read_tick(); /* Read effective address */       \
         read_tick(); /* Write back unmodified value */  \
         poll_for_interrupt();                           \
         write_tick();                                   \
         ram[addr] = fn(ram[addr]);                      \
+        ram_stamps[0] = save_clock;                     \
     } while(0)
 
 //
@@ -524,43 +545,45 @@ static void pull_flags() {
 // Zero page addressing
 
 static uint8_t get_zero_op() {
-    ++pc;
+    ++cpu.pc;
     poll_for_interrupt();
     read_tick();
-    return ram[op_1];
+    return ram[cpu.op_1];
 }
 
 static uint8_t get_zero_xy_op(uint8_t index) {
-    ++pc;
+    ++cpu.pc;
     read_tick(); // Read from address, add index
     poll_for_interrupt();
     read_tick();
-    return ram[(op_1 + index) & 0xFF];
+    return ram[(cpu.op_1 + index) & 0xFF];
 }
 
 // Writing zero page never has side effects, so we can optimize a bit
 
 static void zero_write(uint8_t val) {
-    ++pc;
+    ++cpu.pc;
     poll_for_interrupt();
     write_tick();
-    ram[op_1] = val;
+    ram[cpu.op_1] = val;
+    ram_stamps[0] = save_clock;
 }
 
 static void zero_xy_write(uint8_t val, uint8_t index) {
-    ++pc;
+    ++cpu.pc;
     read_tick(); // Read from address and add x to it
     poll_for_interrupt();
     write_tick();
-    ram[(op_1 + index) & 0xFF] = val;
+    ram[(cpu.op_1 + index) & 0xFF] = val;
+    ram_stamps[0] = save_clock;
 }
 
 
 // Absolute addressing
 
 static uint16_t get_abs_addr() {
-    ++pc;
-    return (read_mem(pc++) << 8) | op_1;
+    ++cpu.pc;
+    return (read_mem(cpu.pc++) << 8) | cpu.op_1;
 }
 
 static uint8_t get_abs_op() {
@@ -600,18 +623,18 @@ static uint8_t get_abs_xy_op_read(uint8_t index) {
 static void abs_xy_write_a(uint8_t index) {
     uint16_t const addr = get_abs_xy_addr_write(index);
     poll_for_interrupt();
-    write_mem(a, addr);
+    write_mem(cpu.a, addr);
 }
 
 
 // (Indirect,X) addressing
 
 static uint16_t get_ind_x_addr() {
-    ++pc;
+    ++cpu.pc;
     read_tick(); // Read from address, add index
     read_tick(); // Fetch effective address low
     read_tick(); // Fetch effective address high
-    uint8_t const zero_addr = op_1 + x;
+    uint8_t const zero_addr = cpu.op_1 + cpu.x;
     return (ram[(zero_addr + 1) & 0xFF] << 8) | ram[zero_addr];
 }
 
@@ -632,23 +655,23 @@ static void ind_x_write(uint8_t val) {
 
 // (Indirect),Y helper for fetching the address from zero page
 static uint16_t get_addr_from_zero_page() {
-    ++pc;
+    ++cpu.pc;
     read_tick(); // Fetch effective address low
     read_tick(); // Fetch effective address high
-    return (ram[(op_1 + 1) & 0xFF] << 8) | ram[op_1];
+    return (ram[(cpu.op_1 + 1) & 0xFF] << 8) | ram[cpu.op_1];
 }
 
 // (Indirect),Y address fetching for write and read-modify-write instructions
 static uint16_t get_ind_y_addr_write() {
     uint16_t const addr = get_addr_from_zero_page();
-    read_mem((addr & 0xFF00) | ((addr + y) & 0x00FF)); // Dummy read
-    return addr + y;
+    read_mem((addr & 0xFF00) | ((addr + cpu.y) & 0x00FF)); // Dummy read
+    return addr + cpu.y;
 }
 
 // (Indirect),Y operand fetching for read instructions
 static uint8_t get_ind_y_op_read() {
     uint16_t const addr = get_addr_from_zero_page();
-    uint16_t const new_addr = addr + y;
+    uint16_t const new_addr = addr + cpu.y;
     if ((addr ^ new_addr) & 0x100) // Page crossing?
         read_mem(new_addr - 0x100); // Dummy read
     poll_for_interrupt();
@@ -659,7 +682,7 @@ static uint8_t get_ind_y_op_read() {
 static void ind_y_write_a() {
     uint16_t const addr = get_ind_y_addr_write();
     poll_for_interrupt();
-    write_mem(a, addr);
+    write_mem(cpu.a, addr);
 }
 
 // Helper function for implementing the weird unofficial write instructions
@@ -680,35 +703,26 @@ static void unoff_addr_write(uint16_t addr, uint8_t val, uint8_t index) {
 // Interrupts
 //
 
-// IRQ from mapper hardware on the cart
-static bool cart_irq;
-
-// The OR of all IRQ sources. Updated in update_irq_status().
-static bool irq_line;
-
-// Set true when a falling edge occurs on the NMI input
-static bool nmi_asserted;
-
 static void update_irq_status() {
-    irq_line = cart_irq || dmc_irq || frame_irq;
+    cpu.irq_line = cpu.cart_irq || cpu.dmc_irq || cpu.frame_irq;
 }
 
 void set_nmi(bool s) {
-    nmi_asserted = s;
+    cpu.nmi_asserted = s;
 }
 
 void set_cart_irq(bool s) {
-    cart_irq = s;
+    cpu.cart_irq = s;
     update_irq_status();
 }
 
 void set_dmc_irq(bool s) {
-    dmc_irq = s;
+    cpu.dmc_irq = s;
     update_irq_status();
 }
 
 void set_frame_irq(bool s) {
-    frame_irq = s;
+    cpu.frame_irq = s;
     update_irq_status();
 }
 
@@ -725,8 +739,8 @@ static void do_interrupt(Interrupt_type type) {
     // Two dummy reads
     if (type != Int_BRK) {
         // For BRK, these have already been done
-        read_mem(pc);
-        read_mem(pc);
+        read_mem(cpu.pc);
+        read_mem(cpu.pc);
     }
 
     if (type == Int_reset) {
@@ -734,28 +748,29 @@ static void do_interrupt(Interrupt_type type) {
         read_tick();
         read_tick();
         read_tick();
-        s -= 3;
+        cpu.s -= 3;
         vec_addr = 0xFFFC;
     }
     else {
-        push(pc >> 8);
-        push(pc & 0xFF);
+        push(cpu.pc >> 8);
+        push(cpu.pc & 0xFF);
 
         // Interrupt glitch. An NMI asserted here can override BRK and IRQ.
-        if (nmi_asserted) {
-            nmi_asserted = false;
-            vec_addr     = 0xFFFA;
+        sync_ppu_if_event_due();
+        if (cpu.nmi_asserted) {
+            cpu.nmi_asserted = false;
+            vec_addr         = 0xFFFA;
         }
         else
             vec_addr = vector_addr[(unsigned)type];
 
         push_flags(type == Int_BRK);
     }
-    irq_disable = true;
+    cpu.irq_disable = true;
     // No interrupt polling happens here; the first instruction of the
     // interrupt handler always executes before another interrupt is serviced
-    pc  = read_mem(vec_addr);
-    pc |= read_mem(vec_addr + 1) << 8;
+    cpu.pc  = read_mem(vec_addr);
+    cpu.pc |= read_mem(vec_addr + 1) << 8;
 }
 
 // The interrupt lines are polled at the end of the second-to-last tick for
@@ -767,17 +782,20 @@ static void do_interrupt(Interrupt_type type) {
 //
 // See http://wiki.nesdev.com/w/index.php/CPU_interrupts as well.
 static void poll_for_interrupt() {
+    // NMI and mapper IRQs come from the PPU
+    sync_ppu_if_event_due();
+
     // If both NMI and IRQ have been asserted, the IRQ assertion is lost at
     // this polling point (as if IRQ had never been asserted). IRQ might still
     // be detected at the next polling point.
     //
     // This behavior has been confirmed in Visual 6502.
-    if (nmi_asserted) {
-        nmi_asserted = false;
-        pending_event = pending_nmi = true;
+    if (cpu.nmi_asserted) {
+        cpu.nmi_asserted = false;
+        pending_event = cpu.pending_nmi = true;
     }
-    else if (irq_line && !irq_disable)
-        pending_event = pending_irq = true;
+    else if (cpu.irq_line && !cpu.irq_disable)
+        pending_event = cpu.pending_irq = true;
 }
 
 // Defined in tables.c. Indexed by opcode.
@@ -793,32 +811,47 @@ static void log_instruction();
 static void set_cpu_cold_boot_state();
 static void reset_cpu();
 
+// End-of-frame operations: output, input, and rewinding (through
+// handle_ui_keys())
+static void end_frame() {
+    BENCH_REGION(BENCH_OTHER)
+// Run tests and headless builds as fast as we can
+#if !defined(RUN_TESTS) && !defined(HEADLESS)
+    // When syncing to audio, end_audio_frame() does the waiting
+    if (!sync_to_audio)
+        sleep_till_end_of_frame();
+#endif
+    draw_frame();
+    end_audio_frame();
+    begin_audio_frame();
+    calc_controller_state();
+    handle_ui_keys();
+#ifdef PROFILE
+    profile_end_frame();
+#endif
+
+    frame_offset = 0;
+    BENCH_REGION(BENCH_CPU)
+}
+
 // See pending_event
 static void process_pending_events() {
-    if (pending_nmi) {
-        pending_nmi = false;
+    if (cpu.pending_nmi) {
+        cpu.pending_nmi = false;
         do_interrupt(Int_NMI);
     }
 
-    if (pending_irq) {
-        pending_irq = false;
+    if (cpu.pending_irq) {
+        cpu.pending_irq = false;
         do_interrupt(Int_IRQ);
     }
 
     if (pending_frame_completion) {
         pending_frame_completion = false;
 
-// Run tests as fast as we can
-#ifndef RUN_TESTS
-        sleep_till_end_of_frame();
-#endif
-        draw_frame();
-        end_audio_frame();
-        begin_audio_frame();
-        calc_controller_state();
-        handle_ui_keys();
-
-        frame_offset = 0;
+        // Frames re-simulated by replay_frame() are only run
+        if (!replaying_frame)
+            end_frame();
     }
 
     if (pending_reset) {
@@ -832,7 +865,7 @@ static void process_pending_events() {
     }
 }
 
-void run() {
+void power_on() {
     set_apu_cold_boot_state();
     set_cpu_cold_boot_state();
     set_ppu_cold_boot_state();
@@ -840,203 +873,350 @@ void run() {
     init_timing();
 
     do_interrupt(Int_reset);
+}
+
+#ifdef PROFILE
+// Time stamp at the start of the current instruction
+static PER_CONSOLE uint64_t op_start;
+#endif
+
+// Runs before each instruction
+static void begin_instruction() {
+#ifdef INCLUDE_DEBUGGER
+    log_instruction();
+#endif
+#ifdef INCLUDE_BENCH
+    ++bench_n_instructions;
+#endif
+#ifdef PROFILE
+    op_start = prof_now();
+#endif
+}
+
+// Runs after each instruction
+static void end_instruction(uint8_t opcode) {
+#ifdef PROFILE
+    prof_opcode(opcode, op_start);
+#else
+    (void)opcode; // Suppress warning
+#endif
+}
+
+// The instruction handlers in run_loop() are written with these macros so
+// that the same code works with two dispatch methods:
+//
+//  - A switch on the opcode. This is the default and the reference
+//    implementation. Interrupt polling after the first cycle and the fetch of
+//    the byte after the opcode (op_1) are done before the switch.
+//
+//  - Threaded code (THREADED_DISPATCH=1 in the Makefile), which uses GCC's
+//    computed goto ("labels as values") extension. Each handler does its own
+//    interrupt polling and op_1 fetch, and ends by fetching the next opcode
+//    and jumping straight to its handler through a table. Giving each handler
+//    its own indirect jump lets the branch predictor pick up on common
+//    instruction sequences, instead of all instructions sharing the jump of
+//    the switch. See
+//    http://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables/
+//    and https://www.cs.tcd.ie/David.Gregg/papers/toplas05.pdf.
+//
+// OP(name) starts the handler for an opcode, OP_ALIAS(name) adds an opcode
+// that shares the handler (it must have the same polls_irq_after_first_cycle
+// value), and OP_END ends the handler.
+#ifdef THREADED_DISPATCH
+#  define OP(name)                                 \
+     op_##name:                                   \
+         if (polls_irq_after_first_cycle[name])   \
+             poll_for_interrupt();                \
+         cpu.op_1 = read_mem(cpu.pc);
+#  define OP_ALIAS(name)
+#  define OP_END                                   \
+     end_instruction(opcode);                     \
+     sync_ppu_if_event_due();                     \
+     if (pending_event)                           \
+         continue;                                \
+     begin_instruction();                         \
+     opcode = read_mem(cpu.pc++);                 \
+     goto *handlers[opcode];
+#else
+#  define OP(name)       case name:
+#  define OP_ALIAS(name) case name:
+#  define OP_END         break;
+#endif
+
+// The emulation loop. Returns when end_emulation() is signaled, or, if
+// 'single_frame' is true, right after the end-of-frame operations for the
+// current frame have run.
+static void run_loop(bool single_frame) {
+#ifdef THREADED_DISPATCH
+    // Handler for each opcode. Opcodes added with OP_ALIAS() use the handler
+    // they share.
+    static void *const handlers[256] = {
+      &&op_BRK,        &&op_ORA_IND_X,  &&op_KI0,        &&op_SLO_IND_X,  // $00-$03
+      &&op_NO0_ZERO,   &&op_ORA_ZERO,   &&op_ASL_ZERO,   &&op_SLO_ZERO,   // $04-$07
+      &&op_PHP,        &&op_ORA_IMM,    &&op_ASL_ACC,    &&op_AN0_IMM,    // $08-$0B
+      &&op_NOP_ABS,    &&op_ORA_ABS,    &&op_ASL_ABS,    &&op_SLO_ABS,    // $0C-$0F
+      &&op_BPL,        &&op_ORA_IND_Y,  &&op_KI0,        &&op_SLO_IND_Y,  // $10-$13
+      &&op_NO0_ZERO_X, &&op_ORA_ZERO_X, &&op_ASL_ZERO_X, &&op_SLO_ZERO_X, // $14-$17
+      &&op_CLC,        &&op_ORA_ABS_Y,  &&op_NOP,        &&op_SLO_ABS_Y,  // $18-$1B
+      &&op_NO0_ABS_X,  &&op_ORA_ABS_X,  &&op_ASL_ABS_X,  &&op_SLO_ABS_X,  // $1C-$1F
+      &&op_JSR_ABS,    &&op_AND_IND_X,  &&op_KI0,        &&op_RLA_IND_X,  // $20-$23
+      &&op_BIT_ZERO,   &&op_AND_ZERO,   &&op_ROL_ZERO,   &&op_RLA_ZERO,   // $24-$27
+      &&op_PLP,        &&op_AND_IMM,    &&op_ROL_ACC,    &&op_AN1_IMM,    // $28-$2B
+      &&op_BIT_ABS,    &&op_AND_ABS,    &&op_ROL_ABS,    &&op_RLA_ABS,    // $2C-$2F
+      &&op_BMI,        &&op_AND_IND_Y,  &&op_KI0,        &&op_RLA_IND_Y,  // $30-$33
+      &&op_NO0_ZERO_X, &&op_AND_ZERO_X, &&op_ROL_ZERO_X, &&op_RLA_ZERO_X, // $34-$37
+      &&op_SEC,        &&op_AND_ABS_Y,  &&op_NOP,        &&op_RLA_ABS_Y,  // $38-$3B
+      &&op_NO0_ABS_X,  &&op_AND_ABS_X,  &&op_ROL_ABS_X,  &&op_RLA_ABS_X,  // $3C-$3F
+      &&op_RTI,        &&op_EOR_IND_X,  &&op_KI0,        &&op_SRE_IND_X,  // $40-$43
+      &&op_NO0_ZERO,   &&op_EOR_ZERO,   &&op_LSR_ZERO,   &&op_SRE_ZERO,   // $44-$47
+      &&op_PHA,        &&op_EOR_IMM,    &&op_LSR_ACC,    &&op_ALR_IMM,    // $48-$4B
+      &&op_JMP_ABS,    &&op_EOR_ABS,    &&op_LSR_ABS,    &&op_SRE_ABS,    // $4C-$4F
+      &&op_BVC,        &&op_EOR_IND_Y,  &&op_KI0,        &&op_SRE_IND_Y,  // $50-$53
+      &&op_NO0_ZERO_X, &&op_EOR_ZERO_X, &&op_LSR_ZERO_X, &&op_SRE_ZERO_X, // $54-$57
+      &&op_CLI,        &&op_EOR_ABS_Y,  &&op_NOP,        &&op_SRE_ABS_Y,  // $58-$5B
+      &&op_NO0_ABS_X,  &&op_EOR_ABS_X,  &&op_LSR_ABS_X,  &&op_SRE_ABS_X,  // $5C-$5F
+      &&op_RTS,        &&op_ADC_IND_X,  &&op_KI0,        &&op_RRA_IND_X,  // $60-$63
+      &&op_NO0_ZERO,   &&op_ADC_ZERO,   &&op_ROR_ZERO,   &&op_RRA_ZERO,   // $64-$67
+      &&op_PLA,        &&op_ADC_IMM,    &&op_ROR_ACC,    &&op_ARR_IMM,    // $68-$6B
+      &&op_JMP_IND,    &&op_ADC_ABS,    &&op_ROR_ABS,    &&op_RRA_ABS,    // $6C-$6F
+      &&op_BVS,        &&op_ADC_IND_Y,  &&op_KI0,        &&op_RRA_IND_Y,  // $70-$73
+      &&op_NO0_ZERO_X, &&op_ADC_ZERO_X, &&op_ROR_ZERO_X, &&op_RRA_ZERO_X, // $74-$77
+      &&op_SEI,        &&op_ADC_ABS_Y,  &&op_NOP,        &&op_RRA_ABS_Y,  // $78-$7B
+      &&op_NO0_ABS_X,  &&op_ADC_ABS_X,  &&op_ROR_ABS_X,  &&op_RRA_ABS_X,  // $7C-$7F
+      &&op_NO0_IMM,    &&op_STA_IND_X,  &&op_NO0_IMM,    &&op_SAX_IND_X,  // $80-$83
+      &&op_STY_ZERO,   &&op_STA_ZERO,   &&op_STX_ZERO,   &&op_SAX_ZERO,   // $84-$87
+      &&op_DEY,        &&op_NO0_IMM,    &&op_TXA,        &&op_XAA_IMM,    // $88-$8B
+      &&op_STY_ABS,    &&op_STA_ABS,    &&op_STX_ABS,    &&op_SAX_ABS,    // $8C-$8F
+      &&op_BCC,        &&op_STA_IND_Y,  &&op_KI0,        &&op_AXA_IND_Y,  // $90-$93
+      &&op_STY_ZERO_X, &&op_STA_ZERO_X, &&op_STX_ZERO_Y, &&op_SAX_ZERO_Y, // $94-$97
+      &&op_TYA,        &&op_STA_ABS_Y,  &&op_TXS,        &&op_TAS_ABS_Y,  // $98-$9B
+      &&op_SAY_ABS_X,  &&op_STA_ABS_X,  &&op_XAS_ABS_Y,  &&op_AXA_ABS_Y,  // $9C-$9F
+      &&op_LDY_IMM,    &&op_LDA_IND_X,  &&op_LDX_IMM,    &&op_LAX_IND_X,  // $A0-$A3
+      &&op_LDY_ZERO,   &&op_LDA_ZERO,   &&op_LDX_ZERO,   &&op_LAX_ZERO,   // $A4-$A7
+      &&op_TAY,        &&op_LDA_IMM,    &&op_TAX,        &&op_ATX_IMM,    // $A8-$AB
+      &&op_LDY_ABS,    &&op_LDA_ABS,    &&op_LDX_ABS,    &&op_LAX_ABS,    // $AC-$AF
+      &&op_BCS,        &&op_LDA_IND_Y,  &&op_KI0,        &&op_LAX_IND_Y,  // $B0-$B3
+      &&op_LDY_ZERO_X, &&op_LDA_ZERO_X, &&op_LDX_ZERO_Y, &&op_LAX_ZERO_Y, // $B4-$B7
+      &&op_CLV,        &&op_LDA_ABS_Y,  &&op_TSX,        &&op_LAS_ABS_Y,  // $B8-$BB
+      &&op_LDY_ABS_X,  &&op_LDA_ABS_X,  &&op_LDX_ABS_Y,  &&op_LAX_ABS_Y,  // $BC-$BF
+      &&op_CPY_IMM,    &&op_CMP_IND_X,  &&op_NO0_IMM,    &&op_DCP_IND_X,  // $C0-$C3
+      &&op_CPY_ZERO,   &&op_CMP_ZERO,   &&op_DEC_ZERO,   &&op_DCP_ZERO,   // $C4-$C7
+      &&op_INY,        &&op_CMP_IMM,    &&op_DEX,        &&op_AXS_IMM,    // $C8-$CB
+      &&op_CPY_ABS,    &&op_CMP_ABS,    &&op_DEC_ABS,    &&op_DCP_ABS,    // $CC-$CF
+      &&op_BNE,        &&op_CMP_IND_Y,  &&op_KI0,        &&op_DCP_IND_Y,  // $D0-$D3
+      &&op_NO0_ZERO_X, &&op_CMP_ZERO_X, &&op_DEC_ZERO_X, &&op_DCP_ZERO_X, // $D4-$D7
+      &&op_CLD,        &&op_CMP_ABS_Y,  &&op_NOP,        &&op_DCP_ABS_Y,  // $D8-$DB
+      &&op_NO0_ABS_X,  &&op_CMP_ABS_X,  &&op_DEC_ABS_X,  &&op_DCP_ABS_X,  // $DC-$DF
+      &&op_CPX_IMM,    &&op_SBC_IND_X,  &&op_NO0_IMM,    &&op_ISC_IND_X,  // $E0-$E3
+      &&op_CPX_ZERO,   &&op_SBC_ZERO,   &&op_INC_ZERO,   &&op_ISC_ZERO,   // $E4-$E7
+      &&op_INX,        &&op_SBC_IMM,    &&op_NOP,        &&op_SBC_IMM,    // $E8-$EB
+      &&op_CPX_ABS,    &&op_SBC_ABS,    &&op_INC_ABS,    &&op_ISC_ABS,    // $EC-$EF
+      &&op_BEQ,        &&op_SBC_IND_Y,  &&op_KI0,        &&op_ISC_IND_Y,  // $F0-$F3
+      &&op_NO0_ZERO_X, &&op_SBC_ZERO_X, &&op_INC_ZERO_X, &&op_ISC_ZERO_X, // $F4-$F7
+      &&op_SED,        &&op_SBC_ABS_Y,  &&op_NOP,        &&op_ISC_ABS_Y,  // $F8-$FB
+      &&op_NO0_ABS_X,  &&op_SBC_ABS_X,  &&op_INC_ABS_X,  &&op_ISC_ABS_X   // $FC-$FF
+    };
+#endif
+
+    uint8_t opcode;
 
     for (;;) {
+        // The end of the frame is signaled from the PPU
+        sync_ppu_if_event_due();
 
         if (pending_event) {
             pending_event = false;
+            bool const frame_ended = pending_frame_completion;
             process_pending_events();
 
-            if (pending_end_emulation)
+            if (pending_end_emulation || (single_frame && frame_ended))
                 break;
         }
 
-#ifdef INCLUDE_DEBUGGER
-        log_instruction();
-#endif
+        begin_instruction();
+        opcode = read_mem(cpu.pc++);
 
-        uint8_t const opcode = read_mem(pc++);
+#ifdef THREADED_DISPATCH
+        goto *handlers[opcode];
+#else
         if (polls_irq_after_first_cycle[opcode])
             poll_for_interrupt();
-        op_1 = read_mem(pc);
-
-        // http://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables/
-        // could possibly speed this up a bit (also,
-        // https://www.cs.tcd.ie/David.Gregg/papers/toplas05.pdf). CPU
-        // emulation seems to account for less than 5% of the runtime though,
-        // so it might not be worth uglifying the code for.
+        cpu.op_1 = read_mem(cpu.pc);
 
         switch (opcode) {
+#endif
 
         //
         // Accumulator or implied addressing
         //
 
-        case BRK:
-            ++pc;
+        OP(BRK)
+            ++cpu.pc;
             do_interrupt(Int_BRK);
-            break;
+            OP_END
 
-        case RTI:
+        OP(RTI)
             read_tick(); // Corresponds to incrementing s
             pull_flags();
-            pc = pull();
+            cpu.pc = pull();
             poll_for_interrupt();
-            pc |= pull() << 8;
-            break;
+            cpu.pc |= pull() << 8;
+            OP_END
 
-        case RTS:
+        OP(RTS)
             {
             read_tick(); // Corresponds to incrementing s
             uint8_t const pc_low = pull();
-            pc = ((pull() << 8) | pc_low) + 1;
+            cpu.pc = ((pull() << 8) | pc_low) + 1;
             poll_for_interrupt();
             read_tick(); // Increment PC
             }
-            break;
+            OP_END
 
-        case PHA:
+        OP(PHA)
             poll_for_interrupt();
-            push(a);
-            break;
+            push(cpu.a);
+            OP_END
 
-        case PHP:
+        OP(PHP)
             poll_for_interrupt();
             push_flags(true);
-            break;
+            OP_END
 
-        case PLA:
+        OP(PLA)
             read_tick(); // Corresponds to incrementing s
             poll_for_interrupt();
-            zn = a = pull();
-            break;
+            cpu.zn = cpu.a = pull();
+            OP_END
 
-        case PLP:
+        OP(PLP)
             read_tick(); // Corresponds to incrementing s
             poll_for_interrupt();
             pull_flags();
-            break;
-
-        case ASL_ACC: a = asl(a); break;
-        case LSR_ACC: a = lsr(a); break;
-        case ROL_ACC: a = rol(a); break;
-        case ROR_ACC: a = ror(a); break;
-
-        case CLC: carry       = false; break;
-        case CLD: decimal     = false; break;
-        case CLI: irq_disable = false; break;
-        case CLV: overflow    = false; break;
-        case SEC: carry       = true;  break;
-        case SED: decimal     = true;  break;
-        case SEI: irq_disable = true;  break;
-
-        case DEX: zn = --x; break;
-        case DEY: zn = --y; break;
-        case INX: zn = ++x; break;
-        case INY: zn = ++y; break;
-
-        case TAX: zn = x = a; break;
-        case TAY: zn = y = a; break;
-        case TSX: zn = x = s; break;
-        case TXA: zn = a = x; break;
-        case TXS:      s = x; break;
-        case TYA: zn = a = y; break;
+            OP_END
+
+        OP(ASL_ACC) cpu.a = asl(cpu.a); OP_END
+        OP(LSR_ACC) cpu.a = lsr(cpu.a); OP_END
+        OP(ROL_ACC) cpu.a = rol(cpu.a); OP_END
+        OP(ROR_ACC) cpu.a = ror(cpu.a); OP_END
+
+        OP(CLC) cpu.carry       = false; OP_END
+        OP(CLD) cpu.decimal     = false; OP_END
+        OP(CLI) cpu.irq_disable = false; OP_END
+        OP(CLV) cpu.overflow    = false; OP_END
+        OP(SEC) cpu.carry       = true;  OP_END
+        OP(SED) cpu.decimal     = true;  OP_END
+        OP(SEI) cpu.irq_disable = true;  OP_END
+
+        OP(DEX) cpu.zn = --cpu.x; OP_END
+        OP(DEY) cpu.zn = --cpu.y; OP_END
+        OP(INX) cpu.zn = ++cpu.x; OP_END
+        OP(INY) cpu.zn = ++cpu.y; OP_END
+
+        OP(TAX) cpu.zn = cpu.x = cpu.a; OP_END
+        OP(TAY) cpu.zn = cpu.y = cpu.a; OP_END
+        OP(TSX) cpu.zn = cpu.x = cpu.s; OP_END
+        OP(TXA) cpu.zn = cpu.a = cpu.x; OP_END
+        OP(TXS)      cpu.s = cpu.x; OP_END
+        OP(TYA) cpu.zn = cpu.a = cpu.y; OP_END
 
         // The "official" NOP and various unofficial NOPs with
         // accumulator/implied addressing
-        case NOP: case NO0: case NO1: case NO2: case NO3: case NO4: case NO5:
-            break;
+        OP(NOP) OP_ALIAS(NO0) OP_ALIAS(NO1) OP_ALIAS(NO2) OP_ALIAS(NO3)
+        OP_ALIAS(NO4) OP_ALIAS(NO5)
+            OP_END
 
         //
         // Immediate addressing
         //
 
-        case ADC_IMM: adc(op_1);     ++pc; break;
-        case ALR_IMM: alr(op_1);     ++pc; break; // Unofficial
-        case AN0_IMM: anc(op_1);     ++pc; break; // Unofficial
-        case AN1_IMM: anc(op_1);     ++pc; break; // Unofficial
-        case AND_IMM: and_(op_1);    ++pc; break;
-        case ARR_IMM: arr(op_1);     ++pc; break; // Unofficial
-        case ATX_IMM: atx(op_1);     ++pc; break; // Unofficial
-        case AXS_IMM: axs(op_1);     ++pc; break; // Unofficial
-        case CMP_IMM: comp(a, op_1); ++pc; break;
-        case CPX_IMM: comp(x, op_1); ++pc; break;
-        case CPY_IMM: comp(y, op_1); ++pc; break;
-        case EOR_IMM: eor(op_1);     ++pc; break;
-        case LDA_IMM: lda(op_1);     ++pc; break;
-        case LDX_IMM: ldx(op_1);     ++pc; break;
-        case LDY_IMM: ldy(op_1);     ++pc; break;
-        case ORA_IMM: ora(op_1);     ++pc; break;
-        case SB2_IMM: // Unofficial, same as SBC
-        case SBC_IMM: sbc(op_1);     ++pc; break;
-        case XAA_IMM: xaa(op_1);     ++pc; break; // Unofficial
+        OP(ADC_IMM) adc(cpu.op_1);     ++cpu.pc; OP_END
+        OP(ALR_IMM) alr(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(AN0_IMM) anc(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(AN1_IMM) anc(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(AND_IMM) and_(cpu.op_1);    ++cpu.pc; OP_END
+        OP(ARR_IMM) arr(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(ATX_IMM) atx(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(AXS_IMM) axs(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
+        OP(CMP_IMM) comp(cpu.a, cpu.op_1); ++cpu.pc; OP_END
+        OP(CPX_IMM) comp(cpu.x, cpu.op_1); ++cpu.pc; OP_END
+        OP(CPY_IMM) comp(cpu.y, cpu.op_1); ++cpu.pc; OP_END
+        OP(EOR_IMM) eor(cpu.op_1);     ++cpu.pc; OP_END
+        OP(LDA_IMM) lda(cpu.op_1);     ++cpu.pc; OP_END
+        OP(LDX_IMM) ldx(cpu.op_1);     ++cpu.pc; OP_END
+        OP(LDY_IMM) ldy(cpu.op_1);     ++cpu.pc; OP_END
+        OP(ORA_IMM) ora(cpu.op_1);     ++cpu.pc; OP_END
+        OP_ALIAS(SB2_IMM) // Unofficial, same as SBC
+        OP(SBC_IMM) sbc(cpu.op_1);     ++cpu.pc; OP_END
+        OP(XAA_IMM) xaa(cpu.op_1);     ++cpu.pc; OP_END // Unofficial
 
         // Unofficial NOPs with immediate addressing
-        case NO0_IMM: case NO1_IMM: case NO2_IMM: case NO3_IMM: case NO4_IMM:
-            ++pc;
-            break;
+        OP(NO0_IMM) OP_ALIAS(NO1_IMM) OP_ALIAS(NO2_IMM) OP_ALIAS(NO3_IMM)
+        OP_ALIAS(NO4_IMM)
+            ++cpu.pc;
+            OP_END
 
         //
         // Absolute addressing
         //
 
-        case JMP_ABS:
+        OP(JMP_ABS)
             poll_for_interrupt();
-            pc = (read_mem(pc + 1) << 8) | op_1;
-            break;
+            cpu.pc = (read_mem(cpu.pc + 1) << 8) | cpu.op_1;
+            OP_END
 
-        case JSR_ABS:
-            ++pc;
+        OP(JSR_ABS)
+            ++cpu.pc;
 
             read_tick(); // Internal operation
 
-            push(pc >> 8);
-            push(pc & 0xFF);
+            push(cpu.pc >> 8);
+            push(cpu.pc & 0xFF);
 
             poll_for_interrupt();
-            pc = (read_mem(pc) << 8) | op_1;
-            break;
+            cpu.pc = (read_mem(cpu.pc) << 8) | cpu.op_1;
+            OP_END
 
         // Read instructions
 
-        case ADC_ABS: adc(get_abs_op());     break;
-        case AND_ABS: and_(get_abs_op());    break;
-        case BIT_ABS: bit(get_abs_op());     break;
-        case CMP_ABS: comp(a, get_abs_op()); break;
-        case CPX_ABS: comp(x, get_abs_op()); break;
-        case CPY_ABS: comp(y, get_abs_op()); break;
-        case EOR_ABS: eor(get_abs_op());     break;
-        case LAX_ABS: lax(get_abs_op());     break; // Unofficial
-        case LDA_ABS: lda(get_abs_op());     break;
-        case LDX_ABS: ldx(get_abs_op());     break;
-        case LDY_ABS: ldy(get_abs_op());     break;
-        case ORA_ABS: ora(get_abs_op());     break;
-        case SBC_ABS: sbc(get_abs_op());     break;
+        OP(ADC_ABS) adc(get_abs_op());     OP_END
+        OP(AND_ABS) and_(get_abs_op());    OP_END
+        OP(BIT_ABS) bit(get_abs_op());     OP_END
+        OP(CMP_ABS) comp(cpu.a, get_abs_op()); OP_END
+        OP(CPX_ABS) comp(cpu.x, get_abs_op()); OP_END
+        OP(CPY_ABS) comp(cpu.y, get_abs_op()); OP_END
+        OP(EOR_ABS) eor(get_abs_op());     OP_END
+        OP(LAX_ABS) lax(get_abs_op());     OP_END // Unofficial
+        OP(LDA_ABS) lda(get_abs_op());     OP_END
+        OP(LDX_ABS) ldx(get_abs_op());     OP_END
+        OP(LDY_ABS) ldy(get_abs_op());     OP_END
+        OP(ORA_ABS) ora(get_abs_op());     OP_END
+        OP(SBC_ABS) sbc(get_abs_op());     OP_END
 
         // Unofficial NOP with absolute addressing (acts like a read)
-        case NOP_ABS: get_abs_op(); break;
+        OP(NOP_ABS) get_abs_op(); OP_END
 
         // Read-modify-write instructions
 
-        case ASL_ABS: RMW(asl, get_abs_addr()); break;
-        case DCP_ABS: RMW(dcp, get_abs_addr()); break; // Unofficial
-        case DEC_ABS: RMW(dec, get_abs_addr()); break;
-        case INC_ABS: RMW(inc, get_abs_addr()); break;
-        case ISC_ABS: RMW(isc, get_abs_addr()); break; // Unofficial
-        case LSR_ABS: RMW(lsr, get_abs_addr()); break;
-        case RLA_ABS: RMW(rla, get_abs_addr()); break; // Unofficial
-        case RRA_ABS: RMW(rra, get_abs_addr()); break; // Unofficial
-        case ROL_ABS: RMW(rol, get_abs_addr()); break;
-        case ROR_ABS: RMW(ror, get_abs_addr()); break;
-        case SLO_ABS: RMW(slo, get_abs_addr()); break; // Unofficial
-        case SRE_ABS: RMW(sre, get_abs_addr()); break; // Unofficial
+        OP(ASL_ABS) RMW(asl, get_abs_addr()); OP_END
+        OP(DCP_ABS) RMW(dcp, get_abs_addr()); OP_END // Unofficial
+        OP(DEC_ABS) RMW(dec, get_abs_addr()); OP_END
+        OP(INC_ABS) RMW(inc, get_abs_addr()); OP_END
+        OP(ISC_ABS) RMW(isc, get_abs_addr()); OP_END // Unofficial
+        OP(LSR_ABS) RMW(lsr, get_abs_addr()); OP_END
+        OP(RLA_ABS) RMW(rla, get_abs_addr()); OP_END // Unofficial
+        OP(RRA_ABS) RMW(rra, get_abs_addr()); OP_END // Unofficial
+        OP(ROL_ABS) RMW(rol, get_abs_addr()); OP_END
+        OP(ROR_ABS) RMW(ror, get_abs_addr()); OP_END
+        OP(SLO_ABS) RMW(slo, get_abs_addr()); OP_END // Unofficial
+        OP(SRE_ABS) RMW(sre, get_abs_addr()); OP_END // Unofficial
 
         // Write instructions
 
-        case SAX_ABS: abs_write(a & x); break; // Unofficial
-        case STA_ABS: abs_write(a);     break;
-        case STX_ABS: abs_write(x);     break;
-        case STY_ABS: abs_write(y);     break;
+        OP(SAX_ABS) abs_write(cpu.a & cpu.x); OP_END // Unofficial
+        OP(STA_ABS) abs_write(cpu.a);     OP_END
+        OP(STX_ABS) abs_write(cpu.x);     OP_END
+        OP(STY_ABS) abs_write(cpu.y);     OP_END
 
         //
         // Zero page addressing
@@ -1044,46 +1224,46 @@ void run() {
 
         // Read instructions
 
-        case ADC_ZERO: adc(get_zero_op());     break;
-        case AND_ZERO: and_(get_zero_op());    break;
-        case BIT_ZERO: bit(get_zero_op());     break;
-        case CMP_ZERO: comp(a, get_zero_op()); break;
-        case CPX_ZERO: comp(x, get_zero_op()); break;
-        case CPY_ZERO: comp(y, get_zero_op()); break;
-        case EOR_ZERO: eor(get_zero_op());     break;
-        case LAX_ZERO: lax(get_zero_op());     break; // Unofficial
-        case LDA_ZERO: lda(get_zero_op());     break;
-        case LDX_ZERO: ldx(get_zero_op());     break;
-        case LDY_ZERO: ldy(get_zero_op());     break;
-        case ORA_ZERO: ora(get_zero_op());     break;
-        case SBC_ZERO: sbc(get_zero_op());     break;
+        OP(ADC_ZERO) adc(get_zero_op());     OP_END
+        OP(AND_ZERO) and_(get_zero_op());    OP_END
+        OP(BIT_ZERO) bit(get_zero_op());     OP_END
+        OP(CMP_ZERO) comp(cpu.a, get_zero_op()); OP_END
+        OP(CPX_ZERO) comp(cpu.x, get_zero_op()); OP_END
+        OP(CPY_ZERO) comp(cpu.y, get_zero_op()); OP_END
+        OP(EOR_ZERO) eor(get_zero_op());     OP_END
+        OP(LAX_ZERO) lax(get_zero_op());     OP_END // Unofficial
+        OP(LDA_ZERO) lda(get_zero_op());     OP_END
+        OP(LDX_ZERO) ldx(get_zero_op());     OP_END
+        OP(LDY_ZERO) ldy(get_zero_op());     OP_END
+        OP(ORA_ZERO) ora(get_zero_op());     OP_END
+        OP(SBC_ZERO) sbc(get_zero_op());     OP_END
 
         // Read-modify-write instructions
 
-        case ASL_ZERO: ZERO_RMW(asl); break;
-        case DCP_ZERO: ZERO_RMW(dcp); break; // Unofficial
-        case DEC_ZERO: ZERO_RMW(dec); break;
-        case INC_ZERO: ZERO_RMW(inc); break;
-        case ISC_ZERO: ZERO_RMW(isc); break; // Unofficial
-        case LSR_ZERO: ZERO_RMW(lsr); break;
-        case RLA_ZERO: ZERO_RMW(rla); break; // Unofficial
-        case RRA_ZERO: ZERO_RMW(rra); break; // Unofficial
-        case ROL_ZERO: ZERO_RMW(rol); break;
-        case ROR_ZERO: ZERO_RMW(ror); break;
-        case SLO_ZERO: ZERO_RMW(slo); break; // Unofficial
-        case SRE_ZERO: ZERO_RMW(sre); break; // Unofficial
+        OP(ASL_ZERO) ZERO_RMW(asl); OP_END
+        OP(DCP_ZERO) ZERO_RMW(dcp); OP_END // Unofficial
+        OP(DEC_ZERO) ZERO_RMW(dec); OP_END
+        OP(INC_ZERO) ZERO_RMW(inc); OP_END
+        OP(ISC_ZERO) ZERO_RMW(isc); OP_END // Unofficial
+        OP(LSR_ZERO) ZERO_RMW(lsr); OP_END
+        OP(RLA_ZERO) ZERO_RMW(rla); OP_END // Unofficial
+        OP(RRA_ZERO) ZERO_RMW(rra); OP_END // Unofficial
+        OP(ROL_ZERO) ZERO_RMW(rol); OP_END
+        OP(ROR_ZERO) ZERO_RMW(ror); OP_END
+        OP(SLO_ZERO) ZERO_RMW(slo); OP_END // Unofficial
+        OP(SRE_ZERO) ZERO_RMW(sre); OP_END // Unofficial
 
         // Write instructions
 
-        case SAX_ZERO: zero_write(a & x); break; // Unofficial
-        case STA_ZERO: zero_write(a);     break;
-        case STX_ZERO: zero_write(x);     break;
-        case STY_ZERO: zero_write(y);     break;
+        OP(SAX_ZERO) zero_write(cpu.a & cpu.x); OP_END // Unofficial
+        OP(STA_ZERO) zero_write(cpu.a);     OP_END
+        OP(STX_ZERO) zero_write(cpu.x);     OP_END
+        OP(STY_ZERO) zero_write(cpu.y);     OP_END
 
         // Unofficial NOPs with zero page addressing (acts like reads)
-        case NO0_ZERO: case NO1_ZERO: case NO2_ZERO:
+        OP(NO0_ZERO) OP_ALIAS(NO1_ZERO) OP_ALIAS(NO2_ZERO)
             get_zero_op();
-            break;
+            OP_END
 
         //
         // Zero page indexed addressing
@@ -1091,44 +1271,44 @@ void run() {
 
         // Read instructions
 
-        case ADC_ZERO_X: adc(get_zero_xy_op(x));     break;
-        case AND_ZERO_X: and_(get_zero_xy_op(x));    break;
-        case CMP_ZERO_X: comp(a, get_zero_xy_op(x)); break;
-        case EOR_ZERO_X: eor(get_zero_xy_op(x));     break;
-        case LAX_ZERO_Y: lax(get_zero_xy_op(y));     break; // Unofficial
-        case LDA_ZERO_X: lda(get_zero_xy_op(x));     break;
-        case LDX_ZERO_Y: ldx(get_zero_xy_op(y));     break;
-        case LDY_ZERO_X: ldy(get_zero_xy_op(x));     break;
-        case ORA_ZERO_X: ora(get_zero_xy_op(x));     break;
-        case SBC_ZERO_X: sbc(get_zero_xy_op(x));     break;
+        OP(ADC_ZERO_X) adc(get_zero_xy_op(cpu.x));     OP_END
+        OP(AND_ZERO_X) and_(get_zero_xy_op(cpu.x));    OP_END
+        OP(CMP_ZERO_X) comp(cpu.a, get_zero_xy_op(cpu.x)); OP_END
+        OP(EOR_ZERO_X) eor(get_zero_xy_op(cpu.x));     OP_END
+        OP(LAX_ZERO_Y) lax(get_zero_xy_op(cpu.y));     OP_END // Unofficial
+        OP(LDA_ZERO_X) lda(get_zero_xy_op(cpu.x));     OP_END
+        OP(LDX_ZERO_Y) ldx(get_zero_xy_op(cpu.y));     OP_END
+        OP(LDY_ZERO_X) ldy(get_zero_xy_op(cpu.x));     OP_END
+        OP(ORA_ZERO_X) ora(get_zero_xy_op(cpu.x));     OP_END
+        OP(SBC_ZERO_X) sbc(get_zero_xy_op(cpu.x));     OP_END
 
         // Read-modify-write instructions
 
-        case ASL_ZERO_X: ZERO_X_RMW(asl); break;
-        case DCP_ZERO_X: ZERO_X_RMW(dcp); break; // Unofficial
-        case DEC_ZERO_X: ZERO_X_RMW(dec); break;
-        case INC_ZERO_X: ZERO_X_RMW(inc); break;
-        case ISC_ZERO_X: ZERO_X_RMW(isc); break; // Unofficial
-        case LSR_ZERO_X: ZERO_X_RMW(lsr); break;
-        case RLA_ZERO_X: ZERO_X_RMW(rla); break; // Unofficial
-        case RRA_ZERO_X: ZERO_X_RMW(rra); break; // Unofficial
-        case ROL_ZERO_X: ZERO_X_RMW(rol); break;
-        case ROR_ZERO_X: ZERO_X_RMW(ror); break;
-        case SLO_ZERO_X: ZERO_X_RMW(slo); break; // Unofficial
-        case SRE_ZERO_X: ZERO_X_RMW(sre); break; // Unofficial
+        OP(ASL_ZERO_X) ZERO_X_RMW(asl); OP_END
+        OP(DCP_ZERO_X) ZERO_X_RMW(dcp); OP_END // Unofficial
+        OP(DEC_ZERO_X) ZERO_X_RMW(dec); OP_END
+        OP(INC_ZERO_X) ZERO_X_RMW(inc); OP_END
+        OP(ISC_ZERO_X) ZERO_X_RMW(isc); OP_END // Unofficial
+        OP(LSR_ZERO_X) ZERO_X_RMW(lsr); OP_END
+        OP(RLA_ZERO_X) ZERO_X_RMW(rla); OP_END // Unofficial
+        OP(RRA_ZERO_X) ZERO_X_RMW(rra); OP_END // Unofficial
+        OP(ROL_ZERO_X) ZERO_X_RMW(rol); OP_END
+        OP(ROR_ZERO_X) ZERO_X_RMW(ror); OP_END
+        OP(SLO_ZERO_X) ZERO_X_RMW(slo); OP_END // Unofficial
+        OP(SRE_ZERO_X) ZERO_X_RMW(sre); OP_END // Unofficial
 
         // Write instructions
 
-        case SAX_ZERO_Y: zero_xy_write(a & x, y); break; // Unofficial
-        case STA_ZERO_X: zero_xy_write(a, x);     break;
-        case STX_ZERO_Y: zero_xy_write(x, y);     break;
-        case STY_ZERO_X: zero_xy_write(y, x);     break;
+        OP(SAX_ZERO_Y) zero_xy_write(cpu.a & cpu.x, cpu.y); OP_END // Unofficial
+        OP(STA_ZERO_X) zero_xy_write(cpu.a, cpu.x);     OP_END
+        OP(STX_ZERO_Y) zero_xy_write(cpu.x, cpu.y);     OP_END
+        OP(STY_ZERO_X) zero_xy_write(cpu.y, cpu.x);     OP_END
 
         // Unofficial NOPs with indexed zero page addressing (acts like reads)
-        case NO0_ZERO_X: case NO1_ZERO_X: case NO2_ZERO_X: case NO3_ZERO_X:
-        case NO4_ZERO_X: case NO5_ZERO_X:
-            get_zero_xy_op(x);
-            break;
+        OP(NO0_ZERO_X) OP_ALIAS(NO1_ZERO_X) OP_ALIAS(NO2_ZERO_X) OP_ALIAS(NO3_ZERO_X)
+        OP_ALIAS(NO4_ZERO_X) OP_ALIAS(NO5_ZERO_X)
+            get_zero_xy_op(cpu.x);
+            OP_END
 
         //
         // Absolute indexed addressing
@@ -1136,65 +1316,65 @@ void run() {
 
         // Read instructions
 
-        case ADC_ABS_X: adc(get_abs_xy_op_read(x));     break;
-        case ADC_ABS_Y: adc(get_abs_xy_op_read(y));     break;
-        case AND_ABS_X: and_(get_abs_xy_op_read(x));    break;
-        case AND_ABS_Y: and_(get_abs_xy_op_read(y));    break;
-        case CMP_ABS_X: comp(a, get_abs_xy_op_read(x)); break;
-        case CMP_ABS_Y: comp(a, get_abs_xy_op_read(y)); break;
-        case EOR_ABS_X: eor(get_abs_xy_op_read(x));     break;
-        case EOR_ABS_Y: eor(get_abs_xy_op_read(y));     break;
-        case LAS_ABS_Y: las(get_abs_xy_op_read(y));     break; // Unofficial
-        case LAX_ABS_Y: lax(get_abs_xy_op_read(y));     break; // Unofficial
-        case LDA_ABS_X: lda(get_abs_xy_op_read(x));     break;
-        case LDA_ABS_Y: lda(get_abs_xy_op_read(y));     break;
-        case LDX_ABS_Y: ldx(get_abs_xy_op_read(y));     break;
-        case LDY_ABS_X: ldy(get_abs_xy_op_read(x));     break;
-        case ORA_ABS_X: ora(get_abs_xy_op_read(x));     break;
-        case ORA_ABS_Y: ora(get_abs_xy_op_read(y));     break;
-        case SBC_ABS_X: sbc(get_abs_xy_op_read(x));     break;
-        case SBC_ABS_Y: sbc(get_abs_xy_op_read(y));     break;
+        OP(ADC_ABS_X) adc(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(ADC_ABS_Y) adc(get_abs_xy_op_read(cpu.y));     OP_END
+        OP(AND_ABS_X) and_(get_abs_xy_op_read(cpu.x));    OP_END
+        OP(AND_ABS_Y) and_(get_abs_xy_op_read(cpu.y));    OP_END
+        OP(CMP_ABS_X) comp(cpu.a, get_abs_xy_op_read(cpu.x)); OP_END
+        OP(CMP_ABS_Y) comp(cpu.a, get_abs_xy_op_read(cpu.y)); OP_END
+        OP(EOR_ABS_X) eor(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(EOR_ABS_Y) eor(get_abs_xy_op_read(cpu.y));     OP_END
+        OP(LAS_ABS_Y) las(get_abs_xy_op_read(cpu.y));     OP_END // Unofficial
+        OP(LAX_ABS_Y) lax(get_abs_xy_op_read(cpu.y));     OP_END // Unofficial
+        OP(LDA_ABS_X) lda(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(LDA_ABS_Y) lda(get_abs_xy_op_read(cpu.y));     OP_END
+        OP(LDX_ABS_Y) ldx(get_abs_xy_op_read(cpu.y));     OP_END
+        OP(LDY_ABS_X) ldy(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(ORA_ABS_X) ora(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(ORA_ABS_Y) ora(get_abs_xy_op_read(cpu.y));     OP_END
+        OP(SBC_ABS_X) sbc(get_abs_xy_op_read(cpu.x));     OP_END
+        OP(SBC_ABS_Y) sbc(get_abs_xy_op_read(cpu.y));     OP_END
 
         // Read-modify-write instructions
 
-        case ASL_ABS_X: RMW(asl, get_abs_xy_addr_write(x)); break;
-        case DCP_ABS_X: RMW(dcp, get_abs_xy_addr_write(x)); break; // Unofficial
-        case DCP_ABS_Y: RMW(dcp, get_abs_xy_addr_write(y)); break; // Unofficial
-        case DEC_ABS_X: RMW(dec, get_abs_xy_addr_write(x)); break;
-        case INC_ABS_X: RMW(inc, get_abs_xy_addr_write(x)); break;
-        case ISC_ABS_X: RMW(isc, get_abs_xy_addr_write(x)); break; // Unofficial
-        case ISC_ABS_Y: RMW(isc, get_abs_xy_addr_write(y)); break; // Unofficial
-        case LSR_ABS_X: RMW(lsr, get_abs_xy_addr_write(x)); break;
-        case RLA_ABS_X: RMW(rla, get_abs_xy_addr_write(x)); break; // Unofficial
-        case RLA_ABS_Y: RMW(rla, get_abs_xy_addr_write(y)); break; // Unofficial
-        case RRA_ABS_X: RMW(rra, get_abs_xy_addr_write(x)); break; // Unofficial
-        case RRA_ABS_Y: RMW(rra, get_abs_xy_addr_write(y)); break; // Unofficial
-        case ROL_ABS_X: RMW(rol, get_abs_xy_addr_write(x)); break;
-        case ROR_ABS_X: RMW(ror, get_abs_xy_addr_write(x)); break;
-        case SLO_ABS_X: RMW(slo, get_abs_xy_addr_write(x)); break; // Unofficial
-        case SLO_ABS_Y: RMW(slo, get_abs_xy_addr_write(y)); break; // Unofficial
-        case SRE_ABS_X: RMW(sre, get_abs_xy_addr_write(x)); break; // Unofficial
-        case SRE_ABS_Y: RMW(sre, get_abs_xy_addr_write(y)); break; // Unofficial
+        OP(ASL_ABS_X) RMW(asl, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(DCP_ABS_X) RMW(dcp, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(DCP_ABS_Y) RMW(dcp, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
+        OP(DEC_ABS_X) RMW(dec, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(INC_ABS_X) RMW(inc, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(ISC_ABS_X) RMW(isc, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(ISC_ABS_Y) RMW(isc, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
+        OP(LSR_ABS_X) RMW(lsr, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(RLA_ABS_X) RMW(rla, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(RLA_ABS_Y) RMW(rla, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
+        OP(RRA_ABS_X) RMW(rra, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(RRA_ABS_Y) RMW(rra, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
+        OP(ROL_ABS_X) RMW(rol, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(ROR_ABS_X) RMW(ror, get_abs_xy_addr_write(cpu.x)); OP_END
+        OP(SLO_ABS_X) RMW(slo, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(SLO_ABS_Y) RMW(slo, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
+        OP(SRE_ABS_X) RMW(sre, get_abs_xy_addr_write(cpu.x)); OP_END // Unofficial
+        OP(SRE_ABS_Y) RMW(sre, get_abs_xy_addr_write(cpu.y)); OP_END // Unofficial
 
         // Write instructions
 
-        case AXA_ABS_Y: unoff_addr_write(get_abs_addr(), a & x, y); break; // Unofficial
-        case SAY_ABS_X: unoff_addr_write(get_abs_addr(), y    , x); break; // Unofficial
-        case XAS_ABS_Y: unoff_addr_write(get_abs_addr(), x    , y); break; // Unofficial
+        OP(AXA_ABS_Y) unoff_addr_write(get_abs_addr(), cpu.a & cpu.x, cpu.y); OP_END // Unofficial
+        OP(SAY_ABS_X) unoff_addr_write(get_abs_addr(), cpu.y        , cpu.x); OP_END // Unofficial
+        OP(XAS_ABS_Y) unoff_addr_write(get_abs_addr(), cpu.x        , cpu.y); OP_END // Unofficial
         // Unofficial
-        case TAS_ABS_Y:
-            s = a & x;
-            unoff_addr_write(get_abs_addr(), a & x, y);
-            break;
+        OP(TAS_ABS_Y)
+            cpu.s = cpu.a & cpu.x;
+            unoff_addr_write(get_abs_addr(), cpu.a & cpu.x, cpu.y);
+            OP_END
 
-        case STA_ABS_X: abs_xy_write_a(x); break;
-        case STA_ABS_Y: abs_xy_write_a(y); break;
+        OP(STA_ABS_X) abs_xy_write_a(cpu.x); OP_END
+        OP(STA_ABS_Y) abs_xy_write_a(cpu.y); OP_END
 
         // Unofficial NOPs with absolute,x addressing (acts like reads)
-        case NO0_ABS_X: case NO1_ABS_X: case NO2_ABS_X: case NO3_ABS_X: case NO4_ABS_X:
-        case NO5_ABS_X:
-            get_abs_xy_op_read(x);
-            break;
+        OP(NO0_ABS_X) OP_ALIAS(NO1_ABS_X) OP_ALIAS(NO2_ABS_X) OP_ALIAS(NO3_ABS_X)
+        OP_ALIAS(NO4_ABS_X) OP_ALIAS(NO5_ABS_X)
+            get_abs_xy_op_read(cpu.x);
+            OP_END
 
         //
         // Indexed indirect addressing
@@ -1202,28 +1382,28 @@ void run() {
 
         // Read instructions
 
-        case ADC_IND_X: adc(get_ind_x_op());     break;
-        case AND_IND_X: and_(get_ind_x_op());    break;
-        case CMP_IND_X: comp(a, get_ind_x_op()); break;
-        case EOR_IND_X: eor(get_ind_x_op());     break;
-        case LAX_IND_X: lax(get_ind_x_op());     break; // Unofficial
-        case LDA_IND_X: lda(get_ind_x_op());     break;
-        case ORA_IND_X: ora(get_ind_x_op());     break;
-        case SBC_IND_X: sbc(get_ind_x_op());     break;
+        OP(ADC_IND_X) adc(get_ind_x_op());     OP_END
+        OP(AND_IND_X) and_(get_ind_x_op());    OP_END
+        OP(CMP_IND_X) comp(cpu.a, get_ind_x_op()); OP_END
+        OP(EOR_IND_X) eor(get_ind_x_op());     OP_END
+        OP(LAX_IND_X) lax(get_ind_x_op());     OP_END // Unofficial
+        OP(LDA_IND_X) lda(get_ind_x_op());     OP_END
+        OP(ORA_IND_X) ora(get_ind_x_op());     OP_END
+        OP(SBC_IND_X) sbc(get_ind_x_op());     OP_END
 
         // Write instructions
 
-        case SAX_IND_X: ind_x_write(a & x); break; // Unofficial
-        case STA_IND_X: ind_x_write(a);     break;
+        OP(SAX_IND_X) ind_x_write(cpu.a & cpu.x); OP_END // Unofficial
+        OP(STA_IND_X) ind_x_write(cpu.a);     OP_END
 
         // Read-modify-write instructions
 
-        case DCP_IND_X: RMW(dcp, get_ind_x_addr()); break; // Unofficial
-        case ISC_IND_X: RMW(isc, get_ind_x_addr()); break; // Unofficial
-        case RLA_IND_X: RMW(rla, get_ind_x_addr()); break; // Unofficial
-        case RRA_IND_X: RMW(rra, get_ind_x_addr()); break; // Unofficial
-        case SLO_IND_X: RMW(slo, get_ind_x_addr()); break; // Unofficial
-        case SRE_IND_X: RMW(sre, get_ind_x_addr()); break; // Unofficial
+        OP(DCP_IND_X) RMW(dcp, get_ind_x_addr()); OP_END // Unofficial
+        OP(ISC_IND_X) RMW(isc, get_ind_x_addr()); OP_END // Unofficial
+        OP(RLA_IND_X) RMW(rla, get_ind_x_addr()); OP_END // Unofficial
+        OP(RRA_IND_X) RMW(rra, get_ind_x_addr()); OP_END // Unofficial
+        OP(SLO_IND_X) RMW(slo, get_ind_x_addr()); OP_END // Unofficial
+        OP(SRE_IND_X) RMW(sre, get_ind_x_addr()); OP_END // Unofficial
 
         //
         // Indirect indexed addressing
@@ -1231,77 +1411,104 @@ void run() {
 
         // Read instructions
 
-        case ADC_IND_Y: adc(get_ind_y_op_read());     break;
-        case AND_IND_Y: and_(get_ind_y_op_read());    break;
-        case CMP_IND_Y: comp(a, get_ind_y_op_read()); break;
-        case EOR_IND_Y: eor(get_ind_y_op_read());     break;
-        case LAX_IND_Y: lax(get_ind_y_op_read());     break; // Unofficial
-        case LDA_IND_Y: lda(get_ind_y_op_read());     break;
-        case ORA_IND_Y: ora(get_ind_y_op_read());     break;
-        case SBC_IND_Y: sbc(get_ind_y_op_read());     break;
+        OP(ADC_IND_Y) adc(get_ind_y_op_read());     OP_END
+        OP(AND_IND_Y) and_(get_ind_y_op_read());    OP_END
+        OP(CMP_IND_Y) comp(cpu.a, get_ind_y_op_read()); OP_END
+        OP(EOR_IND_Y) eor(get_ind_y_op_read());     OP_END
+        OP(LAX_IND_Y) lax(get_ind_y_op_read());     OP_END // Unofficial
+        OP(LDA_IND_Y) lda(get_ind_y_op_read());     OP_END
+        OP(ORA_IND_Y) ora(get_ind_y_op_read());     OP_END
+        OP(SBC_IND_Y) sbc(get_ind_y_op_read());     OP_END
 
         // Write instructions
 
         // Unofficial
-        case AXA_IND_Y:
-            ++pc;
+        OP(AXA_IND_Y)
+            ++cpu.pc;
             read_tick(); // Fetch effective address low
             read_tick(); // Fetch effective address high
             unoff_addr_write(
-              (ram[(op_1 + 1) & 0xFF] << 8) | ram[op_1], // Address
-              a & x, y);
-            break;
+              (ram[(cpu.op_1 + 1) & 0xFF] << 8) | ram[cpu.op_1], // Address
+              cpu.a & cpu.x, cpu.y);
+            OP_END
 
-        case STA_IND_Y: ind_y_write_a(); break;
+        OP(STA_IND_Y) ind_y_write_a(); OP_END
 
         // Read-modify-write instructions
 
-        case DCP_IND_Y: RMW(dcp, get_ind_y_addr_write()); break; // Unofficial
-        case ISC_IND_Y: RMW(isc, get_ind_y_addr_write()); break; // Unofficial
-        case RLA_IND_Y: RMW(rla, get_ind_y_addr_write()); break; // Unofficial
-        case RRA_IND_Y: RMW(rra, get_ind_y_addr_write()); break; // Unofficial
-        case SLO_IND_Y: RMW(slo, get_ind_y_addr_write()); break; // Unofficial
-        case SRE_IND_Y: RMW(sre, get_ind_y_addr_write()); break; // Unofficial
+        OP(DCP_IND_Y) RMW(dcp, get_ind_y_addr_write()); OP_END // Unofficial
+        OP(ISC_IND_Y) RMW(isc, get_ind_y_addr_write()); OP_END // Unofficial
+        OP(RLA_IND_Y) RMW(rla, get_ind_y_addr_write()); OP_END // Unofficial
+        OP(RRA_IND_Y) RMW(rra, get_ind_y_addr_write()); OP_END // Unofficial
+        OP(SLO_IND_Y) RMW(slo, get_ind_y_addr_write()); OP_END // Unofficial
+        OP(SRE_IND_Y) RMW(sre, get_ind_y_addr_write()); OP_END // Unofficial
 
         //
         // Indirect addressing
         //
 
-        case JMP_IND:
+        OP(JMP_IND)
             {
-            uint16_t const addr = (read_mem(pc + 1) << 8) | op_1;
-            pc = read_mem(addr);
+            uint16_t const addr = (read_mem(cpu.pc + 1) << 8) | cpu.op_1;
+            cpu.pc = read_mem(addr);
             poll_for_interrupt();
-            pc |= read_mem((addr & 0xFF00) | ((addr + 1) & 0xFF)) << 8;
-            break;
+            cpu.pc |= read_mem((addr & 0xFF00) | ((addr + 1) & 0xFF)) << 8;
+            OP_END
             }
 
         //
         // Branch instructions
         //
 
-        case BCC: branch_if(!carry);        break;
-        case BCS: branch_if(carry);         break;
-        case BVC: branch_if(!overflow);     break;
-        case BVS: branch_if(overflow);      break;
-        case BEQ: branch_if(!(zn & 0xFF));  break;
-        case BMI: branch_if(zn & 0x180);    break;
-        case BNE: branch_if(zn & 0xFF);     break;
-        case BPL: branch_if(!(zn & 0x180)); break;
+        OP(BCC) branch_if(!cpu.carry);        OP_END
+        OP(BCS) branch_if(cpu.carry);         OP_END
+        OP(BVC) branch_if(!cpu.overflow);     OP_END
+        OP(BVS) branch_if(cpu.overflow);      OP_END
+        OP(BEQ) branch_if(!(cpu.zn & 0xFF));  OP_END
+        OP(BMI) branch_if(cpu.zn & 0x180);    OP_END
+        OP(BNE) branch_if(cpu.zn & 0xFF);     OP_END
+        OP(BPL) branch_if(!(cpu.zn & 0x180)); OP_END
 
         //
         // KIL instructions (hang the CPU)
         //
 
-        case KI0: case KI1: case KI2: case KI3: case KI4: case KI5:
-        case KI6: case KI7: case KI8: case KI9: case K10: case K11:
+        OP(KI0) OP_ALIAS(KI1) OP_ALIAS(KI2) OP_ALIAS(KI3) OP_ALIAS(KI4) OP_ALIAS(KI5)
+        OP_ALIAS(KI6) OP_ALIAS(KI7) OP_ALIAS(KI8) OP_ALIAS(KI9) OP_ALIAS(K10) OP_ALIAS(K11)
             puts("KIL instruction executed, system hung");
             end_emulation();
             exit_sdl_thread();
+            OP_END
+
+#ifndef THREADED_DISPATCH
         }
+
+        end_instruction(opcode);
+#endif
     }
 }
 
+void run() {
+    power_on();
+    run_loop(false);
+}
+
+void run_frame() {
+    pending_end_emulation = false;
+    run_loop(true);
+}
+
+void replay_frame() {
+    replaying_frame = true;
+    frame_offset = 0;
+    run_loop(true);
+    replaying_frame = false;
+
+    // The APU only reports changes to its output level, and those were
+    // discarded while replaying. Make it report the current level.
+    begin_audio_frame();
+}
+
 //
 // Debugging and tracing
 //
@@ -1309,7 +1516,7 @@ void run() {
 #ifdef INCLUDE_DEBUGGER
 
 static int read_without_side_effects(uint16_t addr) {
-    switch (pc) {
+    switch (cpu.pc) {
     case 0x0000 ... 0x1FFF: return ram[addr & 0x07FF];
     case 0x6000 ... 0x7FFF: return wram_6000_page ? wram_6000_page[addr & 0x1FFF] : 0;
     case 0x8000 ... 0xFFFF: return read_prg(addr);
@@ -1368,7 +1575,7 @@ static char const *decode_addr(uint16_t addr) {
 #define INS_ZERO(name)   case name##_ZERO  : printf(#name" $%02X     ", op_1);                            break;
 #define INS_ZERO_X(name) case name##_ZERO_X: printf(#name" $%02X,X   ", op_1);                            break;
 #define INS_ZERO_Y(name) case name##_ZERO_Y: printf(#name" $%02X,Y   ", op_1);                            break;
-#define INS_REL(name)    case name         : printf(#name" $%04X   "  , uint16_t(pc + 2 + (int8_t)op_1)); break;
+#define INS_REL(name)    case name         : printf(#name" $%04X   "  , uint16_t(cpu.pc + 2 + (int8_t)op_1)); break;
 #define INS_IND_X(name)  case name##_IND_X : printf(#name" ($%02X,X) ", op_1);                            break;
 #define INS_IND_Y(name)  case name##_IND_Y : printf(#name" ($%02X),Y ", op_1);                            break;
 #define INS_ABS(name)    case name##_ABS   : printf(#name" %s   "  , decode_addr((op_2 << 8) | op_1));    break;
@@ -1511,26 +1718,29 @@ needs_second_operand:
 }
 
 static void log_instruction() {
+    // The PPU position is shown
+    sync_ppu();
+
     if (debug_mode == RUN) {
-        if ((n_breakpoints_set > 0 && breakpoint_at[pc]) || keys[SDL_SCANCODE_F8])
+        if ((n_breakpoints_set > 0 && breakpoint_at[cpu.pc]) || keys[SDL_SCANCODE_F8])
             debug_mode = SINGLE_STEP;
         else
             return;
     }
 
     if (debug_mode == SINGLE_STEP || debug_mode == TRACE) {
-        print_instruction(pc);
+        print_instruction(cpu.pc);
         printf("A: %02X  X: %02X  Y: %02X  S: %02X  "
                "Carry: %d  Zero: %d  I disable: %d  Decimal: %d  Overflow: %d  Negative: %d  (%u,%u) PPU cycle: %"PRIu64,
-               a, x, y, s,
-               carry, !(zn & 0xFF), irq_disable, decimal, overflow, !!(zn & 0x180),
-               scanline, dot, ppu_cycle);
+               cpu.a, cpu.x, cpu.y, cpu.s,
+               cpu.carry, !(cpu.zn & 0xFF), cpu.irq_disable, cpu.decimal, cpu.overflow, !!(cpu.zn & 0x180),
+               ppu.scanline, ppu.dot, ppu.cycle);
 
-        if (pending_nmi && pending_irq)
+        if (cpu.pending_nmi && cpu.pending_irq)
             puts(" (pending NMI and IRQ)");
-        else if (pending_nmi)
+        else if (cpu.pending_nmi)
             puts(" (pending NMI)");
-        else if (pending_irq)
+        else if (cpu.pending_irq)
             puts(" (pending IRQ)");
         else
             putchar('\n');
@@ -1646,25 +1856,30 @@ static void log_instruction() {
 
 static void set_cpu_cold_boot_state() {
     init_array(ram, (uint8_t)0xFF);
-    cpu_data_bus = 0;
+    mark_all_dirty(ram_stamps, sizeof ram);
+    cpu.data_bus = 0;
 
     // s is later decremented to 0xFD during the reset operation
-    a = s = x = y = 0;
+    cpu.a = cpu.s = cpu.x = cpu.y = 0;
 
-    zn          = 1    ; // Neither negative nor zero
-    overflow    = false;
-    decimal     = false;
-    irq_disable = false; // Later set by reset
-    carry       = false;
+    cpu.zn          = 1    ; // Neither negative nor zero
+    cpu.overflow    = false;
+    cpu.decimal     = false;
+    cpu.irq_disable = false; // Later set by reset
+    cpu.carry       = false;
 
     pending_event         = false;
     pending_end_emulation = false;
-    irq_line              = pending_irq = cart_irq = false;
-    nmi_asserted          = pending_nmi = false;
+    cpu.irq_line          = cpu.pending_irq = cpu.cart_irq = false;
+    cpu.nmi_asserted      = cpu.pending_nmi = false;
 
-    cpu_is_reading = true;
+    cpu.is_reading = true;
 
-    pal_extra_tick = 5;
+    cpu.pal_extra_tick = 5;
+
+#ifdef RUN_TESTS
+    schedule_event(TEST_RESET_EVENT, no_deadline);
+#endif
 
 #ifdef INCLUDE_DEBUGGER
     // TODO: Might be better to do this in conjunction with loading a new ROM
@@ -1673,7 +1888,7 @@ static void set_cpu_cold_boot_state() {
 }
 
 static void reset_cpu() {
-    irq_line = pending_irq = cart_irq = false;
+    cpu.irq_line = cpu.pending_irq = cpu.cart_irq = false;
 
     // This sets the interrupt flag as a side effect
     do_interrupt(Int_reset);
@@ -1685,19 +1900,13 @@ static void reset_cpu() {
 
 template<bool calculating_size, bool is_save>
 void transfer_cpu_state(uint8_t *&buf) {
-    TRANSFER(ram)
-    if (wram_base) TRANSFER_P(wram_base, 0x2000*wram_8k_banks)
-    TRANSFER(pc)
-    TRANSFER(a) TRANSFER(s) TRANSFER(x) TRANSFER(y)
-    TRANSFER(zn) TRANSFER(carry) TRANSFER(irq_disable) TRANSFER(decimal)
-    TRANSFER(overflow)
-    TRANSFER(op_1)
-    TRANSFER(cpu_is_reading)
-    TRANSFER(cpu_data_bus)
-    TRANSFER(cart_irq) TRANSFER(dmc_irq) TRANSFER(frame_irq) TRANSFER(irq_line)
-    TRANSFER(nmi_asserted)
-    TRANSFER(pending_irq) TRANSFER(pending_nmi)
-    if (is_pal) TRANSFER(pal_extra_tick)
+    TRANSFER_TRACKED(ram, sizeof ram, ram_stamps)
+    if (wram_base) TRANSFER_TRACKED(wram_base, 0x2000*wram_8k_banks, wram_stamps)
+    TRANSFER(cpu)
+
+    // Make sure a loaded interrupt gets serviced
+    if (!calculating_size && !is_save && (cpu.pending_irq || cpu.pending_nmi))
+        pending_event = true;
 }
 
 // Explicit instantiations
@@ -1,16 +1,19 @@
 #include "common.h"
 
+#include "input.h"
 #include "sdl_backend.h"
 
+#ifndef HEADLESS
 // The input routines are still tied to SDL
-#include <SDL.h>
+#  include <SDL.h>
+#endif
 
 // If true, prevent the game from seeing left+right or up+down pressed
 // simultaneously, which glitches out some games. When both keys are pressed at
 // the same time, pretend only the key most recently pressed is pressed.
 bool const prevent_simul_left_right_or_up_down = true;
 
-static struct Controller_data {
+static PER_CONSOLE struct Controller_data {
     // Button states
     bool left_pushed, right_pushed, up_pushed, down_pushed,
          a_pushed, b_pushed, start_pushed, select_pushed;
@@ -18,33 +21,37 @@ static struct Controller_data {
     // Used for left+right/up+down elimination
     bool left_pushed_most_recently, up_pushed_most_recently;
     bool left_was_pushed, right_was_pushed, up_was_pushed, down_was_pushed;
-
-    // Key bindings
-    unsigned key_a, key_b, key_select, key_start, key_up, key_down, key_left, key_right;
 } controller_data[2];
 
-bool reset_pushed;
+PER_CONSOLE bool reset_pushed;
+
+#ifndef HEADLESS
+
+// Key bindings. Shared between consoles and set up once by init_input().
+static struct Key_bindings {
+    unsigned key_a, key_b, key_select, key_start, key_up, key_down, key_left, key_right;
+} key_bindings[2];
 
 void init_input() {
     // Currently hardcoded
 
-    controller_data[0].key_a      = SDL_SCANCODE_X;
-    controller_data[0].key_b      = SDL_SCANCODE_Z;
-    controller_data[0].key_select = SDL_SCANCODE_RSHIFT;
-    controller_data[0].key_start  = SDL_SCANCODE_RETURN;
-    controller_data[0].key_up     = SDL_SCANCODE_UP;
-    controller_data[0].key_down   = SDL_SCANCODE_DOWN;
-    controller_data[0].key_left   = SDL_SCANCODE_LEFT;
-    controller_data[0].key_right  = SDL_SCANCODE_RIGHT;
-
-    controller_data[1].key_a      = SDL_SCANCODE_W;
-    controller_data[1].key_b      = SDL_SCANCODE_Q;
-    controller_data[1].key_select = SDL_SCANCODE_2;
-    controller_data[1].key_start  = SDL_SCANCODE_1;
-    controller_data[1].key_up     = SDL_SCANCODE_I;
-    controller_data[1].key_down   = SDL_SCANCODE_K;
-    controller_data[1].key_left   = SDL_SCANCODE_J;
-    controller_data[1].key_right  = SDL_SCANCODE_L;
+    key_bindings[0].key_a      = SDL_SCANCODE_X;
+    key_bindings[0].key_b      = SDL_SCANCODE_Z;
+    key_bindings[0].key_select = SDL_SCANCODE_RSHIFT;
+    key_bindings[0].key_start  = SDL_SCANCODE_RETURN;
+    key_bindings[0].key_up     = SDL_SCANCODE_UP;
+    key_bindings[0].key_down   = SDL_SCANCODE_DOWN;
+    key_bindings[0].key_left   = SDL_SCANCODE_LEFT;
+    key_bindings[0].key_right  = SDL_SCANCODE_RIGHT;
+
+    key_bindings[1].key_a      = SDL_SCANCODE_W;
+    key_bindings[1].key_b      = SDL_SCANCODE_Q;
+    key_bindings[1].key_select = SDL_SCANCODE_2;
+    key_bindings[1].key_start  = SDL_SCANCODE_1;
+    key_bindings[1].key_up     = SDL_SCANCODE_I;
+    key_bindings[1].key_down   = SDL_SCANCODE_K;
+    key_bindings[1].key_left   = SDL_SCANCODE_J;
+    key_bindings[1].key_right  = SDL_SCANCODE_L;
 }
 
 void calc_controller_state() {
@@ -52,55 +59,56 @@ void calc_controller_state() {
 
     for (unsigned i = 0; i < 2; ++i) {
         Controller_data &c = controller_data[i];
+        Key_bindings const &k = key_bindings[i];
 
         // Buttons
 
-        c.a_pushed      = keys[c.key_a];
-        c.b_pushed      = keys[c.key_b];
-        c.start_pushed  = keys[c.key_start];
-        c.select_pushed = keys[c.key_select];
+        c.a_pushed      = keys[k.key_a];
+        c.b_pushed      = keys[k.key_b];
+        c.start_pushed  = keys[k.key_start];
+        c.select_pushed = keys[k.key_select];
 
         // D-Pad (with left+right/up+down elimination if enabled)
 
-        if (!c.left_was_pushed  && keys[c.key_left ])
+        if (!c.left_was_pushed  && keys[k.key_left ])
             c.left_pushed_most_recently = true;
-        if (!c.right_was_pushed && keys[c.key_right])
+        if (!c.right_was_pushed && keys[k.key_right])
             c.left_pushed_most_recently = false;
-        if (!c.up_was_pushed    && keys[c.key_up   ])
+        if (!c.up_was_pushed    && keys[k.key_up   ])
             c.up_pushed_most_recently   = true;
-        if (!c.down_was_pushed  && keys[c.key_down ])
+        if (!c.down_was_pushed  && keys[k.key_down ])
             c.up_pushed_most_recently   = false;
 
         if (prevent_simul_left_right_or_up_down) {
-            if (keys[c.key_left] && keys[c.key_right]) {
+            if (keys[k.key_left] && keys[k.key_right]) {
                 c.left_pushed  =  c.left_pushed_most_recently;
                 c.right_pushed = !c.left_pushed;
             }
             else {
-                c.left_pushed  = keys[c.key_left];
-                c.right_pushed = keys[c.key_right];
+                c.left_pushed  = keys[k.key_left];
+                c.right_pushed = keys[k.key_right];
             }
 
-            if (keys[c.key_up] && keys[c.key_down]) {
+            if (keys[k.key_up] && keys[k.key_down]) {
                 c.up_pushed   =  c.up_pushed_most_recently;
                 c.down_pushed = !c.up_pushed;
             }
             else {
-                c.up_pushed   = keys[c.key_up];
-                c.down_pushed = keys[c.key_down];
+                c.up_pushed   = keys[k.key_up];
+                c.down_pushed = keys[k.key_down];
             }
         }
         else { // !prevent_simul_left_right_or_up_down
-            c.left_pushed  = keys[c.key_left];
-            c.right_pushed = keys[c.key_right];
-            c.up_pushed    = keys[c.key_up];
-            c.down_pushed  = keys[c.key_down];
+            c.left_pushed  = keys[k.key_left];
+            c.right_pushed = keys[k.key_right];
+            c.up_pushed    = keys[k.key_up];
+            c.down_pushed  = keys[k.key_down];
         }
 
-        c.left_was_pushed  = keys[c.key_left];
-        c.right_was_pushed = keys[c.key_right];
-        c.up_was_pushed    = keys[c.key_up];
-        c.down_was_pushed  = keys[c.key_down];
+        c.left_was_pushed  = keys[k.key_left];
+        c.right_was_pushed = keys[k.key_right];
+        c.up_was_pushed    = keys[k.key_up];
+        c.down_was_pushed  = keys[k.key_down];
     }
 
     reset_pushed = keys[SDL_SCANCODE_F5];
@@ -108,6 +116,17 @@ void calc_controller_state() {
     SDL_UnlockMutex(event_lock);
 }
 
+#else
+
+// In headless builds, the backend sets the button states directly through
+// set_button_states()
+
+void init_input() {}
+
+void calc_controller_state() {}
+
+#endif
+
 uint8_t get_button_states(unsigned n) {
     Controller_data &c = controller_data[n];
     return (c.right_pushed << 7) | (c.left_pushed  << 6) | (c.down_pushed   << 5) |
@@ -115,6 +134,18 @@ uint8_t get_button_states(unsigned n) {
            (c.b_pushed     << 1) |  c.a_pushed;
 }
 
+void set_button_states(unsigned n, uint8_t states) {
+    Controller_data &c = controller_data[n];
+    c.a_pushed      = NTH_BIT(states, 0);
+    c.b_pushed      = NTH_BIT(states, 1);
+    c.select_pushed = NTH_BIT(states, 2);
+    c.start_pushed  = NTH_BIT(states, 3);
+    c.up_pushed     = NTH_BIT(states, 4);
+    c.down_pushed   = NTH_BIT(states, 5);
+    c.left_pushed   = NTH_BIT(states, 6);
+    c.right_pushed  = NTH_BIT(states, 7);
+}
+
 template<bool calculating_size, bool is_save>
 void transfer_input_state(uint8_t *&buf) {
     for (unsigned i = 0; i < 2; ++i) {
@@ -1,65 +1,211 @@
 #include "common.h"
 
 #include "apu.h"
+#include "audio.h"
+#include "bench.h"
 #include "cpu.h"
 #include "input.h"
 #include "mapper.h"
+#include "profile.h"
 #include "rom.h"
 #include "sdl_backend.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
 
-#include <SDL.h>
+#ifndef HEADLESS
+#  include <SDL.h>
+#endif
 
 char const *program_name;
 
-static int emulation_thread(void*) {
+#ifndef HEADLESS
+
+// The emulation state is per-thread (see PER_CONSOLE), so the ROM is loaded
+// and unloaded on the emulation thread
+static int emulation_thread(void *rom_filename) {
 #ifdef RUN_TESTS
+    (void)rom_filename; // Suppress warning
     run_tests();
 #else
+    load_rom((char const*)rom_filename, true);
     run();
+    unload_rom();
 #endif
 
     return 0;
 }
 
+static void usage() {
+    fprintf(stderr,
+            "usage: %s [--sync-audio] [--latency <ms>] <rom file>\n"
+            "\n"
+            "  --sync-audio          Pace emulation by audio playback instead of timers\n"
+            "  --latency <ms>        Target audio latency in milliseconds (default: ~140)\n",
+            program_name);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
     program_name = argv[0] ? argv[0] : "nesalizer";
+
+    char const *rom_filename = 0;
+    unsigned long latency_ms = 0;
+    bool sync_audio = false;
+
 #ifndef RUN_TESTS
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <rom file>\n", program_name);
-        exit(EXIT_FAILURE);
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--sync-audio"))
+            sync_audio = true;
+        else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+            char *end;
+            latency_ms = strtoul(argv[++i], &end, 10);
+            fail_if(*end != '\0' || latency_ms == 0 || latency_ms > 1000,
+                    "invalid latency '%s' (expected 1-1000 ms)", argv[i]);
+        }
+        else if (argv[i][0] != '-' && !rom_filename)
+            rom_filename = argv[i];
+        else
+            usage();
     }
+
+    if (!rom_filename)
+        usage();
 #else
     (void)argc; // Suppress warning
+    (void)usage;
 #endif
 
     install_fatal_signal_handlers();
+#ifdef PROFILE
+    init_profile();
+#endif
 
     // One-time initialization of various components
     init_apu();
     init_input();
     init_mappers();
-
-#ifndef RUN_TESTS
-    load_rom(argv[1], true);
-#endif
+    init_audio(latency_ms, sync_audio);
 
     // Create a separate emulation thread and use this thread as the rendering
     // thread
 
     init_sdl();
     SDL_Thread *emu_thread;
-    fail_if(!(emu_thread = SDL_CreateThread(emulation_thread, "emulation", 0)),
+    fail_if(!(emu_thread = SDL_CreateThread(emulation_thread, "emulation", (void*)rom_filename)),
             "failed to create emulation thread: %s", SDL_GetError());
     sdl_thread();
     SDL_WaitThread(emu_thread, 0);
     deinit_sdl();
+    deinit_audio();
+
+    printf("Audio buffer underruns: %lu, overruns: %lu\n",
+           get_audio_underruns(), get_audio_overruns());
+    puts("Shut down cleanly");
+}
+
+#else // HEADLESS
+
+// Number of frames to run with --bench if no --frames argument is given. One
+// minute of NTSC emulation.
+unsigned long const default_bench_frames = 3600;
+
+static void usage() {
+    fprintf(stderr,
+            "usage: %s [--frames <n>] [--input <input log>] [--audio <mode>] [--bench] <rom file>\n"
+            "\n"
+            "  --frames <n>          Stop after n frames (default: run until the ROM halts)\n"
+            "  --input <input log>   Read controller input from a file (two bytes per frame)\n"
+            "  --audio <mode>        Audio generation: off, low (point sampling at a reduced\n"
+            "                        rate), or full (default)\n"
+            "  --bench               Record rewind states as in the SDL build and print a\n"
+            "                        JSON report with timings (default: %lu frames)\n",
+            program_name, default_bench_frames);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    program_name = argv[0] ? argv[0] : "nesalizer-headless";
+
+    unsigned long max_frames = 0;
+    char const *input_filename = 0;
+    char const *rom_filename = 0;
+    bool bench = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            char *end;
+            max_frames = strtoul(argv[++i], &end, 10);
+            fail_if(*end != '\0' || max_frames == 0,
+                    "invalid frame count '%s'", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--input") && i + 1 < argc)
+            input_filename = argv[++i];
+        else if (!strcmp(argv[i], "--audio") && i + 1 < argc) {
+            ++i;
+            if      (!strcmp(argv[i], "off"))  set_audio_mode(AUDIO_OFF);
+            else if (!strcmp(argv[i], "low"))  set_audio_mode(AUDIO_LOW);
+            else if (!strcmp(argv[i], "full")) set_audio_mode(AUDIO_FULL);
+            else fail("invalid audio mode '%s' (expected off, low, or full)", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--bench"))
+            bench = true;
+        else if (argv[i][0] != '-' && !rom_filename)
+            rom_filename = argv[i];
+        else
+            usage();
+    }
 
 #ifndef RUN_TESTS
+    if (!rom_filename)
+        usage();
+#endif
+
+    if (bench && max_frames == 0)
+        max_frames = default_bench_frames;
+
+    install_fatal_signal_handlers();
+#ifdef PROFILE
+    init_profile();
+#endif
+
+    // One-time initialization of various components
+    init_apu();
+    init_input();
+    init_mappers();
+
+    // Everything runs on the main thread in headless builds
+
+    init_null_backend(input_filename, max_frames, bench);
+
+#ifdef RUN_TESTS
+    run_tests();
+#else
+    // Keep stdout clean for the JSON report
+    load_rom(rom_filename, !bench);
+
+    if (bench) {
+        start_bench();
+        run();
+        end_bench(rom_filename);
+    }
+    else {
+        timespec start, end;
+        errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &start) == -1,
+          "failed to fetch start time from clock_gettime()");
+        run();
+        errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &end) == -1,
+          "failed to fetch end time from clock_gettime()");
+
+        double const secs = (end.tv_sec - start.tv_sec) + 1e-9*(end.tv_nsec - start.tv_nsec);
+        printf("%lu frames in %.3f seconds (%.1f FPS)\n",
+               get_n_frames(), secs, get_n_frames()/secs);
+    }
+
     unload_rom();
 #endif
 
-    puts("Shut down cleanly");
+    deinit_null_backend();
 }
+
+#endif
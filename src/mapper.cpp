@@ -4,9 +4,10 @@
 #include "mapper.h"
 #include "rom.h"
 
-static uint8_t nop_read(uint16_t) { return cpu_data_bus; } // Return open bus by default
+static uint8_t nop_read(uint16_t) { return cpu.data_bus; } // Return open bus by default
 static void    nop_write(uint8_t, uint16_t) {}
 static void    nop_ppu_tick_callback() {}
+static unsigned no_ppu_irq() { return UINT_MAX; }
 
 // Implicitly NULL-initialized
 Mapper_fns mapper_fns_table[256];
@@ -24,12 +25,13 @@ DECLARE_STATE_FNS( 71) DECLARE_STATE_FNS(232)
 
 void init_mappers() {
     // All mappers have these
-    #define MAPPER_COMMON(n)                                                      \
-      void mapper_##n##_init();                                                   \
-      mapper_fns_table[n].init       = mapper_##n##_init;                         \
-      mapper_fns_table[n].state_size = transfer_mapper_##n##_state<true, false>;  \
-      mapper_fns_table[n].save_state = transfer_mapper_##n##_state<false, true>;  \
-      mapper_fns_table[n].load_state = transfer_mapper_##n##_state<false, false>;
+    #define MAPPER_COMMON(n)                                                             \
+      void mapper_##n##_init();                                                          \
+      mapper_fns_table[n].init               = mapper_##n##_init;                         \
+      mapper_fns_table[n].ppu_ticks_till_irq = no_ppu_irq;                                \
+      mapper_fns_table[n].state_size         = transfer_mapper_##n##_state<true, false>;  \
+      mapper_fns_table[n].save_state         = transfer_mapper_##n##_state<false, true>;  \
+      mapper_fns_table[n].load_state         = transfer_mapper_##n##_state<false, false>;
 
     // No mapper (hardwired/NROM)
     #define MAPPER_NONE(n)                                           \
@@ -70,6 +72,11 @@ void init_mappers() {
       mapper_fns_table[n].read_nt           = mapper_##n##_read_nt;           \
       mapper_fns_table[n].write_nt          = mapper_##n##_write_nt;          \
 
+    // Mapper whose ppu_tick_callback() can assert IRQ
+    #define MAPPER_PPU_IRQ(n)                                                   \
+      unsigned mapper_##n##_ppu_ticks_till_irq(void);                           \
+      mapper_fns_table[n].ppu_ticks_till_irq = mapper_##n##_ppu_ticks_till_irq;
+
     // NROM
     MAPPER_NONE(  0)
     // SxROM, all of which use the Nintendo MMC1
@@ -82,8 +89,10 @@ void init_mappers() {
     // Nintendo MMC3, Nintendo MMC6, or functional clones of any of the above. Most
     // games utilizing TxROM, DxROM, and HKROM boards use this designation."
     MAPPER_WP(    4)
+    MAPPER_PPU_IRQ(4)
     // MMC5/ExROM - Used by Castlevania III
     MAPPER_RWPN(  5)
+    MAPPER_PPU_IRQ(5)
     // AxROM - Rare games often use this one
     MAPPER_W(     7)
     // MMC2 - only used by Punch-Out!!
@@ -106,6 +115,7 @@ void init_mappers() {
     #undef MAPPER_W
     #undef MAPPER_WP
     #undef MAPPER_RWPN
+    #undef MAPPER_PPU_IRQ
 }
 
 //
@@ -115,20 +125,23 @@ void init_mappers() {
 // PRG is split up into four 8 KB pages to handle memory mapping. This is the
 // finest granularity switched by any mapper. These pointers point to the
 // beginning of each page.
-static uint8_t *prg_pages[4];
-static bool prg_page_is_ram[4]; // MMC5 can map WRAM into the $8000+ range
+static PER_CONSOLE uint8_t *prg_pages[4];
+static PER_CONSOLE bool prg_page_is_ram[4]; // MMC5 can map WRAM into the $8000+ range
 
 uint8_t read_prg(uint16_t addr) {
     return prg_pages[(addr >> 13) & 3][addr & 0x1FFF];
 }
 
 void write_prg(uint16_t addr, uint8_t val) {
-    if (prg_page_is_ram[(addr >> 13) & 3])
-        prg_pages[(addr >> 13) & 3][addr & 0x1FFF] = val;
+    if (prg_page_is_ram[(addr >> 13) & 3]) {
+        uint8_t *const page = prg_pages[(addr >> 13) & 3];
+        page[addr & 0x1FFF] = val;
+        mark_dirty(wram_stamps, page - wram_base + (addr & 0x1FFF));
+    }
 }
 
 // CHR is split up into eight 1 KB pages
-uint8_t *chr_pages[8];
+PER_CONSOLE uint8_t *chr_pages[8];
 
 void set_prg_32k_bank(unsigned bank) {
     if (prg_16k_banks == 1) {
@@ -217,7 +230,7 @@ void set_chr_1k_bank(unsigned n, unsigned bank) {
     chr_pages[n] = chr_base + 0x400*(bank & (8*chr_8k_banks - 1));
 }
 
-uint8_t *wram_6000_page;
+PER_CONSOLE uint8_t *wram_6000_page;
 
 void set_wram_6000_bank(unsigned bank) {
     wram_6000_page = wram_base + 0x2000*(bank & (wram_8k_banks - 1));
@@ -227,7 +240,7 @@ void set_wram_6000_bank(unsigned bank) {
 // Mirroring
 //
 
-Mirroring mirroring;
+PER_CONSOLE Mirroring mirroring;
 
 void set_mirroring(Mirroring m) {
     // In four-screen mode, the cart is assumed to be wired so that the mapper
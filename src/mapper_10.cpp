@@ -5,28 +5,30 @@
 #include "mapper.h"
 #include "ppu.h"
 
-static uint8_t prg_bank;
+static PER_CONSOLE struct STATE_BLOCK Mmc4_state {
+    uint8_t prg_bank;
 
-// Index 0 is from $B000/$D000, index 1 from $C000/$E000
-static uint8_t chr_low_bank[2];
-static uint8_t chr_high_bank[2];
+    // Index 0 is from $B000/$D000, index 1 from $C000/$E000
+    uint8_t chr_low_bank[2];
+    uint8_t chr_high_bank[2];
 
-static bool chr_low_uses_C000, chr_high_uses_E000;
+    bool chr_low_uses_C000, chr_high_uses_E000;
 
-// Assume the CHR switch-over happens when the PPU address bus goes from one of
-// the magic values to some other value (maybe not perfectly accurate, but
-// captures observed behavior)
-static uint16_t prev_ppu_addr_bus;
+    // Assume the CHR switch-over happens when the PPU address bus goes from one
+    // of the magic values to some other value (maybe not perfectly accurate,
+    // but captures observed behavior)
+    uint16_t prev_ppu_addr_bus;
 
-static bool horizontal_mirroring;
+    bool horizontal_mirroring;
+} mmc4;
 
 static void apply_state() {
-    set_prg_16k_bank(0, prg_bank);
+    set_prg_16k_bank(0, mmc4.prg_bank);
 
-    set_chr_4k_bank(0, chr_low_bank[chr_low_uses_C000]);
-    set_chr_4k_bank(1, chr_high_bank[chr_high_uses_E000]);
+    set_chr_4k_bank(0, mmc4.chr_low_bank[mmc4.chr_low_uses_C000]);
+    set_chr_4k_bank(1, mmc4.chr_high_bank[mmc4.chr_high_uses_E000]);
 
-    set_mirroring(horizontal_mirroring ? HORIZONTAL : VERTICAL);
+    set_mirroring(mmc4.horizontal_mirroring ? HORIZONTAL : VERTICAL);
 }
 
 void mapper_10_init() {
@@ -34,11 +36,11 @@ void mapper_10_init() {
     set_prg_16k_bank(1, -1);
 
     // Guess at defaults
-    prg_bank = 0;
-    chr_low_bank[0] = chr_low_bank[1] = 0;
-    chr_high_bank[0] = chr_high_bank[1] = 0;
-    chr_low_uses_C000 = chr_high_uses_E000 = false;
-    prev_ppu_addr_bus = 0;
+    mmc4.prg_bank = 0;
+    mmc4.chr_low_bank[0] = mmc4.chr_low_bank[1] = 0;
+    mmc4.chr_high_bank[0] = mmc4.chr_high_bank[1] = 0;
+    mmc4.chr_low_uses_C000 = mmc4.chr_high_uses_E000 = false;
+    mmc4.prev_ppu_addr_bus = 0;
 
     apply_state();
 }
@@ -47,38 +49,34 @@ void mapper_10_write(uint8_t val, uint16_t addr) {
     if (!(addr & 0x8000)) return;
 
     switch ((addr >> 12) & 7) {
-    case 2: prg_bank             = val & 0x0F; break; // 0xA000
-    case 3: chr_low_bank[0]      = val & 0x1F; break; // 0xB000
-    case 4: chr_low_bank[1]      = val & 0x1F; break; // 0xC000
-    case 5: chr_high_bank[0]     = val & 0x1F; break; // 0xD000
-    case 6: chr_high_bank[1]     = val & 0x1F; break; // 0xE000
-    case 7: horizontal_mirroring = val & 1;    break; // 0xF000
+    case 2: mmc4.prg_bank             = val & 0x0F; break; // 0xA000
+    case 3: mmc4.chr_low_bank[0]      = val & 0x1F; break; // 0xB000
+    case 4: mmc4.chr_low_bank[1]      = val & 0x1F; break; // 0xC000
+    case 5: mmc4.chr_high_bank[0]     = val & 0x1F; break; // 0xD000
+    case 6: mmc4.chr_high_bank[1]     = val & 0x1F; break; // 0xE000
+    case 7: mmc4.horizontal_mirroring = val & 1;    break; // 0xF000
     }
 
     apply_state();
 }
 
 void mapper_10_ppu_tick_callback() {
-    unsigned const magic_bits = ppu_addr_bus & 0x2FF8;
+    unsigned const magic_bits = ppu.addr_bus & 0x2FF8;
 
     if (magic_bits != 0x0FD8 && magic_bits != 0x0FE8) {
-        // ppu_addr_bus is non-magic
+        // ppu.addr_bus is non-magic
 
-        switch (prev_ppu_addr_bus) {
-        case 0x0FD8 ... 0x0FDF: chr_low_uses_C000  = false; apply_state(); break;
-        case 0x0FE8 ... 0x0FEF: chr_low_uses_C000  = true;  apply_state(); break;
-        case 0x1FD8 ... 0x1FDF: chr_high_uses_E000 = false; apply_state(); break;
-        case 0x1FE8 ... 0x1FEF: chr_high_uses_E000 = true;  apply_state(); break;
+        switch (mmc4.prev_ppu_addr_bus) {
+        case 0x0FD8 ... 0x0FDF: mmc4.chr_low_uses_C000  = false; apply_state(); break;
+        case 0x0FE8 ... 0x0FEF: mmc4.chr_low_uses_C000  = true;  apply_state(); break;
+        case 0x1FD8 ... 0x1FDF: mmc4.chr_high_uses_E000 = false; apply_state(); break;
+        case 0x1FE8 ... 0x1FEF: mmc4.chr_high_uses_E000 = true;  apply_state(); break;
         }
     }
 
-    prev_ppu_addr_bus = ppu_addr_bus;
+    mmc4.prev_ppu_addr_bus = ppu.addr_bus;
 }
 
 MAPPER_STATE_START(10)
-  TRANSFER(prg_bank)
-  TRANSFER(chr_low_bank) TRANSFER(chr_high_bank)
-  TRANSFER(chr_low_uses_C000) TRANSFER(chr_high_uses_E000)
-  TRANSFER(prev_ppu_addr_bus)
-  TRANSFER(horizontal_mirroring)
+  TRANSFER(mmc4)
 MAPPER_STATE_END(10)
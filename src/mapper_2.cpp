@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-static uint8_t prg_bank;
+static PER_CONSOLE uint8_t prg_bank;
 
 static void apply_state() {
     set_prg_16k_bank(0, prg_bank);
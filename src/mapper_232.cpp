@@ -7,22 +7,24 @@
 
 #include "mapper.h"
 
-// 64 KB block, selected by 0x8000-0x9FFF. Represented as an offset in 16 KB
-// units - always a multiple of four.
-static uint8_t block;
-// 16 KB Page within block, selected by 0xA000-0xFFFF
-static uint8_t page;
+static PER_CONSOLE struct STATE_BLOCK Camerica_state {
+    // 64 KB block, selected by 0x8000-0x9FFF. Represented as an offset in 16 KB
+    // units - always a multiple of four.
+    uint8_t block;
+    // 16 KB Page within block, selected by 0xA000-0xFFFF
+    uint8_t page;
+} camerica;
 
 static void apply_state() {
-    set_prg_16k_bank(0, block | page);
-    set_prg_16k_bank(1, block | 3);
+    set_prg_16k_bank(0, camerica.block | camerica.page);
+    set_prg_16k_bank(1, camerica.block | 3);
 }
 
 void mapper_232_init() {
     // CHR fixed
     set_chr_8k_bank(0);
 
-    block = page = 0;
+    camerica.block = camerica.page = 0;
     apply_state();
 }
 
@@ -31,15 +33,14 @@ void mapper_232_write(uint8_t val, uint16_t addr) {
 
     if (!((addr >> 13) & 3))
         // 0x8000-0x9FFF
-        block = (val & 0x18) >> 1;
+        camerica.block = (val & 0x18) >> 1;
     else
         // 0xA000-0xFFFF
-        page = val & 3;
+        camerica.page = val & 3;
 
     apply_state();
 }
 
 MAPPER_STATE_START(232)
-  TRANSFER(block)
-  TRANSFER(page)
+  TRANSFER(camerica)
 MAPPER_STATE_END(232)
@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-static uint8_t reg;
+static PER_CONSOLE uint8_t reg;
 
 static void apply_state() {
     set_mirroring(reg & 0x10 ? ONE_SCREEN_HIGH : ONE_SCREEN_LOW);
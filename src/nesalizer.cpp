@@ -0,0 +1,66 @@
+// Implementation of the C API in nesalizer.h. Thin wrappers around the rest of
+// the emulator, using the null backend for video and input.
+
+#include "common.h"
+
+#include "apu.h"
+#include "audio.h"
+#include "cpu.h"
+#include "input.h"
+#include "mapper.h"
+#include "nesalizer.h"
+#include "rom.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+
+char const *program_name = "libnesalizer";
+
+void nes_init() {
+    init_apu();
+    init_input();
+    init_mappers();
+}
+
+void nes_load_rom(void const *data, size_t size, char const *name) {
+    init_null_backend(0, 0, false);
+    load_rom_from_memory((uint8_t const*)data, size, name, false);
+    power_on();
+}
+
+void nes_unload_rom() {
+    unload_rom();
+    deinit_null_backend();
+}
+
+void nes_step_frame(uint8_t pad_1, uint8_t pad_2) {
+    set_button_states(0, pad_1);
+    set_button_states(1, pad_2);
+    run_frame();
+}
+
+uint32_t const *nes_get_frame() { return get_frame_buffer(); }
+
+uint16_t const *nes_get_frame_pixels() { return get_frame_pixels(); }
+
+int16_t const *nes_get_audio(size_t *n_samples) {
+    return get_frame_samples(*n_samples);
+}
+
+void nes_set_audio_mode(int mode) {
+    switch (mode) {
+    case NES_AUDIO_OFF:  set_audio_mode(AUDIO_OFF);  break;
+    case NES_AUDIO_LOW:  set_audio_mode(AUDIO_LOW);  break;
+    case NES_AUDIO_FULL: set_audio_mode(AUDIO_FULL); break;
+    default: fail("invalid audio mode %d", mode);
+    }
+}
+
+unsigned nes_audio_sample_rate() { return get_audio_sample_rate(); }
+
+size_t nes_state_size() { return get_state_size(); }
+
+void nes_save_state(void *buf) { save_state_to_buf((uint8_t*)buf); }
+
+void nes_load_state(void const *buf) { load_state_from_buf((uint8_t const*)buf); }
+
+void nes_reset() { soft_reset(); }
@@ -0,0 +1,119 @@
+// Null backend used for headless builds. Frames are rendered to memory, audio
+// is dropped after resampling, and input is read from a file. Nothing here
+// sleeps, so emulation runs as fast as the host allows.
+
+#include "common.h"
+
+#include "bench.h"
+#include "cpu.h"
+#include "input.h"
+#include "palette.h"
+#include "save_states.h"
+#include "sdl_backend.h"
+
+//
+// Video
+//
+
+// Allocated in init_null_backend() rather than being thread-local itself, as
+// every thread in the process gets a copy of each thread-local variable
+static PER_CONSOLE uint16_t *frame_buffer;
+// RGB version of frame_buffer, filled in by get_frame_buffer()
+static PER_CONSOLE uint32_t *argb_frame_buffer;
+
+// Number of frames completed. Used for the frame limit and for statistics.
+static PER_CONSOLE unsigned long n_frames;
+// Emulation ends after this many frames. 0 means no limit.
+static PER_CONSOLE unsigned long frame_limit;
+
+void put_pixel(unsigned x, unsigned y, uint16_t pixel) {
+    assert(x < 256);
+    assert(y < 240);
+
+    frame_buffer[256*y + x] = pixel;
+}
+
+void draw_frame() {
+    ++n_frames;
+}
+
+uint32_t const *get_frame_buffer() {
+    pixels_to_argb(frame_buffer, argb_frame_buffer, 240*256);
+    return argb_frame_buffer;
+}
+
+uint16_t const *get_frame_pixels() { return frame_buffer; }
+
+unsigned long get_n_frames() { return n_frames; }
+
+//
+// Input
+//
+
+// Input log. Null if no log is used.
+static PER_CONSOLE FILE *input_file;
+
+// True if rewind states should be recorded each frame
+static PER_CONSOLE bool record_rewind_states;
+
+// Sets the button states from the next entry in the input log. The first entry
+// is read in init_null_backend() and each following one at the end of the
+// preceding frame, so that entry k is used for frame k.
+static void read_input_entry() {
+    int const c1 = getc(input_file);
+    int const c2 = getc(input_file);
+    // Release all buttons at the end of the log
+    set_button_states(0, c1 == EOF ? 0 : c1);
+    set_button_states(1, c2 == EOF ? 0 : c2);
+}
+
+// Runs from emulation thread at the end of each frame
+void handle_ui_keys() {
+    if (input_file)
+        read_input_entry();
+
+    if (record_rewind_states)
+        handle_rewind(false);
+
+#ifdef INCLUDE_BENCH
+    bench_frame();
+#endif
+
+    if (frame_limit != 0 && n_frames >= frame_limit)
+        end_emulation();
+}
+
+void exit_sdl_thread() {}
+
+//
+// Initialization and de-initialization
+//
+
+void init_null_backend(char const *input_filename, unsigned long max_frames,
+                       bool record_rewind) {
+    fail_if(!(frame_buffer = alloc_array_init<uint16_t>(240*256, 0)),
+            "failed to allocate frame buffer");
+    fail_if(!(argb_frame_buffer = alloc_array_init<uint32_t>(240*256, 0)),
+            "failed to allocate RGB frame buffer");
+
+    n_frames    = 0;
+    frame_limit = max_frames;
+
+    record_rewind_states = record_rewind;
+
+    if (input_filename) {
+        errno_fail_if(!(input_file = fopen(input_filename, "rb")),
+          "failed to open input log '%s'", input_filename);
+        read_input_entry();
+    }
+}
+
+void deinit_null_backend() {
+    free_array_set_null(frame_buffer);
+    free_array_set_null(argb_frame_buffer);
+
+    if (input_file) {
+        fclose(input_file);
+        input_file = 0;
+    }
+}
@@ -0,0 +1,13 @@
+#include "common.h"
+
+#include "palette.h"
+
+#include "palette.inc"
+
+void pixels_to_argb(uint16_t const *pixels, uint32_t *argb, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        // The emphasis bits select the row and the NES color the column
+        unsigned const p = pixels[i];
+        argb[i] = nes_to_rgb[(p >> 6) & 7][p & 0x3F];
+    }
+}
@@ -1,128 +1,65 @@
 #include "common.h"
 
+#include "bench.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "profile.h"
 #include "mapper.h"
 #include "rom.h"
 #include "sdl_backend.h"
 #include "timing.h"
 
-#include "palette.inc"
-
-// Points to the current palette as determined by the color tint bits
-static uint32_t const     *pal_to_rgb;
+// The color tint bits in the position they have in output pixels (see
+// palette.h)
+static PER_CONSOLE unsigned           pixel_tint_bits;
 
 // If true, treat the emulated code as the first code that runs (i.e., not the
 // situation on PowerPak), which means writes to certain registers will be
 // inhibited during the initial frame. This breaks some demos.
-bool const                starts_on_initial_frame = false;
-
-uint8_t                   *ciram;
-
-unsigned                  prerender_line;
-
-static uint8_t            palettes[0x20];
-static uint8_t            oam[0x100];
-static uint8_t            sec_oam[0x20];
-
-// VRAM address/scroll regs. 15 bits long.
-static unsigned           t, v;
-static uint8_t            fine_x;
-// v is not immediately updated from t on the second write to $2006. This
-// variable implements the delay.
-static unsigned           pending_v_update;
-
-static unsigned           v_inc;           // $2000:2
-static uint16_t           sprite_pat_addr; // $2000:3
-static uint16_t           bg_pat_addr;     // $2000:4
-static enum Sprite_size {
-    EIGHT_BY_EIGHT,
-    EIGHT_BY_SIXTEEN
-}                         sprite_size;   // $2000:5
-static bool               nmi_on_vblank; // $2000:7
-
-// $2001:0 - 0x30 if grayscale mode enabled, otherwise 0x3F
-static uint8_t            grayscale_color_mask;
-static bool               show_bg_left_8;       // $2001:1
-static bool               show_sprites_left_8;  // $2001:2
-static bool               show_bg;              // $2001:3
-static bool               show_sprites;         // $2001:4
-static uint8_t            tint_bits;            // $2001:7-5
-
-bool                      rendering_enabled;
-// Optimizations - if bg/sprites are disabled, a value is set that causes
-// comparisons to always fail. If the leftmost 8 pixels should be clipped,
-// comparisons only fail for those pixels. Otherwise, comparisons never fail.
-static unsigned           bg_clip_comp;
-static unsigned           sprite_clip_comp;
-
-static bool               sprite_overflow; // $2002:5
-static bool               sprite_zero_hit; // $2002:6
-static bool               in_vblank;       // $2002:7
-
-static uint8_t            oam_addr; // $2003
-// Pointer into the secondary OAM, 5 bits wide
-//  - Updated during sprite evaluation and loading
-//  - Cleared at dots 64.5, 256.5 and 340.5, if rendering
-static unsigned           sec_oam_addr;
-static uint8_t            oam_data; // $2004 (seen when reading from $2004)
-
-// Sprite evaluation state
-
-// Goes high for three ticks when an in-range sprite is found during sprite
-// evaluation
-static unsigned           copy_sprite_signal;
-static bool               oam_addr_overflow, sec_oam_addr_overflow;
-static bool               overflow_detection;
-
-// PPUSCROLL/PPUADDR write flip-flop. First write when false, second write when
-// true.
-static bool               write_flip_flop;
-
-static uint8_t            ppu_data_reg; // $2007 read buffer
-
-static bool               odd_frame;
+bool const                            starts_on_initial_frame = false;
 
-uint64_t                  ppu_cycle;
+PER_CONSOLE uint8_t                   *ciram;
+PER_CONSOLE uint32_t                  *ciram_stamps;
 
-// Internal PPU counters and registers
+PER_CONSOLE unsigned                  prerender_line;
 
-unsigned                  dot, scanline;
+PER_CONSOLE Ppu_state                 ppu;
 
-static uint8_t            nt_byte, at_byte;
-static uint8_t            bg_byte_l, bg_byte_h;
-static uint16_t           bg_shift_l, bg_shift_h;
-static unsigned           at_shift_l, at_shift_h;
-static unsigned           at_latch_l, at_latch_h;
-
-static uint8_t            sprite_attribs[8];
-static uint8_t            sprite_x[8];
-static uint8_t            sprite_pat_l[8];
-static uint8_t            sprite_pat_h[8];
-
-static bool               s0_on_next_scanline;
-static bool               s0_on_cur_scanline;
-
-// Temporary storage (also exists in PPU) for data during sprite loading
-static uint8_t            sprite_y, sprite_index;
-static bool               sprite_in_range;
-
-// Writes to certain registers are suppressed during the initial frame:
-// http://wiki.nesdev.com/w/index.php/PPU_power_up_state
-//
-// Emulating this makes NY2011 and possibly other demos hang. They probably
-// don't run on the real thing either.
-static bool               initial_frame;
-
-unsigned                  ppu_addr_bus;
-
-// Open bus for reads from PPU $2000-$2007 (tested by ppu_open_bus.nes).
-// "wcycle" is short for "write cycle".
-
-static uint8_t            ppu_open_bus;
-static uint64_t           bit_7_6_wcycle, bit_5_wcycle, bit_4_0_wcycle;
-
-static unsigned           open_bus_decay_cycles;
+PER_CONSOLE bool                      rendering_enabled;
+// Optimizations - if bg/sprites are disabled, a value is set that causes
+// comparisons to always fail. If the leftmost 8 pixels should be clipped,
+// comparisons only fail for those pixels. Otherwise, comparisons never fail.
+static PER_CONSOLE unsigned           bg_clip_comp;
+static PER_CONSOLE unsigned           sprite_clip_comp;
+
+#ifdef CATCH_UP_PPU
+PER_CONSOLE unsigned                  ppu_ticks_owed;
+PER_CONSOLE unsigned                  ppu_ticks_till_event;
+#endif
+
+// Background palette indices (0-15, with 0 for transparent pixels) for the
+// eight pixels following the most recent shift register reload, indexed by
+// pixel % 8. Computed a tile at a time by calc_bg_tile_pixels(). Anything that
+// changes which shift register bits go to which pixel mid-tile (writes to
+// fine_x, rendering getting toggled) clears bg_tile_pixels_valid, making pixels
+// come straight from the shift registers until the next reload.
+static PER_CONSOLE uint8_t            bg_tile_pixels[8];
+static PER_CONSOLE bool               bg_tile_pixels_valid;
+
+// Sprite pixels for the line, built from the sprite output units by
+// build_sprite_line() so that get_sprite_pixel() can do a single lookup. Each
+// entry holds the pattern bits in bits 1-0 (zero means no sprite pixel), the
+// palette in bits 3-2, the behind-background bit in bit 5 (as in the
+// attribute byte), and whether the pixel comes from the first sprite output
+// unit in bit 7. Derived data, so not included in save states.
+static PER_CONSOLE uint8_t            sprite_line[256];
+// Set when the sprite output units have been modified since sprite_line was
+// built
+static PER_CONSOLE bool               sprite_line_dirty;
+// Set if sprite_line might have non-zero entries
+static PER_CONSOLE bool               sprites_on_line;
+
+static PER_CONSOLE unsigned           open_bus_decay_cycles;
 
 void init_ppu_for_rom() {
     prerender_line = is_pal ? 311 : 261;
@@ -131,31 +68,31 @@ void init_ppu_for_rom() {
 }
 
 static void open_bus_refreshed() {
-    bit_7_6_wcycle = bit_5_wcycle = bit_4_0_wcycle = ppu_cycle;
+    ppu.bit_7_6_wcycle = ppu.bit_5_wcycle = ppu.bit_4_0_wcycle = ppu.cycle;
 }
 
 static void open_bus_bits_7_to_5_refreshed() {
-    bit_7_6_wcycle = bit_5_wcycle = ppu_cycle;
+    ppu.bit_7_6_wcycle = ppu.bit_5_wcycle = ppu.cycle;
 }
 
 static void open_bus_bits_5_to_0_refreshed() {
-    bit_5_wcycle = bit_4_0_wcycle = ppu_cycle;
+    ppu.bit_5_wcycle = ppu.bit_4_0_wcycle = ppu.cycle;
 }
 
 static uint8_t get_open_bus_bits_7_to_6() {
-    return (ppu_cycle - bit_7_6_wcycle > open_bus_decay_cycles) ?
-             0 : ppu_open_bus & 0xC0;
+    return (ppu.cycle - ppu.bit_7_6_wcycle > open_bus_decay_cycles) ?
+             0 : ppu.open_bus & 0xC0;
 }
 
 static uint8_t get_open_bus_bits_4_to_0() {
-    return (ppu_cycle - bit_4_0_wcycle > open_bus_decay_cycles) ?
-             0 : ppu_open_bus & 0x1F;
+    return (ppu.cycle - ppu.bit_4_0_wcycle > open_bus_decay_cycles) ?
+             0 : ppu.open_bus & 0x1F;
 }
 
 static uint8_t get_all_open_bus_bits() {
     return get_open_bus_bits_7_to_6() |
-           ((ppu_cycle - bit_5_wcycle > open_bus_decay_cycles) ?
-             0 : ppu_open_bus & 0x20) |
+           ((ppu.cycle - ppu.bit_5_wcycle > open_bus_decay_cycles) ?
+             0 : ppu.open_bus & 0x20) |
            get_open_bus_bits_4_to_0();
 }
 
@@ -186,121 +123,166 @@ static uint8_t read_nt(uint16_t addr) {
 static void write_nt(uint16_t addr, uint8_t val) {
     if (mapper_fns.write_nt)
         mapper_fns.write_nt(val, addr);
-    else
-        ciram[get_mirrored_addr(addr)] = val;
+    else {
+        unsigned const ciram_addr = get_mirrored_addr(addr);
+        ciram[ciram_addr] = val;
+        mark_dirty(ciram_stamps, ciram_addr);
+    }
 }
 
 // Bumps the horizontal bits in v every eight pixels during rendering
 static void bump_horiz() {
     // Coarse x equal to 31?
-    if ((v & 0x1F) == 0x1F)
+    if ((ppu.v & 0x1F) == 0x1F)
         // Set coarse x to 0 and switch horizontal nametable. The bit twiddling
         // to clear the lower five bits relies on them being 1.
-        v ^= 0x041F;
-    else ++v;
+        ppu.v ^= 0x041F;
+    else ++ppu.v;
 }
 
 // Bumps the vertical bits in v at the end of each scanline during rendering
 static void bump_vert() {
     // Fine y equal to 7?
-    if ((v & 0x7000) == 0x7000)
+    if ((ppu.v & 0x7000) == 0x7000)
         // Check coarse y
-        switch (v & 0x03E0) {
+        switch (ppu.v & 0x03E0) {
 
         // Coarse y equal to 29. Switch vertical nametable (XOR by 0x0800) and
         // clear fine y and coarse y in the same operation (possible since we
         // know their value).
-        case 29 << 5: v ^= 0x7800 | (29 << 5); break;
+        case 29 << 5: ppu.v ^= 0x7800 | (29 << 5); break;
 
         // Coarse y equal to 31. Clear fine y and coarse y without switching
         // vertical nametable (this occurs for vertical scroll values > 240).
-        case 31 << 5: v &= ~0x73E0; break;
+        case 31 << 5: ppu.v &= ~0x73E0; break;
 
         // Clear fine y and increment coarse y
-        default: v = (v & ~0x7000) + 0x0020;
+        default: ppu.v = (ppu.v & ~0x7000) + 0x0020;
         }
     else
         // Bump fine y
-        v += 0x1000;
+        ppu.v += 0x1000;
 }
 
 // Restores the horizontal bits in v from t at the end of each scanline during
 // rendering
 static void copy_horiz() {
     // v: ... .H.. ...E DCBA = t: ... .H.. ...E DCBA
-    v = (v & ~0x041F) | (t & 0x041F);
+    ppu.v = (ppu.v & ~0x041F) | (ppu.t & 0x041F);
 }
 
 // Initializes the vertical bits in v from t on the pre-render line
 static void copy_vert() {
     // v: IHG F.ED CBA. .... = t: IHG F.ED CBA. ....
-    v = (v & ~0x7BE0) | (t & 0x7BE0);
+    ppu.v = (ppu.v & ~0x7BE0) | (ppu.t & 0x7BE0);
 }
 
 // Fetches nametable and tile bytes for the background
 static void do_bg_fetches() {
-    switch ((dot - 1) % 8) {
+    switch ((ppu.dot - 1) % 8) {
 
     // NT byte
-    case 0: ppu_addr_bus = 0x2000 | (v & 0x0FFF); break;
-    case 1: nt_byte = read_nt(ppu_addr_bus);      break;
+    case 0: ppu.addr_bus = 0x2000 | (ppu.v & 0x0FFF); break;
+    case 1: ppu.nt_byte = read_nt(ppu.addr_bus);      break;
 
     // AT byte
     case 2:
         //    yyy NNAB CDEG HIJK
         // =>  10 NN11 11AB CGHI
         // 1162 is the Visual 2C02 signal that sets up this address
-        ppu_addr_bus = 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 7);
+        ppu.addr_bus = 0x23C0 | (ppu.v & 0x0C00) | ((ppu.v >> 4) & 0x38) | ((ppu.v >> 2) & 7);
         break;
     case 3:
-        at_byte = read_nt(ppu_addr_bus);
+        ppu.at_byte = read_nt(ppu.addr_bus);
         break;
 
     // Low BG tile byte
     case 4:
-        assert(v <= 0x7FFF);
-        ppu_addr_bus = bg_pat_addr + 16*nt_byte + (v >> 12);
+        assert(ppu.v <= 0x7FFF);
+        ppu.addr_bus = ppu.bg_pat_addr + 16*ppu.nt_byte + (ppu.v >> 12);
         break;
     case 5:
-        bg_byte_l = chr_ref(ppu_addr_bus);
+        ppu.bg_byte_l = chr_ref(ppu.addr_bus);
         break;
 
     // High BG tile byte and horizontal bump
     case 6:
-        assert(v <= 0x7FFF);
-        ppu_addr_bus = bg_pat_addr + 16*nt_byte + (v >> 12) + 8;
+        assert(ppu.v <= 0x7FFF);
+        ppu.addr_bus = ppu.bg_pat_addr + 16*ppu.nt_byte + (ppu.v >> 12) + 8;
         break;
     case 7:
-        bg_byte_h = chr_ref(ppu_addr_bus);
+        ppu.bg_byte_h = chr_ref(ppu.addr_bus);
         bump_horiz();
         break;
     }
 }
 
+// Renders the sprites in the sprite output units into sprite_line. Where
+// sprites overlap, the non-transparent pixel from the lowest-numbered output
+// unit wins, same as in the PPU.
+static void build_sprite_line() {
+    sprite_line_dirty = false;
+
+    if (sprites_on_line) {
+        init_array(sprite_line, (uint8_t)0);
+        sprites_on_line = false;
+    }
+
+    // Go backwards so that lower-numbered sprites overwrite higher-numbered
+    // ones
+    for (unsigned i = 8; i-- > 0;) {
+        if (!(ppu.sprite_pat_l[i] | ppu.sprite_pat_h[i]))
+            continue;
+        sprites_on_line = true;
+
+        unsigned const info = ((ppu.sprite_attribs[i] & 3) << 2) |
+                              (ppu.sprite_attribs[i] & 0x20) |
+                              (i == 0 ? 0x80 : 0);
+        // Sprites can extend past the right edge of the screen
+        unsigned const n_pixels = min(8u, 256u - ppu.sprite_x[i]);
+        for (unsigned offset = 0; offset < n_pixels; ++offset) {
+            unsigned const pat_res = (NTH_BIT(ppu.sprite_pat_h[i], 7 - offset) << 1) |
+                                      NTH_BIT(ppu.sprite_pat_l[i], 7 - offset);
+            if (pat_res)
+                sprite_line[ppu.sprite_x[i] + offset] = info | pat_res;
+        }
+    }
+}
+
 // Looks for an in-range sprite pixel at the current location.
 // Performance hotspot!
-// Possible optimization: Set flag if any sprites on the line
 static unsigned get_sprite_pixel(unsigned &spr_pal, bool &spr_behind_bg, bool &spr_is_s0) {
-    unsigned const pixel = dot - 2;
+    unsigned const pixel = ppu.dot - 2;
     // Equivalent to 'if (!show_sprites || (!show_sprites_left_8 && pixel < 8))'
     if (pixel < sprite_clip_comp)
         return 0;
 
-    for (unsigned i = 0; i < 8; ++i) {
-        unsigned const offset = pixel - sprite_x[i];
-        if (offset < 8) { // offset >= 0 && offset < 8
-            unsigned const pat_res = (NTH_BIT(sprite_pat_h[i], 7 - offset) << 1) |
-                                      NTH_BIT(sprite_pat_l[i], 7 - offset);
-            if (pat_res) {
-                spr_pal       = sprite_attribs[i] & 3;
-                spr_behind_bg = sprite_attribs[i] & 0x20;
-                spr_is_s0     = s0_on_cur_scanline && (i == 0);
-                return pat_res;
-            }
-        }
-    }
+    // The line is normally built at the end of sprite loading. This catches
+    // loading being cut short by rendering getting disabled, and state loads.
+    if (sprite_line_dirty)
+        build_sprite_line();
+
+    if (!sprites_on_line)
+        return 0;
 
-    return 0;
+    unsigned const spr = sprite_line[pixel];
+    spr_pal       = (spr >> 2) & 3;
+    spr_behind_bg = spr & 0x20;
+    spr_is_s0     = ppu.s0_on_cur_scanline && (spr & 0x80);
+    return spr & 3;
+}
+
+// Returns the background palette index for the current pixel, reading the
+// shift registers directly. Only used when bg_tile_pixels isn't valid.
+static unsigned get_bg_pixel_from_shift_regs() {
+    unsigned const bg_pixel_pat = (NTH_BIT(ppu.bg_shift_h, 15 - ppu.fine_x) << 1) |
+                                   NTH_BIT(ppu.bg_shift_l, 15 - ppu.fine_x);
+    if (!bg_pixel_pat)
+        return 0;
+
+    unsigned const attr_bits = (NTH_BIT(ppu.at_shift_h, 7 - ppu.fine_x) << 1) |
+                                NTH_BIT(ppu.at_shift_l, 7 - ppu.fine_x);
+    return (attr_bits << 2) | bg_pixel_pat;
 }
 
 // Fetches pixels from the background and sprite shift registers and produces
@@ -308,16 +290,16 @@ static unsigned get_sprite_pixel(unsigned &spr_pal, bool &spr_behind_bg, bool &s
 // priority. Also handles sprite zero hit detection.
 // Performance hotspot!
 static void do_pixel_output_and_sprite_zero() {
-    unsigned const pixel = dot - 2;
+    unsigned const pixel = ppu.dot - 2;
     unsigned pal_index;
 
     if (!rendering_enabled)
         // If v points in the $3Fxx range while rendering is disabled, the
         // color from that palette index is displayed instead of the background
         // color
-        pal_index = (~v & 0x3F00) ? 0 : v & 0x1F;
+        pal_index = (~ppu.v & 0x3F00) ? 0 : ppu.v & 0x1F;
     else {
-        unsigned       bg_pixel_pat;
+        unsigned       bg_pixel; // Palette index, or 0 if transparent
 
         bool           spr_behind_bg, spr_is_s0;
         unsigned       spr_pal;
@@ -325,46 +307,77 @@ static void do_pixel_output_and_sprite_zero() {
 
         // Equivalent to 'if (!show_bg || (!show_bg_left_8 && pixel < 8))'
         if (pixel < bg_clip_comp)
-            bg_pixel_pat = 0;
+            bg_pixel = 0;
         else {
-            bg_pixel_pat = (NTH_BIT(bg_shift_h, 15 - fine_x) << 1) |
-                            NTH_BIT(bg_shift_l, 15 - fine_x);
+            bg_pixel = bg_tile_pixels_valid ? bg_tile_pixels[pixel % 8]
+                                            : get_bg_pixel_from_shift_regs();
 
-            if (spr_pat && spr_is_s0 && bg_pixel_pat && pixel != 255)
-                sprite_zero_hit = true;
+            if (spr_pat && spr_is_s0 && bg_pixel && pixel != 255)
+                ppu.sprite_zero_hit = true;
         }
 
-        if (spr_pat && !(spr_behind_bg && bg_pixel_pat))
+        if (spr_pat && !(spr_behind_bg && bg_pixel))
             pal_index = 0x10 + (spr_pal << 2) + spr_pat;
-        else {
-            if (!bg_pixel_pat)
-                pal_index = 0;
-            else {
-                unsigned const attr_bits = (NTH_BIT(at_shift_h, 7 - fine_x) << 1) |
-                                            NTH_BIT(at_shift_l, 7 - fine_x);
-                pal_index = (attr_bits << 2) | bg_pixel_pat;
-            }
-        }
+        else
+            pal_index = bg_pixel;
     }
 
-    put_pixel(pixel, scanline, pal_to_rgb[palettes[pal_index] & grayscale_color_mask]);
+    put_pixel(pixel, ppu.scanline, pixel_tint_bits | (ppu.palettes[pal_index] & ppu.grayscale_color_mask));
+}
+
+// Spreads the bits of 'byte' over the bytes of the result, with bit 7 going to
+// the byte at the lowest address. Each byte becomes 0 or 1.
+static uint64_t spread_bits(unsigned byte) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t const bit_masks = UINT64_C(0x0102040810204080);
+#else
+    uint64_t const bit_masks = UINT64_C(0x8040201008040201);
+#endif
+    uint64_t const bits = (byte*UINT64_C(0x0101010101010101)) & bit_masks;
+    // Moves bit 7 of each byte to bit 0. No byte exceeds 0x80, so the
+    // addition never carries into the next byte.
+    return ((bits + UINT64_C(0x7F7F7F7F7F7F7F7F)) >> 7) & UINT64_C(0x0101010101010101);
+}
+
+// Computes bg_tile_pixels for the eight pixels following a shift register
+// reload. Each pixel gets its own byte in a 64-bit word, so that all eight are
+// computed at once.
+static void calc_bg_tile_pixels() {
+    // Pixel n (0-7) uses bit 15 - fine_x - n of the pattern shift registers.
+    // The attribute shift registers are eight bits wide and get the latched
+    // attribute bits shifted in at the bottom, so extend them with eight
+    // copies of the latch to get the same layout.
+    unsigned const shift = 8 - ppu.fine_x;
+    unsigned const pat_l = (ppu.bg_shift_l >> shift) & 0xFF;
+    unsigned const pat_h = (ppu.bg_shift_h >> shift) & 0xFF;
+    unsigned const at_l  = ((((ppu.at_shift_l & 0xFF) << 8) | 0xFF*ppu.at_latch_l) >> shift) & 0xFF;
+    unsigned const at_h  = ((((ppu.at_shift_h & 0xFF) << 8) | 0xFF*ppu.at_latch_h) >> shift) & 0xFF;
+
+    uint64_t const pixels = spread_bits(pat_l)      | (spread_bits(pat_h) << 1) |
+                            (spread_bits(at_l) << 2) | (spread_bits(at_h) << 3);
+    // Transparent pixels are 0 regardless of the attribute bits
+    uint64_t const opaque_mask = 0x0F*spread_bits(pat_l | pat_h);
+
+    uint64_t const res = pixels & opaque_mask;
+    memcpy(bg_tile_pixels, &res, sizeof bg_tile_pixels);
+    bg_tile_pixels_valid = true;
 }
 
 // Shifts the background shift registers, reloading the upper eight bits and
 // the attribute bits every eight pixels
 static void do_shifts_and_reloads() {
-    assert(at_latch_l <= 1);
-    assert(at_latch_h <= 1);
+    assert(ppu.at_latch_l <= 1);
+    assert(ppu.at_latch_h <= 1);
 
-    bg_shift_l <<= 1;
-    bg_shift_h <<= 1;
-    at_shift_l = (at_shift_l << 1) | at_latch_l;
-    at_shift_h = (at_shift_h << 1) | at_latch_h;
+    ppu.bg_shift_l <<= 1;
+    ppu.bg_shift_h <<= 1;
+    ppu.at_shift_l = (ppu.at_shift_l << 1) | ppu.at_latch_l;
+    ppu.at_shift_h = (ppu.at_shift_h << 1) | ppu.at_latch_h;
 
-    if (dot % 8 == 1) {
+    if (ppu.dot % 8 == 1) {
         // Reload regs
-        bg_shift_l = (bg_shift_l & 0xFF00) | bg_byte_l;
-        bg_shift_h = (bg_shift_h & 0xFF00) | bg_byte_h;
+        ppu.bg_shift_l = (ppu.bg_shift_l & 0xFF00) | ppu.bg_byte_l;
+        ppu.bg_shift_h = (ppu.bg_shift_h & 0xFF00) | ppu.bg_byte_h;
 
         // v:
         //
@@ -395,26 +408,28 @@ static void do_shifts_and_reloads() {
         // unsigned const coarse_y = (v >> 5) & 0x1F;
         // unsigned const at_bits =
         //   at_byte >> 2*((coarse_y & 0x02) | (((coarse_x - 1) & 0x02) >> 1));
-        unsigned const at_bits = at_byte >> (((v >> 4) & 4) | ((v - 1) & 2));
+        unsigned const at_bits = ppu.at_byte >> (((ppu.v >> 4) & 4) | ((ppu.v - 1) & 2));
+
+        ppu.at_latch_l = at_bits & 1;
+        ppu.at_latch_h = (at_bits >> 1) & 1;
 
-        at_latch_l = at_bits & 1;
-        at_latch_h = (at_bits >> 1) & 1;
+        calc_bg_tile_pixels();
     }
 }
 
 // Bumps the OAM and secondary OAM addresses, detecting overflow in either one
 static void move_to_next_oam_byte() {
-    oam_addr     = (oam_addr     + 1) & 0xFF;
-    sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+    ppu.oam_addr     = (ppu.oam_addr     + 1) & 0xFF;
+    ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
 
-    if (oam_addr == 0)
-        oam_addr_overflow = true;
+    if (ppu.oam_addr == 0)
+        ppu.oam_addr_overflow = true;
 
-    if (sec_oam_addr == 0) {
-        sec_oam_addr_overflow = true;
+    if (ppu.sec_oam_addr == 0) {
+        ppu.sec_oam_addr_overflow = true;
         // If sec_oam_addr becomes zero, eight sprites have been found, and we
         // enter overflow glitch mode
-        overflow_detection = true;
+        ppu.overflow_detection = true;
     }
 }
 
@@ -422,71 +437,71 @@ static void move_to_next_oam_byte() {
 // linear search of the primary OAM is performed, and sprites found to be
 // within range are copied into the secondary OAM.
 static void do_sprite_evaluation() {
-    if (dot == 65) {
+    if (ppu.dot == 65) {
         // TODO: Should these be cleared even if rendering is disabled?
-        overflow_detection = oam_addr_overflow = sec_oam_addr_overflow = false;
-        sec_oam_addr = 0;
+        ppu.overflow_detection = ppu.oam_addr_overflow = ppu.sec_oam_addr_overflow = false;
+        ppu.sec_oam_addr = 0;
     }
 
-    if (dot & 1) {
+    if (ppu.dot & 1) {
         // On odd ticks, data is read from OAM
-        oam_data = oam[oam_addr];
+        ppu.oam_data = ppu.oam[ppu.oam_addr];
         return;
     }
 
     // We need the original value to implement sprite overflow checking. It
     // might get overwritten below.
-    uint8_t const orig_oam_data = oam_data;
+    uint8_t const orig_oam_data = ppu.oam_data;
 
     // On even ticks, data is written into secondary OAM...
-    if (!(oam_addr_overflow || sec_oam_addr_overflow))
-        sec_oam[sec_oam_addr] = oam_data;
+    if (!(ppu.oam_addr_overflow || ppu.sec_oam_addr_overflow))
+        ppu.sec_oam[ppu.sec_oam_addr] = ppu.oam_data;
     else
         // ...unless we have OAM or secondary OAM overflow, in which case we
         // get a read from secondary OAM instead
-        oam_data = sec_oam[sec_oam_addr];
+        ppu.oam_data = ppu.sec_oam[ppu.sec_oam_addr];
 
-    if (copy_sprite_signal > 0) {
+    if (ppu.copy_sprite_signal > 0) {
         // We're currently copying data for a sprite
-        --copy_sprite_signal;
+        --ppu.copy_sprite_signal;
         move_to_next_oam_byte();
         return;
     }
 
     // Is the current sprite in range?
-    bool const in_range = (scanline - orig_oam_data) < (sprite_size == EIGHT_BY_EIGHT ? 8 : 16);
+    bool const in_range = (ppu.scanline - orig_oam_data) < (ppu.sprite_size == EIGHT_BY_EIGHT ? 8 : 16);
     // At dot 66 we're evaluating sprite zero. This is how the hardware does it.
-    if (dot == 66)
-        s0_on_next_scanline = in_range;
+    if (ppu.dot == 66)
+        ppu.s0_on_next_scanline = in_range;
 
-    if (in_range && !(oam_addr_overflow || sec_oam_addr_overflow)) {
+    if (in_range && !(ppu.oam_addr_overflow || ppu.sec_oam_addr_overflow)) {
         // In-range sprite found. Copy it.
-        copy_sprite_signal = 3;
+        ppu.copy_sprite_signal = 3;
         move_to_next_oam_byte();
         return;
     }
 
     // Sprite is not in range (or we have OAM or secondary OAM overflow)
 
-    if (!overflow_detection) {
+    if (!ppu.overflow_detection) {
         // Clear low bits, bump high (HW does this, even though the low
         // clearing wouldn't usually be noticeable)
-        oam_addr = (oam_addr + 4) & 0xFC;
-        if (oam_addr == 0)
-            oam_addr_overflow = true;
+        ppu.oam_addr = (ppu.oam_addr + 4) & 0xFC;
+        if (ppu.oam_addr == 0)
+            ppu.oam_addr_overflow = true;
     }
     else {
-        if (in_range && !oam_addr_overflow) {
-            sprite_overflow = true;
-            overflow_detection = false;
+        if (in_range && !ppu.oam_addr_overflow) {
+            ppu.sprite_overflow = true;
+            ppu.overflow_detection = false;
         }
         else {
             // Glitchy oam_addr increment after exactly eight
             // sprites have been found:
             // http://wiki.nesdev.com/w/index.php/PPU_sprite_evaluation
-            oam_addr = ((oam_addr + 4) & 0xFC) | ((oam_addr + 1) & 3);
-            if ((oam_addr & 0xFC) == 0)
-                oam_addr_overflow = true;
+            ppu.oam_addr = ((ppu.oam_addr + 4) & 0xFC) | ((ppu.oam_addr + 1) & 3);
+            if ((ppu.oam_addr & 0xFC) == 0)
+                ppu.oam_addr_overflow = true;
         }
     }
 }
@@ -507,16 +522,16 @@ static bool calc_sprite_tile_addr(uint8_t y, uint8_t index, uint8_t attrib, bool
     //           horizontal position in the hardware.
     //
     //   ab2-0 : Bits 2-0 of scanline - y, possibly y-flipped
-    unsigned const diff        = scanline - y;
+    unsigned const diff        = ppu.scanline - y;
     unsigned const diff_y_flip = (attrib & 0x80) ? ~diff : diff;
 
-    if (sprite_size == EIGHT_BY_EIGHT) {
-        ppu_addr_bus = sprite_pat_addr + 16*index + 8*is_high + (diff_y_flip & 7);
+    if (ppu.sprite_size == EIGHT_BY_EIGHT) {
+        ppu.addr_bus = ppu.sprite_pat_addr + 16*index + 8*is_high + (diff_y_flip & 7);
         // Equivalent to diff >= 0 && diff < 8 due to unsigned arithmetic
         return diff < 8;
     }
     else { // EIGHT_BY_SIXTEEN
-        ppu_addr_bus = 0x1000*(index & 1) + 16*(index & 0xFE) + ((diff_y_flip & 8) << 1)
+        ppu.addr_bus = 0x1000*(index & 1) + 16*(index & 0xFE) + ((diff_y_flip & 8) << 1)
                                           + 8*is_high + (diff_y_flip & 7);
         return diff < 16;
     }
@@ -526,19 +541,21 @@ static bool calc_sprite_tile_addr(uint8_t y, uint8_t index, uint8_t attrib, bool
 // the secondary OAM during sprite evaluation
 static void do_sprite_loading() {
     // This is position-based in the hardware as well
-    unsigned const sprite_n = (dot - 257)/8;
+    unsigned const sprite_n = (ppu.dot - 257)/8;
 
-    if (dot == 257)
-        sec_oam_addr = 0;
+    if (ppu.dot == 257) {
+        ppu.sec_oam_addr = 0;
+        sprite_line_dirty = true;
+    }
 
     // Sprite 0 flag timing:
     //  - s0_on_next_scanline is initialized at dot = 66.5-67 (during sprite
     //    evaluation for sprite 0)
     //  - It is copied over to s0_on_cur_scanline during dots
     //    257.5-258, 258.5-259, ..., 319.5-320
-    s0_on_cur_scanline = s0_on_next_scanline;
+    ppu.s0_on_cur_scanline = ppu.s0_on_next_scanline;
 
-    switch ((dot - 1) % 8) {
+    switch ((ppu.dot - 1) % 8) {
 
     // Load sprite attributes from secondary OAM
 
@@ -546,51 +563,54 @@ static void do_sprite_loading() {
         // TODO: How does the sprite_y/index loading work in detail?
 
         // Dummy NT fetch
-        ppu_addr_bus = 0x2000 | (v & 0x0FFF);
+        ppu.addr_bus = 0x2000 | (ppu.v & 0x0FFF);
 
-        sprite_y = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        ppu.sprite_y = ppu.sec_oam[ppu.sec_oam_addr];
+        ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
         break;
     case 1:
-        sprite_index = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        ppu.sprite_index = ppu.sec_oam[ppu.sec_oam_addr];
+        ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
         break;
     case 2:
         // Dummy "AT" fetch, which is actually an NT fetch too
-        ppu_addr_bus = 0x2000 | (v & 0x0FFF);
+        ppu.addr_bus = 0x2000 | (ppu.v & 0x0FFF);
 
-        sprite_attribs[sprite_n] = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        ppu.sprite_attribs[sprite_n] = ppu.sec_oam[ppu.sec_oam_addr];
+        ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
         break;
     case 3:
-        sprite_x[sprite_n] = sec_oam[sec_oam_addr];
-        sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+        ppu.sprite_x[sprite_n] = ppu.sec_oam[ppu.sec_oam_addr];
+        ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
         break;
 
     // Load low sprite tile byte
 
     case 4:
-        sprite_in_range =
-          calc_sprite_tile_addr(sprite_y, sprite_index, sprite_attribs[sprite_n], false);
+        ppu.sprite_in_range =
+          calc_sprite_tile_addr(ppu.sprite_y, ppu.sprite_index, ppu.sprite_attribs[sprite_n], false);
         break;
     case 5:
-        sprite_pat_l[sprite_n] = sprite_in_range ? chr_ref(ppu_addr_bus) : 0;
+        ppu.sprite_pat_l[sprite_n] = ppu.sprite_in_range ? chr_ref(ppu.addr_bus) : 0;
         // Horizontal flipping
-        if (sprite_attribs[sprite_n] & 0x40)
-            sprite_pat_l[sprite_n] = rev_byte(sprite_pat_l[sprite_n]);
+        if (ppu.sprite_attribs[sprite_n] & 0x40)
+            ppu.sprite_pat_l[sprite_n] = rev_byte(ppu.sprite_pat_l[sprite_n]);
         break;
 
     // Load high sprite tile byte
 
     case 6:
-        sprite_in_range =
-          calc_sprite_tile_addr(sprite_y, sprite_index, sprite_attribs[sprite_n], true);
+        ppu.sprite_in_range =
+          calc_sprite_tile_addr(ppu.sprite_y, ppu.sprite_index, ppu.sprite_attribs[sprite_n], true);
         break;
     case 7:
-        sprite_pat_h[sprite_n] = sprite_in_range ? chr_ref(ppu_addr_bus) : 0;
+        ppu.sprite_pat_h[sprite_n] = ppu.sprite_in_range ? chr_ref(ppu.addr_bus) : 0;
         // Horizontal flipping
-        if (sprite_attribs[sprite_n] & 0x40)
-            sprite_pat_h[sprite_n] = rev_byte(sprite_pat_h[sprite_n]);
+        if (ppu.sprite_attribs[sprite_n] & 0x40)
+            ppu.sprite_pat_h[sprite_n] = rev_byte(ppu.sprite_pat_h[sprite_n]);
+
+        if (sprite_n == 7)
+            build_sprite_line();
         break;
 
     default: UNREACHABLE
@@ -603,56 +623,56 @@ static void do_render_line_ops() {
     // We get a short dummy bg-related fetch here. Probably not worth
     // emulating the exact address.
     // TODO: This breaks mmc3_test_2 - look into it more
-    //if (dot == 0) ppu_addr_bus = bg_pat_addr;
+    //if (ppu.dot == 0) ppu.addr_bus = ppu.bg_pat_addr;
 
-    if ((dot >= 2 && dot <= 257) || (dot >= 322 && dot <= 337))
+    if ((ppu.dot >= 2 && ppu.dot <= 257) || (ppu.dot >= 322 && ppu.dot <= 337))
         do_shifts_and_reloads();
 
-    switch (dot) {
+    switch (ppu.dot) {
     case 1 ... 256: case 321 ... 336:
         // Possible optimization: Could be merged to save double decoding of dot
         do_bg_fetches();
-        if (dot == 256)
+        if (ppu.dot == 256)
             bump_vert();
         break;
 
     case 257 ... 320:
         // Possible optimization: Could be merged to save double decoding of dot
         do_sprite_loading();
-        oam_addr = 0;
-        if (dot == 257)
+        ppu.oam_addr = 0;
+        if (ppu.dot == 257)
             copy_horiz();
         break;
 
     case 337: case 339:
         // Dummy NT fetches
-        ppu_addr_bus = 0x2000 | (v & 0xFFF);
+        ppu.addr_bus = 0x2000 | (ppu.v & 0xFFF);
         break;
 
     case 341:
-        sec_oam_addr = 0;
+        ppu.sec_oam_addr = 0;
         break;
     }
 }
 
 // Called for dots on the visible lines (0-239)
 static void do_visible_line_ops() {
-    if (dot >= 2 && dot <= 257)
+    if (ppu.dot >= 2 && ppu.dot <= 257)
         do_pixel_output_and_sprite_zero();
 
     if (rendering_enabled) {
         do_render_line_ops();
 
-        switch (dot) {
+        switch (ppu.dot) {
         case 1 ... 64:
             // Secondary OAM clear
-            if (dot & 1)
-                oam_data = 0xFF;
+            if (ppu.dot & 1)
+                ppu.oam_data = 0xFF;
             else {
-                sec_oam[sec_oam_addr] = oam_data;
+                ppu.sec_oam[ppu.sec_oam_addr] = ppu.oam_data;
                 // Should this be done when setting oam_data? Extremely
                 // obscure.
-                sec_oam_addr = (sec_oam_addr + 1) & 0x1F;
+                ppu.sec_oam_addr = (ppu.sec_oam_addr + 1) & 0x1F;
             }
             break;
 
@@ -664,9 +684,9 @@ static void do_visible_line_ops() {
 
 // Called for dots on line 241
 static void do_line_241_ops() {
-    if (dot == 1) {
-        in_vblank = true;
-        set_nmi(nmi_on_vblank);
+    if (ppu.dot == 1) {
+        ppu.in_vblank = true;
+        set_nmi(ppu.nmi_on_vblank);
     }
 }
 
@@ -674,9 +694,9 @@ static void do_line_241_ops() {
 static void do_prerender_line_ops() {
     // This might be one tick off due to the possibility of reading the flags
     // really shortly after they are cleared in the preferred alignment
-    if (dot == 1) sprite_overflow = sprite_zero_hit = initial_frame = false;
+    if (ppu.dot == 1) ppu.sprite_overflow = ppu.sprite_zero_hit = ppu.initial_frame = false;
     // TODO: Explain why the timing works out like this (and is it cycle-perfect?)
-    if (dot == 2) in_vblank = false;
+    if (ppu.dot == 2) ppu.in_vblank = false;
 
     if (rendering_enabled) {
         do_render_line_ops();
@@ -685,10 +705,10 @@ static void do_prerender_line_ops() {
         // prerender line the hardware. There's an "in visible frame"
         // condition on the value the flag is initialized to - hence it
         // always becomes false.
-        if (dot == 66)
-            s0_on_next_scanline = false;
+        if (ppu.dot == 66)
+            ppu.s0_on_next_scanline = false;
 
-        if (dot >= 280 && dot <= 304)
+        if (ppu.dot >= 280 && ppu.dot <= 304)
             copy_vert();
     }
 }
@@ -702,57 +722,95 @@ static void do_prerender_line_ops() {
 // compile-time constants here for performance.
 template<bool IS_PAL, unsigned PRERENDER_LINE>
 static void tick_ppu() {
-    ++ppu_cycle;
+    ++ppu.cycle;
 
     // Move to next tick - doing this first mirrors how Visual 2C02 views it
-    if (++dot == 341) {
-        dot = 0;
-        ++scanline;
+    if (++ppu.dot == 341) {
+        ppu.dot = 0;
+        ++ppu.scanline;
         // Possible optimization: set an enum indicating the scanline range
         // here and use below (SCANLINE_0_TO_239, SCANLINE_241, etc.)
-        switch (scanline) {
+        switch (ppu.scanline) {
         case 240:
             frame_completed();
             // The PPU address bus mirrors v outside of rendering
-            ppu_addr_bus = v & 0x3FFF;
+            ppu.addr_bus = ppu.v & 0x3FFF;
             break;
 
         case PRERENDER_LINE + 1:
-            scanline = 0;
+            ppu.scanline = 0;
             if (!IS_PAL) {
-                if (rendering_enabled && odd_frame) ++dot;
-                odd_frame = !odd_frame;
+                if (rendering_enabled && ppu.odd_frame) ++ppu.dot;
+                ppu.odd_frame = !ppu.odd_frame;
             }
         }
     }
 
-    if (pending_v_update > 0 && --pending_v_update == 0) {
-        v = t;
-        if ((scanline >= 240 && scanline < PRERENDER_LINE) || !rendering_enabled)
+    if (ppu.pending_v_update > 0 && --ppu.pending_v_update == 0) {
+        ppu.v = ppu.t;
+        if ((ppu.scanline >= 240 && ppu.scanline < PRERENDER_LINE) || !rendering_enabled)
             // The PPU address bus mirrors v outside of rendering
-            ppu_addr_bus = v & 0x3FFF;
+            ppu.addr_bus = ppu.v & 0x3FFF;
     }
 
-    switch (scanline) {
+    switch (ppu.scanline) {
     case 0 ... 239     : do_visible_line_ops();   break;
     case 241           : do_line_241_ops();       break;
     case PRERENDER_LINE: do_prerender_line_ops();
     }
 
-    // Mapper-specific operations - usually to snoop on ppu_addr_bus
-    mapper_fns.ppu_tick_callback();
+    // Mapper-specific operations - usually to snoop on ppu.addr_bus
+    PROFILE_CALL(PROF_MAPPER_PPU_TICK, mapper_fns.ppu_tick_callback());
 }
 
 void tick_ntsc_ppu() {
-    tick_ppu<false, 261>();
+    PROFILE_CALL(PROF_TICK_PPU, tick_ppu<false, 261>());
 }
 
 void tick_pal_ppu() {
-    tick_ppu<true, 311>();
+    PROFILE_CALL(PROF_TICK_PPU, tick_ppu<true, 311>());
+}
+
+#ifdef CATCH_UP_PPU
+
+void catch_up_ppu() {
+    BENCH_ENTER(BENCH_PPU)
+
+    // Clear the count first. Nothing run from tick_ppu() syncs, but be safe.
+    unsigned n = ppu_ticks_owed;
+    ppu_ticks_owed = 0;
+    if (is_pal)
+        while (n-- > 0) tick_pal_ppu();
+    else
+        while (n-- > 0) tick_ntsc_ppu();
+
+    predict_ppu_events();
+
+    BENCH_LEAVE
+}
+
+// Returns a lower bound on the number of ticks until the PPU reaches dot
+// 'line_dot' on line 'line'. Reaching the current position again takes a full
+// frame. The skipped dot on odd frames can make the real number one less,
+// which is compensated for.
+static unsigned ticks_till(unsigned line, unsigned line_dot) {
+    unsigned const frame_len = 341*(prerender_line + 1);
+    unsigned const cur       = 341*ppu.scanline + ppu.dot;
+    unsigned const target    = 341*line + line_dot;
+    return (target > cur ? target - cur : target + frame_len - cur) - 1;
+}
+
+void predict_ppu_events() {
+    // End of frame (frame_completed()) and start of VBlank (NMI). Done
+    // regardless of whether NMIs are enabled, as that's cheap.
+    unsigned const n = min(ticks_till(240, 0), ticks_till(241, 1));
+    ppu_ticks_till_event = max(min(n, mapper_fns.ppu_ticks_till_irq()), 1u);
 }
 
+#endif
+
 static void do_2007_post_access_bump() {
-    if (rendering_enabled && (scanline < 240 || scanline == prerender_line)) {
+    if (rendering_enabled && (ppu.scanline < 240 || ppu.scanline == prerender_line)) {
         // Accessing $2007 during rendering performs this glitch. Used by Young
         // Indiana Jones Chronicles to shake the screen.
         bump_horiz();
@@ -761,62 +819,68 @@ static void do_2007_post_access_bump() {
     // The incrementation operation can touch the high bit even though it's not
     // used for addressing (it's the high bit of fine y)
     else {
-        v = (v + v_inc) & 0x7FFF;
+        ppu.v = (ppu.v + ppu.v_inc) & 0x7FFF;
         // The PPU address bus mirrors v outside of rendering
-        ppu_addr_bus = v & 0x3FFF;
+        ppu.addr_bus = ppu.v & 0x3FFF;
     }
 }
 
 static uint8_t read_vram() {
-    // Use ppu_open_bus to hold the result, updating it in the process
+    // Use ppu.open_bus to hold the result, updating it in the process
 
-    switch (v & 0x3FFF) {
+    switch (ppu.v & 0x3FFF) {
 
     // Pattern tables
     case 0x0000 ... 0x1FFF:
-        ppu_open_bus = ppu_data_reg;
+        ppu.open_bus = ppu.data_reg;
         open_bus_refreshed();
-        ppu_data_reg = chr_ref(v);
+        ppu.data_reg = chr_ref(ppu.v);
         break;
 
     // Nametables
     case 0x2000 ... 0x3EFF:
-        ppu_open_bus = ppu_data_reg;
+        ppu.open_bus = ppu.data_reg;
         open_bus_refreshed();
-        ppu_data_reg = read_nt(v);
+        ppu.data_reg = read_nt(ppu.v);
         break;
 
     // Palettes
     case 0x3F00 ... 0x3FFF:
-        ppu_open_bus = get_open_bus_bits_7_to_6() |
-          (palettes[v & 0x1F] & grayscale_color_mask);
+        ppu.open_bus = get_open_bus_bits_7_to_6() |
+          (ppu.palettes[ppu.v & 0x1F] & ppu.grayscale_color_mask);
         open_bus_bits_5_to_0_refreshed();
 
         // The data register is updated with the nametable byte that would
         // appear "underneath" the palette
         // (http://wiki.nesdev.com/w/index.php/PPU_memory_map)
-        ppu_data_reg = read_nt(v);
+        ppu.data_reg = read_nt(ppu.v);
         break;
 
     // GCC doesn't seem to infer this
     default: UNREACHABLE
     }
 
-    if (initial_frame) {
-        ppu_data_reg = 0;
-        printf("Warning: Reading PPUDATA during initial frame, at (%u,%u)\n", scanline, dot);
+    if (ppu.initial_frame) {
+        ppu.data_reg = 0;
+        printf("Warning: Reading PPUDATA during initial frame, at (%u,%u)\n", ppu.scanline, ppu.dot);
     }
 
-    return ppu_open_bus;
+    return ppu.open_bus;
 }
 
 static void write_vram(uint8_t val) {
-    switch (v & 0x3FFF) {
+    switch (ppu.v & 0x3FFF) {
 
     // Pattern tables
-    case 0x0000 ... 0x1FFF: if (chr_is_ram) chr_ref(v) = val; break;
+    case 0x0000 ... 0x1FFF:
+        if (chr_is_ram) {
+            uint8_t &byte = chr_ref(ppu.v);
+            byte = val;
+            mark_dirty(chr_ram_stamps, &byte - chr_base);
+        }
+        break;
     // Nametables
-    case 0x2000 ... 0x3EFF: write_nt(v, val); break;
+    case 0x2000 ... 0x3EFF: write_nt(ppu.v, val); break;
     // Palettes
     case 0x3F00 ... 0x3FFF:
         {
@@ -830,7 +894,7 @@ static void write_vram(uint8_t val) {
             0x00, 0x11, 0x12, 0x13, 0x04, 0x15, 0x16, 0x17,
             0x08, 0x19, 0x1A, 0x1B, 0x0C, 0x1D, 0x1E, 0x1F };
 
-        palettes[palette_write_mirror[v & 0x1F]] = palettes[v & 0x1F] = val & 0x3F;
+        ppu.palettes[palette_write_mirror[ppu.v & 0x1F]] = ppu.palettes[ppu.v & 0x1F] = val & 0x3F;
         break;
         }
     // GCC doesn't seem to infer this
@@ -839,18 +903,20 @@ static void write_vram(uint8_t val) {
 }
 
 uint8_t read_ppu_reg(unsigned n) {
+    sync_ppu();
+
     switch (n) {
 
     // Write-only registers
     case 0: case 1: case 3: case 5: case 6: return get_all_open_bus_bits();
 
     case 2:
-        if (scanline == 241) {
+        if (ppu.scanline == 241) {
             // Quirkiness related to reading $2002 around the point where the
             // VBlank flag is set. TODO: Elaborate on timing.
-            switch (dot) {
+            switch (ppu.dot) {
             case 1:
-                in_vblank = false;
+                ppu.in_vblank = false;
                 set_nmi(false);
                 break;
 
@@ -859,28 +925,28 @@ uint8_t read_ppu_reg(unsigned n) {
                 break;
             }
         }
-        write_flip_flop = false;
-        ppu_open_bus    = (in_vblank << 7) | (sprite_zero_hit << 6) | (sprite_overflow << 5) |
-                          get_open_bus_bits_4_to_0();
-        in_vblank       = false;
+        ppu.write_flip_flop = false;
+        ppu.open_bus        = (ppu.in_vblank << 7) | (ppu.sprite_zero_hit << 6) | (ppu.sprite_overflow << 5) |
+                              get_open_bus_bits_4_to_0();
+        ppu.in_vblank       = false;
         open_bus_bits_7_to_5_refreshed();
-        return ppu_open_bus;
+        return ppu.open_bus;
 
     case 4:
         {
         // Micro machines reads this during rendering
-        if (rendering_enabled && (scanline < 240 || scanline == prerender_line)) {
+        if (rendering_enabled && (ppu.scanline < 240 || ppu.scanline == prerender_line)) {
             // TODO: Make this work automagically through proper emulation of
             // the interval after the sprite fetches
-            if (dot >= 323)
-                return sec_oam[0];
-            return oam_data;
+            if (ppu.dot >= 323)
+                return ppu.sec_oam[0];
+            return ppu.oam_data;
         }
         open_bus_refreshed();
 
         // Some of the attribute bits do not exist and always read back as zero
         static uint8_t const mask_lut[] = { 0xFF, 0xFF, 0xE3, 0xFF };
-        return ppu_open_bus = oam[oam_addr] & mask_lut[oam_addr & 3];
+        return ppu.open_bus = ppu.oam[ppu.oam_addr] & mask_lut[ppu.oam_addr & 3];
         }
 
     case 7:
@@ -895,25 +961,30 @@ uint8_t read_ppu_reg(unsigned n) {
 }
 
 void write_oam_data_reg(uint8_t val) {
+    sync_ppu();
+
     // OAM updates are inhibited during rendering. $2004 writes during
     // rendering do perform a glitchy oam_addr increment however, but that
     // might be hard to pin down (could depend on current sprite evaluation
     // status for example) and not worth emulating.
-    if (rendering_enabled && (scanline < 240 || scanline == prerender_line))
+    if (rendering_enabled && (ppu.scanline < 240 || ppu.scanline == prerender_line))
         return;
-    oam[oam_addr++] = val;
+    ppu.oam[ppu.oam_addr++] = val;
 }
 
 static void set_derived_ppumask_vars() {
-    rendering_enabled = show_bg || show_sprites;
-    bg_clip_comp      = !show_bg      ? 256 : show_bg_left_8      ? 0 : 8;
-    sprite_clip_comp  = !show_sprites ? 256 : show_sprites_left_8 ? 0 : 8;
-    // The status of the tint bits determines the current palette
-    pal_to_rgb        = nes_to_rgb[tint_bits];
+    rendering_enabled = ppu.show_bg || ppu.show_sprites;
+    bg_clip_comp      = !ppu.show_bg      ? 256 : ppu.show_bg_left_8      ? 0 : 8;
+    sprite_clip_comp  = !ppu.show_sprites ? 256 : ppu.show_sprites_left_8 ? 0 : 8;
+    pixel_tint_bits   = ppu.tint_bits << 6;
+    // Toggling rendering stops or restarts the shift registers mid-tile
+    bg_tile_pixels_valid = false;
 }
 
 void write_ppu_reg(uint8_t val, unsigned n) {
-    ppu_open_bus = val;
+    sync_ppu();
+
+    ppu.open_bus = val;
     open_bus_refreshed();
 
     switch (n) {
@@ -921,17 +992,17 @@ void write_ppu_reg(uint8_t val, unsigned n) {
     // PPUCTRL
     case 0:
         {
-        if (initial_frame) {
-            printf("Warning: Writing PPUCTRL during initial frame, at (%u,%u)\n", scanline, dot);
+        if (ppu.initial_frame) {
+            printf("Warning: Writing PPUCTRL during initial frame, at (%u,%u)\n", ppu.scanline, ppu.dot);
             return;
         }
 
         // t: ... AB.. .... .... = value: .... ..AB
-        t               = (t & 0x73FF) | ((val & 0x03) << 10);
-        v_inc           = (val & 0x04) ? 32 : 1;
-        sprite_pat_addr = (val & 0x08) << 9; // val & 0x08 ? 0x1000 : 0x0000
-        bg_pat_addr     = (val & 0x10) << 8; // val & 0x10 ? 0x1000 : 0x0000
-        sprite_size     = val & 0x20 ? EIGHT_BY_SIXTEEN : EIGHT_BY_EIGHT;
+        ppu.t               = (ppu.t & 0x73FF) | ((val & 0x03) << 10);
+        ppu.v_inc           = (val & 0x04) ? 32 : 1;
+        ppu.sprite_pat_addr = (val & 0x08) << 9; // val & 0x08 ? 0x1000 : 0x0000
+        ppu.bg_pat_addr     = (val & 0x10) << 8; // val & 0x10 ? 0x1000 : 0x0000
+        ppu.sprite_size     = val & 0x20 ? EIGHT_BY_SIXTEEN : EIGHT_BY_EIGHT;
 
         bool const new_nmi_on_vblank = val & 0x80;
         if (new_nmi_on_vblank) {
@@ -939,7 +1010,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
             // set causes another NMI to be generated, since the NMI line
             // equals nmi_on_vblank AND in_vblank (though it's active low
             // instead): http://wiki.nesdev.com/w/index.php/NMI
-            if (!nmi_on_vblank && in_vblank)
+            if (!ppu.nmi_on_vblank && ppu.in_vblank)
                 set_nmi(true);
         }
         else
@@ -948,23 +1019,23 @@ void write_ppu_reg(uint8_t val, unsigned n) {
             // pulse in that case, but it won't be seen.
             set_nmi(false);
 
-        nmi_on_vblank = new_nmi_on_vblank;
+        ppu.nmi_on_vblank = new_nmi_on_vblank;
         break;
         }
 
     // PPUMASK
     case 1:
-        if (initial_frame) {
-            printf("Warning: Writing PPUMASK during initial frame, at (%u,%u)\n", scanline, dot);
+        if (ppu.initial_frame) {
+            printf("Warning: Writing PPUMASK during initial frame, at (%u,%u)\n", ppu.scanline, ppu.dot);
             return;
         }
 
-        grayscale_color_mask = val & 0x01 ? 0x30 : 0x3F;
-        show_bg_left_8       = val & 0x02;
-        show_sprites_left_8  = val & 0x04;
-        show_bg              = val & 0x08;
-        show_sprites         = val & 0x10;
-        tint_bits            = (val >> 5) & 7;
+        ppu.grayscale_color_mask = val & 0x01 ? 0x30 : 0x3F;
+        ppu.show_bg_left_8       = val & 0x02;
+        ppu.show_sprites_left_8  = val & 0x04;
+        ppu.show_bg              = val & 0x08;
+        ppu.show_sprites         = val & 0x10;
+        ppu.tint_bits            = (val >> 5) & 7;
 
         set_derived_ppumask_vars();
 
@@ -974,54 +1045,55 @@ void write_ppu_reg(uint8_t val, unsigned n) {
     case 2: break;
 
     // OAMADDR
-    case 3: oam_addr = val; break;
+    case 3: ppu.oam_addr = val; break;
 
     // OAMDATA
     case 4: write_oam_data_reg(val); break;
 
     // PPUSCROLL
     case 5:
-        if (initial_frame) {
-            printf("Warning: Writing PPUSCROLL during initial frame, at (%u,%u)\n", scanline, dot);
+        if (ppu.initial_frame) {
+            printf("Warning: Writing PPUSCROLL during initial frame, at (%u,%u)\n", ppu.scanline, ppu.dot);
             return;
         }
 
-        if (!write_flip_flop) {
+        if (!ppu.write_flip_flop) {
             // First write
             // fine_x = val: .... .ABC
             // t: ... .... ...D EFGH = val: DEFG H...
-            fine_x = val & 7;
-            t      = (t & 0x7FE0) | ((val & 0xF8) >> 3);
+            ppu.fine_x = val & 7;
+            ppu.t      = (ppu.t & 0x7FE0) | ((val & 0xF8) >> 3);
+            bg_tile_pixels_valid = false;
         }
         else
             // Second write
             // t: ABC ..DE FGH. .... = val: DEFG HABC
-            t = (t & 0x0C1F) | ((val & 0xF8) << 2) | ((val & 7) << 12);
+            ppu.t = (ppu.t & 0x0C1F) | ((val & 0xF8) << 2) | ((val & 7) << 12);
 
-        write_flip_flop = !write_flip_flop;
+        ppu.write_flip_flop = !ppu.write_flip_flop;
         break;
 
     // PPUADDR
     case 6:
-        if (initial_frame) {
-            printf("Warning: Writing PPUADDR during initial frame, at (%u,%u)\n", scanline, dot);
+        if (ppu.initial_frame) {
+            printf("Warning: Writing PPUADDR during initial frame, at (%u,%u)\n", ppu.scanline, ppu.dot);
             return;
         }
 
-        if (!write_flip_flop)
+        if (!ppu.write_flip_flop)
             // First write
             // t: 0AB CDEF .... .... = val: ..AB CDEF
             // Clearing of high bit confirmed in Visual 2C02
-            t = (t & 0x00FF) | ((val & 0x3F) << 8);
+            ppu.t = (ppu.t & 0x00FF) | ((val & 0x3F) << 8);
         else {
             // Second write
             // t: ... .... ABCD EFGH = val: ABCD EFGH
-            t = (t & 0x7F00) | val;
+            ppu.t = (ppu.t & 0x7F00) | val;
             // There is a delay of ~3 ticks before t is copied to v
-            pending_v_update = 3;
+            ppu.pending_v_update = 3;
         }
 
-        write_flip_flop = !write_flip_flop;
+        ppu.write_flip_flop = !ppu.write_flip_flop;
         break;
 
     // PPUDATA
@@ -1040,20 +1112,21 @@ void write_ppu_reg(uint8_t val, unsigned n) {
 
 static void clear_2000() {
     // $2000
-    v_inc           = 1;
-    sprite_pat_addr = bg_pat_addr = 0x0000;
-    sprite_size     = EIGHT_BY_EIGHT;
-    nmi_on_vblank   = false;
+    ppu.v_inc           = 1;
+    ppu.sprite_pat_addr = ppu.bg_pat_addr = 0x0000;
+    ppu.sprite_size     = EIGHT_BY_EIGHT;
+    ppu.nmi_on_vblank   = false;
 }
 
 static void clear_2001() {
-    grayscale_color_mask = 0x3F; // Grayscale off
-    show_bg_left_8       = show_sprites_left_8 = false;
-    show_bg              = show_sprites        = false;
-    tint_bits            = 0;
-    pal_to_rgb           = nes_to_rgb[tint_bits];
-    rendering_enabled    = false;
-    bg_clip_comp         = sprite_clip_comp = 256;
+    ppu.grayscale_color_mask = 0x3F; // Grayscale off
+    ppu.show_bg_left_8       = ppu.show_sprites_left_8 = false;
+    ppu.show_bg              = ppu.show_sprites        = false;
+    ppu.tint_bits            = 0;
+    pixel_tint_bits          = 0;
+    rendering_enabled        = false;
+    bg_clip_comp             = sprite_clip_comp = 256;
+    bg_tile_pixels_valid     = false;
 }
 
 void set_ppu_cold_boot_state() {
@@ -1062,65 +1135,76 @@ void set_ppu_cold_boot_state() {
 
     // This makes the uninitialized background color the "NES gray" seen on
     // startup in many games, so it's probably correct(ish)
-    init_array(palettes, (uint8_t)0);
+    init_array(ppu.palettes, (uint8_t)0);
     // Make all sprites out-of-range by default to prevent temporary glitching.
     // On the real thing the values might be indeterminate.
-    init_array(oam    , (uint8_t)0xFF);
-    init_array(sec_oam, (uint8_t)0xFF);
+    init_array(ppu.oam    , (uint8_t)0xFF);
+    init_array(ppu.sec_oam, (uint8_t)0xFF);
 
     // Loopy regs
-    fine_x = t = v = 0;
+    ppu.fine_x = ppu.t = ppu.v = 0;
 
     clear_2000();
     clear_2001();
 
     // $2002
-    sprite_overflow = sprite_zero_hit = in_vblank = false;
+    ppu.sprite_overflow = ppu.sprite_zero_hit = ppu.in_vblank = false;
 
     // OAM regs
-    oam_addr = sec_oam_addr = oam_data = 0;
+    ppu.oam_addr = ppu.sec_oam_addr = ppu.oam_data = 0;
 
     // Sprite evaluation state
 
-    copy_sprite_signal = 0;
-    oam_addr_overflow  = sec_oam_addr_overflow = false;
-    overflow_detection = false;
+    ppu.copy_sprite_signal = 0;
+    ppu.oam_addr_overflow  = ppu.sec_oam_addr_overflow = false;
+    ppu.overflow_detection = false;
 
     // Misc. regs and helpers
-    write_flip_flop     = false;
-    ppu_data_reg        = 0;
-    pending_v_update    = 0;     // No pending v update
-    odd_frame           = false; // Initial frame is even
-    initial_frame       = starts_on_initial_frame;
-    s0_on_next_scanline = s0_on_cur_scanline = false;
-    ppu_addr_bus        = 0;
-    dot                 = scanline = ppu_cycle = 0;
+    ppu.write_flip_flop     = false;
+    ppu.data_reg            = 0;
+    ppu.pending_v_update    = 0;     // No pending v update
+    ppu.odd_frame           = false; // Initial frame is even
+    ppu.initial_frame       = starts_on_initial_frame;
+    ppu.s0_on_next_scanline = ppu.s0_on_cur_scanline = false;
+    ppu.addr_bus            = 0;
+    ppu.dot                 = ppu.scanline = ppu.cycle = 0;
 
     // Open bus
 
-    ppu_open_bus = 0;
-    bit_7_6_wcycle = bit_5_wcycle = bit_4_0_wcycle = 0;
+    ppu.open_bus = 0;
+    ppu.bit_7_6_wcycle = ppu.bit_5_wcycle = ppu.bit_4_0_wcycle = 0;
 
     // Render pipeline buffers and shift registers and sprite output units
 
-    nt_byte    = at_byte    = 0;
-    bg_byte_l  = bg_byte_h  = 0;
-    bg_shift_l = bg_shift_h = 0;
-    at_shift_l = at_shift_h = 0;
-    at_latch_l = at_latch_h = 0;
+    ppu.nt_byte    = ppu.at_byte    = 0;
+    ppu.bg_byte_l  = ppu.bg_byte_h  = 0;
+    ppu.bg_shift_l = ppu.bg_shift_h = 0;
+    ppu.at_shift_l = ppu.at_shift_h = 0;
+    ppu.at_latch_l = ppu.at_latch_h = 0;
+
+    ppu.sprite_y = ppu.sprite_index = 0;
+    ppu.sprite_in_range = false;
+
+    init_array(ppu.sprite_attribs, (uint8_t)0);
+    init_array(ppu.sprite_x      , (uint8_t)0);
+    init_array(ppu.sprite_pat_l  , (uint8_t)0);
+    init_array(ppu.sprite_pat_h  , (uint8_t)0);
 
-    sprite_y = sprite_index = 0;
-    sprite_in_range = false;
+    // Clear any sprites left over from a previous ROM
+    sprites_on_line = sprite_line_dirty = true;
 
-    init_array(sprite_attribs, (uint8_t)0);
-    init_array(sprite_x      , (uint8_t)0);
-    init_array(sprite_pat_l  , (uint8_t)0);
-    init_array(sprite_pat_h  , (uint8_t)0);
+#ifdef CATCH_UP_PPU
+    ppu_ticks_owed = 0;
+#endif
+    predict_ppu_events();
 }
 
 void reset_ppu() {
+    // The reset takes effect after the ticks that ran before it
+    sync_ppu();
+
     // Loopy regs
-    fine_x = t = 0;
+    ppu.fine_x = ppu.t = 0;
 
     clear_2000();
     clear_2001();
@@ -1128,78 +1212,34 @@ void reset_ppu() {
     // 2002 is probably unchanged since the reset signal isn't tied to any of
     // the flip-flops
 
-    write_flip_flop = false;
-    dot = scanline = 0;
-    odd_frame = false;
+    ppu.write_flip_flop = false;
+    ppu.dot = ppu.scanline = 0;
+    ppu.odd_frame = false;
+
+    ppu.sprite_y = ppu.sprite_index = 0;
+    ppu.sprite_in_range = false;
 
-    sprite_y = sprite_index = 0;
-    sprite_in_range = false;
+    predict_ppu_events();
 }
 
 // State transfers
 
 template<bool calculating_size, bool is_save>
 void transfer_ppu_state(uint8_t *&buf) {
-    if (chr_is_ram) TRANSFER_P(chr_base, chr_8k_banks*0x2000);
-    TRANSFER_P(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
-    TRANSFER(palettes)
-    TRANSFER(oam) TRANSFER(sec_oam)
-    TRANSFER(t) TRANSFER(v) TRANSFER(fine_x)
-    TRANSFER(pending_v_update)
-
-    TRANSFER(v_inc)
-    TRANSFER(sprite_pat_addr)
-    TRANSFER(bg_pat_addr)
-    TRANSFER(sprite_size)
-    TRANSFER(nmi_on_vblank)
-
-    TRANSFER(grayscale_color_mask)
-    TRANSFER(show_bg_left_8)
-    TRANSFER(show_sprites_left_8)
-    TRANSFER(show_bg)
-    TRANSFER(show_sprites)
-    TRANSFER(tint_bits)
+    if (chr_is_ram) TRANSFER_TRACKED(chr_base, chr_8k_banks*0x2000, chr_ram_stamps);
+    TRANSFER_TRACKED(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800, ciram_stamps);
+    TRANSFER(ppu)
     if (!is_save)
         set_derived_ppumask_vars();
 
-    TRANSFER(sprite_overflow) TRANSFER(sprite_zero_hit) TRANSFER(in_vblank)
-
-    TRANSFER(oam_addr) TRANSFER(sec_oam_addr) TRANSFER(oam_data)
-
-    TRANSFER(copy_sprite_signal)
-    TRANSFER(oam_addr_overflow) TRANSFER(sec_oam_addr_overflow)
-    TRANSFER(overflow_detection)
-
-    TRANSFER(write_flip_flop)
-    TRANSFER(ppu_data_reg)
-    TRANSFER(odd_frame)
-    TRANSFER(ppu_cycle)
-
-    TRANSFER(dot) TRANSFER(scanline)
-
-    TRANSFER(nt_byte) TRANSFER(at_byte)
-    TRANSFER(bg_byte_l) TRANSFER(bg_byte_h)
-    TRANSFER(bg_shift_l) TRANSFER(bg_shift_h)
-    TRANSFER(at_shift_l) TRANSFER(at_shift_h)
-    TRANSFER(at_latch_l) TRANSFER(at_latch_h)
-
-    TRANSFER(sprite_attribs)
-    TRANSFER(sprite_x)
-    TRANSFER(sprite_pat_l)
-    TRANSFER(sprite_pat_h)
-
-    TRANSFER(s0_on_next_scanline)
-    TRANSFER(s0_on_cur_scanline)
-
-    TRANSFER(sprite_y) TRANSFER(sprite_index)
-    TRANSFER(sprite_in_range)
-
-    TRANSFER(initial_frame)
-
-    TRANSFER(ppu_addr_bus)
+    if (!calculating_size && !is_save)
+        sprite_line_dirty = true;
 
-    TRANSFER(ppu_open_bus)
-    TRANSFER(bit_7_6_wcycle) TRANSFER(bit_5_wcycle) TRANSFER(bit_4_0_wcycle)
+#ifdef CATCH_UP_PPU
+    // States are saved with the PPU caught up (see transfer_system_state())
+    if (!calculating_size && !is_save)
+        ppu_ticks_owed = 0;
+#endif
 }
 
 // Explicit instantiations
@@ -0,0 +1,141 @@
+#include "common.h"
+
+#include "profile.h"
+
+#include <signal.h>
+
+PER_CONSOLE Prof_accumulator prof_frame[N_PROF_COUNTERS];
+
+static char const *const counter_names[N_PROF_COUNTERS] =
+  { "tick_ppu<>", "tick_apu", "mapper ppu_tick_callback", "mapper write",
+    "read_ppu_reg", "write_ppu_reg", "do_oam_dma" };
+
+// Totals for the completed frames
+static PER_CONSOLE Prof_accumulator prof_total[N_PROF_COUNTERS];
+// The highest cycle count seen for each counter in a single frame
+static PER_CONSOLE uint64_t prof_max_frame_cycles[N_PROF_COUNTERS];
+
+static PER_CONSOLE unsigned long n_prof_frames;
+// Total cycles for the completed frames, and the time stamp at the end of the
+// previous frame (or the reset)
+static PER_CONSOLE uint64_t total_frame_cycles;
+static PER_CONSOLE uint64_t prev_frame_end;
+
+// Per-opcode execution counts and cycles. Not split by frame.
+static PER_CONSOLE uint64_t op_count[256];
+static PER_CONSOLE uint64_t op_cycles[256];
+
+// Incremented by the SIGUSR1 handler. Shared between consoles, each of which
+// prints its results when the count changes.
+static volatile sig_atomic_t n_print_requests;
+static PER_CONSOLE sig_atomic_t n_handled_print_requests;
+
+static void sigusr1_handler(int) {
+    ++n_print_requests;
+}
+
+void init_profile() {
+    struct sigaction sa;
+    sa.sa_handler = sigusr1_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    errno_fail_if(sigaction(SIGUSR1, &sa, 0) == -1,
+      "failed to install SIGUSR1 handler");
+}
+
+void reset_profile() {
+    for (unsigned i = 0; i < N_PROF_COUNTERS; ++i) {
+        prof_frame[i].calls = prof_frame[i].cycles = 0;
+        prof_total[i].calls = prof_total[i].cycles = 0;
+        prof_max_frame_cycles[i] = 0;
+    }
+    for (unsigned i = 0; i < 256; ++i)
+        op_count[i] = op_cycles[i] = 0;
+
+    n_prof_frames      = 0;
+    total_frame_cycles = 0;
+    prev_frame_end     = prof_now();
+
+    n_handled_print_requests = n_print_requests;
+}
+
+void prof_opcode(uint8_t opcode, uint64_t start) {
+    ++op_count[opcode];
+    op_cycles[opcode] += prof_now() - start;
+}
+
+void profile_end_frame() {
+    for (unsigned i = 0; i < N_PROF_COUNTERS; ++i) {
+        prof_total[i].calls  += prof_frame[i].calls;
+        prof_total[i].cycles += prof_frame[i].cycles;
+        prof_max_frame_cycles[i] =
+          max(prof_max_frame_cycles[i], prof_frame[i].cycles);
+        prof_frame[i].calls = prof_frame[i].cycles = 0;
+    }
+
+    uint64_t const now = prof_now();
+    total_frame_cycles += now - prev_frame_end;
+    prev_frame_end = now;
+    ++n_prof_frames;
+
+    if (n_handled_print_requests != n_print_requests) {
+        n_handled_print_requests = n_print_requests;
+        print_profile();
+    }
+}
+
+void print_profile() {
+    if (n_prof_frames == 0) {
+        fputs("profile: no completed frames\n", stderr);
+        return;
+    }
+
+    double const frames = n_prof_frames;
+
+    fprintf(stderr,
+            "profile: %lu frames, %.0f cycles/frame\n"
+            "%-26s %12s %12s %14s %14s %7s\n",
+            n_prof_frames, total_frame_cycles/frames,
+            "counter", "calls/frame", "cycles/call", "cycles/frame",
+            "max/frame", "% frame");
+    for (unsigned i = 0; i < N_PROF_COUNTERS; ++i) {
+        Prof_accumulator const &t = prof_total[i];
+        fprintf(stderr, "%-26s %12.1f %12.1f %14.0f %14" PRIu64 " %7.2f\n",
+                counter_names[i], t.calls/frames,
+                t.calls ? (double)t.cycles/t.calls : 0.0, t.cycles/frames,
+                prof_max_frame_cycles[i],
+                100.0*t.cycles/total_frame_cycles);
+    }
+
+    // What remains after the PPU and APU ticks. Gives an upper bound on the
+    // time spent emulating the CPU.
+    uint64_t const ticks = prof_total[PROF_TICK_PPU].cycles +
+                           prof_total[PROF_TICK_APU].cycles;
+    fprintf(stderr, "%-26s %12s %12s %14.0f %14s %7.2f\n",
+            "rest (CPU, end of frame)", "", "",
+            (total_frame_cycles - ticks)/frames, "",
+            100.0*(total_frame_cycles - ticks)/total_frame_cycles);
+
+    // Opcodes by decreasing total cycles. Includes instructions from the
+    // current (incomplete) frame.
+    uint8_t order[256];
+    unsigned n_ops = 0;
+    for (unsigned op = 0; op < 256; ++op)
+        if (op_count[op] > 0)
+            order[n_ops++] = op;
+    for (unsigned i = 1; i < n_ops; ++i)
+        for (unsigned j = i; j > 0 && op_cycles[order[j]] > op_cycles[order[j - 1]]; --j) {
+            uint8_t const tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+
+    fprintf(stderr, "%-6s %14s %16s %12s\n",
+            "opcode", "count", "cycles", "cycles/op");
+    for (unsigned i = 0; i < n_ops; ++i) {
+        uint8_t const op = order[i];
+        fprintf(stderr, "$%02X    %14" PRIu64 " %16" PRIu64 " %12.1f\n",
+                op, op_count[op], op_cycles[op],
+                (double)op_cycles[op]/op_count[op]);
+    }
+}
@@ -8,33 +8,39 @@
 #endif
 #include "md5.h"
 #include "ppu.h"
+#include "profile.h"
 #include "rom.h"
 #include "save_states.h"
+#include "state_files.h"
 #include "timing.h"
 
-uint8_t *prg_base;
-unsigned prg_16k_banks;
+PER_CONSOLE uint8_t *prg_base;
+PER_CONSOLE unsigned prg_16k_banks;
 
-uint8_t *chr_base;
-unsigned chr_8k_banks;
-bool chr_is_ram;
+PER_CONSOLE uint8_t *chr_base;
+PER_CONSOLE unsigned chr_8k_banks;
+PER_CONSOLE bool chr_is_ram;
+PER_CONSOLE uint32_t *chr_ram_stamps;
 
-uint8_t *wram_base;
-unsigned wram_8k_banks;
+PER_CONSOLE uint8_t *wram_base;
+PER_CONSOLE unsigned wram_8k_banks;
+PER_CONSOLE uint32_t *wram_stamps;
 
-bool is_pal;
+PER_CONSOLE bool is_pal;
 
-bool has_battery;
-bool has_trainer;
+PER_CONSOLE uint8_t prg_md5[16];
 
-bool is_vs_unisystem;
-bool is_playchoice_10;
+PER_CONSOLE bool has_battery;
+PER_CONSOLE bool has_trainer;
 
-bool has_bus_conflicts;
+PER_CONSOLE bool is_vs_unisystem;
+PER_CONSOLE bool is_playchoice_10;
 
-Mapper_fns mapper_fns;
+PER_CONSOLE bool has_bus_conflicts;
 
-static uint8_t *rom_buf;
+PER_CONSOLE Mapper_fns mapper_fns;
+
+static PER_CONSOLE uint8_t *rom_buf;
 
 char const *const mirroring_to_str[N_MIRRORING_MODES] =
   { "horizontal",
@@ -45,11 +51,25 @@ char const *const mirroring_to_str[N_MIRRORING_MODES] =
 
 static void do_rom_specific_overrides();
 
-void load_rom(char const *filename, bool print_info) {
-    #define PRINT_INFO(...) do { if (print_info) printf(__VA_ARGS__); } while(0)
+static void load_rom_buf(size_t rom_buf_size, char const *filename, bool print_info);
 
+void load_rom(char const *filename, bool print_info) {
     size_t rom_buf_size;
     rom_buf = get_file_buffer(filename, rom_buf_size);
+    load_rom_buf(rom_buf_size, filename, print_info);
+}
+
+void load_rom_from_memory(uint8_t const *data, size_t size, char const *name, bool print_info) {
+    fail_if(!(rom_buf = new (std::nothrow) uint8_t[size]),
+            "failed to allocate %zu-byte buffer for '%s'", size, name);
+    memcpy(rom_buf, data, size);
+    load_rom_buf(size, name, print_info);
+}
+
+// Sets up the console for the ROM image in 'rom_buf'. 'filename' is used in
+// messages, for guessing the TV system, and for naming save state files.
+static void load_rom_buf(size_t rom_buf_size, char const *filename, bool print_info) {
+    #define PRINT_INFO(...) do { if (print_info) printf(__VA_ARGS__); } while(0)
 
     //
     // Parse header
@@ -128,19 +148,28 @@ void load_rom(char const *filename, bool print_info) {
 
     fail_if(!(ciram = alloc_array_init<uint8_t>(mirroring == FOUR_SCREEN ? 0x1000 : 0x800, 0xFF)),
             "failed to allocate %u bytes of nametable memory", mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    // Stamps start out at 0, which is below any save_clock value, so the
+    // freshly initialized memory counts as clean. That's fine since there are
+    // no saves yet.
+    fail_if(!(ciram_stamps = alloc_array_init<uint32_t>(n_dirty_pages(0x1000), 0)),
+            "failed to allocate nametable dirty-page stamps");
 
-    if (mirroring == FOUR_SCREEN || mapper == 7)
+    if (mirroring == FOUR_SCREEN || mapper == 7) {
         // Assume no WRAM when four-screen, per
         // http://wiki.nesdev.com/w/index.php/INES_Mapper_004. Also assume no
         // WRAM for AxROM (mapper 7) as having it breaks Battletoads & Double
         // Dragon. No AxROM games use WRAM.
         wram_base = wram_6000_page = NULL;
+        wram_stamps = NULL;
+    }
     else {
         // iNES assumes all carts have 8 KB of WRAM. For MMC5, assume the cart
         // has 64 KB.
         wram_8k_banks = (mapper == 5) ? 8 : 1;
         fail_if(!(wram_6000_page = wram_base = alloc_array_init<uint8_t>(0x2000*wram_8k_banks, 0xFF)),
                 "failed to allocate %u KB of WRAM", 8*wram_8k_banks);
+        fail_if(!(wram_stamps = alloc_array_init<uint32_t>(n_dirty_pages(0x2000*wram_8k_banks), 0)),
+                "failed to allocate WRAM dirty-page stamps");
     }
 
     if ((chr_is_ram = (chr_8k_banks == 0))) {
@@ -148,6 +177,8 @@ void load_rom(char const *filename, bool print_info) {
         chr_8k_banks = (mapper == 13) ? 2 : 1;
         fail_if(!(chr_base = alloc_array_init<uint8_t>(0x2000*chr_8k_banks, 0xFF)),
                 "failed to allocate %u KB of CHR RAM", 8*chr_8k_banks);
+        fail_if(!(chr_ram_stamps = alloc_array_init<uint32_t>(n_dirty_pages(0x2000*chr_8k_banks), 0)),
+                "failed to allocate CHR RAM dirty-page stamps");
     }
     else chr_base = prg_base + 16*1024*prg_16k_banks;
 
@@ -167,24 +198,38 @@ void load_rom(char const *filename, bool print_info) {
     init_apu_for_rom();
     init_audio_for_rom();
     init_ppu_for_rom();
-    init_save_states_for_rom();
+    init_save_states_for_rom(print_info);
+    // Uses the state layout from init_save_states_for_rom()
+    init_state_files_for_rom(filename);
 #ifdef RECORD_MOVIE
     // Needs to know whether PAL or NTSC, so can't be done in main()
     init_movie();
 #endif
+#ifdef PROFILE
+    reset_profile();
+#endif
 }
 
 void unload_rom() {
+#ifdef PROFILE
+    print_profile();
+#endif
+
     // Flush any pending audio samples
     end_audio_frame();
 
     free_array_set_null(rom_buf);
     free_array_set_null(ciram);
-    if (chr_is_ram)
+    free_array_set_null(ciram_stamps);
+    if (chr_is_ram) {
         free_array_set_null(chr_base);
+        free_array_set_null(chr_ram_stamps);
+    }
     free_array_set_null(wram_base);
+    free_array_set_null(wram_stamps);
 
     deinit_audio_for_rom();
+    deinit_state_files_for_rom();
     deinit_save_states_for_rom();
 #ifdef RECORD_MOVIE
     end_movie();
@@ -213,26 +258,25 @@ static void set_pal() {
 }
 
 static void do_rom_specific_overrides() {
-    static MD5_CTX md5_ctx;
-    static unsigned char md5[16];
+    static PER_CONSOLE MD5_CTX md5_ctx;
 
     MD5_Init(&md5_ctx);
     MD5_Update(&md5_ctx, (void*)prg_base, 16*1024*prg_16k_banks);
-    MD5_Final(md5, &md5_ctx);
+    MD5_Final(prg_md5, &md5_ctx);
 
 #if 0
     for (unsigned i = 0; i < 16; ++i)
-        printf("%02X", md5[i]);
+        printf("%02X", prg_md5[i]);
     putchar('\n');
 #endif
 
-    if (MEM_EQ(md5, "\xAC\x5F\x53\x53\x59\x87\x58\x45\xBC\xBD\x1B\x6F\x31\x30\x7D\xEC"))
+    if (MEM_EQ(prg_md5, "\xAC\x5F\x53\x53\x59\x87\x58\x45\xBC\xBD\x1B\x6F\x31\x30\x7D\xEC"))
         // Cybernoid
         enable_bus_conflicts();
-    else if (MEM_EQ(md5, "\x60\xC6\x21\xF5\xB5\x09\xD4\x14\xBB\x4A\xFB\x9B\x56\x95\xC0\x73"))
+    else if (MEM_EQ(prg_md5, "\x60\xC6\x21\xF5\xB5\x09\xD4\x14\xBB\x4A\xFB\x9B\x56\x95\xC0\x73"))
         // High hopes
         set_pal();
-    else if (MEM_EQ(md5, "\x44\x6F\xCD\x30\x75\x61\x00\xA9\x94\x35\x9A\xD4\xC5\xF8\x76\x67"))
+    else if (MEM_EQ(prg_md5, "\x44\x6F\xCD\x30\x75\x61\x00\xA9\x94\x35\x9A\xD4\xC5\xF8\x76\x67"))
         // Rad Racer 2
         correct_mirroring(FOUR_SCREEN);
 }
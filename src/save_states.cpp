@@ -2,6 +2,8 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "bench.h"
+#include "compress.h"
 #include "controller.h"
 #include "cpu.h"
 #include "input.h"
@@ -10,40 +12,210 @@
 #include "rom.h"
 #include "save_states.h"
 #include "timing.h"
+#include "worker_queue.h"
 
-// Number of seconds of rewind to support. The rewind buffer is a ring buffer
-// where a new state will overwrite the oldest state when the buffer is full.
-unsigned const rewind_seconds = 60;
+// Total size of the rewind buffers in megabytes. Snapshots are compressed, and
+// most frames are only stored as input (see below), so this gives many hours
+// of rewind for most games. The oldest frames are dropped when the buffers are
+// full.
+unsigned const rewind_megabytes = 64;
+
+// Number of frames in a rewind segment (see below)
+unsigned const segment_len = 60;
+
+// Number of segments kept in the dense tier before they're moved to the sparse
+// tier (see below). One minute on NTSC.
+unsigned const dense_segments = 60;
+
+// Number of segments per entry in the sparse tier
+unsigned const sparse_interval = 4;
+
+// Every full_snapshot_interval'th snapshot in a tier is stored in full rather
+// than as a delta
+unsigned const full_snapshot_interval = 16;
 
-// Buffer for a single plain old save state. Not related to rewinding.
-static uint8_t *state;
 // Total state size. Varies depending on the mapper.
-static size_t state_size;
-// For the plain old save state
-static bool has_save;
-
-static uint8_t *rewind_buf;
-// frame_len[n] is the length of frame n in CPU ticks, which is used to cleanly
-// reverse audio. The length varies since we always process finished frames at
-// instruction boundaries to simplify things, and since actual frames vary in
-// length by +-1 PPU tick on NTSC. It would also be possible to store the
-// length directly in the rewind buffer together with the frame's data.
-static unsigned *frame_len;
-static unsigned rewind_buf_i;
-static unsigned n_rewind_frames;
-static unsigned n_recorded_frames;
-
-bool is_backwards_frame;
+static PER_CONSOLE size_t state_size;
+
+// Layout of the state, for get_state_sections()
+static PER_CONSOLE State_section sections[n_state_sections];
+
+PER_CONSOLE uint32_t save_clock = 1;
+PER_CONSOLE uint32_t save_base;
+
+#ifndef OPTIMIZING
+// Used to check that saves that skip clean pages give the same result as full
+// saves
+static PER_CONSOLE uint8_t *check_state;
+#endif
+
+// Rewinding works on segments of segment_len frames. Only some states
+// (snapshots) are stored, along with the input for each frame. Other states
+// are recreated by loading an earlier state and re-simulating frames with the
+// recorded input (see replay_frame()).
+//
+// Recent history is denser than old history:
+//
+//  - The two newest segments are kept decoded, with every state uncompressed.
+//    The open segment holds the most recent frames. New states are added to
+//    it while running forwards, and it's moved to the dense tier when it fills
+//    up. The previous segment is the newest segment in the tiers. While
+//    rewinding, it's decoded a few frames at a time, so that it's ready by the
+//    time the open segment runs out. This keeps the cost of rewinding roughly
+//    constant from frame to frame.
+//
+//  - The dense tier holds one entry per segment, with a snapshot of the state
+//    at the start of the segment (one per second).
+//
+//  - The sparse tier holds one entry per sparse_interval segments, with a
+//    snapshot only for the first one. Entries are moved from the dense tier to
+//    the sparse tier as they age, dropping the other snapshots. When
+//    rewinding into a sparse entry, the start states of its segments are
+//    recreated on the way and kept in entry_starts.
+//
+// Each tier is a ring buffer of variable-length entries. Snapshots are
+// compressed (see compress.h), and are usually deltas against the snapshot of
+// the previous entry in the tier. Every full_snapshot_interval'th snapshot is
+// stored in full instead. The sparse tier drops its oldest entries one full
+// snapshot group at a time when it fills up, so that every snapshot in it can
+// be rebuilt. The dense tier instead moves its oldest entries to the sparse
+// tier, keeping the snapshot of the oldest entry decoded in dense_tail.
+
+// Input for a frame. Together with the state before the frame, this is
+// enough to re-simulate it.
+struct Frame_input {
+    // See get_button_states()
+    uint8_t buttons[2];
+    bool reset_pushed;
+};
+
+// Followed by room for the tier's entry_frames Frame_inputs and by the
+// compressed snapshot
+struct Rewind_entry {
+    // Offsets in the tier's buffer of the previous (older) and next (newer)
+    // entries. Only valid if those entries exist.
+    uint32_t prev, next;
+    // Size of the compressed snapshot
+    uint32_t size;
+    // Number of frames in the entry. A multiple of segment_len.
+    uint32_t n_frames;
+    bool is_full;
+};
+
+struct Tier {
+    uint8_t *buf;
+    size_t buf_size;
+    // Maximum number of frames per entry
+    unsigned entry_frames;
+    // Offsets of the oldest and newest entries
+    size_t oldest, newest;
+    unsigned n_entries;
+    // Number of entries since (and including) the newest full snapshot
+    unsigned n_since_full;
+};
+
+// Finished segments are written to the dense tier by a capture thread, which
+// keeps compression off the emulation thread. The emulation thread copies the
+// snapshot and input of the segment into a staging slot and queues it (see
+// worker_queue.h). The tiers belong to the capture thread while slots are
+// queued, so the emulation thread waits for the queue to drain before it
+// touches them itself (when rewinding or clearing the history).
+
+unsigned const n_staging_slots = 4;
+
+struct Staging_slot {
+    uint8_t *snapshot;
+    Frame_input inputs[segment_len];
+};
+
+// Rewinding state shared with the capture thread
+struct Rewind_store {
+    Tier dense, sparse;
+
+    // Decoded snapshots of the newest and oldest dense entries and of the
+    // newest sparse entry. Used as references for deltas and when moving
+    // entries from the dense tier to the sparse tier.
+    uint8_t *dense_head, *dense_tail, *sparse_head;
+    // Scratch buffer for compressed snapshots
+    uint8_t *compressed_state;
+
+    size_t state_size;
+
+    Staging_slot slots[n_staging_slots];
+    Worker_queue capture_queue;
+};
+
+// The capture thread points its copy at the store of the console it works
+// for
+static PER_CONSOLE Rewind_store *store;
+
+struct Segment {
+    // segment_len states of state_size bytes each
+    uint8_t *states;
+    Frame_input inputs[segment_len];
+    // Length in CPU ticks of each frame, which is used to cleanly reverse
+    // audio. The length varies since we always process finished frames at
+    // instruction boundaries to simplify things, and since actual frames vary
+    // in length by +-1 PPU tick on NTSC. Frame lengths aren't stored in the
+    // tiers, as re-simulating frames gives them back.
+    uint32_t frame_lens[segment_len];
+    // The save_clock value at which each state was saved, or 0 if it wasn't
+    // saved there directly (e.g. if it was copied from elsewhere). Used as the
+    // save_base when the state is overwritten, so that only pages written
+    // since then need to be copied.
+    uint32_t saved_at[segment_len];
+    unsigned n_frames;
+    // For the previous segment, the index of the segment within the newest
+    // entry, and the number of frames that have been re-simulated so far. The
+    // states up to and including index n_replayed are valid.
+    unsigned index;
+    unsigned n_replayed;
+};
+
+static PER_CONSOLE Segment open_segment, prev_segment;
+
+// Start states of the segments in the newest entry that have been found so
+// far. The first one is the snapshot of the entry.
+static PER_CONSOLE uint8_t *entry_starts;
+static PER_CONSOLE unsigned n_entry_starts;
+
+PER_CONSOLE bool is_backwards_frame;
+
+// Adds section 'n' to the layout of the state, ending at offset 'end'
+static void end_state_section(unsigned n, char const *name, size_t end) {
+    sections[n].name   = name;
+    sections[n].offset = n > 0 ? sections[n - 1].offset + sections[n - 1].size
+                               : 0;
+    sections[n].size   = end - sections[n].offset;
+}
 
 template<bool calculating_size, bool is_save>
 static size_t transfer_system_state(uint8_t *buf) {
+    BENCH_ENTER(BENCH_REWIND)
+
+    // Run any PPU ticks that are still owed with catch-up PPU emulation, so
+    // that the state is complete
+    if (!calculating_size && is_save)
+        sync_ppu();
+
     uint8_t *tmp = buf;
 
+    // Records the layout of the state while calculating its size
+    unsigned n_sections = 0;
+    #define END_SECTION(section_name)                                 \
+        if (calculating_size)                                         \
+            end_state_section(n_sections++, section_name, buf - tmp);
+
     transfer_apu_state<calculating_size, is_save>(buf);
+    END_SECTION("apu")
     transfer_cpu_state<calculating_size, is_save>(buf);
+    END_SECTION("cpu")
     transfer_ppu_state<calculating_size, is_save>(buf);
+    END_SECTION("ppu")
     transfer_controller_state<calculating_size, is_save>(buf);
+    END_SECTION("controller")
     transfer_input_state<calculating_size, is_save>(buf);
+    END_SECTION("input")
 
     if (calculating_size)
         mapper_fns.state_size(buf);
@@ -53,58 +225,479 @@ static size_t transfer_system_state(uint8_t *buf) {
         else
             mapper_fns.load_state(buf);
     }
+    END_SECTION("mapper")
+
+    #undef END_SECTION
+    assert(!calculating_size || n_sections == n_state_sections);
+
+    // The prediction depends on both the PPU and the mapper state
+    if (!calculating_size && !is_save)
+        predict_ppu_events();
+
+    BENCH_LEAVE
 
     // Return size of state in bytes
     return buf - tmp;
 }
 
+// Saves the state to 'buf', which holds the state saved at save_clock value
+// 'saved_at' (or anything if it's 0), only copying memory pages that were
+// written since then. Updates 'saved_at'.
+static void save_state_incrementally(uint8_t *buf, uint32_t &saved_at) {
+    save_base = saved_at;
+    transfer_system_state<false, true>(buf);
+    save_base = 0;
+
+#ifndef OPTIMIZING
+    if (saved_at != 0) {
+        transfer_system_state<false, true>(check_state);
+        fail_if(memcmp(buf, check_state, state_size) != 0,
+                "incremental save differs from full save (untracked write?)");
+    }
+#endif
+
+    saved_at = save_clock++;
+}
+
+static void clear_rewind();
+
 //
 // Save states
 //
 
-void save_state() {
-    transfer_system_state<false, true>(state);
-    has_save = true;
+size_t get_state_size() { return state_size; }
+
+void save_state_to_buf(uint8_t *buf) {
+    transfer_system_state<false, true>(buf);
 }
 
-void load_state() {
-    if (has_save) {
-        // Clear rewind
-        n_recorded_frames = 0;
+void load_state_from_buf(uint8_t const *buf) {
+    clear_rewind();
 
-        transfer_system_state<false, false>(state);
-    }
+    // transfer_system_state() only reads from the buffer when loading
+    transfer_system_state<false, false>((uint8_t*)buf);
 }
 
+State_section const *get_state_sections() { return sections; }
+
 //
 // Rewinding
 //
 
+static Rewind_entry *entry_at(Tier &tier, size_t offset) {
+    return (Rewind_entry*)(tier.buf + offset);
+}
+
+static Frame_input *entry_inputs(Rewind_entry *entry) {
+    return (Frame_input*)(entry + 1);
+}
+
+static uint8_t *entry_snapshot(Tier &tier, Rewind_entry *entry) {
+    return (uint8_t*)(entry_inputs(entry) + tier.entry_frames);
+}
+
+// Returns the total size of an entry in 'tier' with a 'snapshot_size'-byte
+// compressed snapshot, keeping the next entry aligned
+static size_t entry_total_size(Tier &tier, size_t snapshot_size) {
+    size_t const align = __alignof__(Rewind_entry);
+    return (sizeof(Rewind_entry) + tier.entry_frames*sizeof(Frame_input) +
+            snapshot_size + align - 1) & ~(align - 1);
+}
+
+static uint8_t *segment_state(Segment &segment, unsigned n) {
+    return segment.states + n*state_size;
+}
+
+static uint8_t *entry_start(unsigned n) {
+    return entry_starts + n*state_size;
+}
+
+// Returns the tier holding the newest entry, or null if both are empty
+static Tier *newest_tier() {
+    if (store->dense.n_entries > 0)
+        return &store->dense;
+    if (store->sparse.n_entries > 0)
+        return &store->sparse;
+    return 0;
+}
+
 unsigned get_frame_len() {
     assert(is_backwards_frame);
-    return frame_len[rewind_buf_i];
+    return open_segment.frame_lens[open_segment.n_frames - 1];
+}
+
+static void move_oldest_dense_entry();
+
+// Drops the oldest full snapshot group (the oldest entry and the entries with
+// delta snapshots that follow it) from the sparse tier
+static void drop_oldest_sparse_group() {
+    Tier &sparse = store->sparse;
+
+    assert(sparse.n_entries > 0 && entry_at(sparse, sparse.oldest)->is_full);
+    do {
+        --sparse.n_entries;
+        sparse.oldest = entry_at(sparse, sparse.oldest)->next;
+    } while (sparse.n_entries > 0 && !entry_at(sparse, sparse.oldest)->is_full);
+}
+
+// Returns the offset at which an entry of 'total_size' bytes can be placed
+// after the newest entry in 'tier', making room if needed
+static size_t make_room(Tier &tier, size_t total_size) {
+    assert(total_size <= tier.buf_size);
+
+    for (;;) {
+        if (tier.n_entries == 0)
+            return 0;
+
+        Rewind_entry *const newest = entry_at(tier, tier.newest);
+        size_t const end = tier.newest + entry_total_size(tier, newest->size);
+
+        if (end > tier.oldest) {
+            // The used part of the buffer doesn't wrap around. Use the space
+            // after it if possible, and the space before it otherwise.
+            if (tier.buf_size - end >= total_size)
+                return end;
+            if (tier.oldest >= total_size)
+                return 0;
+        }
+        else if (tier.oldest - end >= total_size)
+            // The used part wraps around, and there's room in the gap
+            return end;
+
+        if (&tier == &store->dense)
+            move_oldest_dense_entry();
+        else
+            drop_oldest_sparse_group();
+    }
+}
+
+// Adds an entry to 'tier' with the decoded snapshot 'snapshot' and the input
+// for 'n_frames' frames. 'ref' is the decoded snapshot of the newest entry in
+// the tier, which the new snapshot is encoded as a delta against.
+static void add_entry(Tier &tier, uint8_t const *snapshot, uint8_t const *ref,
+                      Frame_input const *inputs, unsigned n_frames) {
+    uint8_t *const compressed = store->compressed_state;
+
+    bool is_full = tier.n_entries == 0 ||
+                   tier.n_since_full >= full_snapshot_interval;
+    size_t size = encode_delta(snapshot, is_full ? 0 : ref, state_size,
+                               compressed);
+
+    size_t offset = make_room(tier, entry_total_size(tier, size));
+    if (!is_full && tier.n_entries == 0) {
+        // Making room removed the snapshot the delta was against. Should
+        // only happen with a tiny buffer.
+        is_full = true;
+        size    = encode_delta(snapshot, 0, state_size, compressed);
+        offset  = make_room(tier, entry_total_size(tier, size));
+    }
+
+    Rewind_entry *const entry = entry_at(tier, offset);
+    entry->size     = size;
+    entry->n_frames = n_frames;
+    entry->is_full  = is_full;
+    memcpy(entry_inputs(entry), inputs, n_frames*sizeof(Frame_input));
+    memcpy(entry_snapshot(tier, entry), compressed, size);
+
+    if (tier.n_entries == 0)
+        tier.oldest = offset;
+    else {
+        entry->prev = tier.newest;
+        entry_at(tier, tier.newest)->next = offset;
+    }
+    tier.newest = offset;
+    ++tier.n_entries;
+
+    tier.n_since_full = is_full ? 1 : tier.n_since_full + 1;
 }
 
-// Saves the current state to the rewind buffer. New states overwrite old if
-// the buffer becomes full.
+// Moves the oldest entry in the dense tier to the sparse tier. Its snapshot
+// is only kept if it starts a new sparse entry.
+static void move_oldest_dense_entry() {
+    Tier &dense = store->dense, &sparse = store->sparse;
+
+    assert(dense.n_entries > 0);
+
+    Rewind_entry *const entry = entry_at(dense, dense.oldest);
+
+    Rewind_entry *const sparse_newest =
+      sparse.n_entries > 0 ? entry_at(sparse, sparse.newest) : 0;
+    if (sparse_newest && sparse_newest->n_frames < sparse.entry_frames) {
+        // Room for the input in the newest sparse entry
+        memcpy(entry_inputs(sparse_newest) + sparse_newest->n_frames,
+               entry_inputs(entry), entry->n_frames*sizeof(Frame_input));
+        sparse_newest->n_frames += entry->n_frames;
+    }
+    else {
+        add_entry(sparse, store->dense_tail, store->sparse_head,
+                  entry_inputs(entry), entry->n_frames);
+        memcpy(store->sparse_head, store->dense_tail, state_size);
+    }
+
+    dense.oldest = entry->next;
+    if (--dense.n_entries > 0) {
+        // Decode the snapshot of the new oldest entry
+        Rewind_entry *const oldest = entry_at(dense, dense.oldest);
+        if (oldest->is_full)
+            memset(store->dense_tail, 0, state_size);
+        apply_delta(entry_snapshot(dense, oldest), store->dense_tail,
+                    state_size);
+    }
+}
+
+// Decodes the snapshot of the newest entry in 'tier' into 'snapshot', by going
+// forward from the closest full snapshot (or from dense_tail)
+static void rebuild_newest_snapshot(Tier &tier, uint8_t *snapshot) {
+    size_t offset = tier.newest;
+    while (!entry_at(tier, offset)->is_full && offset != tier.oldest)
+        offset = entry_at(tier, offset)->prev;
+
+    if (entry_at(tier, offset)->is_full) {
+        memset(snapshot, 0, state_size);
+        apply_delta(entry_snapshot(tier, entry_at(tier, offset)), snapshot,
+                    state_size);
+    }
+    else {
+        // Only the oldest dense entry can lack a full snapshot to start from
+        assert(&tier == &store->dense);
+        memcpy(snapshot, store->dense_tail, state_size);
+    }
+
+    while (offset != tier.newest) {
+        offset = entry_at(tier, offset)->next;
+        apply_delta(entry_snapshot(tier, entry_at(tier, offset)), snapshot,
+                    state_size);
+    }
+}
+
+// Writes a queued segment to the dense tier. Runs on the capture thread.
+static void write_segment(Staging_slot &slot) {
+    Tier &dense = store->dense;
+
+    add_entry(dense, slot.snapshot, store->dense_head, slot.inputs,
+              segment_len);
+    if (dense.n_entries == 1)
+        memcpy(store->dense_tail, slot.snapshot, state_size);
+    while (dense.n_entries > dense_segments)
+        move_oldest_dense_entry();
+
+    // The snapshot becomes the reference for the next delta. Trade buffers
+    // with the slot instead of copying it.
+    swap(slot.snapshot, store->dense_head);
+}
+
+static void write_staging_slot(void *rewind_store, unsigned slot) {
+    store      = (Rewind_store*)rewind_store;
+    state_size = store->state_size;
+    write_segment(store->slots[slot]);
+}
+
+// Waits until the capture thread has written all queued segments. The
+// emulation thread can then access the tiers.
+static void wait_for_capture() {
+    flush_worker_queue(store->capture_queue);
+}
+
+// Queues the open segment for writing to the dense tier
+static void queue_open_segment() {
+    unsigned const slot =
+      begin_queue_slot(store->capture_queue, n_staging_slots);
+    memcpy(store->slots[slot].snapshot, segment_state(open_segment, 0),
+           state_size);
+    memcpy(store->slots[slot].inputs, open_segment.inputs,
+           sizeof store->slots[slot].inputs);
+    end_queue_slot(store->capture_queue);
+}
+
+// Hands the (full) open segment to the capture thread. It then becomes the
+// previous segment, and a new open segment is started.
+static void close_segment() {
+    assert(open_segment.n_frames == segment_len);
+
+    queue_open_segment();
+
+    memcpy(entry_start(0), segment_state(open_segment, 0), state_size);
+    n_entry_starts = 1;
+
+    swap(open_segment, prev_segment);
+    prev_segment.index      = 0;
+    prev_segment.n_replayed = segment_len;
+    open_segment.n_frames   = 0;
+}
+
+// Saves the current state and input to the open segment
 static void push_state() {
-    if (n_recorded_frames < n_rewind_frames)
-        ++n_recorded_frames;
+    if (open_segment.n_frames == segment_len)
+        close_segment();
+
+    unsigned const n = open_segment.n_frames++;
+    save_state_incrementally(segment_state(open_segment, n),
+                             open_segment.saved_at[n]);
+
+    Frame_input &input = open_segment.inputs[n];
+    input.buttons[0]   = get_button_states(0);
+    input.buttons[1]   = get_button_states(1);
+    input.reset_pushed = reset_pushed;
+    open_segment.frame_lens[n] = 0;
+}
+
+// Starts decoding segment 'index' of the newest entry into the previous
+// segment. Its start state must already be in entry_starts.
+static void begin_prev_segment(unsigned index) {
+    assert(index < n_entry_starts);
 
-    rewind_buf_i = (rewind_buf_i + 1) % n_rewind_frames;
-    transfer_system_state<false, true>(rewind_buf + state_size*rewind_buf_i);
+    Tier &tier = *newest_tier();
+    Rewind_entry *const entry = entry_at(tier, tier.newest);
+
+    memcpy(segment_state(prev_segment, 0), entry_start(index), state_size);
+    prev_segment.saved_at[0] = 0;
+    memcpy(prev_segment.inputs, entry_inputs(entry) + index*segment_len,
+           sizeof prev_segment.inputs);
+    prev_segment.n_frames   = segment_len;
+    prev_segment.index      = index;
+    prev_segment.n_replayed = 0;
 }
 
-// Removes the most recently pushed state from the rewind buffer
+// Returns the number of frames that still need to be re-simulated before the
+// previous segment is completely decoded
+static unsigned prev_frames_left() {
+    Tier *const tier = newest_tier();
+    if (!tier)
+        return 0;
+
+    unsigned const n_segments =
+      entry_at(*tier, tier->newest)->n_frames/segment_len;
+    return (n_segments - prev_segment.index)*segment_len -
+           prev_segment.n_replayed;
+}
+
+// Re-simulates the next frame in the previous segment (or in one of the
+// segments before it in the same entry, if we're still looking for its start
+// state)
+static void decode_prev_frame() {
+    unsigned const n = prev_segment.n_replayed;
+    assert(n < segment_len);
+
+    transfer_system_state<false, false>(segment_state(prev_segment, n));
+    // Mirrors handle_ui_keys(). (The state was saved before the reset button
+    // was handled.)
+    if (reset_pushed)
+        soft_reset();
+    replay_frame();
+    prev_segment.frame_lens[n] = frame_offset;
+    ++prev_segment.n_replayed;
+
+    Frame_input const *input;
+    uint8_t *next_state;
+    // Entry starts aren't tracked
+    uint32_t untracked = 0;
+    uint32_t *next_saved_at = &untracked;
+    if (n + 1 < segment_len) {
+        input         = &prev_segment.inputs[n + 1];
+        next_state    = segment_state(prev_segment, n + 1);
+        next_saved_at = &prev_segment.saved_at[n + 1];
+    }
+    else if (prev_frames_left() > 0) {
+        // Found the start state of the next segment in the entry
+        Tier &tier = *newest_tier();
+        input = entry_inputs(entry_at(tier, tier.newest)) +
+                (prev_segment.index + 1)*segment_len;
+        next_state = entry_start(prev_segment.index + 1);
+        n_entry_starts = prev_segment.index + 2;
+    }
+    else
+        // The last frame is only replayed to get its length
+        return;
+
+    // The input for the next frame was read at the end of the frame
+    set_button_states(0, input->buttons[0]);
+    set_button_states(1, input->buttons[1]);
+    reset_pushed = input->reset_pushed;
+    save_state_incrementally(next_state, *next_saved_at);
+
+    if (n + 1 == segment_len)
+        begin_prev_segment(prev_segment.index + 1);
+}
+
+// Removes the most recently pushed state
 static void pop_state() {
-    assert(n_recorded_frames > 0);
-    rewind_buf_i = (rewind_buf_i == 0) ? n_rewind_frames - 1 : rewind_buf_i - 1;
-    --n_recorded_frames;
+    assert(open_segment.n_frames > 1 || newest_tier());
+
+    if (open_segment.n_frames > 1) {
+        --open_segment.n_frames;
+        return;
+    }
+
+    // The open segment ran out. The previous segment becomes the open
+    // segment, and is removed from the newest entry.
+
+    while (prev_frames_left() > 0)
+        decode_prev_frame();
+    swap(open_segment, prev_segment);
+
+    Tier &tier = *newest_tier();
+    Rewind_entry *const entry = entry_at(tier, tier.newest);
+    entry->n_frames -= segment_len;
+    --n_entry_starts;
+
+    if (entry->n_frames > 0) {
+        // More segments in the entry. Their start states were found while
+        // decoding the removed one.
+        begin_prev_segment(n_entry_starts - 1);
+        return;
+    }
+
+    // Remove the entry and decode the snapshot of the new newest entry into
+    // entry_starts. It still holds the snapshot of the removed entry.
+
+    tier.newest = entry->prev;
+    --tier.n_entries;
+
+    Tier &dense = store->dense, &sparse = store->sparse;
+    if (dense.n_entries > 0) {
+        if (!entry->is_full)
+            // XOR deltas work in both directions, so the delta takes us from
+            // the removed snapshot back to the one before it
+            apply_delta(entry_snapshot(dense, entry), entry_start(0),
+                        state_size);
+        else
+            rebuild_newest_snapshot(dense, entry_start(0));
+        memcpy(store->dense_head, entry_start(0), state_size);
+    }
+    else if (sparse.n_entries > 0) {
+        if (&tier == &sparse) {
+            // Removed a sparse entry
+            if (!entry->is_full)
+                apply_delta(entry_snapshot(sparse, entry), store->sparse_head,
+                            state_size);
+            else
+                rebuild_newest_snapshot(sparse, store->sparse_head);
+        }
+        memcpy(entry_start(0), store->sparse_head, state_size);
+    }
+    else {
+        prev_segment.n_frames = 0;
+        n_entry_starts = 0;
+        return;
+    }
+
+    n_entry_starts = 1;
+    begin_prev_segment(0);
+}
+
+// Decodes part of the previous segment. The work is spread out so that it's
+// finished by the time the open segment runs out.
+static void decode_ahead() {
+    unsigned const n_left = prev_frames_left();
+    unsigned n = (n_left + open_segment.n_frames - 1)/open_segment.n_frames;
+    while (n-- > 0)
+        decode_prev_frame();
 }
 
-// Loads the most recently pushed state from the rewind buffer
+// Loads the most recently pushed state
 static void load_top_state() {
-    transfer_system_state<false, false>(rewind_buf + state_size*rewind_buf_i);
+    transfer_system_state<false, false>(
+      segment_state(open_segment, open_segment.n_frames - 1));
 }
 
 static void handle_forwards_frame() {
@@ -121,52 +714,129 @@ static void handle_forwards_frame() {
 }
 
 static void handle_backwards_frame() {
-    assert(n_recorded_frames > 0);
+    assert(open_segment.n_frames > 0);
+    wait_for_capture();
     // Do not pop the top state if we just started rewinding (i.e., if
     // !is_backwards_frame). We want to run it again backwards first to
     // get a clean transition in the sound.
-    if (is_backwards_frame && n_recorded_frames > 1)
+    if (is_backwards_frame && (open_segment.n_frames > 1 || newest_tier()))
         pop_state();
+    // Re-simulating frames clobbers the current state, so do it before
+    // loading the state to rewind to
+    decode_ahead();
     load_top_state();
 
     is_backwards_frame = true;
 }
 
 void handle_rewind(bool do_rewind) {
+    BENCH_ENTER(BENCH_REWIND)
+
     // Save the length of the most recently finished frame in CPU ticks. Used
     // later to properly reverse audio if the frame is rewound.
-    frame_len[rewind_buf_i] = frame_offset;
+    if (open_segment.n_frames > 0)
+        open_segment.frame_lens[open_segment.n_frames - 1] = frame_offset;
 
-    if (do_rewind && n_recorded_frames > 0)
+    if (do_rewind && open_segment.n_frames > 0)
         handle_backwards_frame();
     else
         handle_forwards_frame();
+
+    BENCH_LEAVE
+}
+
+// Empties the tiers and the decoded segments
+static void clear_rewind() {
+    wait_for_capture();
+    store->dense.n_entries = store->sparse.n_entries = 0;
+    open_segment.n_frames = prev_segment.n_frames = 0;
+    n_entry_starts = 0;
+    is_backwards_frame = false;
+}
+
+// Allocates a buffer for the state of the current ROM
+static uint8_t *alloc_state_buf(size_t size, char const *desc) {
+    uint8_t *buf;
+    fail_if(!(buf = new (std::nothrow) uint8_t[size]),
+      "failed to allocate %zu-byte buffer for %s", size, desc);
+    return buf;
 }
 
-void init_save_states_for_rom() {
-    n_rewind_frames = rewind_seconds*ppu_fps;
+// Sets up an empty tier with entries of up to 'entry_frames' frames
+static void init_tier(Tier &tier, size_t buf_size, unsigned entry_frames) {
+    tier.entry_frames = entry_frames;
+    // Make sure a few full snapshots always fit
+    tier.buf_size = max(buf_size,
+                        4*entry_total_size(tier, max_delta_size(state_size)));
+    tier.buf = alloc_state_buf(tier.buf_size, "rewind buffer");
+    tier.n_entries = 0;
+}
 
+void init_save_states_for_rom(bool print_info) {
     state_size = transfer_system_state<true, false>(0);
-    size_t const rewind_buf_size = state_size*n_rewind_frames;
-#ifndef RUN_TESTS
-    printf("save state size: %zu bytes\nrewind buffer size: %zu bytes\n",
-           state_size, rewind_buf_size);
+
+    fail_if(!(store = new (std::nothrow) Rewind_store),
+            "failed to allocate rewind state");
+    store->state_size = state_size;
+
+    // The dense tier gets an eighth of the memory, which is usually far more
+    // than dense_segments segments need
+    size_t const rewind_size = (size_t)rewind_megabytes << 20;
+    init_tier(store->dense, rewind_size/8, segment_len);
+    init_tier(store->sparse, rewind_size - rewind_size/8,
+              sparse_interval*segment_len);
+    if (print_info)
+        printf("save state size: %zu bytes\nrewind buffer size: %zu bytes\n",
+               state_size, store->dense.buf_size + store->sparse.buf_size);
+
+    store->dense_head  = alloc_state_buf(state_size, "rewind snapshot");
+    store->dense_tail  = alloc_state_buf(state_size, "rewind snapshot");
+    store->sparse_head = alloc_state_buf(state_size, "rewind snapshot");
+    store->compressed_state = alloc_state_buf(max_delta_size(state_size),
+                                              "compressed rewind state");
+
+    for (unsigned i = 0; i < n_staging_slots; ++i)
+        store->slots[i].snapshot = alloc_state_buf(state_size,
+                                                   "rewind staging slot");
+    init_worker_queue(store->capture_queue, n_staging_slots,
+                      write_staging_slot, store, "rewind capture");
+
+    entry_starts = alloc_state_buf(sparse_interval*state_size,
+                                   "rewind snapshots");
+    open_segment.states = alloc_state_buf(segment_len*state_size,
+                                          "rewind segment");
+    prev_segment.states = alloc_state_buf(segment_len*state_size,
+                                          "rewind segment");
+    init_array(open_segment.saved_at, (uint32_t)0);
+    init_array(prev_segment.saved_at, (uint32_t)0);
+#ifndef OPTIMIZING
+    check_state = alloc_state_buf(state_size, "save state check");
 #endif
-    fail_if(!(state = new (std::nothrow) uint8_t[state_size]),
-      "failed to allocate %zu-byte buffer for save state", state_size);
-    fail_if(!(rewind_buf = new (std::nothrow) uint8_t[rewind_buf_size]),
-      "failed to allocate %zu-byte rewind buffer", rewind_buf_size);
-    fail_if(!(frame_len = new (std::nothrow) unsigned[n_rewind_frames]),
-      "failed to allocate %zu-byte buffer for frame lengths",
-      sizeof(unsigned)*n_rewind_frames);
 
-    rewind_buf_i = 0;
+    clear_rewind();
 }
 
 void deinit_save_states_for_rom() {
-    free_array_set_null(state);
-    free_array_set_null(rewind_buf);
-    free_array_set_null(frame_len);
-    n_recorded_frames = 0;
-    has_save = false;
+    // Writes any queued segments before stopping the capture thread
+    stop_worker(store->capture_queue);
+    clear_rewind();
+
+    free_array_set_null(store->dense.buf);
+    free_array_set_null(store->sparse.buf);
+    free_array_set_null(store->dense_head);
+    free_array_set_null(store->dense_tail);
+    free_array_set_null(store->sparse_head);
+    free_array_set_null(store->compressed_state);
+    for (unsigned i = 0; i < n_staging_slots; ++i)
+        free_array_set_null(store->slots[i].snapshot);
+    deinit_worker_queue(store->capture_queue);
+    delete store;
+    store = 0;
+
+    free_array_set_null(entry_starts);
+    free_array_set_null(open_segment.states);
+    free_array_set_null(prev_segment.states);
+#ifndef OPTIMIZING
+    free_array_set_null(check_state);
+#endif
 }
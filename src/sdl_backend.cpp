@@ -6,8 +6,10 @@
 #ifdef RECORD_MOVIE
 #  include "movie.h"
 #endif
+#include "palette.h"
 #include "save_states.h"
 #include "sdl_backend.h"
+#include "state_files.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
@@ -29,54 +31,63 @@ static SDL_Texture  *screen_tex;
 // a very long time (to the tune of only managing 30 FPS with everything
 // removed but render calls when the translucent Ubuntu menu is open, and often
 // less than 60 with Firefox open too). This in turn slows down emulation and
-// messes up audio. To get around it, we upload frames in the SDL thread and
-// keep a back buffer for drawing into from the emulation thread while the
-// frame is being uploaded (a kind of manual triple buffering). If the frame
-// doesn't upload in time for the next frame, we drop the new frame. This gives
-// us automatic frame skipping in general.
+// messes up audio. To get around it, we upload frames in the SDL thread,
+// using triple buffering: The emulation thread draws into the back buffer,
+// the SDL thread uploads the front buffer, and the third ("middle") buffer
+// is passed between them by atomically exchanging buffer indices. Neither
+// thread ever waits for the other. If the SDL thread falls behind, the newest
+// frame replaces the one in the middle buffer, which gives us automatic frame
+// skipping in general.
 //
-// TODO: This could probably be optimized to eliminate some copying and format
-// conversions.
+// The buffers hold pixels in the PPU's output format (see palette.h), which
+// is converted to RGB in the SDL thread right before uploading. This keeps
+// the emulation thread's writes small.
 
-static Uint32 *front_buffer;
-static Uint32 *back_buffer;
+static uint16_t render_buffers[3][240*256];
 
-static SDL_mutex *frame_lock;
-static SDL_cond  *frame_available_cond;
-static bool ready_to_draw_new_frame;
-static bool frame_available;
+// Only accessed by the emulation thread
+static unsigned  back_buffer_i;
+static uint16_t *back_buffer;
+// Only accessed by the SDL thread
+static unsigned  front_buffer_i;
 
-void put_pixel(unsigned x, unsigned y, uint32_t color) {
+// Index of the middle buffer, with new_frame_bit set if it holds a frame that
+// the SDL thread hasn't picked up yet
+static SDL_atomic_t middle_buffer;
+int const new_frame_bit = 4;
+
+// Posted after each frame to wake up the SDL thread
+static SDL_sem *frame_available_sem;
+
+// Used by the SDL thread for the RGB version of the front buffer
+static Uint32 argb_buffer[240*256];
+
+void put_pixel(unsigned x, unsigned y, uint16_t pixel) {
     assert(x < 256);
     assert(y < 240);
 
-    back_buffer[256*y + x] = color;
+    back_buffer[256*y + x] = pixel;
 }
 
 void draw_frame() {
 #ifdef RECORD_MOVIE
-    add_movie_video_frame(back_buffer);
+    static uint32_t movie_frame[240*256];
+    pixels_to_argb(back_buffer, movie_frame, 240*256);
+    add_movie_video_frame(movie_frame);
 #endif
 
-    // Signal to the SDL thread that the frame has ended
-
-    SDL_LockMutex(frame_lock);
-    // Drop the new frame if the old one is still being rendered. This also
-    // means that we drop event processing for one frame, but it's probably not
-    // a huge deal.
-    if (ready_to_draw_new_frame) {
-        frame_available = true;
-        swap(back_buffer, front_buffer);
-        SDL_CondSignal(frame_available_cond);
-    }
-    SDL_UnlockMutex(frame_lock);
+    // Hand the frame to the SDL thread. We get back either the buffer the SDL
+    // thread last uploaded from or an older frame it never picked up, which
+    // can be drawn over in both cases.
+    back_buffer_i = SDL_AtomicSet(&middle_buffer, back_buffer_i | new_frame_bit) & 3;
+    back_buffer   = render_buffers[back_buffer_i];
+    SDL_SemPost(frame_available_sem);
 }
 
 //
 // Audio
 //
 
-Uint16 const sdl_audio_buffer_size = 2048;
 static SDL_AudioDeviceID audio_device_id;
 
 static void audio_callback(void*, Uint8 *stream, int len) {
@@ -85,9 +96,6 @@ static void audio_callback(void*, Uint8 *stream, int len) {
     read_samples((int16_t*)stream, len/sizeof(int16_t));
 }
 
-void lock_audio() { SDL_LockAudioDevice(audio_device_id); }
-void unlock_audio() { SDL_UnlockAudioDevice(audio_device_id); }
-
 void start_audio_playback() { SDL_PauseAudioDevice(audio_device_id, 0); }
 void stop_audio_playback() { SDL_PauseAudioDevice(audio_device_id, 1); }
 
@@ -101,15 +109,32 @@ Uint8 const *keys;
 // SDL thread and events
 //
 
+// Set by the SDL thread when the window is closed. Picked up by the emulation
+// thread in handle_ui_keys(), as the emulation state (including the
+// end-of-emulation flag) belongs to that thread. Protected by 'event_lock'.
+static bool quit_requested;
+
 // Runs from emulation thread
 void handle_ui_keys() {
     SDL_LockMutex(event_lock);
 
+    if (quit_requested)
+        end_emulation();
+
+    // F1-F4 select save slots 1-4, and F9 selects the autosave slot
+    for (unsigned i = 1; i <= 4; ++i)
+        if (keys[SDL_SCANCODE_F1 + i - 1])
+            select_state_slot(i);
+    if (keys[SDL_SCANCODE_F9])
+        select_state_slot(0);
+
     if (keys[SDL_SCANCODE_S])
         save_state();
     else if (keys[SDL_SCANCODE_L])
         load_state();
 
+    handle_autosave();
+
     handle_rewind(keys[SDL_SCANCODE_R]);
 
     if (reset_pushed)
@@ -118,7 +143,8 @@ void handle_ui_keys() {
     SDL_UnlockMutex(event_lock);
 }
 
-static bool pending_sdl_thread_exit;
+// Set from both threads, hence atomic
+static SDL_atomic_t pending_sdl_thread_exit;
 
 // Protects the 'keys' array from being read while being updated
 SDL_mutex   *event_lock;
@@ -128,8 +154,8 @@ static void process_events() {
     SDL_LockMutex(event_lock);
     while (SDL_PollEvent(&event))
         if (event.type == SDL_QUIT) {
-            end_emulation();
-            pending_sdl_thread_exit = true;
+            quit_requested = true;
+            SDL_AtomicSet(&pending_sdl_thread_exit, 1);
 #ifdef RUN_TESTS
             end_testing = true;
 #endif
@@ -138,20 +164,20 @@ static void process_events() {
 }
 
 void sdl_thread() {
-    for (;;) {
+    while (!SDL_AtomicGet(&pending_sdl_thread_exit)) {
 
         // Wait for the emulation thread to signal that a frame has completed
 
-        SDL_LockMutex(frame_lock);
-        ready_to_draw_new_frame = true;
-        while (!frame_available && !pending_sdl_thread_exit)
-            SDL_CondWait(frame_available_cond, frame_lock);
-        if (pending_sdl_thread_exit) {
-            SDL_UnlockMutex(frame_lock);
+        SDL_SemWait(frame_available_sem);
+        if (SDL_AtomicGet(&pending_sdl_thread_exit))
             return;
-        }
-        frame_available = ready_to_draw_new_frame = false;
-        SDL_UnlockMutex(frame_lock);
+        // The frame might already have been picked up after an earlier post,
+        // if we fell behind
+        if (!(SDL_AtomicGet(&middle_buffer) & new_frame_bit))
+            continue;
+        // Swap in the newest frame, giving the emulation thread our old front
+        // buffer to use as the middle buffer
+        front_buffer_i = SDL_AtomicSet(&middle_buffer, front_buffer_i) & 3;
 
         // Process events and calculate controller input state (which might
         // need left+right/up+down elimination)
@@ -160,7 +186,8 @@ void sdl_thread() {
 
         // Draw the new frame
 
-        fail_if(SDL_UpdateTexture(screen_tex, 0, front_buffer, 256*sizeof(Uint32)),
+        pixels_to_argb(render_buffers[front_buffer_i], argb_buffer, 240*256);
+        fail_if(SDL_UpdateTexture(screen_tex, 0, argb_buffer, 256*sizeof(Uint32)),
           "failed to update screen texture: %s", SDL_GetError());
         fail_if(SDL_RenderCopy(renderer, screen_tex, 0, 0),
           "failed to copy rendered frame to render target: %s", SDL_GetError());
@@ -169,10 +196,8 @@ void sdl_thread() {
 }
 
 void exit_sdl_thread() {
-    SDL_LockMutex(frame_lock);
-    pending_sdl_thread_exit = true;
-    SDL_CondSignal(frame_available_cond);
-    SDL_UnlockMutex(frame_lock);
+    SDL_AtomicSet(&pending_sdl_thread_exit, 1);
+    SDL_SemPost(frame_available_sem);
 }
 
 //
@@ -238,9 +263,10 @@ void init_sdl() {
         256, 240)),
       "failed to create texture for screen: %s", SDL_GetError());
 
-    static Uint32 render_buffers[2][240*256];
-    back_buffer  = render_buffers[0];
-    front_buffer = render_buffers[1];
+    back_buffer_i  = 0;
+    back_buffer    = render_buffers[back_buffer_i];
+    SDL_AtomicSet(&middle_buffer, 1);
+    front_buffer_i = 2;
 
     // Audio
 
@@ -249,7 +275,7 @@ void init_sdl() {
     want.freq     = sample_rate;
     want.format   = AUDIO_S16SYS;
     want.channels = 1;
-    want.samples  = sdl_audio_buffer_size;
+    want.samples  = get_audio_device_buffer_len();
     want.callback = audio_callback;
 
     fail_if(!(audio_device_id = SDL_OpenAudioDevice(0, 0, &want, 0, 0)),
@@ -275,10 +301,8 @@ void init_sdl() {
     fail_if(!(event_lock = SDL_CreateMutex()),
       "failed to create event mutex: %s", SDL_GetError());
 
-    fail_if(!(frame_lock = SDL_CreateMutex()),
-      "failed to create frame mutex: %s", SDL_GetError());
-    fail_if(!(frame_available_cond = SDL_CreateCond()),
-      "failed to create frame condition variable: %s", SDL_GetError());
+    fail_if(!(frame_available_sem = SDL_CreateSemaphore(0)),
+      "failed to create frame semaphore: %s", SDL_GetError());
 }
 
 void deinit_sdl() {
@@ -287,8 +311,7 @@ void deinit_sdl() {
 
     SDL_DestroyMutex(event_lock);
 
-    SDL_DestroyMutex(frame_lock);
-    SDL_DestroyCond(frame_available_cond);
+    SDL_DestroySemaphore(frame_available_sem);
 
     SDL_CloseAudioDevice(audio_device_id); // Prolly not needed, but play it safe
     SDL_Quit();
@@ -0,0 +1,466 @@
+#include "common.h"
+
+#include "compress.h"
+#include "mapper.h"
+#include "md5.h"
+#include "rom.h"
+#include "save_states.h"
+#include "state_files.h"
+#include "timing.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Seconds between autosaves to slot 0. 0 disables autosaving.
+unsigned const autosave_seconds = 60;
+
+// State file format (native byte order):
+//
+//   State_file_header
+//   n_state_sections State_file_sections
+//   The state, compressed with encode_delta() (without a reference state)
+//
+// The section table is checked against the layout of the state on load, so
+// that a state from a build with a different layout is rejected with a useful
+// message rather than loaded as garbage. Bump state_file_version for changes
+// that don't affect section sizes (e.g. reordering variables).
+
+char const state_file_magic[8] = { 'N', 'E', 'S', 'S', 'T', 'A', 'T', 'E' };
+uint32_t const state_file_version = 2;
+
+struct State_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_sections;
+    // MD5 hash of the PRG ROM of the game the state is for
+    uint8_t prg_md5[16];
+    // Size of the decompressed state
+    uint32_t state_size;
+    // Size and MD5 hash of the compressed state following the section table
+    uint32_t compressed_size;
+    uint8_t compressed_md5[16];
+};
+
+struct State_file_section {
+    char name[16];
+    uint32_t offset, size;
+};
+
+// Files are written by a writer thread. Each slot has a buffer for a state
+// waiting to be written. save_state() copies the state into the slot's buffer
+// and signals the thread, which swaps it with 'writing' before compressing and
+// writing it. Saving again to a slot that already has a state waiting replaces
+// that state, so saving never waits for the disk, and at most one write per
+// slot is pending no matter how often states are saved.
+struct State_writer {
+    // Buffers for the filename of the slot being written, and for the
+    // temporary file it's written to. Start with the ROM filename.
+    char *filename, *tmp_filename;
+    size_t rom_filename_len;
+
+    size_t state_size;
+    uint8_t *queued[n_state_slots], *writing;
+    // Header and section table, followed by the compressed state
+    uint8_t *file_buf;
+    size_t header_size;
+
+    bool has_queued[n_state_slots];
+    // Order in which states were queued. The state that has been waiting the
+    // longest is written first.
+    unsigned long queued_seq[n_state_slots], next_seq;
+    unsigned n_queued;
+
+    unsigned writing_slot;
+    bool is_writing, exit_writer;
+
+    pthread_mutex_t lock;
+    // Signaled when a state is queued or when the writer thread should exit
+    pthread_cond_t queued_cond;
+    // Signaled when the writer thread finishes a write
+    pthread_cond_t done_cond;
+
+    pthread_t writer_thread;
+    bool writer_thread_started;
+};
+
+static PER_CONSOLE State_writer *writer;
+
+// Header and section table of files for the current ROM. Copied into each
+// written file and compared against loaded files.
+static PER_CONSOLE uint8_t *file_header;
+static PER_CONSOLE size_t file_header_size;
+
+// Buffer for the filename of the slot being loaded. Starts with the ROM
+// filename.
+static PER_CONSOLE char *load_filename;
+
+static PER_CONSOLE unsigned selected_slot;
+static PER_CONSOLE unsigned frames_since_autosave;
+
+// Returns a buffer that starts with 'rom_filename' and has room for the
+// suffixes added by set_slot_filename() and write_state_file()
+static char *alloc_filename_buf(char const *rom_filename) {
+    size_t const size = strlen(rom_filename) + sizeof ".state" +
+                        3*sizeof(unsigned) + sizeof ".tmp";
+    char *buf;
+    fail_if(!(buf = new (std::nothrow) char[size]),
+            "failed to allocate %zu-byte filename buffer", size);
+    strcpy(buf, rom_filename);
+    return buf;
+}
+
+// Sets the filename of slot 'slot' in a buffer from alloc_filename_buf()
+static void set_slot_filename(char *filename, size_t rom_filename_len,
+                              unsigned slot) {
+    sprintf(filename + rom_filename_len, ".state%u", slot);
+}
+
+static void warn_errno(char const *what, char const *filename) {
+    fprintf(stderr, "%s: warning: failed to %s '%s': %s\n", program_name, what,
+            filename, strerror(errno));
+}
+
+// Writes 'len' bytes to 'fd', retrying after partial writes
+static bool write_all(int fd, uint8_t const *buf, size_t len) {
+    while (len > 0) {
+        ssize_t const res = write(fd, buf, len);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Compresses the state in 'writing' and writes it to slot 'writing_slot'. The
+// file is written under a temporary name and renamed into place, so a crash
+// can't leave a partially written state behind. Runs on the writer thread.
+static void write_state_file(State_writer *w) {
+    size_t const compressed_size =
+      encode_delta(w->writing, 0, w->state_size, w->file_buf + w->header_size);
+    State_file_header *const header = (State_file_header*)w->file_buf;
+    header->compressed_size = compressed_size;
+    MD5_CTX md5_ctx;
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, w->file_buf + w->header_size, compressed_size);
+    MD5_Final(header->compressed_md5, &md5_ctx);
+
+    set_slot_filename(w->filename, w->rom_filename_len, w->writing_slot);
+    set_slot_filename(w->tmp_filename, w->rom_filename_len, w->writing_slot);
+    strcat(w->tmp_filename, ".tmp");
+
+    int const fd = open(w->tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        warn_errno("create", w->tmp_filename);
+        return;
+    }
+    bool const ok = write_all(fd, w->file_buf,
+                              w->header_size + compressed_size) &&
+                    fsync(fd) == 0;
+    if (!ok)
+        warn_errno("write", w->tmp_filename);
+    if (close(fd) == -1 || !ok) {
+        if (ok)
+            warn_errno("close", w->tmp_filename);
+        unlink(w->tmp_filename);
+        return;
+    }
+
+    if (rename(w->tmp_filename, w->filename) == -1)
+        warn_errno("replace", w->filename);
+}
+
+static void *writer_thread(void *state_writer) {
+    State_writer *const w = (State_writer*)state_writer;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->n_queued == 0 && !w->exit_writer)
+            pthread_cond_wait(&w->queued_cond, &w->lock);
+        // Queued states are written before exiting
+        if (w->n_queued == 0)
+            break;
+
+        unsigned slot = n_state_slots;
+        for (unsigned i = 0; i < n_state_slots; ++i)
+            if (w->has_queued[i] &&
+                (slot == n_state_slots || w->queued_seq[i] < w->queued_seq[slot]))
+                slot = i;
+
+        swap(w->queued[slot], w->writing);
+        w->writing_slot     = slot;
+        w->has_queued[slot] = false;
+        --w->n_queued;
+        w->is_writing       = true;
+        pthread_mutex_unlock(&w->lock);
+
+        write_state_file(w);
+
+        pthread_mutex_lock(&w->lock);
+        w->is_writing = false;
+        pthread_cond_broadcast(&w->done_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+// Waits until all queued states have been written
+static void wait_for_writes() {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->n_queued > 0 || writer->is_writing)
+        pthread_cond_wait(&writer->done_cond, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Queues the current state for writing to 'slot'. If 'only_if_idle' is true,
+// nothing is done if a write is queued or in progress.
+static void queue_state(unsigned slot, bool only_if_idle) {
+    if (!writer->writer_thread_started) {
+        int const res = pthread_create(&writer->writer_thread, 0,
+                                       writer_thread, writer);
+        errno_val_fail_if(res != 0, res, "failed to create state writer thread");
+        writer->writer_thread_started = true;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    if (only_if_idle && (writer->n_queued > 0 || writer->is_writing)) {
+        pthread_mutex_unlock(&writer->lock);
+        return;
+    }
+    // The slot's buffer is never the one being written, so this doesn't wait
+    // for the writer
+    save_state_to_buf(writer->queued[slot]);
+    if (!writer->has_queued[slot]) {
+        writer->has_queued[slot] = true;
+        writer->queued_seq[slot] = writer->next_seq++;
+        ++writer->n_queued;
+    }
+    pthread_cond_signal(&writer->queued_cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void save_state() {
+    queue_state(selected_slot, false);
+}
+
+void handle_autosave() {
+    if (autosave_seconds == 0 ||
+        ++frames_since_autosave < autosave_seconds*ppu_fps)
+        return;
+
+    frames_since_autosave = 0;
+    queue_state(0, true);
+}
+
+// Checks the header and section table of a state file against those for the
+// current ROM, and the hash of the compressed state. Prints a warning for
+// mismatches.
+static bool check_file_header(uint8_t const *file, size_t file_size,
+                              char const *filename) {
+    #define WARN(...)                                               \
+        do {                                                        \
+            fprintf(stderr, "%s: warning: not loading '%s': ",      \
+                    program_name, filename);                        \
+            fprintf(stderr, __VA_ARGS__);                           \
+            putc('\n', stderr);                                     \
+            return false;                                           \
+        } while (0)
+
+    State_file_header const *const header = (State_file_header const*)file;
+    State_file_header const *const expected =
+      (State_file_header const*)file_header;
+
+    if (file_size < sizeof *header ||
+        memcmp(header->magic, state_file_magic, sizeof header->magic))
+        WARN("not a save state");
+    if (header->version != state_file_version)
+        WARN("unsupported format version %" PRIu32 " (expected %" PRIu32 ")",
+             header->version, state_file_version);
+    if (memcmp(header->prg_md5, expected->prg_md5, sizeof header->prg_md5))
+        WARN("the state is for a different ROM");
+    if (header->n_sections != n_state_sections ||
+        header->state_size != expected->state_size ||
+        file_size < file_header_size)
+        WARN("the state has a different layout");
+
+    State_file_section const *const sections =
+      (State_file_section const*)(header + 1);
+    State_file_section const *const expected_sections =
+      (State_file_section const*)(expected + 1);
+    for (unsigned i = 0; i < n_state_sections; ++i)
+        if (memcmp(&sections[i], &expected_sections[i], sizeof sections[i]))
+            WARN("%s state has a different layout",
+                 expected_sections[i].name);
+
+    if (header->compressed_size != file_size - file_header_size)
+        WARN("the file is truncated or has trailing data");
+
+    MD5_CTX md5_ctx;
+    uint8_t md5[16];
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, (void*)(file + file_header_size),
+               header->compressed_size);
+    MD5_Final(md5, &md5_ctx);
+    if (memcmp(md5, header->compressed_md5, sizeof md5))
+        WARN("the state is corrupt");
+
+    #undef WARN
+
+    return true;
+}
+
+void load_state() {
+    char *const filename = load_filename;
+    set_slot_filename(filename, writer->rom_filename_len, selected_slot);
+
+    // Make sure we get the most recently saved state
+    wait_for_writes();
+
+    int const fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            fprintf(stderr, "%s: warning: no saved state in slot %u\n",
+                    program_name, selected_slot);
+        else
+            warn_errno("open", filename);
+        return;
+    }
+
+    struct stat st;
+    void *file = MAP_FAILED;
+    if (fstat(fd, &st) == -1)
+        warn_errno("get size of", filename);
+    else if (st.st_size == 0)
+        // Empty files (e.g. left behind by a full disk) can't be mapped.
+        // check_file_header() rejects them with a warning.
+        file = 0;
+    else if ((file = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+               == MAP_FAILED)
+        warn_errno("map", filename);
+    close(fd);
+    if (file == MAP_FAILED)
+        return;
+
+    uint8_t const *const data = (uint8_t const*)file;
+    size_t const state_size = get_state_size();
+    if (check_file_header(data, st.st_size, filename)) {
+        uint8_t const *const compressed = data + file_header_size;
+        size_t const compressed_size = st.st_size - file_header_size;
+        if (!is_valid_delta(compressed, compressed_size, state_size))
+            fprintf(stderr, "%s: warning: not loading '%s': the state is "
+                            "corrupt\n", program_name, filename);
+        else {
+            // The writer's buffers are free after wait_for_writes()
+            memset(writer->writing, 0, state_size);
+            apply_delta(compressed, writer->writing, state_size);
+            load_state_from_buf(writer->writing);
+        }
+    }
+
+    if (file)
+        munmap(file, st.st_size);
+}
+
+void select_state_slot(unsigned n) {
+    assert(n < n_state_slots);
+    if (n != selected_slot) {
+        selected_slot = n;
+        printf("save slot %u\n", n);
+    }
+}
+
+// Builds the header and section table of state files for the current ROM
+static void init_file_header() {
+    size_t const state_size = get_state_size();
+    State_section const *const sections = get_state_sections();
+
+    file_header_size = sizeof(State_file_header) +
+                       n_state_sections*sizeof(State_file_section);
+    fail_if(!(file_header = alloc_array_init<uint8_t>(file_header_size, 0)),
+            "failed to allocate state file header");
+
+    State_file_header *const header = (State_file_header*)file_header;
+    memcpy(header->magic, state_file_magic, sizeof header->magic);
+    header->version    = state_file_version;
+    header->n_sections = n_state_sections;
+    memcpy(header->prg_md5, prg_md5, sizeof header->prg_md5);
+    header->state_size = state_size;
+
+    State_file_section *const file_sections =
+      (State_file_section*)(header + 1);
+    for (unsigned i = 0; i < n_state_sections; ++i) {
+        strncpy(file_sections[i].name, sections[i].name,
+                sizeof file_sections[i].name - 1);
+        file_sections[i].offset = sections[i].offset;
+        file_sections[i].size   = sections[i].size;
+    }
+}
+
+void init_state_files_for_rom(char const *rom_filename) {
+    init_file_header();
+
+    fail_if(!(writer = new (std::nothrow) State_writer),
+            "failed to allocate state writer");
+
+    writer->rom_filename_len = strlen(rom_filename);
+    writer->filename     = alloc_filename_buf(rom_filename);
+    writer->tmp_filename = alloc_filename_buf(rom_filename);
+    load_filename        = alloc_filename_buf(rom_filename);
+
+    size_t const state_size = get_state_size();
+    writer->state_size = state_size;
+    for (unsigned i = 0; i < n_state_slots; ++i)
+        fail_if(!(writer->queued[i] = new (std::nothrow) uint8_t[state_size]),
+                "failed to allocate state file buffers");
+    fail_if(!(writer->writing = new (std::nothrow) uint8_t[state_size]) ||
+            !(writer->file_buf = new (std::nothrow)
+                uint8_t[file_header_size + max_delta_size(state_size)]),
+            "failed to allocate state file buffers");
+    memcpy(writer->file_buf, file_header, file_header_size);
+    writer->header_size = file_header_size;
+
+    for (unsigned i = 0; i < n_state_slots; ++i)
+        writer->has_queued[i] = false;
+    writer->next_seq = 0;
+    writer->n_queued = 0;
+    writer->is_writing = writer->exit_writer = false;
+    writer->writer_thread_started = false;
+    pthread_mutex_init(&writer->lock, 0);
+    pthread_cond_init(&writer->queued_cond, 0);
+    pthread_cond_init(&writer->done_cond, 0);
+
+    selected_slot = 1;
+    frames_since_autosave = 0;
+}
+
+void deinit_state_files_for_rom() {
+    if (writer->writer_thread_started) {
+        pthread_mutex_lock(&writer->lock);
+        writer->exit_writer = true;
+        pthread_cond_signal(&writer->queued_cond);
+        pthread_mutex_unlock(&writer->lock);
+
+        pthread_join(writer->writer_thread, 0);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->queued_cond);
+    pthread_cond_destroy(&writer->done_cond);
+    free_array_set_null(writer->filename);
+    free_array_set_null(writer->tmp_filename);
+    for (unsigned i = 0; i < n_state_slots; ++i)
+        free_array_set_null(writer->queued[i]);
+    free_array_set_null(writer->writing);
+    free_array_set_null(writer->file_buf);
+    delete writer;
+    writer = 0;
+
+    free_array_set_null(file_header);
+    free_array_set_null(load_filename);
+}
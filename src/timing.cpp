@@ -4,9 +4,9 @@
 #include "rom.h"
 #include "timing.h"
 
-double cpu_clock_rate;
-double ppu_clock_rate;
-double ppu_fps;
+PER_CONSOLE double cpu_clock_rate;
+PER_CONSOLE double ppu_clock_rate;
+PER_CONSOLE double ppu_fps;
 
 void init_timing_for_rom() {
     if (is_pal) {
@@ -29,7 +29,7 @@ void init_timing_for_rom() {
 // scheduling.
 
 // Used for main loop synchronization
-static timespec clock_previous;
+static PER_CONSOLE timespec clock_previous;
 
 static void add_to_timespec(timespec &ts, long nano_secs) {
     long const new_nanos = ts.tv_nsec + nano_secs;
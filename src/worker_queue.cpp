@@ -0,0 +1,96 @@
+#include "common.h"
+
+#include "worker_queue.h"
+
+static void *run_worker(void *worker_queue) {
+    Worker_queue *const q = (Worker_queue*)worker_queue;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->n_queued == 0 && !q->exit_worker)
+            pthread_cond_wait(&q->queued_cond, &q->lock);
+        // Queued slots are processed before exiting
+        if (q->n_queued == 0)
+            break;
+
+        unsigned const slot = q->first_queued;
+        pthread_mutex_unlock(&q->lock);
+        q->process(q->ctx, slot);
+        pthread_mutex_lock(&q->lock);
+
+        q->first_queued = (q->first_queued + 1) % q->n_slots;
+        --q->n_queued;
+        pthread_cond_signal(&q->done_cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+void init_worker_queue(Worker_queue &q, unsigned n_slots,
+                       void (*process)(void *ctx, unsigned slot), void *ctx,
+                       char const *name) {
+    q.process        = process;
+    q.ctx            = ctx;
+    q.name           = name;
+    q.n_slots        = n_slots;
+    q.first_queued   = q.n_queued = 0;
+    q.exit_worker    = q.thread_started = false;
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.queued_cond, 0);
+    pthread_cond_init(&q.done_cond, 0);
+}
+
+void deinit_worker_queue(Worker_queue &q) {
+    stop_worker(q);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.queued_cond);
+    pthread_cond_destroy(&q.done_cond);
+}
+
+unsigned begin_queue_slot(Worker_queue &q, unsigned max_queued) {
+    assert(max_queued >= 1 && max_queued <= q.n_slots);
+
+    if (!q.thread_started) {
+        int const res = pthread_create(&q.thread, 0, run_worker, &q);
+        errno_val_fail_if(res != 0, res, "failed to create %s thread", q.name);
+        q.thread_started = true;
+    }
+
+    pthread_mutex_lock(&q.lock);
+    // Backpressure: wait for a free slot if the worker is behind
+    while (q.n_queued >= max_queued)
+        pthread_cond_wait(&q.done_cond, &q.lock);
+    unsigned const slot = (q.first_queued + q.n_queued) % q.n_slots;
+    pthread_mutex_unlock(&q.lock);
+
+    return slot;
+}
+
+void end_queue_slot(Worker_queue &q) {
+    pthread_mutex_lock(&q.lock);
+    ++q.n_queued;
+    pthread_cond_signal(&q.queued_cond);
+    pthread_mutex_unlock(&q.lock);
+}
+
+void flush_worker_queue(Worker_queue &q) {
+    pthread_mutex_lock(&q.lock);
+    while (q.n_queued > 0)
+        pthread_cond_wait(&q.done_cond, &q.lock);
+    pthread_mutex_unlock(&q.lock);
+}
+
+void stop_worker(Worker_queue &q) {
+    if (!q.thread_started)
+        return;
+
+    pthread_mutex_lock(&q.lock);
+    q.exit_worker = true;
+    pthread_cond_signal(&q.queued_cond);
+    pthread_mutex_unlock(&q.lock);
+
+    pthread_join(q.thread, 0);
+    q.thread_started = false;
+    q.exit_worker    = false;
+}